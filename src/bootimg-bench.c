@@ -0,0 +1,1378 @@
+/* bootimg-tools/bootimg-bench.c
+ *
+ * Copyright 2007, The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#ifdef STDC_HEADERS
+# include <stdlib.h>
+# include <stddef.h>
+#else
+# ifdef HAVE_STDLIB_H
+#  include <stdlib.h>
+# endif
+# ifdef HAVE_STDDEF_H
+#  include <stddef.h>
+# endif
+#endif
+#ifdef HAVE_STRING_H
+# include <string.h>
+#endif
+#ifdef HAVE_STRINGS_H
+# include <strings.h>
+#endif
+#ifdef HAVE_FCNTL_H
+# include <fcntl.h>
+#endif
+#ifdef HAVE_SYS_TYPES_H
+# include <sys/types.h>
+#endif
+#ifdef HAVE_SYS_STAT_H
+# include <sys/stat.h>
+#endif
+#ifdef HAVE_UNISTD_H
+# include <unistd.h>
+#endif
+#include <getopt.h>
+#ifdef HAVE_ALLOCA_H
+# include <alloca.h>
+#endif
+#ifdef HAVE_ASSERT_H
+# include <assert.h>
+#endif
+#include <errno.h>
+#include <limits.h>
+#include <math.h>
+#include <time.h>
+#include <ftw.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+#include <openssl/bn.h>
+#include <openssl/rsa.h>
+#include <openssl/evp.h>
+#include <openssl/pem.h>
+#include <openssl/x509.h>
+#include <openssl/err.h>
+#include <openssl/sha.h>
+
+#include "bootimg.h"
+#include "bootimg-priv.h"
+#include "bootimg-utils.h"
+#include "bootimg-io.h"
+#include "bootimg-cpio.h"
+#include "bootimg-gzip.h"
+#include "bootimg-jsonw.h"
+#include "bootimg-log.h"
+
+#define BENCH_DEFAULT_KERNEL_SIZE       (8*1024*1024)
+#define BENCH_DEFAULT_RAMDISK_SIZE      (4*1024*1024)
+#define BENCH_DEFAULT_PAGESIZE          2048
+#define BENCH_DEFAULT_RUNS              5
+#define BENCH_GZIP_LEVEL                9       /* as create's gzip -c9 */
+#define BENCH_RAMDISK_DIRS              16
+#define BENCH_RAMDISK_MAX_FILE          (32*1024)
+#define BENCH_FIND_MAGIC_OPS            1000
+#define BENCH_IMAGE_NAME                "bench.img"
+#define BENCH_BMETA_NAME                "bench_img.bmeta"
+#define BENCH_KEY_NAME                  "bench.key"
+#define BENCH_CERT_NAME                 "bench.crt"
+#define BENCH_RSA_BITS                  2048
+
+/*
+ * Options flags & values
+ * - v: verbose. vflag € N+*
+ * - k: kernel size. kflag € [0, 1]
+ * - r: ramdisk size (cpio archive, before gzip). rflag € [0, 1]
+ * - s: second bootloader size. sflag € [0, 1]
+ * - d: dtb size. dflag € [0, 1]
+ * - p: page size. pflag € [0, 1]
+ * - S: sign the image with a throw away key. Sflag € [0, 1]
+ * - n: runs per benchmark. nflag € [0, 1]
+ * - w: work directory. wflag € [0, 1]
+ * - o: output file. oflag € [0, 1]
+ * - g: only generate an image. gflag € [0, 1]
+ * - t: directory of the tools. tflag € [0, 1]
+ */
+int vflag = 0;
+int kflag = 0;
+int rflag = 0;
+int sflag = 0;
+int dflag = 0;
+int pflag = 0;
+int Sflag = 0;
+int nflag = 0;
+int wflag = 0;
+int oflag = 0;
+int gflag = 0;
+int tflag = 0;
+
+/* kval, rval, sval, dval: component sizes (K, M & G suffixes) */
+char *kval = (char *)NULL;
+char *rval = (char *)NULL;
+char *sval = (char *)NULL;
+char *dval = (char *)NULL;
+/* pval: page size */
+char *pval = (char *)NULL;
+/* nval: runs */
+char *nval = (char *)NULL;
+/* wval: work directory, kept */
+char *wval = (char *)NULL;
+/* oval: output file */
+char *oval = (char *)NULL;
+/* gval: generated image file */
+char *gval = (char *)NULL;
+/* tval: tools directory */
+char *tval = (char *)NULL;
+
+/*
+ * progname & blankname are program name and space string with progname size
+ * for displaying messsages and help
+ */
+char *progname = (char *)NULL;
+char *blankname = (char *)NULL;
+
+static const char *progusage =
+  "usage: %s [options]\n"
+  "       %s --help\n";
+static const char *proghelp =
+  "\n"
+  "       basic user options:\n"
+  "       %s -h --help                     display this message.\n"
+  "       %s -v --verbose[=<lvl>]          be verbose at runtime. <lvl> is\n"
+  "       %s                               added to current verbosity level.\n"
+  "\n"
+  "       options for the synthetic image (sizes accept K, M & G):\n"
+  "       %s -k --kernel-size=<sz>         kernel size (default 8M).\n"
+  "       %s -r --ramdisk-size=<sz>        size of the ramdisk cpio archive\n"
+  "       %s                               before gzip (default 4M).\n"
+  "       %s -s --second-size=<sz>         second bootloader size (default 0).\n"
+  "       %s -d --dtb-size=<sz>            device tree blob size (default 0).\n"
+  "       %s -p --pagesize=<pgsz>          page size (default 2048).\n"
+  "       %s -S --sign                     sign the image with a throw away\n"
+  "       %s                               key & certificate.\n"
+  "       %s -g --generate=<imgfile>       only write the image in <imgfile>.\n"
+  "\n"
+  "       options for running the benchmarks:\n"
+  "       %s -n --runs=<n>                 runs per benchmark (default 5).\n"
+  "       %s -w --workdir=<dir>            work in <dir> and keep its files.\n"
+  "       %s                               Default is a temporary directory.\n"
+  "       %s -t --tools=<dir>              where bootimg-extract & bootimg-create\n"
+  "       %s                               are. Default is the directory of\n"
+  "       %s                               this program or the PATH.\n"
+  "       %s -o --output=<file>            write results in <file> instead\n"
+  "       %s                               of stdout.\n"
+  "\n"
+  "       %s Results are JSON lines, one object per benchmark: best &\n"
+  "       %s mean run time (ns), throughput of the best run (MB/s),\n"
+  "       %s read & write syscalls per run (syscr/syscw of /proc/<pid>/io)\n"
+  "       %s and peak RSS (KB). Each benchmark runs in its own process.\n"
+  "       %s Syscalls do not count reads & writes done through io_uring.\n";
+
+/*
+ * Long options
+ */
+struct option long_options[] = {
+  {"verbose",      optional_argument, 0,  'v' },
+  {"kernel-size",  required_argument, 0,  'k' },
+  {"ramdisk-size", required_argument, 0,  'r' },
+  {"second-size",  required_argument, 0,  's' },
+  {"dtb-size",     required_argument, 0,  'd' },
+  {"pagesize",     required_argument, 0,  'p' },
+  {"sign",         no_argument,       0,  'S' },
+  {"runs",         required_argument, 0,  'n' },
+  {"workdir",      required_argument, 0,  'w' },
+  {"output",       required_argument, 0,  'o' },
+  {"generate",     required_argument, 0,  'g' },
+  {"tools",        required_argument, 0,  't' },
+  {"help",         no_argument,       0,  'h' },
+  {0,              0,                 0,   0  }
+};
+#define BOOTIMG_OPTSTRING "v::k:r:s:d:p:Sn:w:o:g:t:h"
+const char *unknown_option = "????";
+
+/*
+ * Getopt external defs
+ */
+extern char *optarg;
+extern int optind;
+
+/*
+ * Measures of one benchmark
+ */
+typedef struct _benchResult_st
+{
+  unsigned runs;
+  uint64_t ops;                         /* calls per run */
+  uint64_t bytes;                       /* bytes per run */
+  uint64_t best_ns;
+  uint64_t total_ns;
+  long long syscr;                      /* all runs, -1 if unknown */
+  long long syscw;
+  long maxrss_kb;
+  int failed;
+} benchResult_t, *benchResult_p;
+
+/*
+ * State of the in process benchmarks, set up in the child
+ */
+typedef struct _benchCtxt_st
+{
+  const char *imgfile;
+  boot_img_hdr hdr;
+  uint64_t imglen;
+  int fd;
+  FILE *fp;
+  uint8_t *image;
+  size_t image_len;
+  uint8_t *ramdisk;
+  bootimgCpioArchive_t archive;
+  uint64_t bytes;
+  uint64_t ops;
+} benchCtxt_t, *benchCtxt_p;
+
+typedef struct _benchCase_st
+{
+  const char *name;
+  int needsSignature;
+  int (*setup)(benchCtxt_p);
+  int (*run)(benchCtxt_p);
+} benchCase_t, *benchCase_p;
+
+static uint64_t rngState = 0x9e3779b97f4a7c15ULL;
+
+/*
+ * Forward decls
+ */
+void  printusage         (int);
+int   generateSigningKey (const char *, const char *);
+int   generateImage      (const char *, const char *, const char *,
+                          uint64_t, uint64_t, uint64_t, uint64_t, uint32_t,
+                          boot_img_hdr *);
+int   runInProcess       (benchCase_p, const char *, benchResult_p);
+int   runTool            (char *const *, const char *, uint64_t, benchResult_p);
+int   writeResult        (int, const char *, const char *, boot_img_hdr *, benchResult_p);
+void  removeTree         (const char *);
+
+static int  setupImage          (benchCtxt_p);
+static int  setupLoadedImage    (benchCtxt_p);
+static int  setupRamdisk        (benchCtxt_p);
+static int  setupArchive        (benchCtxt_p);
+static int  runFindMagic        (benchCtxt_p);
+static int  runImageId          (benchCtxt_p);
+static int  runImageDigest      (benchCtxt_p);
+static int  runVerify           (benchCtxt_p);
+static int  runRamdiskUnpack    (benchCtxt_p);
+static int  runRamdiskPack      (benchCtxt_p);
+
+/*
+ * In process benchmarks, run before the extract & create tools ones
+ */
+static benchCase_t cases[] = {
+  { "find-magic",     0, setupImage,       runFindMagic     },
+  { "image-id",       0, setupLoadedImage, runImageId       },
+  { "image-digest",   0, setupImage,       runImageDigest   },
+  { "verify",         1, setupImage,       runVerify        },
+  { "ramdisk-unpack", 0, setupRamdisk,     runRamdiskUnpack },
+  { "ramdisk-pack",   0, setupArchive,     runRamdiskPack   },
+  { (const char *)NULL, 0, NULL, NULL }
+};
+
+/*
+ * Deterministic pseudo random numbers (xorshift64*): images are the
+ * same from one run to the other
+ */
+static uint64_t
+benchRandom(void)
+{
+  rngState ^= rngState >> 12;
+  rngState ^= rngState << 25;
+  rngState ^= rngState >> 27;
+  return rngState * 0x2545f4914f6cdd1dULL;
+}
+
+static uint64_t
+benchNow(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/*
+ * main
+ */
+int
+main(int argc, char **argv)
+{
+  int c, ret = 1;
+  uint64_t ksz = BENCH_DEFAULT_KERNEL_SIZE, rsz = BENCH_DEFAULT_RAMDISK_SIZE;
+  uint64_t ssz = 0, dsz = 0, pgsz = BENCH_DEFAULT_PAGESIZE, runs = BENCH_DEFAULT_RUNS;
+  char workdir[PATH_MAX], imgfile[PATH_MAX], keyfile[PATH_MAX], certfile[PATH_MAX];
+  char extract[PATH_MAX], create[PATH_MAX];
+  const char *tooldir = (const char *)NULL;
+  int outfd = STDOUT_FILENO, tmpdir = 0;
+  boot_img_hdr hdr;
+
+  progname = (rindex(argv[0], '/') ? rindex(argv[0], '/')+1 : argv[0]);
+  blankname = (char *)alloca(strlen(progname) +1);
+  memset((void *)blankname, (int)' ', (size_t)strlen(progname));
+  blankname[strlen(progname)] = 0;
+  logInit();
+
+  /*
+   * Process options
+   */
+  while (1)
+    {
+      int option_index = 0;
+      int *flag = (int *)NULL;
+      char **val = (char **)NULL;
+
+      c = getopt_long(argc, argv, BOOTIMG_OPTSTRING,
+                      long_options, &option_index);
+      if (c == -1)
+        break;
+
+      switch (c)
+        {
+        case 'v':
+          if (optarg)
+            vflag += strtol(optarg, NULL, 10);
+          else
+            vflag++;
+          if (vflag > 3)
+            fprintf(stderr, "%s: option %s/%c set to %d\n",
+                    progname, getLongOptionName(long_options, c), c, vflag);
+          break;
+
+        case 'k': flag = &kflag; val = &kval; break;
+        case 'r': flag = &rflag; val = &rval; break;
+        case 's': flag = &sflag; val = &sval; break;
+        case 'd': flag = &dflag; val = &dval; break;
+        case 'p': flag = &pflag; val = &pval; break;
+        case 'n': flag = &nflag; val = &nval; break;
+        case 'w': flag = &wflag; val = &wval; break;
+        case 'o': flag = &oflag; val = &oval; break;
+        case 'g': flag = &gflag; val = &gval; break;
+        case 't': flag = &tflag; val = &tval; break;
+
+        case 'S':
+          Sflag = 1;
+          if (vflag > 3)
+            fprintf(stderr, "%s: option %s/%c set to %d\n",
+                    progname, getLongOptionName(long_options, c), c, Sflag);
+          break;
+
+        case 'h':
+          printusage(1);
+          exit(1);
+
+        case '?':
+          printusage(0);
+          break;
+
+        default:
+          fprintf(stderr, "%s: getopt returned character code 0%o ??\n", progname, c);
+          printusage(0);
+        }
+
+      if (flag)
+        {
+          *flag = 1;
+          *val = optarg;
+          if (vflag > 3)
+            fprintf(stderr, "%s: option %s/%c (=%d) set with value '%s'\n",
+                    progname, getLongOptionName(long_options, c), c, *flag, *val);
+        }
+    }
+
+  if (argc != optind)
+    {
+      fprintf(stderr, "%s: error: no argument is expected !\n", progname);
+      printusage(0);
+      exit(1);
+    }
+
+  if ((kflag && parseSize(kval, "kernel size", UINT32_MAX, &ksz) < 0) ||
+      (rflag && parseSize(rval, "ramdisk size", UINT32_MAX, &rsz) < 0) ||
+      (sflag && parseSize(sval, "second bootloader size", UINT32_MAX, &ssz) < 0) ||
+      (dflag && parseSize(dval, "dtb size", UINT32_MAX, &dsz) < 0) ||
+      (pflag && parseSize(pval, "page size", 0x10000, &pgsz) < 0) ||
+      (nflag && parseSize(nval, "runs", 100000, &runs) < 0))
+    exit(1);
+  if (!ksz)
+    {
+      fprintf(stderr, "%s: error: the kernel is required (size != 0) !\n", progname);
+      exit(1);
+    }
+  if (pgsz < sizeof(boot_img_hdr) || (pgsz & (pgsz -1)))
+    {
+      fprintf(stderr, "%s: error: page size must be a power of 2 of at least %lu !\n",
+              progname, sizeof(boot_img_hdr));
+      exit(1);
+    }
+  if (!runs)
+    runs = 1;
+
+  /* tools are run from the work directory */
+  if (tflag && !(tooldir = realpath(tval, NULL)))
+    {
+      fprintf(stderr, "%s: error: invalid tools directory '%s' !\n", progname, tval);
+      exit(1);
+    }
+  else if (!tflag && rindex(argv[0], '/'))
+    tooldir = getDirname(argv[0], FLAG_GET_DIRNAME_ABSOLUTE);
+  snprintf(extract, sizeof(extract), "%s%sbootimg-extract",
+           tooldir ? tooldir : "", tooldir ? "/" : "");
+  snprintf(create, sizeof(create), "%s%sbootimg-create",
+           tooldir ? tooldir : "", tooldir ? "/" : "");
+
+  do
+    {
+      char *extractArgv[] = { extract, "-b", BENCH_IMAGE_NAME, (char *)NULL };
+      char *createArgv[] = { create, "-f", BENCH_BMETA_NAME, (char *)NULL };
+      benchResult_t res;
+      bootimgIo_p io;
+      const char *backend;
+
+      if (wflag)
+        {
+          if (mkdir(wval, 0755) < 0 && errno != EEXIST)
+            {
+              fprintf(stderr, "%s: error: cannot create work directory '%s': %s !\n",
+                      progname, wval, strerror(errno));
+              break;
+            }
+          snprintf(workdir, sizeof(workdir), "%s", wval);
+        }
+      else
+        {
+          const char *tmp = getenv("TMPDIR");
+
+          snprintf(workdir, sizeof(workdir), "%s/bootimg-bench.XXXXXX", tmp && *tmp ? tmp : "/tmp");
+          if (!mkdtemp(workdir))
+            {
+              fprintf(stderr, "%s: error: cannot create a temporary directory: %s !\n",
+                      progname, strerror(errno));
+              break;
+            }
+          tmpdir = 1;
+        }
+
+      if (snprintf(imgfile, sizeof(imgfile), "%s/%s", workdir, BENCH_IMAGE_NAME) >= (int)sizeof(imgfile) ||
+          snprintf(keyfile, sizeof(keyfile), "%s/%s", workdir, BENCH_KEY_NAME) >= (int)sizeof(keyfile) ||
+          snprintf(certfile, sizeof(certfile), "%s/%s", workdir, BENCH_CERT_NAME) >= (int)sizeof(certfile))
+        {
+          fprintf(stderr, "%s: error: work directory path '%s' too long !\n", progname, workdir);
+          break;
+        }
+
+      if (Sflag && generateSigningKey(keyfile, certfile) < 0)
+        break;
+      if (generateImage(gflag ? gval : imgfile,
+                        Sflag ? keyfile : (const char *)NULL, Sflag ? certfile : (const char *)NULL,
+                        ksz, rsz, ssz, dsz, (uint32_t)pgsz, &hdr) < 0)
+        break;
+      /* children must not share the ring of this thread */
+      ioReleaseDefault();
+
+      if (gflag)
+        {
+          ret = 0;
+          break;
+        }
+
+      if (oflag && (outfd = open(oval, O_CREAT | O_TRUNC | O_WRONLY, 0644)) < 0)
+        {
+          fprintf(stderr, "%s: error: cannot open output file '%s': %s !\n",
+                  progname, oval, strerror(errno));
+          break;
+        }
+
+      if (!(io = ioNew(1, 0)))
+        break;
+      backend = ioBackendName(io);
+      ioFree(io);
+
+      ret = 0;
+      for (benchCase_p bc = cases; bc->name; bc++)
+        {
+          if (bc->needsSignature && !Sflag)
+            continue;
+          if (vflag)
+            fprintf(stderr, "%s: running %s...\n", progname, bc->name);
+          bzero((void *)&res, sizeof(benchResult_t));
+          res.runs = runs;
+          if (runInProcess(bc, imgfile, &res) < 0 ||
+              writeResult(outfd, bc->name, backend, &hdr, &res) < 0)
+            ret = 1;
+        }
+
+      /* extract first: create rebuilds the image from its outputs */
+      if (vflag)
+        fprintf(stderr, "%s: running extract...\n", progname);
+      bzero((void *)&res, sizeof(benchResult_t));
+      res.runs = runs;
+      if (runTool(extractArgv, workdir, computeSignatureBlockOffset(&hdr), &res) < 0 ||
+          writeResult(outfd, "extract", backend, &hdr, &res) < 0)
+        ret = 1;
+
+      if (vflag)
+        fprintf(stderr, "%s: running create...\n", progname);
+      bzero((void *)&res, sizeof(benchResult_t));
+      res.runs = runs;
+      if (runTool(createArgv, workdir, computeSignatureBlockOffset(&hdr), &res) < 0 ||
+          writeResult(outfd, "create", backend, &hdr, &res) < 0)
+        ret = 1;
+    }
+  while (0);
+
+  if (oflag && outfd >= 0)
+    close(outfd);
+  if (tmpdir)
+    removeTree(workdir);
+
+  return ret;
+}
+
+/*
+ * Print usage message
+ */
+void
+printusage(int withhelp)
+{
+  char line[256];
+  char *tok = (char *)NULL;
+  char twolines = 2;
+  char *str;
+
+  if (withhelp)
+    {
+      str = (char *)malloc(strlen(progusage) +strlen(proghelp) +1);
+      assert(str);
+      memcpy(str, progusage, strlen(progusage));
+      memcpy(str +strlen(progusage), proghelp, strlen(proghelp) +1);
+    }
+  else
+    {
+      str = (char *)malloc(strlen(progusage) +1);
+      assert(str);
+      memcpy(str, progusage, strlen(progusage) +1);
+    }
+
+  while ((tok = strtok((char *)str, "\n")) != (char *)NULL)
+    {
+      if (twolines)
+        {
+          sprintf(line, tok, progname);
+          twolines--;
+        }
+      else
+        sprintf(line, tok, blankname);
+
+      str = (char *)NULL;
+      fprintf(stdout, "%s\n", line);
+    }
+
+  free((void *)str);
+}
+
+static int
+removeEntry(const char *path, const struct stat *st, int type, struct FTW *ftw)
+{
+  (void)st; (void)type; (void)ftw;
+
+  if (remove(path) < 0)
+    fprintf(stderr, "%s: warning: cannot remove '%s': %s\n", progname, path, strerror(errno));
+
+  return 0;
+}
+
+/*
+ * rm -rf of the temporary work directory
+ */
+void
+removeTree(const char *dir)
+{
+  nftw(dir, removeEntry, 16, FTW_DEPTH | FTW_PHYS);
+}
+
+/*
+ * pwrite(2) all or fail
+ */
+static int
+writeAt(int fd, const void *buf, size_t len, off64_t offset)
+{
+  while (len)
+    {
+      ssize_t wrsz = pwrite(fd, buf, len, offset);
+      if (wrsz < 0)
+        {
+          if (errno == EINTR)
+            continue;
+          return -1;
+        }
+      buf = (const uint8_t *)buf + wrsz;
+      offset += wrsz;
+      len -= wrsz;
+    }
+
+  return 0;
+}
+
+/*
+ * Incompressible data, as a compressed kernel is
+ */
+static void
+fillRandom(uint8_t *buf, size_t len)
+{
+  while (len)
+    {
+      uint64_t r = benchRandom();
+      size_t n = BOOTIMG_MIN(len, sizeof(r));
+
+      memcpy((void *)buf, (const void *)&r, n);
+      buf += n;
+      len -= n;
+    }
+}
+
+/*
+ * Text made of init.rc like words: gzip'es about as well as a ramdisk
+ */
+static void
+fillText(uint8_t *buf, size_t len)
+{
+  static const char *words[] = {
+    "service", "on", "property:", "import", "/system/bin/", "mount", "class",
+    "main", "user", "root", "group", "system", "write", "chmod", "0644",
+    "chown", "start", "stop", "setprop", "ro.", "persist.", "exec", "--",
+    "oneshot", "disabled", "critical", "socket", "stream", "0660", "/dev/",
+    "/sys/", "trigger"
+  };
+
+  while (len)
+    {
+      uint64_t r = benchRandom();
+      const char *word = words[r % (sizeof(words) / sizeof(words[0]))];
+      size_t n = BOOTIMG_MIN(len, strlen(word));
+
+      memcpy((void *)buf, (const void *)word, n);
+      buf += n;
+      len -= n;
+      if (len)
+        {
+          *buf++ = ((r >> 32) % 8) ? ' ' : '\n';
+          len--;
+        }
+    }
+}
+
+/*
+ * Write a throw away RSA key & its self signed certificate (PEM)
+ */
+int
+generateSigningKey(const char *keyfile, const char *certfile)
+{
+  int ret = -1;
+  EVP_PKEY *key = EVP_PKEY_new();
+  RSA *rsa = RSA_new();
+  BIGNUM *exponent = BN_new();
+  X509 *cert = X509_new();
+  X509_NAME *name;
+  FILE *fp = (FILE *)NULL;
+
+  do
+    {
+      if (!key || !rsa || !exponent || !cert ||
+          !BN_set_word(exponent, RSA_F4) ||
+          !RSA_generate_key_ex(rsa, BENCH_RSA_BITS, exponent, NULL) ||
+          !EVP_PKEY_assign_RSA(key, rsa))
+        {
+          ERR_print_errors_fp(stderr);
+          break;
+        }
+      /* owned by the key now */
+      rsa = (RSA *)NULL;
+
+      X509_set_version(cert, 2);
+      ASN1_INTEGER_set(X509_get_serialNumber(cert), 1);
+      X509_gmtime_adj(X509_get_notBefore(cert), 0);
+      X509_gmtime_adj(X509_get_notAfter(cert), 365L * 24 * 3600);
+      X509_set_pubkey(cert, key);
+      name = X509_get_subject_name(cert);
+      X509_NAME_add_entry_by_txt(name, "CN", MBSTRING_ASC,
+                                 (const unsigned char *)"bootimg-bench", -1, -1, 0);
+      X509_set_issuer_name(cert, name);
+      if (!X509_sign(cert, key, EVP_sha256()))
+        {
+          ERR_print_errors_fp(stderr);
+          break;
+        }
+
+      if (!(fp = fopen(keyfile, "w")) ||
+          !PEM_write_PrivateKey(fp, key, NULL, NULL, 0, NULL, NULL) ||
+          fclose(fp))
+        {
+          fprintf(stderr, "%s: error: cannot write private key '%s' !\n", progname, keyfile);
+          fp = (FILE *)NULL;
+          break;
+        }
+      if (!(fp = fopen(certfile, "w")) ||
+          !PEM_write_X509(fp, cert) ||
+          fclose(fp))
+        {
+          fprintf(stderr, "%s: error: cannot write certificate '%s' !\n", progname, certfile);
+          fp = (FILE *)NULL;
+          break;
+        }
+      fp = (FILE *)NULL;
+
+      ret = 0;
+    }
+  while (0);
+
+  if (fp)
+    fclose(fp);
+  X509_free(cert);
+  BN_free(exponent);
+  RSA_free(rsa);
+  EVP_PKEY_free(key);
+
+  return ret;
+}
+
+/*
+ * Build a gzip'ed newc ramdisk of about size bytes (before gzip):
+ * BENCH_RAMDISK_DIRS directories filled with text files
+ */
+static int
+generateRamdisk(uint64_t size, uint8_t **out, size_t *outlen)
+{
+  static const uint8_t gzip_header[] = { GZIP_MAGIC_0, GZIP_MAGIC_1, 8, 0, 0, 0, 0, 0, 2, 3 };
+  bootimgCpioArchive_t archive;
+  bootimgCpioEntry_t entry;
+  uint8_t *data = (uint8_t *)NULL, *cpio = (uint8_t *)NULL;
+  char **names = (char **)NULL;
+  size_t nnames = 0, cpio_len = 0;
+  uint64_t pos = 0;
+  int ret = -1;
+
+  bzero((void *)&archive, sizeof(bootimgCpioArchive_t));
+
+  do
+    {
+      int failed = 0;
+
+      if (!(data = (uint8_t *)malloc(size ? size : 1)) ||
+          !(names = (char **)calloc(BENCH_RAMDISK_DIRS +1 + size / 1024 +1, sizeof(char *))))
+        {
+          fprintf(stderr, "%s: error: cannot allocate the ramdisk !\n", progname);
+          break;
+        }
+      fillText(data, size);
+
+      /* the directories, then files spread over them */
+      for (unsigned nd = 0; nd <= BENCH_RAMDISK_DIRS && !failed; nd++)
+        {
+          bzero((void *)&entry, sizeof(bootimgCpioEntry_t));
+          names[nnames] = (char *)malloc(16);
+          if (!names[nnames])
+            {
+              failed = 1;
+              break;
+            }
+          if (nd == 0)
+            snprintf(names[nnames], 16, "bench");
+          else
+            snprintf(names[nnames], 16, "bench/d%02u", nd -1);
+          entry.name = names[nnames++];
+          entry.ino = nnames;
+          entry.mode = 040755;
+          entry.nlink = 2;
+          failed = (cpioAppendEntry(&archive, &entry) < 0);
+        }
+
+      while (pos < size && !failed)
+        {
+          uint64_t filesize = 1024 + benchRandom() % (BENCH_RAMDISK_MAX_FILE - 1024);
+
+          filesize = BOOTIMG_MIN(size - pos, filesize);
+
+          bzero((void *)&entry, sizeof(bootimgCpioEntry_t));
+          names[nnames] = (char *)malloc(32);
+          if (!names[nnames])
+            {
+              failed = 1;
+              break;
+            }
+          snprintf(names[nnames], 32, "bench/d%02u/f%06lu",
+                   (unsigned)(nnames % BENCH_RAMDISK_DIRS), (unsigned long)nnames);
+          entry.name = names[nnames++];
+          entry.ino = nnames;
+          entry.mode = 0100644;
+          entry.nlink = 1;
+          entry.filesize = filesize;
+          entry.data = data + pos;
+          pos += filesize;
+          failed = (cpioAppendEntry(&archive, &entry) < 0);
+        }
+      if (failed)
+        {
+          fprintf(stderr, "%s: error: cannot allocate the ramdisk entries !\n", progname);
+          break;
+        }
+
+      if (cpioWrite(&archive, &cpio, &cpio_len) < 0 ||
+          gzipRebuild(cpio, cpio_len, BENCH_GZIP_LEVEL, gzip_header, sizeof(gzip_header),
+                      NULL, 0, out, outlen) < 0)
+        {
+          fprintf(stderr, "%s: error: cannot build the ramdisk !\n", progname);
+          break;
+        }
+      if (vflag)
+        fprintf(stderr, "%s: ramdisk: %lu entries, %lu bytes, %lu gzip'ed\n",
+                progname, archive.count, cpio_len, *outlen);
+
+      ret = 0;
+    }
+  while (0);
+
+  cpioRelease(&archive);
+  free((void *)cpio);
+  for (size_t nn = 0; nn < nnames; nn++)
+    free((void *)names[nn]);
+  free((void *)names);
+  free((void *)data);
+
+  return ret;
+}
+
+/*
+ * Write a synthetic image: random kernel, second & dtb, text ramdisk.
+ * Signed when a key is given.
+ */
+int
+generateImage(const char *imgfile, const char *keyfile, const char *certfile,
+              uint64_t ksz, uint64_t rsz, uint64_t ssz, uint64_t dsz, uint32_t pgsz,
+              boot_img_hdr *hdr)
+{
+  uint8_t *data[BOOTIMG_COMPONENT_COUNT] = { NULL, };
+  size_t size[BOOTIMG_COMPONENT_COUNT] = { ksz, 0, ssz, dsz };
+  uint8_t *page = (uint8_t *)NULL;
+  uint64_t imglen = 0;
+  int fd = -1, ret = -1;
+
+  do
+    {
+      int failed = 0;
+
+      if (generateRamdisk(rsz, &data[BOOTIMG_COMPONENT_RAMDISK], &size[BOOTIMG_COMPONENT_RAMDISK]) < 0)
+        break;
+      if (size[BOOTIMG_COMPONENT_RAMDISK] > UINT32_MAX)
+        {
+          fprintf(stderr, "%s: error: gzip'ed ramdisk is too big !\n", progname);
+          break;
+        }
+      for (int nc = 0; nc < BOOTIMG_COMPONENT_COUNT; nc++)
+        {
+          if (nc == BOOTIMG_COMPONENT_RAMDISK || !size[nc])
+            continue;
+          if (!(data[nc] = (uint8_t *)malloc(size[nc])))
+            {
+              fprintf(stderr, "%s: error: cannot allocate %lu bytes !\n", progname, size[nc]);
+              failed = 1;
+              break;
+            }
+          fillRandom(data[nc], size[nc]);
+        }
+      if (failed)
+        break;
+
+      initBootImgHeader(hdr);
+      hdr->kernel_size = size[BOOTIMG_COMPONENT_KERNEL];
+      hdr->kernel_addr = BOOTIMG_DEFAULT_BASEADDR + BOOTIMG_DEFAULT_KERNEL_OFFSET;
+      hdr->ramdisk_size = size[BOOTIMG_COMPONENT_RAMDISK];
+      hdr->ramdisk_addr = BOOTIMG_DEFAULT_BASEADDR + BOOTIMG_DEFAULT_RAMDISK_OFFSET;
+      hdr->second_size = size[BOOTIMG_COMPONENT_SECOND];
+      hdr->second_addr = BOOTIMG_DEFAULT_BASEADDR + BOOTIMG_DEFAULT_SECOND_OFFSET;
+      hdr->tags_addr = BOOTIMG_DEFAULT_BASEADDR + BOOTIMG_DEFAULT_TAGS_OFFSET;
+      hdr->page_size = pgsz;
+      hdr->dt_size = size[BOOTIMG_COMPONENT_DTB];
+      memcpy((void *)hdr->name, (const void *)"bootimg-bench", sizeof("bootimg-bench"));
+      setCmdline(hdr, "console=ttyS0,115200 androidboot.hardware=bench");
+      computeImageId(hdr,
+                     data[BOOTIMG_COMPONENT_KERNEL], data[BOOTIMG_COMPONENT_RAMDISK],
+                     data[BOOTIMG_COMPONENT_SECOND], data[BOOTIMG_COMPONENT_DTB],
+                     (unsigned char *)hdr->id);
+
+      if ((fd = open(imgfile, O_CREAT | O_TRUNC | O_RDWR, 0644)) < 0)
+        {
+          fprintf(stderr, "%s: error: cannot create image '%s': %s !\n",
+                  progname, imgfile, strerror(errno));
+          break;
+        }
+      if (!(page = (uint8_t *)calloc(1, pgsz)))
+        break;
+      memcpy((void *)page, (const void *)hdr, sizeof(boot_img_hdr));
+      if (writeAt(fd, page, pgsz, 0) < 0)
+        failed = 1;
+      for (int nc = 0; nc < BOOTIMG_COMPONENT_COUNT && !failed; nc++)
+        if (size[nc] && writeAt(fd, data[nc], size[nc], computeComponentOffset(hdr, nc)) < 0)
+          failed = 1;
+      /* pages are padded with zeros */
+      imglen = computeSignatureBlockOffset(hdr);
+      if (failed || ftruncate(fd, imglen) < 0)
+        {
+          fprintf(stderr, "%s: error: cannot write image '%s': %s !\n",
+                  progname, imgfile, strerror(errno));
+          break;
+        }
+
+      if (keyfile && veritySign(fd, imglen, NULL, 0, keyfile, certfile) < 0)
+        break;
+
+      if (vflag)
+        fprintf(stderr, "%s: image '%s': %lu bytes, page size %u%s\n",
+                progname, imgfile, imglen, pgsz, keyfile ? ", signed" : "");
+      ret = 0;
+    }
+  while (0);
+
+  if (fd >= 0)
+    close(fd);
+  free((void *)page);
+  for (int nc = 0; nc < BOOTIMG_COMPONENT_COUNT; nc++)
+    free((void *)data[nc]);
+
+  return ret;
+}
+
+/*
+ * Benchmarks set up & runs. Each run sets the bytes & calls it went
+ * through.
+ */
+static int
+setupImage(benchCtxt_p ctxt)
+{
+  off_t off = 0;
+  const char *error = (const char *)NULL;
+
+  if (!(ctxt->fp = fopen(ctxt->imgfile, "r")))
+    {
+      fprintf(stderr, "%s: error: cannot open image '%s' !\n", progname, ctxt->imgfile);
+      return -1;
+    }
+  ctxt->fd = fileno(ctxt->fp);
+  if (!findBootMagicFd(ctxt->fd, &ctxt->hdr, &off, &error))
+    {
+      fprintf(stderr, "%s: error: %s in file '%s'\n", progname, error, ctxt->imgfile);
+      return -1;
+    }
+  ctxt->imglen = computeSignatureBlockOffset(&ctxt->hdr);
+
+  return 0;
+}
+
+static int
+setupLoadedImage(benchCtxt_p ctxt)
+{
+  if (setupImage(ctxt) < 0 ||
+      !(ctxt->image = (uint8_t *)loadImage(ctxt->imgfile, &ctxt->image_len)) ||
+      ctxt->image_len < ctxt->imglen)
+    return -1;
+
+  return 0;
+}
+
+static int
+setupRamdisk(benchCtxt_p ctxt)
+{
+  if (setupImage(ctxt) < 0 ||
+      !(ctxt->ramdisk = (uint8_t *)malloc(ctxt->hdr.ramdisk_size)) ||
+      pread(ctxt->fd, ctxt->ramdisk, ctxt->hdr.ramdisk_size,
+            computeComponentOffset(&ctxt->hdr, BOOTIMG_COMPONENT_RAMDISK)) != ctxt->hdr.ramdisk_size)
+    return -1;
+
+  return 0;
+}
+
+static int
+setupArchive(benchCtxt_p ctxt)
+{
+  if (setupRamdisk(ctxt) < 0 ||
+      cpioLoad(ctxt->ramdisk, ctxt->hdr.ramdisk_size, &ctxt->archive) < 0)
+    return -1;
+
+  return 0;
+}
+
+static int
+runFindMagic(benchCtxt_p ctxt)
+{
+  off_t off = 0;
+
+  for (unsigned n = 0; n < BENCH_FIND_MAGIC_OPS; n++)
+    if (!findBootMagicFd(ctxt->fd, &ctxt->hdr, &off, (const char **)NULL))
+      return -1;
+  ctxt->ops = BENCH_FIND_MAGIC_OPS;
+  ctxt->bytes = 0;
+
+  return 0;
+}
+
+static int
+runImageId(benchCtxt_p ctxt)
+{
+  boot_img_hdr *hdr = &ctxt->hdr;
+  unsigned char id[sizeof(hdr->id)];
+
+  /* SHA1 ids leave the end of the field zeroed */
+  bzero((void *)id, sizeof(id));
+  computeImageId(hdr,
+                 ctxt->image + computeComponentOffset(hdr, BOOTIMG_COMPONENT_KERNEL),
+                 ctxt->image + computeComponentOffset(hdr, BOOTIMG_COMPONENT_RAMDISK),
+                 hdr->second_size ?
+                 ctxt->image + computeComponentOffset(hdr, BOOTIMG_COMPONENT_SECOND) : NULL,
+                 hdr->dt_size ?
+                 ctxt->image + computeComponentOffset(hdr, BOOTIMG_COMPONENT_DTB) : NULL,
+                 id);
+  if (memcmp((const void *)id, (const void *)hdr->id, sizeof(id)))
+    {
+      fprintf(stderr, "%s: error: image id mismatch !\n", progname);
+      return -1;
+    }
+  ctxt->ops = 1;
+  ctxt->bytes = (uint64_t)hdr->kernel_size + hdr->ramdisk_size + hdr->second_size + hdr->dt_size;
+
+  return 0;
+}
+
+static int
+runImageDigest(benchCtxt_p ctxt)
+{
+  unsigned char digest[SHA256_DIGEST_LENGTH];
+
+  if (computeRangeDigest(ctxt->fd, 0, ctxt->imglen, digest) < 0)
+    return -1;
+  ctxt->ops = 1;
+  ctxt->bytes = ctxt->imglen;
+
+  return 0;
+}
+
+static int
+runVerify(benchCtxt_p ctxt)
+{
+  if (verityVerify(ctxt->fp, &ctxt->hdr) != 0)
+    {
+      fprintf(stderr, "%s: error: signature is not valid !\n", progname);
+      return -1;
+    }
+  ctxt->ops = 1;
+  ctxt->bytes = ctxt->imglen;
+
+  return 0;
+}
+
+static int
+runRamdiskUnpack(benchCtxt_p ctxt)
+{
+  if (cpioLoad(ctxt->ramdisk, ctxt->hdr.ramdisk_size, &ctxt->archive) < 0)
+    return -1;
+  ctxt->ops = 1;
+  ctxt->bytes = ctxt->archive.len;
+  cpioRelease(&ctxt->archive);
+
+  return 0;
+}
+
+static int
+runRamdiskPack(benchCtxt_p ctxt)
+{
+  static const uint8_t gzip_header[] = { GZIP_MAGIC_0, GZIP_MAGIC_1, 8, 0, 0, 0, 0, 0, 2, 3 };
+  uint8_t *cpio = (uint8_t *)NULL, *out = (uint8_t *)NULL;
+  size_t cpio_len = 0, outlen = 0;
+  int ret = -1;
+
+  if (cpioWrite(&ctxt->archive, &cpio, &cpio_len) == 0 &&
+      gzipRebuild(cpio, cpio_len, BENCH_GZIP_LEVEL, gzip_header, sizeof(gzip_header),
+                  NULL, 0, &out, &outlen) == 0)
+    ret = 0;
+  ctxt->ops = 1;
+  ctxt->bytes = cpio_len;
+  free((void *)cpio);
+  free((void *)out);
+
+  return ret;
+}
+
+/*
+ * syscr & syscw of a process (0 for this one)
+ */
+static int
+readProcIo(pid_t pid, long long *syscr, long long *syscw)
+{
+  char path[64], line[128];
+  FILE *fp;
+  int found = 0;
+
+  if (pid)
+    snprintf(path, sizeof(path), "/proc/%d/io", (int)pid);
+  else
+    snprintf(path, sizeof(path), "/proc/self/io");
+  if (!(fp = fopen(path, "r")))
+    return -1;
+  while (fgets(line, sizeof(line), fp))
+    {
+      if (sscanf(line, "syscr: %lld", syscr) == 1)
+        found |= 1;
+      else if (sscanf(line, "syscw: %lld", syscw) == 1)
+        found |= 2;
+    }
+  fclose(fp);
+
+  return found == 3 ? 0 : -1;
+}
+
+static int
+redirectOutput(void)
+{
+  int fd = open("/dev/null", O_WRONLY);
+
+  if (fd < 0)
+    return -1;
+  dup2(fd, STDOUT_FILENO);
+  if (vflag < 2)
+    dup2(fd, STDERR_FILENO);
+  close(fd);
+
+  return 0;
+}
+
+/*
+ * Run a benchmark in a child process (so that its peak RSS & syscalls
+ * are its own): set up once, then res->runs timed runs
+ */
+int
+runInProcess(benchCase_p bc, const char *imgfile, benchResult_p res)
+{
+  int pipefd[2], status = 0;
+  struct rusage ru;
+  ssize_t rdsz = 0;
+  pid_t pid;
+
+  if (pipe(pipefd) < 0)
+    {
+      perror("pipe");
+      return -1;
+    }
+
+  fflush(NULL);
+  if ((pid = fork()) < 0)
+    {
+      perror("fork");
+      close(pipefd[0]);
+      close(pipefd[1]);
+      return -1;
+    }
+
+  if (pid == 0)
+    {
+      benchCtxt_t ctxt;
+      long long r0 = 0, w0 = 0, r1 = 0, w1 = 0;
+      int haveIo;
+
+      close(pipefd[0]);
+      redirectOutput();
+      bzero((void *)&ctxt, sizeof(benchCtxt_t));
+      ctxt.imgfile = imgfile;
+      ctxt.fd = -1;
+
+      if (bc->setup(&ctxt) < 0)
+        res->failed = 1;
+      haveIo = (readProcIo(0, &r0, &w0) == 0);
+      for (unsigned n = 0; n < res->runs && !res->failed; n++)
+        {
+          uint64_t t0 = benchNow(), dt;
+
+          if (bc->run(&ctxt) < 0)
+            res->failed = 1;
+          dt = benchNow() - t0;
+          if (!n || dt < res->best_ns)
+            res->best_ns = dt;
+          res->total_ns += dt;
+        }
+      if (haveIo && readProcIo(0, &r1, &w1) == 0)
+        {
+          res->syscr = r1 - r0;
+          res->syscw = w1 - w0;
+        }
+      else
+        res->syscr = res->syscw = -1;
+      res->ops = ctxt.ops;
+      res->bytes = ctxt.bytes;
+
+      if (write(pipefd[1], res, sizeof(benchResult_t)) != sizeof(benchResult_t))
+        _exit(1);
+      _exit(res->failed ? 1 : 0);
+    }
+
+  close(pipefd[1]);
+  rdsz = read(pipefd[0], res, sizeof(benchResult_t));
+  close(pipefd[0]);
+  while (wait4(pid, &status, 0, &ru) < 0 && errno == EINTR)
+    ;
+  res->maxrss_kb = ru.ru_maxrss;
+
+  if (rdsz != sizeof(benchResult_t) || !WIFEXITED(status) || WEXITSTATUS(status))
+    {
+      fprintf(stderr, "%s: error: benchmark %s failed !\n", progname, bc->name);
+      return -1;
+    }
+
+  return 0;
+}
+
+/*
+ * Run a tool res->runs times in dir. Each run is timed up to the exit
+ * of the tool, its counters are read before it is reaped.
+ */
+int
+runTool(char *const *argv, const char *dir, uint64_t bytes, benchResult_p res)
+{
+  int haveIo = 1;
+
+  for (unsigned n = 0; n < res->runs; n++)
+    {
+      long long syscr = 0, syscw = 0;
+      struct rusage ru;
+      siginfo_t si;
+      int status = 0;
+      uint64_t t0, dt;
+      pid_t pid;
+
+      fflush(NULL);
+      t0 = benchNow();
+      if ((pid = fork()) < 0)
+        {
+          perror("fork");
+          return -1;
+        }
+      if (pid == 0)
+        {
+          if (chdir(dir) < 0 || redirectOutput() < 0)
+            _exit(127);
+          execvp(argv[0], argv);
+          _exit(127);
+        }
+
+      /* zombie kept for /proc/<pid>/io */
+      while (waitid(P_PID, pid, &si, WEXITED | WNOWAIT) < 0 && errno == EINTR)
+        ;
+      dt = benchNow() - t0;
+      if (readProcIo(pid, &syscr, &syscw) < 0)
+        haveIo = 0;
+      while (wait4(pid, &status, 0, &ru) < 0 && errno == EINTR)
+        ;
+
+      if (!WIFEXITED(status) || WEXITSTATUS(status))
+        {
+          fprintf(stderr, "%s: error: '%s' failed (status %d) !\n",
+                  progname, argv[0], WIFEXITED(status) ? WEXITSTATUS(status) : -1);
+          return -1;
+        }
+
+      if (!n || dt < res->best_ns)
+        res->best_ns = dt;
+      res->total_ns += dt;
+      res->syscr += syscr;
+      res->syscw += syscw;
+      if (ru.ru_maxrss > res->maxrss_kb)
+        res->maxrss_kb = ru.ru_maxrss;
+    }
+
+  if (!haveIo)
+    res->syscr = res->syscw = -1;
+  res->ops = 1;
+  res->bytes = bytes;
+
+  return 0;
+}
+
+/*
+ * One JSON line per benchmark
+ */
+int
+writeResult(int fd, const char *name, const char *backend, boot_img_hdr *hdr, benchResult_p res)
+{
+  bootimgJsonWriter_p w;
+  int ret = 0;
+
+  if (!(w = jsonWriterNew(fd, JSON_WRITER_FLAG_COMPACT)))
+    return -1;
+
+  jsonWriterStartObject(w, NULL);
+  jsonWriterWriteString(w, "bench", name);
+  jsonWriterWriteString(w, "io", backend);
+  jsonWriterWriteNumber(w, "page_size", hdr->page_size);
+  jsonWriterWriteNumber(w, "kernel_size", hdr->kernel_size);
+  jsonWriterWriteNumber(w, "ramdisk_size", hdr->ramdisk_size);
+  jsonWriterWriteNumber(w, "second_size", hdr->second_size);
+  jsonWriterWriteNumber(w, "dt_size", hdr->dt_size);
+  jsonWriterWriteBool(w, "signed", Sflag);
+  jsonWriterWriteNumber(w, "runs", res->runs);
+  jsonWriterWriteNumber(w, "ops", res->ops);
+  jsonWriterWriteNumber(w, "bytes", res->bytes);
+  jsonWriterWriteNumber(w, "best_ns", res->best_ns);
+  jsonWriterWriteNumber(w, "mean_ns", res->total_ns / res->runs);
+  if (res->bytes && res->best_ns)
+    jsonWriterWriteDouble(w, "mb_per_s", round((double)res->bytes * 1e5 / res->best_ns) / 100);
+  else
+    jsonWriterWriteNull(w, "mb_per_s");
+  if (res->best_ns)
+    jsonWriterWriteDouble(w, "ops_per_s", round((double)res->ops * 1e11 / res->best_ns) / 100);
+  else
+    jsonWriterWriteNull(w, "ops_per_s");
+  if (res->syscr < 0)
+    {
+      jsonWriterWriteNull(w, "syscr");
+      jsonWriterWriteNull(w, "syscw");
+    }
+  else
+    {
+      jsonWriterWriteNumber(w, "syscr", llround((double)res->syscr / res->runs));
+      jsonWriterWriteNumber(w, "syscw", llround((double)res->syscw / res->runs));
+    }
+  jsonWriterWriteNumber(w, "maxrss_kb", res->maxrss_kb);
+  jsonWriterEndObject(w);
+
+  if (jsonWriterFree(w) < 0 || write(fd, "\n", 1) != 1)
+    {
+      fprintf(stderr, "%s: error: cannot write results: %s !\n", progname, strerror(errno));
+      ret = -1;
+    }
+
+  return ret;
+}
+
+/* Local Variables:                                                */
+/* mode: C                                                         */
+/* comment-column: 0                                               */
+/* End:                                                            */
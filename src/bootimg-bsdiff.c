@@ -0,0 +1,680 @@
+/* bootimg-tools/bootimg-bsdiff.c
+ *
+ * Copyright 2007, The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * The suffix sorting (Larsson & Sadakane's qsufsort) and the scan loop
+ * follow Colin Percival's bsdiff 4.3 (BSD license).
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#ifdef STDC_HEADERS
+# include <stdlib.h>
+# include <stddef.h>
+#else
+# ifdef HAVE_STDLIB_H
+#  include <stdlib.h>
+# endif
+# ifdef HAVE_STDDEF_H
+#  include <stddef.h>
+# endif
+#endif
+#ifdef HAVE_STRING_H
+# include <string.h>
+#endif
+#ifdef HAVE_STRINGS_H
+# include <strings.h>
+#endif
+#include <endian.h>
+
+#include "bootimg-bsdiff.h"
+
+/* Rolling hash over BSDIFF_BLOCK bytes, blocks of old indexed */
+#define BSDIFF_BLOCK            32
+#define BSDIFF_HASH_BASE        0x01000193U
+#define BSDIFF_HASH_CHAIN       16
+/* Suffix array is built if more than newsize / ratio extra bytes */
+#define BSDIFF_EXTRA_RATIO      8
+#define BSDIFF_MAX_SIZE         (INT32_MAX - 1)
+
+#define BSDIFF_MIN(a, b)        ((a) < (b) ? (a) : (b))
+
+/* External decls */
+extern int vflag;
+extern char *progname;
+
+typedef struct _bsdiffContext_st
+{
+  const uint8_t *old;
+  int64_t oldsize;
+  const uint8_t *new;
+  int64_t newsize;
+
+  /* suffix array of old, NULL if not built */
+  int32_t *I;
+
+  /* hash index of old blocks: block number + 1, 0 ends a chain */
+  uint32_t *head;
+  uint32_t *next;
+  int hbits;
+  uint32_t hpow;                        /* BASE^(BLOCK-1) */
+  uint32_t hval;                        /* hash of new[hpos..hpos+BLOCK) */
+  int64_t hpos;
+} bsdiffContext_t, *bsdiffContext_p;
+
+/*
+ * Suffix sorting
+ */
+static void
+bsdiffSplit(int32_t *I, int32_t *V, int32_t start, int32_t len, int32_t h)
+{
+  int32_t i, j, k, x, tmp, jj, kk;
+
+  while (1)
+    {
+      if (len < 16)
+        {
+          for (k = start; k < start + len; k += j)
+            {
+              j = 1;
+              x = V[I[k] + h];
+              for (i = 1; k + i < start + len; i++)
+                {
+                  if (V[I[k + i] + h] < x)
+                    {
+                      x = V[I[k + i] + h];
+                      j = 0;
+                    }
+                  if (V[I[k + i] + h] == x)
+                    {
+                      tmp = I[k + j];
+                      I[k + j] = I[k + i];
+                      I[k + i] = tmp;
+                      j++;
+                    }
+                }
+              for (i = 0; i < j; i++)
+                V[I[k + i]] = k + j - 1;
+              if (j == 1)
+                I[k] = -1;
+            }
+          return;
+        }
+
+      x = V[I[start + len / 2] + h];
+      jj = 0;
+      kk = 0;
+      for (i = start; i < start + len; i++)
+        {
+          if (V[I[i] + h] < x)
+            jj++;
+          if (V[I[i] + h] == x)
+            kk++;
+        }
+      jj += start;
+      kk += jj;
+
+      i = start;
+      j = 0;
+      k = 0;
+      while (i < jj)
+        {
+          if (V[I[i] + h] < x)
+            i++;
+          else if (V[I[i] + h] == x)
+            {
+              tmp = I[i];
+              I[i] = I[jj + j];
+              I[jj + j] = tmp;
+              j++;
+            }
+          else
+            {
+              tmp = I[i];
+              I[i] = I[kk + k];
+              I[kk + k] = tmp;
+              k++;
+            }
+        }
+      while (jj + j < kk)
+        {
+          if (V[I[jj + j] + h] == x)
+            j++;
+          else
+            {
+              tmp = I[jj + j];
+              I[jj + j] = I[kk + k];
+              I[kk + k] = tmp;
+              k++;
+            }
+        }
+
+      if (jj > start)
+        bsdiffSplit(I, V, start, jj - start, h);
+
+      for (i = 0; i < kk - jj; i++)
+        V[I[jj + i]] = kk - 1;
+      if (jj == kk - 1)
+        I[jj] = -1;
+
+      /* tail call as a loop */
+      if (start + len <= kk)
+        return;
+      len = start + len - kk;
+      start = kk;
+    }
+}
+
+static int
+bsdiffSuffixSort(bsdiffContext_p ctx)
+{
+  int32_t buckets[256];
+  int32_t oldsize = (int32_t)ctx->oldsize;
+  int32_t *I, *V;
+  int32_t i, h, len;
+
+  I = (int32_t *)malloc((oldsize + 1) * sizeof(int32_t));
+  V = (int32_t *)malloc((oldsize + 1) * sizeof(int32_t));
+  if (!I || !V)
+    {
+      free((void *)I);
+      free((void *)V);
+      return -1;
+    }
+
+  bzero((void *)buckets, sizeof(buckets));
+  for (i = 0; i < oldsize; i++)
+    buckets[ctx->old[i]]++;
+  for (i = 1; i < 256; i++)
+    buckets[i] += buckets[i - 1];
+  for (i = 255; i > 0; i--)
+    buckets[i] = buckets[i - 1];
+  buckets[0] = 0;
+
+  for (i = 0; i < oldsize; i++)
+    I[++buckets[ctx->old[i]]] = i;
+  I[0] = oldsize;
+  for (i = 0; i < oldsize; i++)
+    V[i] = buckets[ctx->old[i]];
+  V[oldsize] = 0;
+  for (i = 1; i < 256; i++)
+    if (buckets[i] == buckets[i - 1] + 1)
+      I[buckets[i]] = -1;
+  I[0] = -1;
+
+  for (h = 1; I[0] != -(oldsize + 1); h += h)
+    {
+      len = 0;
+      for (i = 0; i < oldsize + 1; )
+        {
+          if (I[i] < 0)
+            {
+              len -= I[i];
+              i -= I[i];
+            }
+          else
+            {
+              if (len)
+                I[i - len] = -len;
+              len = V[I[i]] + 1 - i;
+              bsdiffSplit(I, V, i, len, h);
+              i += len;
+              len = 0;
+            }
+        }
+      if (len)
+        I[i - len] = -len;
+    }
+
+  for (i = 0; i < oldsize + 1; i++)
+    I[V[i]] = i;
+
+  free((void *)V);
+  ctx->I = I;
+
+  return 0;
+}
+
+static int64_t
+bsdiffMatchLen(const uint8_t *a, int64_t alen, const uint8_t *b, int64_t blen)
+{
+  int64_t i;
+
+  for (i = 0; i < alen && i < blen; i++)
+    if (a[i] != b[i])
+      break;
+
+  return i;
+}
+
+/*
+ * Longest match of new[scan..] in old, by binary search in the suffix array
+ */
+static int64_t
+bsdiffSuffixSearch(bsdiffContext_p ctx, int64_t scan, int64_t *pos)
+{
+  const uint8_t *new = ctx->new + scan;
+  int64_t newsize = ctx->newsize - scan;
+  int64_t st = 0, en = ctx->oldsize, x, y;
+
+  while (en - st >= 2)
+    {
+      x = st + (en - st) / 2;
+      if (memcmp((const void *)(ctx->old + ctx->I[x]), (const void *)new,
+                 BSDIFF_MIN(ctx->oldsize - ctx->I[x], newsize)) < 0)
+        st = x;
+      else
+        en = x;
+    }
+
+  x = bsdiffMatchLen(ctx->old + ctx->I[st], ctx->oldsize - ctx->I[st], new, newsize);
+  y = bsdiffMatchLen(ctx->old + ctx->I[en], ctx->oldsize - ctx->I[en], new, newsize);
+  if (x > y)
+    {
+      *pos = ctx->I[st];
+      return x;
+    }
+  *pos = ctx->I[en];
+  return y;
+}
+
+/*
+ * Rolling hash
+ */
+static uint32_t
+bsdiffHashBlock(const uint8_t *p)
+{
+  uint32_t h = 0;
+
+  for (int i = 0; i < BSDIFF_BLOCK; i++)
+    h = h * BSDIFF_HASH_BASE + p[i];
+
+  return h;
+}
+
+static uint32_t
+bsdiffHashBucket(bsdiffContext_p ctx, uint32_t h)
+{
+  return (h * 2654435761U) >> (32 - ctx->hbits);
+}
+
+static int
+bsdiffHashIndex(bsdiffContext_p ctx)
+{
+  uint32_t nblocks = ctx->oldsize / BSDIFF_BLOCK;
+
+  ctx->hpow = 1;
+  for (int i = 1; i < BSDIFF_BLOCK; i++)
+    ctx->hpow *= BSDIFF_HASH_BASE;
+  ctx->hpos = -1;
+
+  if (!nblocks)
+    return 0;
+
+  for (ctx->hbits = 4; (1U << ctx->hbits) < 2 * nblocks; ctx->hbits++)
+    ;
+  ctx->head = (uint32_t *)calloc(1U << ctx->hbits, sizeof(uint32_t));
+  ctx->next = (uint32_t *)malloc(nblocks * sizeof(uint32_t));
+  if (!ctx->head || !ctx->next)
+    return -1;
+
+  /* last blocks first so that chains start with the first ones */
+  for (uint32_t b = nblocks; b > 0; b--)
+    {
+      uint32_t bucket = bsdiffHashBucket(ctx, bsdiffHashBlock(ctx->old + (b - 1) * BSDIFF_BLOCK));
+
+      ctx->next[b - 1] = ctx->head[bucket];
+      ctx->head[bucket] = b;
+    }
+
+  return 0;
+}
+
+/*
+ * Longest match of new[scan..] starting on an old block boundary
+ */
+static int64_t
+bsdiffHashSearch(bsdiffContext_p ctx, int64_t scan, int64_t *pos)
+{
+  const uint8_t *new = ctx->new;
+  int64_t best = 0;
+  uint32_t b;
+  int n;
+
+  if (!ctx->head || ctx->newsize - scan < BSDIFF_BLOCK)
+    return 0;
+
+  if (ctx->hpos >= 0 && scan == ctx->hpos + 1)
+    ctx->hval = (ctx->hval - new[ctx->hpos] * ctx->hpow) * BSDIFF_HASH_BASE + new[scan + BSDIFF_BLOCK - 1];
+  else
+    ctx->hval = bsdiffHashBlock(new + scan);
+  ctx->hpos = scan;
+
+  for (b = ctx->head[bsdiffHashBucket(ctx, ctx->hval)], n = 0;
+       b && n < BSDIFF_HASH_CHAIN;
+       b = ctx->next[b - 1], n++)
+    {
+      int64_t p = (int64_t)(b - 1) * BSDIFF_BLOCK, len;
+
+      if (memcmp((const void *)(ctx->old + p), (const void *)(new + scan), BSDIFF_BLOCK))
+        continue;
+      len = BSDIFF_BLOCK + bsdiffMatchLen(ctx->old + p + BSDIFF_BLOCK, ctx->oldsize - p - BSDIFF_BLOCK,
+                                          new + scan + BSDIFF_BLOCK, ctx->newsize - scan - BSDIFF_BLOCK);
+      if (len > best)
+        {
+          best = len;
+          *pos = p;
+        }
+    }
+
+  return best;
+}
+
+static int64_t
+bsdiffSearch(bsdiffContext_p ctx, int64_t scan, int64_t *pos)
+{
+  if (!ctx->oldsize)
+    return 0;
+  if (ctx->I)
+    return bsdiffSuffixSearch(ctx, scan, pos);
+  return bsdiffHashSearch(ctx, scan, pos);
+}
+
+static void
+bsdiffPut64(uint8_t *p, int64_t v)
+{
+  uint64_t le = htole64((uint64_t)v);
+  memcpy((void *)p, (const void *)&le, sizeof(le));
+}
+
+static int64_t
+bsdiffGet64(const uint8_t *p)
+{
+  uint64_t le;
+  memcpy((void *)&le, (const void *)p, sizeof(le));
+  return (int64_t)le64toh(le);
+}
+
+/*
+ * The bsdiff scan loop. Returns the extra bytes count in *extra.
+ */
+static int
+bsdiffRun(bsdiffContext_p ctx, uint8_t **out, size_t *outlen, int64_t *extra)
+{
+  const uint8_t *old = ctx->old, *new = ctx->new;
+  int64_t oldsize = ctx->oldsize, newsize = ctx->newsize;
+  int64_t scan = 0, len = 0, pos = 0, lastscan = 0, lastpos = 0, lastoffset = 0;
+  int64_t oldscore, scsc, s, Sf, lenf, Sb, lenb, overlap, Ss, lens, i;
+  int64_t dblen = 0, eblen = 0;
+  uint8_t *db, *eb, *ctrl = (uint8_t *)NULL, *buf;
+  size_t nctrl = 0, ctrl_alloc = 0;
+  int ret = -1, failed = 0;
+
+  db = (uint8_t *)malloc(newsize + 1);
+  eb = (uint8_t *)malloc(newsize + 1);
+  ctx->hpos = -1;
+
+  while (db && eb && scan < newsize)
+    {
+      oldscore = 0;
+
+      for (scsc = scan += len; scan < newsize; scan++)
+        {
+          len = bsdiffSearch(ctx, scan, &pos);
+
+          for ( ; scsc < scan + len; scsc++)
+            if ((scsc + lastoffset < oldsize) && (old[scsc + lastoffset] == new[scsc]))
+              oldscore++;
+
+          if (((len == oldscore) && (len != 0)) || (len > oldscore + 8))
+            break;
+
+          if ((scan + lastoffset < oldsize) && (old[scan + lastoffset] == new[scan]))
+            oldscore--;
+        }
+
+      if ((len != oldscore) || (scan == newsize))
+        {
+          s = 0;
+          Sf = 0;
+          lenf = 0;
+          for (i = 0; (lastscan + i < scan) && (lastpos + i < oldsize); )
+            {
+              if (old[lastpos + i] == new[lastscan + i])
+                s++;
+              i++;
+              if (s * 2 - i > Sf * 2 - lenf)
+                {
+                  Sf = s;
+                  lenf = i;
+                }
+            }
+
+          lenb = 0;
+          if (scan < newsize)
+            {
+              s = 0;
+              Sb = 0;
+              for (i = 1; (scan >= lastscan + i) && (pos >= i); i++)
+                {
+                  if (old[pos - i] == new[scan - i])
+                    s++;
+                  if (s * 2 - i > Sb * 2 - lenb)
+                    {
+                      Sb = s;
+                      lenb = i;
+                    }
+                }
+            }
+
+          if (lastscan + lenf > scan - lenb)
+            {
+              overlap = (lastscan + lenf) - (scan - lenb);
+              s = 0;
+              Ss = 0;
+              lens = 0;
+              for (i = 0; i < overlap; i++)
+                {
+                  if (new[lastscan + lenf - overlap + i] == old[lastpos + lenf - overlap + i])
+                    s++;
+                  if (new[scan - lenb + i] == old[pos - lenb + i])
+                    s--;
+                  if (s > Ss)
+                    {
+                      Ss = s;
+                      lens = i + 1;
+                    }
+                }
+              lenf += lens - overlap;
+              lenb -= lens;
+            }
+
+          for (i = 0; i < lenf; i++)
+            db[dblen + i] = new[lastscan + i] - old[lastpos + i];
+          for (i = 0; i < (scan - lenb) - (lastscan + lenf); i++)
+            eb[eblen + i] = new[lastscan + lenf + i];
+          dblen += lenf;
+          eblen += (scan - lenb) - (lastscan + lenf);
+
+          if (nctrl == ctrl_alloc)
+            {
+              uint8_t *newctrl;
+
+              ctrl_alloc = ctrl_alloc ? ctrl_alloc * 2 : 256;
+              /* scan may already be newsize here: no truncated delta */
+              if (!(newctrl = (uint8_t *)realloc(ctrl, ctrl_alloc * BSDIFF_CTRL_SIZE)))
+                {
+                  failed = 1;
+                  break;
+                }
+              ctrl = newctrl;
+            }
+          bsdiffPut64(ctrl + nctrl * BSDIFF_CTRL_SIZE, lenf);
+          bsdiffPut64(ctrl + nctrl * BSDIFF_CTRL_SIZE + 8, (scan - lenb) - (lastscan + lenf));
+          bsdiffPut64(ctrl + nctrl * BSDIFF_CTRL_SIZE + 16, (pos - lenb) - (lastpos + lenf));
+          nctrl++;
+
+          lastscan = scan - lenb;
+          lastpos = pos - lenb;
+          lastoffset = pos - scan;
+        }
+    }
+
+  if (db && eb && !failed && scan >= newsize)
+    {
+      size_t len = BSDIFF_HEADER_SIZE + nctrl * BSDIFF_CTRL_SIZE + dblen + eblen;
+
+      if ((buf = (uint8_t *)malloc(len)))
+        {
+          bsdiffPut64(buf, nctrl);
+          bsdiffPut64(buf + 8, dblen);
+          bsdiffPut64(buf + 16, eblen);
+          if (nctrl)
+            memcpy((void *)(buf + BSDIFF_HEADER_SIZE), (const void *)ctrl, nctrl * BSDIFF_CTRL_SIZE);
+          memcpy((void *)(buf + BSDIFF_HEADER_SIZE + nctrl * BSDIFF_CTRL_SIZE), (const void *)db, dblen);
+          memcpy((void *)(buf + BSDIFF_HEADER_SIZE + nctrl * BSDIFF_CTRL_SIZE + dblen), (const void *)eb, eblen);
+          *out = buf;
+          *outlen = len;
+          *extra = eblen;
+          ret = 0;
+        }
+    }
+
+  free((void *)ctrl);
+  free((void *)db);
+  free((void *)eb);
+
+  return ret;
+}
+
+/*
+ * Compute the delta from old to new
+ */
+int
+bsdiffCreate(const uint8_t *old, size_t oldsize, const uint8_t *new, size_t newsize,
+             int flags, uint8_t **out, size_t *outlen)
+{
+  bsdiffContext_t ctx;
+  int64_t extra = 0;
+  int ret = -1;
+
+  if (oldsize > BSDIFF_MAX_SIZE || newsize > BSDIFF_MAX_SIZE)
+    {
+      fprintf(stderr, "%s: error: buffer too large for delta!\n", progname);
+      return -1;
+    }
+
+  bzero((void *)&ctx, sizeof(bsdiffContext_t));
+  ctx.old = old;
+  ctx.oldsize = oldsize;
+  ctx.new = new;
+  ctx.newsize = newsize;
+
+  do
+    {
+      if (bsdiffHashIndex(&ctx) < 0)
+        break;
+      if (bsdiffRun(&ctx, out, outlen, &extra) < 0)
+        break;
+      ret = 0;
+
+      if (flags & BSDIFF_FLAG_FAST || !oldsize ||
+          extra <= (int64_t)newsize / BSDIFF_EXTRA_RATIO)
+        break;
+
+      /* too much left unmatched: use the suffix array */
+      if (vflag > 1)
+        fprintf(stderr, "%s: %ld extra bytes out of %lu, sorting suffixes\n",
+                progname, extra, newsize);
+      if (bsdiffSuffixSort(&ctx) < 0)
+        break;
+      free((void *)*out);
+      ret = bsdiffRun(&ctx, out, outlen, &extra);
+    }
+  while (0);
+
+  free((void *)ctx.I);
+  free((void *)ctx.head);
+  free((void *)ctx.next);
+
+  return ret;
+}
+
+/*
+ * Rebuild new (newsize bytes) from old and a delta
+ */
+int
+bsdiffApply(const uint8_t *old, size_t oldsize, const uint8_t *patch, size_t patchlen,
+            uint8_t *new, size_t newsize)
+{
+  const uint8_t *ctrl, *diff, *extra;
+  uint64_t nctrl, difflen, extralen;
+  int64_t oldpos = 0;
+  uint64_t newpos = 0, dpos = 0, epos = 0;
+
+  if (patchlen < BSDIFF_HEADER_SIZE)
+    return -1;
+  nctrl = bsdiffGet64(patch);
+  difflen = bsdiffGet64(patch + 8);
+  extralen = bsdiffGet64(patch + 16);
+  patchlen -= BSDIFF_HEADER_SIZE;
+  if (nctrl > patchlen / BSDIFF_CTRL_SIZE ||
+      difflen > patchlen - nctrl * BSDIFF_CTRL_SIZE ||
+      extralen != patchlen - nctrl * BSDIFF_CTRL_SIZE - difflen)
+    return -1;
+
+  ctrl = patch + BSDIFF_HEADER_SIZE;
+  diff = ctrl + nctrl * BSDIFF_CTRL_SIZE;
+  extra = diff + difflen;
+
+  for (uint64_t nc = 0; nc < nctrl; nc++, ctrl += BSDIFF_CTRL_SIZE)
+    {
+      int64_t x = bsdiffGet64(ctrl), y = bsdiffGet64(ctrl + 8), z = bsdiffGet64(ctrl + 16);
+
+      if (x < 0 || y < 0 ||
+          (uint64_t)x > newsize - newpos || (uint64_t)x > difflen - dpos)
+        return -1;
+      for (int64_t i = 0; i < x; i++)
+        {
+          uint8_t b = diff[dpos + i];
+          if (oldpos + i >= 0 && oldpos + i < (int64_t)oldsize)
+            b += old[oldpos + i];
+          new[newpos + i] = b;
+        }
+      newpos += x;
+      dpos += x;
+      oldpos += x;
+
+      if ((uint64_t)y > newsize - newpos || (uint64_t)y > extralen - epos)
+        return -1;
+      memcpy((void *)(new + newpos), (const void *)(extra + epos), y);
+      newpos += y;
+      epos += y;
+
+      if (z > BSDIFF_MAX_SIZE || z < -BSDIFF_MAX_SIZE)
+        return -1;
+      oldpos += z;
+    }
+
+  return (newpos == newsize && dpos == difflen && epos == extralen) ? 0 : -1;
+}
+
+/* Local Variables:                                                */
+/* mode: C                                                         */
+/* comment-column: 0                                               */
+/* End:                                                            */
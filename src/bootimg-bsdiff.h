@@ -0,0 +1,61 @@
+/* bootimg-tools/bootimg-bsdiff.h
+ *
+ * Copyright 2007, The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef __BOOTIMG_BSDIFF_H__
+#define __BOOTIMG_BSDIFF_H__
+
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+ * Binary delta between two buffers, after Colin Percival's bsdiff.
+ *
+ * The delta is a list of controls (x, y, z): add x diff bytes to x old
+ * bytes, copy y extra bytes, then move the old position by z. It is
+ * stored uncompressed, little endian:
+ *
+ * +--------------------------------------+
+ * | u64 ctrl count, diff len, extra len  |
+ * +--------------------------------------+
+ * | i64 x, y, z                          | ctrl count times
+ * +--------------------------------------+
+ * | diff bytes                           |
+ * +--------------------------------------+
+ * | extra bytes                          |
+ * +--------------------------------------+
+ *
+ * Matches are first looked for with a rolling hash of the old blocks,
+ * which catches unchanged (even moved) blocks without building the
+ * suffix array. The suffix array search is only used if this leaves
+ * too many extra bytes, unless BSDIFF_FLAG_FAST is given.
+ */
+
+#define BSDIFF_FLAG_NONE                0x00
+#define BSDIFF_FLAG_FAST                0x01    /* rolling hash only */
+
+#define BSDIFF_HEADER_SIZE              24
+#define BSDIFF_CTRL_SIZE                24
+
+int   bsdiffCreate      (const uint8_t *, size_t, const uint8_t *, size_t, int, uint8_t **, size_t *);
+int   bsdiffApply       (const uint8_t *, size_t, const uint8_t *, size_t, uint8_t *, size_t);
+
+#endif /* __BOOTIMG_BSDIFF_H__ */
+
+/* Local Variables:                                                */
+/* mode: C                                                         */
+/* comment-column: 0                                               */
+/* End:                                                            */
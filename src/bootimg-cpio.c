@@ -0,0 +1,2106 @@
+/* bootimg-tools/bootimg-cpio.c
+ *
+ * Copyright 2007, The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#ifdef STDC_HEADERS
+# include <stdlib.h>
+# include <stddef.h>
+#else
+# ifdef HAVE_STDLIB_H
+#  include <stdlib.h>
+# endif
+# ifdef HAVE_STDDEF_H
+#  include <stddef.h>
+# endif
+#endif
+#ifdef HAVE_STRING_H
+# include <string.h>
+#endif
+#ifdef HAVE_STRINGS_H
+# include <strings.h>
+#endif
+#ifdef HAVE_UNISTD_H
+# include <unistd.h>
+#endif
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <search.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <zlib.h>
+
+#include "bootimg-cpio.h"
+#include "bootimg-stats.h"
+#include "bootimg-log.h"
+
+#define CPIO_ALIGN4(x)          (((x) + 3) & ~((size_t)3))
+#define CPIO_INFLATE_CHUNK      (256*1024)
+#define CPIO_STREAM_CHUNK       (64*1024)
+#define CPIO_MIN(x,y)           ((x) < (y) ? (x) : (y))
+#define CPIO_MAX(x,y)           ((x) > (y) ? (x) : (y))
+
+/* External decls */
+extern int vflag;
+extern char *progname;
+
+/*
+ * Inflate a gzip stream in a new buffer. Concatenated members are
+ * inflated too; the zero padding often found after the last one is
+ * ignored.
+ */
+int
+cpioInflate(const void *in, size_t inlen, uint8_t **out, size_t *outlen)
+{
+  z_stream zs;
+  uint8_t *buf = (uint8_t *)NULL;
+  size_t alloc = 0, len = 0;
+  int zrc = Z_OK;
+
+  bzero((void *)&zs, sizeof(z_stream));
+  /* 15 + 16: gzip wrapper only */
+  if (inflateInit2(&zs, 15 + 16) != Z_OK)
+    return -1;
+
+  zs.next_in = (Bytef *)in;
+  zs.avail_in = inlen;
+
+  do
+    {
+      if (alloc - len < CPIO_INFLATE_CHUNK)
+        {
+          uint8_t *newbuf;
+
+          alloc = alloc ? alloc * 2 : (inlen * 4 > CPIO_INFLATE_CHUNK ? inlen * 4 : CPIO_INFLATE_CHUNK);
+          if (!(newbuf = (uint8_t *)realloc(buf, alloc)))
+            {
+              zrc = Z_MEM_ERROR;
+              break;
+            }
+          buf = newbuf;
+          statsCount(BOOTIMG_STATS_CURRENT, BOOTIMG_STATS_ALLOCS, 1);
+        }
+      zs.next_out = buf + len;
+      zs.avail_out = alloc - len;
+
+      zrc = inflate(&zs, Z_NO_FLUSH);
+      len = alloc - zs.avail_out;
+
+      /* next member ? */
+      if (zrc == Z_STREAM_END && zs.avail_in >= 2 &&
+          zs.next_in[0] == GZIP_MAGIC_0 && zs.next_in[1] == GZIP_MAGIC_1)
+        {
+          zrc = inflateReset(&zs);
+          continue;
+        }
+    }
+  while (zrc == Z_OK);
+
+  inflateEnd(&zs);
+
+  if (zrc != Z_STREAM_END)
+    {
+      BOOTIMG_LOG(BOOTIMG_LOG_RAMDISK, BOOTIMG_LOG_INFO,
+                  "error: cannot inflate gzip data (%d)!", zrc);
+      free((void *)buf);
+      return -1;
+    }
+
+  *out = buf;
+  *outlen = len;
+  return 0;
+}
+
+/*
+ * Parse 8 hex digits
+ */
+static int
+cpioHex(const char *str, uint32_t *value)
+{
+  uint32_t v = 0;
+
+  for (int n = 0; n < 8; n++)
+    {
+      char c = str[n];
+
+      v <<= 4;
+      if (c >= '0' && c <= '9')
+        v |= c - '0';
+      else if (c >= 'a' && c <= 'f')
+        v |= c - 'a' + 10;
+      else if (c >= 'A' && c <= 'F')
+        v |= c - 'A' + 10;
+      else
+        return -1;
+    }
+  *value = v;
+
+  return 0;
+}
+
+/*
+ * Append a copy of entry (name & data are not copied)
+ */
+int
+cpioAppendEntry(bootimgCpioArchive_p archive, const bootimgCpioEntry_t *entry)
+{
+  if (archive->count == archive->alloc)
+    {
+      size_t alloc = archive->alloc ? archive->alloc * 2 : 64;
+      bootimgCpioEntry_p entries =
+        (bootimgCpioEntry_p)realloc(archive->entries, alloc * sizeof(bootimgCpioEntry_t));
+
+      if (!entries)
+        return -1;
+      statsCount(BOOTIMG_STATS_CURRENT, BOOTIMG_STATS_ALLOCS, 1);
+      archive->entries = entries;
+      archive->alloc = alloc;
+    }
+  archive->entries[archive->count++] = *entry;
+
+  return 0;
+}
+
+/*
+ * Remove the entry at index, keeping the order of the others
+ */
+void
+cpioRemoveEntry(bootimgCpioArchive_p archive, size_t index)
+{
+  if (index >= archive->count)
+    return;
+  memmove((void *)&archive->entries[index], (const void *)&archive->entries[index +1],
+          (archive->count - index -1) * sizeof(bootimgCpioEntry_t));
+  archive->count--;
+}
+
+/*
+ * Decode a newc header, name excepted. Returns -1 if it is not one.
+ */
+static int
+cpioDecodeHeader(const char *hdr, bootimgCpioEntry_p entry, size_t *namesize)
+{
+  uint32_t fields[13];
+
+  if (memcmp((const void *)hdr, (const void *)CPIO_NEWC_MAGIC, CPIO_NEWC_MAGIC_SIZE))
+    return -1;
+  for (int nf = 0; nf < 13; nf++)
+    if (cpioHex(hdr + CPIO_NEWC_MAGIC_SIZE + nf * 8, &fields[nf]) < 0)
+      return -1;
+
+  bzero((void *)entry, sizeof(bootimgCpioEntry_t));
+  entry->ino       = fields[0];
+  entry->mode      = fields[1];
+  entry->uid       = fields[2];
+  entry->gid       = fields[3];
+  entry->nlink     = fields[4];
+  entry->mtime     = fields[5];
+  entry->filesize  = fields[6];
+  entry->devmajor  = fields[7];
+  entry->devminor  = fields[8];
+  entry->rdevmajor = fields[9];
+  entry->rdevminor = fields[10];
+  *namesize        = fields[11];
+
+  return 0;
+}
+
+/*
+ * Parse a newc archive held by archive->buf
+ */
+static int
+cpioParse(bootimgCpioArchive_p archive)
+{
+  size_t offset = 0;
+
+  while (1)
+    {
+      const char *hdr = (const char *)archive->buf + offset;
+      bootimgCpioEntry_t entry;
+      size_t namesize;
+
+      if (archive->len - offset < CPIO_NEWC_HEADER_SIZE ||
+          cpioDecodeHeader(hdr, &entry, &namesize) < 0)
+        {
+          fprintf(stderr, "%s: error: bad cpio header at offset %lu!\n", progname, offset);
+          return -1;
+        }
+
+      /* name and data must fit, name must be NUL terminated */
+      if (namesize == 0 ||
+          archive->len - offset - CPIO_NEWC_HEADER_SIZE < namesize ||
+          hdr[CPIO_NEWC_HEADER_SIZE + namesize -1] != '\0')
+        {
+          fprintf(stderr, "%s: error: bad cpio entry name at offset %lu!\n", progname, offset);
+          return -1;
+        }
+      entry.name = hdr + CPIO_NEWC_HEADER_SIZE;
+      offset = CPIO_ALIGN4(offset + CPIO_NEWC_HEADER_SIZE + namesize);
+
+      if (!strcmp(entry.name, CPIO_TRAILER_NAME))
+        {
+          archive->trailer = entry;
+          archive->padding = (offset < archive->len ? archive->len - offset : 0);
+          break;
+        }
+
+      if (offset > archive->len || archive->len - offset < entry.filesize)
+        {
+          fprintf(stderr, "%s: error: truncated cpio entry '%s'!\n", progname, entry.name);
+          return -1;
+        }
+      entry.data = archive->buf + offset;
+      offset = CPIO_ALIGN4(offset + entry.filesize);
+
+      if (cpioAppendEntry(archive, &entry) < 0)
+        return -1;
+
+      if (offset > archive->len)
+        {
+          fprintf(stderr, "%s: error: cpio archive without trailer!\n", progname);
+          return -1;
+        }
+    }
+
+  return 0;
+}
+
+/*
+ * Load a ramdisk (gzip'ed or raw newc cpio) from memory
+ */
+int
+cpioLoad(const void *data, size_t len, bootimgCpioArchive_p archive)
+{
+  const uint8_t *bytes = (const uint8_t *)data;
+
+  bzero((void *)archive, sizeof(bootimgCpioArchive_t));
+
+  if (len >= 2 && bytes[0] == GZIP_MAGIC_0 && bytes[1] == GZIP_MAGIC_1)
+    {
+      if (cpioInflate(data, len, &archive->buf, &archive->len) < 0)
+        return -1;
+      archive->compressed = 1;
+    }
+  else
+    {
+      if (!(archive->buf = (uint8_t *)malloc(len ? len : 1)))
+        return -1;
+      statsCount(BOOTIMG_STATS_CURRENT, BOOTIMG_STATS_ALLOCS, 1);
+      memcpy((void *)archive->buf, data, len);
+      archive->len = len;
+    }
+
+  if (cpioParse(archive) < 0)
+    {
+      cpioRelease(archive);
+      return -1;
+    }
+
+  return 0;
+}
+
+void
+cpioRelease(bootimgCpioArchive_p archive)
+{
+  free((void *)archive->buf);
+  free((void *)archive->entries);
+  bzero((void *)archive, sizeof(bootimgCpioArchive_t));
+}
+
+/*
+ * Streaming access: entries are decoded as the archive is inflated
+ * from the source, a chunk at a time, and their data is only copied
+ * when read. Data not read is inflated and dropped.
+ */
+int
+cpioStreamOpen(bootimgCpioStream_p st, bootimgCpioRead_t read, void *arg)
+{
+  ssize_t rdsz;
+
+  bzero((void *)st, sizeof(bootimgCpioStream_t));
+  st->read = read;
+  st->arg = arg;
+
+  if (!(st->in = (uint8_t *)malloc(CPIO_STREAM_CHUNK)) ||
+      !(st->out = (uint8_t *)malloc(CPIO_STREAM_CHUNK)))
+    {
+      cpioStreamClose(st);
+      return -1;
+    }
+  statsCount(BOOTIMG_STATS_CURRENT, BOOTIMG_STATS_ALLOCS, 2);
+
+  if ((rdsz = read(arg, st->in, CPIO_STREAM_CHUNK)) < 0)
+    {
+      cpioStreamClose(st);
+      return -1;
+    }
+
+  if (rdsz >= 2 && st->in[0] == GZIP_MAGIC_0 && st->in[1] == GZIP_MAGIC_1)
+    {
+      z_stream *zs = (z_stream *)calloc(1, sizeof(z_stream));
+
+      /* 15 + 16: gzip wrapper only */
+      if (!zs || inflateInit2(zs, 15 + 16) != Z_OK)
+        {
+          free((void *)zs);
+          cpioStreamClose(st);
+          return -1;
+        }
+      zs->next_in = st->in;
+      zs->avail_in = rdsz;
+      st->zs = (void *)zs;
+    }
+  else
+    {
+      memcpy((void *)st->out, (const void *)st->in, rdsz);
+      st->len = rdsz;
+    }
+
+  return 0;
+}
+
+void
+cpioStreamClose(bootimgCpioStream_p st)
+{
+  if (st->zs)
+    {
+      inflateEnd((z_stream *)st->zs);
+      free(st->zs);
+    }
+  free((void *)st->in);
+  free((void *)st->out);
+  bzero((void *)st, sizeof(bootimgCpioStream_t));
+}
+
+/*
+ * Next chunk of the archive. Concatenated gzip members are inflated
+ * as cpioInflate does. Returns its length, 0 at the end of the archive
+ * or -1 if the source is truncated or corrupted.
+ */
+static ssize_t
+cpioStreamFill(bootimgCpioStream_p st)
+{
+  z_stream *zs = (z_stream *)st->zs;
+  ssize_t rdsz;
+  int zrc;
+
+  st->pos = st->len = 0;
+  if (!zs)
+    {
+      if ((rdsz = st->read(st->arg, st->out, CPIO_STREAM_CHUNK)) > 0)
+        st->len = rdsz;
+      return rdsz;
+    }
+
+  while (!st->len && !st->eof)
+    {
+      if (!zs->avail_in)
+        {
+          if ((rdsz = st->read(st->arg, st->in, CPIO_STREAM_CHUNK)) <= 0)
+            return -1;
+          zs->next_in = st->in;
+          zs->avail_in = rdsz;
+        }
+      zs->next_out = st->out;
+      zs->avail_out = CPIO_STREAM_CHUNK;
+      zrc = inflate(zs, Z_NO_FLUSH);
+      st->len = CPIO_STREAM_CHUNK - zs->avail_out;
+      if (zrc == Z_STREAM_END)
+        {
+          /* next member ? its magic may be in the next source chunk */
+          if (zs->avail_in < 2)
+            {
+              memmove((void *)st->in, (const void *)zs->next_in, zs->avail_in);
+              if ((rdsz = st->read(st->arg, st->in + zs->avail_in, CPIO_STREAM_CHUNK - zs->avail_in)) < 0)
+                return -1;
+              zs->next_in = st->in;
+              zs->avail_in += rdsz;
+            }
+          if (zs->avail_in >= 2 && zs->next_in[0] == GZIP_MAGIC_0 && zs->next_in[1] == GZIP_MAGIC_1)
+            zrc = inflateReset(zs);
+          else
+            st->eof = 1;
+        }
+      if (zrc != Z_OK && zrc != Z_STREAM_END)
+        {
+          BOOTIMG_LOG(BOOTIMG_LOG_RAMDISK, BOOTIMG_LOG_INFO,
+                      "error: cannot inflate gzip data (%d)!", zrc);
+          return -1;
+        }
+    }
+
+  return st->len;
+}
+
+/*
+ * Copy len bytes of the archive to buf, or drop them if buf is NULL.
+ * Returns the count copied, less than len at the end of the archive.
+ */
+static ssize_t
+cpioStreamGet(bootimgCpioStream_p st, void *buf, size_t len)
+{
+  size_t done = 0;
+
+  while (done < len)
+    {
+      size_t chunk;
+
+      if (st->pos == st->len)
+        {
+          ssize_t rc = cpioStreamFill(st);
+
+          if (rc < 0)
+            return -1;
+          if (!rc)
+            break;
+        }
+      chunk = CPIO_MIN(len - done, st->len - st->pos);
+      if (buf)
+        memcpy((uint8_t *)buf + done, (const void *)(st->out + st->pos), chunk);
+      st->pos += chunk;
+      done += chunk;
+    }
+  st->offset += done;
+
+  return done;
+}
+
+/*
+ * Decode the next entry, skipping what is left of the current one. The
+ * entry name is valid until the next call and its data is read with
+ * cpioStreamRead. Returns 1, 0 at the trailer or -1 on error.
+ */
+int
+cpioStreamNext(bootimgCpioStream_p st, bootimgCpioEntry_p entry)
+{
+  char hdr[CPIO_NEWC_HEADER_SIZE];
+  uint64_t skip = CPIO_ALIGN4(st->offset + st->left) - st->offset;
+  uint64_t offset;
+  size_t namesize;
+
+  if (cpioStreamGet(st, (void *)NULL, skip) != (ssize_t)skip)
+    {
+      fprintf(stderr, "%s: error: truncated cpio entry '%s'!\n", progname, st->name);
+      return -1;
+    }
+  st->left = 0;
+
+  offset = st->offset;
+  if (cpioStreamGet(st, (void *)hdr, sizeof(hdr)) != (ssize_t)sizeof(hdr) ||
+      cpioDecodeHeader(hdr, entry, &namesize) < 0)
+    {
+      fprintf(stderr, "%s: error: bad cpio header at offset %lu!\n", progname, offset);
+      return -1;
+    }
+  if (namesize == 0 || namesize > sizeof(st->name) ||
+      cpioStreamGet(st, (void *)st->name, namesize) != (ssize_t)namesize ||
+      st->name[namesize -1] != '\0')
+    {
+      fprintf(stderr, "%s: error: bad cpio entry name at offset %lu!\n", progname, offset);
+      return -1;
+    }
+  skip = CPIO_ALIGN4(st->offset) - st->offset;
+  if (cpioStreamGet(st, (void *)NULL, skip) != (ssize_t)skip)
+    {
+      fprintf(stderr, "%s: error: truncated cpio entry '%s'!\n", progname, st->name);
+      return -1;
+    }
+  entry->name = st->name;
+
+  if (!strcmp(st->name, CPIO_TRAILER_NAME))
+    return 0;
+  st->left = entry->filesize;
+
+  return 1;
+}
+
+/*
+ * Read up to len bytes of the data of the current entry. Returns the
+ * count read, 0 once all of it was.
+ */
+ssize_t
+cpioStreamRead(bootimgCpioStream_p st, void *buf, size_t len)
+{
+  ssize_t rdsz;
+
+  len = CPIO_MIN(len, st->left);
+  if ((rdsz = cpioStreamGet(st, buf, len)) != (ssize_t)len)
+    {
+      fprintf(stderr, "%s: error: truncated cpio entry '%s'!\n", progname, st->name);
+      return -1;
+    }
+  st->left -= len;
+
+  return rdsz;
+}
+
+static int
+cpioCompareEntries(const void *a, const void *b)
+{
+  return strcmp(((const bootimgCpioEntry_t *)a)->name, ((const bootimgCpioEntry_t *)b)->name);
+}
+
+/*
+ * Sort entries by name (allows bsearch in cpioFindEntry & merge walks)
+ */
+void
+cpioSortEntries(bootimgCpioArchive_p archive)
+{
+  qsort((void *)archive->entries, archive->count, sizeof(bootimgCpioEntry_t), cpioCompareEntries);
+}
+
+/*
+ * Find an entry by name in a sorted archive
+ */
+bootimgCpioEntry_p
+cpioFindEntry(bootimgCpioArchive_p archive, const char *name)
+{
+  bootimgCpioEntry_t key;
+
+  key.name = name;
+  return (bootimgCpioEntry_p)bsearch((const void *)&key, (const void *)archive->entries,
+                                     archive->count, sizeof(bootimgCpioEntry_t),
+                                     cpioCompareEntries);
+}
+
+/*
+ * Whether two archives hold the same entries, in any order: names,
+ * modes, owners, mtimes, devices & data. Inode numbers, link counts &
+ * the devices holding the files are not compared. The entries are
+ * compared on sorted copies, the archives are left as they are.
+ */
+int
+cpioSameEntries(bootimgCpioArchive_p a, bootimgCpioArchive_p b)
+{
+  bootimgCpioEntry_p sa, sb;
+  int same = 1;
+
+  if (a->count != b->count)
+    return 0;
+  if (!a->count)
+    return 1;
+
+  sa = (bootimgCpioEntry_p)malloc(a->count * sizeof(bootimgCpioEntry_t));
+  sb = (bootimgCpioEntry_p)malloc(b->count * sizeof(bootimgCpioEntry_t));
+  if (!sa || !sb)
+    same = 0;
+  else
+    {
+      memcpy((void *)sa, (const void *)a->entries, a->count * sizeof(bootimgCpioEntry_t));
+      memcpy((void *)sb, (const void *)b->entries, b->count * sizeof(bootimgCpioEntry_t));
+      qsort((void *)sa, a->count, sizeof(bootimgCpioEntry_t), cpioCompareEntries);
+      qsort((void *)sb, b->count, sizeof(bootimgCpioEntry_t), cpioCompareEntries);
+    }
+
+  for (size_t ne = 0; same && ne < a->count; ne++)
+    {
+      bootimgCpioEntry_p ea = &sa[ne], eb = &sb[ne];
+
+      if (strcmp(ea->name, eb->name) || ea->mode != eb->mode ||
+          ea->uid != eb->uid || ea->gid != eb->gid || ea->mtime != eb->mtime ||
+          ea->rdevmajor != eb->rdevmajor || ea->rdevminor != eb->rdevminor ||
+          ea->filesize != eb->filesize ||
+          (ea->filesize && memcmp((const void *)ea->data, (const void *)eb->data, ea->filesize)))
+        same = 0;
+    }
+
+  free((void *)sa);
+  free((void *)sb);
+
+  return same;
+}
+
+/*
+ * Write a newc header and name at out, return the padded size
+ */
+static size_t
+cpioWriteHeader(uint8_t *out, const bootimgCpioEntry_t *entry, const char *name, uint32_t filesize)
+{
+  size_t namesize = strlen(name) +1;
+  char hdr[CPIO_NEWC_HEADER_SIZE +1];
+
+  snprintf(hdr, sizeof(hdr),
+           "%s%08x%08x%08x%08x%08x%08x%08x%08x%08x%08x%08x%08x%08x",
+           CPIO_NEWC_MAGIC, entry->ino, entry->mode, entry->uid, entry->gid,
+           entry->nlink, entry->mtime, filesize, entry->devmajor, entry->devminor,
+           entry->rdevmajor, entry->rdevminor, (uint32_t)namesize, 0);
+  memcpy((void *)out, (const void *)hdr, CPIO_NEWC_HEADER_SIZE);
+  memcpy((void *)(out + CPIO_NEWC_HEADER_SIZE), (const void *)name, namesize);
+
+  return CPIO_ALIGN4(CPIO_NEWC_HEADER_SIZE + namesize);
+}
+
+/*
+ * Serialize the entries, in their order, as an uncompressed newc
+ * archive in a new buffer
+ */
+int
+cpioWrite(bootimgCpioArchive_p archive, uint8_t **out, size_t *outlen)
+{
+  bootimgCpioEntry_t trailer;
+  uint8_t *buf;
+  size_t len = 0, pos = 0;
+
+  for (size_t ne = 0; ne < archive->count; ne++)
+    len += CPIO_ALIGN4(CPIO_NEWC_HEADER_SIZE + strlen(archive->entries[ne].name) +1) +
+      CPIO_ALIGN4(archive->entries[ne].filesize);
+  len += CPIO_ALIGN4(CPIO_NEWC_HEADER_SIZE + sizeof(CPIO_TRAILER_NAME)) + archive->padding;
+
+  /* headers, name & data paddings are zeros */
+  if (!(buf = (uint8_t *)calloc(1, len)))
+    return -1;
+  statsCount(BOOTIMG_STATS_CURRENT, BOOTIMG_STATS_ALLOCS, 1);
+
+  for (size_t ne = 0; ne < archive->count; ne++)
+    {
+      bootimgCpioEntry_p entry = &archive->entries[ne];
+
+      pos += cpioWriteHeader(buf + pos, entry, entry->name, entry->filesize);
+      if (entry->filesize)
+        memcpy((void *)(buf + pos), (const void *)entry->data, entry->filesize);
+      pos += CPIO_ALIGN4(entry->filesize);
+    }
+
+  if (archive->trailer.name)
+    trailer = archive->trailer;
+  else
+    {
+      bzero((void *)&trailer, sizeof(bootimgCpioEntry_t));
+      trailer.nlink = 1;
+    }
+  pos += cpioWriteHeader(buf + pos, &trailer, CPIO_TRAILER_NAME, 0);
+  pos += archive->padding;
+
+  *out = buf;
+  *outlen = pos;
+  return 0;
+}
+
+/*
+ * Materialization of an archive as a tree: the directories are made
+ * first, in path order so that parents come first, and kept open. The
+ * other entries are then created by a pool of threads relative to the
+ * fd of their directory (no path resolution), hard links are made and
+ * last the attributes (owner & mode of directories, mtimes) are set by
+ * the pool, once nothing is created in the directories anymore. As
+ * with cpio, the last entry of a path wins: the others are skipped.
+ */
+
+#define CPIO_TREE_CREATE        0
+#define CPIO_TREE_ATTRS         1
+
+/* fds left to the threads & the directories reached from the root */
+#define CPIO_TREE_FD_RESERVE    (64 + 2 * CPIO_MAX_JOBS)
+
+typedef struct _cpioTreeDir_st
+{
+  const char *name;                     /* not NUL terminated */
+  size_t len;
+  long entry;                           /* -1 if only implied by a path */
+  int fd;                               /* -1 if not kept open */
+} cpioTreeDir_t, *cpioTreeDir_p;
+
+typedef struct _cpioTree_st
+{
+  bootimgCpioArchive_p archive;
+  const char **names;                   /* relative, NULL if skipped */
+  size_t *lens;
+  cpioTreeDir_p dirs;
+  size_t ndirs;
+  size_t nopen;                         /* directories kept open at most */
+  int rootfd;
+  int owner;                            /* set owners (root only) */
+  int round;
+  size_t next;
+  size_t failed;
+} cpioTree_t, *cpioTree_p;
+
+static int
+cpioCompareDirs(const void *a, const void *b)
+{
+  const cpioTreeDir_t *da = (const cpioTreeDir_t *)a, *db = (const cpioTreeDir_t *)b;
+  int rc = memcmp((const void *)da->name, (const void *)db->name, CPIO_MIN(da->len, db->len));
+
+  return rc ? rc : (da->len > db->len) - (da->len < db->len);
+}
+
+/*
+ * Name of an entry relative to the tree, NULL if it would go out of it
+ */
+static const char *
+cpioTreeName(const char *name, size_t *len)
+{
+  const char *comp;
+
+  while (*name == '/' || (name[0] == '.' && (name[1] == '/' || !name[1])))
+    name += (*name == '/' ? 1 : 1 + (name[1] == '/'));
+  *len = strlen(name);
+  while (*len && name[*len -1] == '/')
+    (*len)--;
+
+  for (comp = name; comp < name + *len; comp = strchr(comp, '/') +1)
+    {
+      if (comp[0] == '.' && comp[1] == '.' && (comp[2] == '/' || comp + 2 == name + *len))
+        return (const char *)NULL;
+      if (!memchr((const void *)comp, '/', name + *len - comp))
+        break;
+    }
+
+  return name;
+}
+
+/*
+ * Open a directory of the tree one component at a time from the root,
+ * symlinks (made by earlier entries or already there) not followed
+ */
+static int
+cpioTreeOpenDir(cpioTree_p tree, const char *name, size_t len)
+{
+  const char *end = name + len;
+  char comp[NAME_MAX +1];
+  int fd = tree->rootfd;
+
+  while (name < end && fd >= 0)
+    {
+      const char *slash = (const char *)memchr((const void *)name, '/', end - name);
+      size_t clen = (slash ? slash : end) - name;
+      int next = -1;
+
+      if (!clen)
+        {
+          name++;
+          continue;
+        }
+      if (clen > NAME_MAX)
+        errno = ENAMETOOLONG;
+      else
+        {
+          memcpy((void *)comp, (const void *)name, clen);
+          comp[clen] = '\0';
+          next = openat(fd, comp, O_PATH | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+          statsCount(BOOTIMG_STATS_CURRENT, BOOTIMG_STATS_SYSCALLS, 1);
+        }
+      if (fd != tree->rootfd)
+        close(fd);
+      fd = next;
+      name += clen +1;
+    }
+
+  return fd;
+}
+
+/*
+ * Directory fd & NUL terminated name (in buf) to reach a path of the
+ * tree, NULL (errno set) if too long or if the directory cannot be
+ * reached. A directory not kept open is opened for the call: its fd
+ * is set in tmpfd for the caller to close, -1 otherwise.
+ */
+static const char *
+cpioTreeAt(cpioTree_p tree, const char *name, size_t len, char *buf, int *dirfd, int *tmpfd)
+{
+  const char *slash = (const char *)memrchr((const void *)name, '/', len);
+
+  *dirfd = tree->rootfd;
+  *tmpfd = -1;
+  if (!len)
+    return ".";
+  if (len >= PATH_MAX)
+    {
+      errno = ENAMETOOLONG;
+      return (const char *)NULL;
+    }
+
+  if (slash)
+    {
+      cpioTreeDir_t key = { name, (size_t)(slash - name), -1, -1 };
+      cpioTreeDir_p parent = (cpioTreeDir_p)bsearch((const void *)&key, (const void *)tree->dirs, tree->ndirs,
+                                                    sizeof(cpioTreeDir_t), cpioCompareDirs);
+
+      if (parent && parent->fd >= 0)
+        *dirfd = parent->fd;
+      else if ((*dirfd = cpioTreeOpenDir(tree, name, slash - name)) < 0)
+        return (const char *)NULL;
+      else if (*dirfd != tree->rootfd)
+        *tmpfd = *dirfd;
+      len -= slash +1 - name;
+      name = slash +1;
+    }
+
+  memcpy((void *)buf, (const void *)name, len);
+  buf[len] = '\0';
+  return buf;
+}
+
+/*
+ * Skip the entries of a path but the last one, which cpio would leave
+ */
+static int
+cpioTreeUnique(cpioTree_p tree)
+{
+  cpioTreeDir_p paths = (cpioTreeDir_p)calloc(tree->archive->count +1, sizeof(cpioTreeDir_t));
+  size_t count = 0;
+
+  if (!paths)
+    return -1;
+  statsCount(BOOTIMG_STATS_CURRENT, BOOTIMG_STATS_ALLOCS, 1);
+
+  for (size_t ne = 0; ne < tree->archive->count; ne++)
+    if (tree->names[ne])
+      paths[count++] = (cpioTreeDir_t){ tree->names[ne], tree->lens[ne], (long)ne, -1 };
+  qsort((void *)paths, count, sizeof(cpioTreeDir_t), cpioCompareDirs);
+
+  /* the sort is not stable: the last entry of a path is looked for */
+  for (size_t np = 0, last; np < count; np = last +1)
+    {
+      long keep = paths[np].entry;
+
+      for (last = np; last +1 < count && !cpioCompareDirs((const void *)&paths[np], (const void *)&paths[last +1]); last++)
+        if (paths[last +1].entry > keep)
+          keep = paths[last +1].entry;
+      for (size_t nd = np; nd <= last; nd++)
+        if (paths[nd].entry != keep)
+          {
+            BOOTIMG_LOG(BOOTIMG_LOG_RAMDISK, BOOTIMG_LOG_VERBOSE, "'%s' replaced by a later entry",
+                        tree->archive->entries[paths[nd].entry].name);
+            tree->names[paths[nd].entry] = (const char *)NULL;
+          }
+    }
+
+  free((void *)paths);
+  return 0;
+}
+
+/*
+ * Directories of the tree (given or implied by a path), sorted & with
+ * their parents first, and the root
+ */
+static int
+cpioTreeDirs(cpioTree_p tree)
+{
+  size_t count = 1;
+
+  for (size_t ne = 0; ne < tree->archive->count; ne++)
+    if (tree->names[ne])
+      {
+        count++;
+        for (size_t nc = 0; nc < tree->lens[ne]; nc++)
+          count += (tree->names[ne][nc] == '/');
+      }
+
+  tree->dirs = (cpioTreeDir_p)calloc(count, sizeof(cpioTreeDir_t));
+  if (!tree->dirs)
+    return -1;
+  count = 0;
+  statsCount(BOOTIMG_STATS_CURRENT, BOOTIMG_STATS_ALLOCS, 1);
+
+  tree->dirs[count++] = (cpioTreeDir_t){ "", 0, -1, tree->rootfd };
+  for (size_t ne = 0; ne < tree->archive->count; ne++)
+    {
+      const char *name = tree->names[ne];
+
+      if (!name)
+        continue;
+      if (S_ISDIR(tree->archive->entries[ne].mode))
+        tree->dirs[count++] = (cpioTreeDir_t){ name, tree->lens[ne], (long)ne, -1 };
+      for (size_t nc = 0; nc < tree->lens[ne]; nc++)
+        if (name[nc] == '/')
+          tree->dirs[count++] = (cpioTreeDir_t){ name, nc, -1, -1 };
+    }
+  qsort((void *)tree->dirs, count, sizeof(cpioTreeDir_t), cpioCompareDirs);
+
+  /* one per path, given ones kept */
+  tree->ndirs = 0;
+  for (size_t nd = 0; nd < count; nd++)
+    {
+      cpioTreeDir_p last = tree->ndirs ? &tree->dirs[tree->ndirs -1] : (cpioTreeDir_p)NULL;
+
+      if (last && !cpioCompareDirs((const void *)last, (const void *)&tree->dirs[nd]))
+        {
+          if (tree->dirs[nd].entry >= 0)
+            last->entry = tree->dirs[nd].entry;
+          if (tree->dirs[nd].fd >= 0)
+            last->fd = tree->dirs[nd].fd;
+          continue;
+        }
+      tree->dirs[tree->ndirs++] = tree->dirs[nd];
+    }
+
+  return 0;
+}
+
+/*
+ * Make the directories (writable by us until their attributes are
+ * set) and keep them open; with too many of them, the directories not
+ * kept are reached from the root one component at a time.
+ */
+static int
+cpioTreeMakeDirs(cpioTree_p tree)
+{
+  char buf[PATH_MAX];
+  int rc = 0;
+
+  for (size_t nd = 0; nd < tree->ndirs; nd++)
+    {
+      cpioTreeDir_p dir = &tree->dirs[nd];
+      const char *base;
+      int dirfd, tmpfd;
+
+      if (!dir->len)
+        continue;
+      if (!(base = cpioTreeAt(tree, dir->name, dir->len, buf, &dirfd, &tmpfd)) ||
+          (mkdirat(dirfd, base, 0700) < 0 && errno != EEXIST))
+        {
+          fprintf(stderr, "%s: error: cannot create directory '%.*s': %s!\n",
+                  progname, (int)dir->len, dir->name, strerror(errno));
+          if (tmpfd >= 0)
+            close(tmpfd);
+          rc = -1;
+          continue;
+        }
+      statsCount(BOOTIMG_STATS_CURRENT, BOOTIMG_STATS_SYSCALLS, 2);
+      if (tree->nopen)
+        {
+          dir->fd = openat(dirfd, base, O_PATH | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+          tree->nopen -= (dir->fd >= 0);
+        }
+      if (tmpfd >= 0)
+        close(tmpfd);
+    }
+
+  return rc;
+}
+
+static int
+cpioTreeWrite(int fd, const uint8_t *data, size_t len)
+{
+  while (len)
+    {
+      ssize_t done = write(fd, (const void *)data, len);
+
+      if (done < 0 && errno == EINTR)
+        continue;
+      if (done <= 0)
+        return -1;
+      statsCount(BOOTIMG_STATS_CURRENT, BOOTIMG_STATS_WRITE, done);
+      data += done;
+      len -= done;
+    }
+
+  return 0;
+}
+
+/*
+ * Create an entry other than a directory. Owner & mode are set on the
+ * new file, the mtime later.
+ */
+static int
+cpioTreeCreate(cpioTree_p tree, size_t ne)
+{
+  bootimgCpioEntry_p entry = &tree->archive->entries[ne];
+  char buf[PATH_MAX];
+  const char *base;
+  int dirfd, tmpfd, rc = -1;
+
+  if (!tree->names[ne] || S_ISDIR(entry->mode))
+    return 0;
+  if (!(base = cpioTreeAt(tree, tree->names[ne], tree->lens[ne], buf, &dirfd, &tmpfd)))
+    {
+      fprintf(stderr, "%s: error: cannot reach '%s': %s!\n", progname, entry->name, strerror(errno));
+      return -1;
+    }
+
+  statsCount(BOOTIMG_STATS_CURRENT, BOOTIMG_STATS_SYSCALLS, 2);
+  if (S_ISREG(entry->mode))
+    {
+      int fd = openat(dirfd, base, O_WRONLY | O_CREAT | O_TRUNC | O_NOFOLLOW | O_CLOEXEC, 0600);
+
+      if (fd >= 0)
+        {
+          if (cpioTreeWrite(fd, entry->data, entry->filesize) == 0 &&
+              (!tree->owner || fchown(fd, entry->uid, entry->gid) == 0) &&
+              fchmod(fd, entry->mode & 07777) == 0)
+            rc = 0;
+          close(fd);
+        }
+    }
+  else if (S_ISLNK(entry->mode))
+    {
+      char target[PATH_MAX];
+      int made = -1;
+
+      errno = ENAMETOOLONG;
+      if (entry->filesize < PATH_MAX)
+        {
+          memcpy((void *)target, (const void *)entry->data, entry->filesize);
+          target[entry->filesize] = '\0';
+          made = symlinkat(target, dirfd, base);
+          if (made < 0 && errno == EEXIST && unlinkat(dirfd, base, 0) == 0)
+            made = symlinkat(target, dirfd, base);
+        }
+      if (made == 0 &&
+          (!tree->owner || fchownat(dirfd, base, entry->uid, entry->gid, AT_SYMLINK_NOFOLLOW) == 0))
+        rc = 0;
+    }
+  else
+    {
+      dev_t dev = makedev(entry->rdevmajor, entry->rdevminor);
+      int made = mknodat(dirfd, base, entry->mode & (S_IFMT | 07777), dev);
+
+      if (made < 0 && errno == EEXIST && unlinkat(dirfd, base, 0) == 0)
+        made = mknodat(dirfd, base, entry->mode & (S_IFMT | 07777), dev);
+      if (made == 0 &&
+          (!tree->owner || fchownat(dirfd, base, entry->uid, entry->gid, AT_SYMLINK_NOFOLLOW) == 0) &&
+          fchmodat(dirfd, base, entry->mode & 07777, 0) == 0)
+        rc = 0;
+    }
+
+  if (rc < 0)
+    fprintf(stderr, "%s: error: cannot create '%s': %s!\n", progname, entry->name, strerror(errno));
+  else
+    BOOTIMG_LOG(BOOTIMG_LOG_RAMDISK, BOOTIMG_LOG_DEBUG, "'%s' created", entry->name);
+  if (tmpfd >= 0)
+    close(tmpfd);
+
+  return rc;
+}
+
+/*
+ * Regular file with more links, the data being with one of them
+ */
+static int
+cpioTreeIsLink(bootimgCpioEntry_p entry)
+{
+  return S_ISREG(entry->mode) && entry->nlink > 1 && !entry->filesize;
+}
+
+/*
+ * Link an entry to the one of its inode holding the data, or the first
+ * one if none does
+ */
+static int
+cpioTreeLink(cpioTree_p tree, size_t ne)
+{
+  bootimgCpioEntry_p entry = &tree->archive->entries[ne];
+  char buf[PATH_MAX], tbuf[PATH_MAX];
+  const char *base, *tbase = (const char *)NULL;
+  int dirfd, tmpfd, tdirfd, ttmpfd = -1, rc = -1;
+  long target = -1;
+
+  if (!tree->names[ne])
+    return 0;
+  for (size_t nl = 0; nl < tree->archive->count && target < 0; nl++)
+    if (tree->names[nl] && tree->archive->entries[nl].ino == entry->ino &&
+        S_ISREG(tree->archive->entries[nl].mode) && tree->archive->entries[nl].filesize)
+      target = nl;
+  for (size_t nl = 0; nl < ne && target < 0; nl++)
+    if (tree->names[nl] && tree->archive->entries[nl].ino == entry->ino &&
+        cpioTreeIsLink(&tree->archive->entries[nl]))
+      target = nl;
+  if (target < 0)
+    return cpioTreeCreate(tree, ne);
+
+  /* both ends are reached through their directories, never from the root */
+  if ((base = cpioTreeAt(tree, tree->names[ne], tree->lens[ne], buf, &dirfd, &tmpfd)) &&
+      (tbase = cpioTreeAt(tree, tree->names[target], tree->lens[target], tbuf, &tdirfd, &ttmpfd)))
+    {
+      statsCount(BOOTIMG_STATS_CURRENT, BOOTIMG_STATS_SYSCALLS, 2);
+      unlinkat(dirfd, base, 0);
+      rc = linkat(tdirfd, tbase, dirfd, base, 0);
+    }
+  if (rc < 0)
+    fprintf(stderr, "%s: error: cannot link '%s' to '%s': %s!\n",
+            progname, entry->name, tree->archive->entries[target].name, strerror(errno));
+  if (tmpfd >= 0)
+    close(tmpfd);
+  if (ttmpfd >= 0)
+    close(ttmpfd);
+
+  return rc;
+}
+
+/*
+ * mtime of an entry, owner & mode too for directories (implied ones
+ * after the entries). Directories are changed through an fd, so that
+ * a symlink in their place is not followed.
+ */
+static int
+cpioTreeAttrs(cpioTree_p tree, size_t ne)
+{
+  bootimgCpioEntry_p entry = (bootimgCpioEntry_p)NULL;
+  char buf[PATH_MAX];
+  const char *base, *name;
+  int dirfd, tmpfd, fd = -1, rc = -1, namelen;
+
+  if (ne < tree->archive->count)
+    {
+      entry = &tree->archive->entries[ne];
+      if (!tree->names[ne])
+        return 0;
+      name = entry->name;
+      namelen = (int)strlen(name);
+      base = cpioTreeAt(tree, tree->names[ne], tree->lens[ne], buf, &dirfd, &tmpfd);
+    }
+  else
+    {
+      cpioTreeDir_p dir = &tree->dirs[ne - tree->archive->count];
+
+      if (dir->entry >= 0 || !dir->len)
+        return 0;
+      name = dir->name;
+      namelen = (int)dir->len;
+      base = cpioTreeAt(tree, dir->name, dir->len, buf, &dirfd, &tmpfd);
+    }
+  if (!base)
+    return -1;
+
+  do
+    {
+      struct timespec times[2] = { { entry ? entry->mtime : 0, 0 }, { entry ? entry->mtime : 0, 0 } };
+
+      statsCount(BOOTIMG_STATS_CURRENT, BOOTIMG_STATS_SYSCALLS, 1);
+      if (entry && !S_ISDIR(entry->mode))
+        {
+          if ((rc = utimensat(dirfd, base, times, AT_SYMLINK_NOFOLLOW)) < 0)
+            fprintf(stderr, "%s: error: cannot set the mtime of '%.*s': %s!\n", progname, namelen, name, strerror(errno));
+          break;
+        }
+
+      if ((fd = openat(dirfd, base, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC)) < 0)
+        {
+          fprintf(stderr, "%s: error: cannot open directory '%.*s': %s!\n", progname, namelen, name, strerror(errno));
+          break;
+        }
+      if (!entry)
+        {
+          rc = fchmod(fd, 0755);
+          break;
+        }
+
+      statsCount(BOOTIMG_STATS_CURRENT, BOOTIMG_STATS_SYSCALLS, 3);
+      if ((tree->owner && fchown(fd, entry->uid, entry->gid) < 0) ||
+          fchmod(fd, entry->mode & 07777) < 0)
+        fprintf(stderr, "%s: error: cannot set the mode of '%.*s': %s!\n", progname, namelen, name, strerror(errno));
+      else if (futimens(fd, times) < 0)
+        fprintf(stderr, "%s: error: cannot set the mtime of '%.*s': %s!\n", progname, namelen, name, strerror(errno));
+      else
+        rc = 0;
+    }
+  while (0);
+
+  if (fd >= 0)
+    close(fd);
+  if (tmpfd >= 0)
+    close(tmpfd);
+  return rc;
+}
+
+static void *
+cpioTreeThread(void *arg)
+{
+  cpioTree_p tree = (cpioTree_p)arg;
+  size_t count = tree->archive->count + (tree->round == CPIO_TREE_ATTRS ? tree->ndirs : 0);
+  uint64_t start = statsBegin(BOOTIMG_STATS_RAMDISK_UNPACK);
+  size_t ne;
+
+  while ((ne = __atomic_fetch_add(&tree->next, 1, __ATOMIC_RELAXED)) < count)
+    {
+      int rc;
+
+      if (tree->round == CPIO_TREE_ATTRS)
+        rc = cpioTreeAttrs(tree, ne);
+      else if (cpioTreeIsLink(&tree->archive->entries[ne]))
+        rc = 0;
+      else
+        rc = cpioTreeCreate(tree, ne);
+      if (rc < 0)
+        __atomic_fetch_add(&tree->failed, 1, __ATOMIC_RELAXED);
+    }
+  statsEnd(BOOTIMG_STATS_RAMDISK_UNPACK, start);
+
+  return NULL;
+}
+
+/*
+ * Run a round over the entries with jobs threads, the caller included
+ */
+static void
+cpioTreeRound(cpioTree_p tree, int round, unsigned jobs)
+{
+  pthread_t threads[CPIO_MAX_JOBS];
+  unsigned nthreads = 0;
+
+  tree->round = round;
+  tree->next = 0;
+  for (; nthreads +1 < CPIO_MIN(jobs, CPIO_MAX_JOBS); nthreads++)
+    if (pthread_create(&threads[nthreads], NULL, cpioTreeThread, (void *)tree))
+      break;
+  (void)cpioTreeThread((void *)tree);
+  for (unsigned nt = 0; nt < nthreads; nt++)
+    pthread_join(threads[nt], NULL);
+}
+
+/*
+ * Create the entries of an archive below the existing directory dir
+ * with up to jobs threads. Owners are set when run as root. Returns
+ * -1 if an entry could not be created as in the archive.
+ */
+int
+cpioExtractTree(bootimgCpioArchive_p archive, const char *dir, unsigned jobs)
+{
+  cpioTree_t tree;
+  struct rlimit limit;
+  int rc = -1;
+
+  bzero((void *)&tree, sizeof(cpioTree_t));
+  tree.archive = archive;
+  tree.owner = (geteuid() == 0);
+
+  do
+    {
+      if ((tree.rootfd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) < 0)
+        {
+          fprintf(stderr, "%s: error: cannot open directory '%s': %s!\n", progname, dir, strerror(errno));
+          break;
+        }
+
+      tree.names = (const char **)calloc(archive->count +1, sizeof(const char *));
+      tree.lens = (size_t *)calloc(archive->count +1, sizeof(size_t));
+      if (!tree.names || !tree.lens)
+        {
+          fprintf(stderr, "%s: error: cannot allocate memory for the ramdisk tree!\n", progname);
+          break;
+        }
+      for (size_t ne = 0; ne < archive->count; ne++)
+        if (!(tree.names[ne] = cpioTreeName(archive->entries[ne].name, &tree.lens[ne])))
+          {
+            fprintf(stderr, "%s: error: '%s' is out of the ramdisk tree, skipped!\n",
+                    progname, archive->entries[ne].name);
+            tree.failed++;
+          }
+      if (cpioTreeUnique(&tree) < 0)
+        {
+          fprintf(stderr, "%s: error: cannot allocate memory for the ramdisk tree!\n", progname);
+          break;
+        }
+
+      if (cpioTreeDirs(&tree) < 0)
+        {
+          fprintf(stderr, "%s: error: cannot allocate memory for the ramdisk tree!\n", progname);
+          break;
+        }
+
+      /* directories are kept open: as many as the hard limit allows */
+      tree.nopen = tree.ndirs;
+      if (getrlimit(RLIMIT_NOFILE, &limit) == 0)
+        {
+          if (limit.rlim_cur < limit.rlim_max && limit.rlim_cur < tree.ndirs + CPIO_TREE_FD_RESERVE)
+            {
+              limit.rlim_cur = CPIO_MIN(limit.rlim_max, (rlim_t)tree.ndirs + CPIO_TREE_FD_RESERVE);
+              if (setrlimit(RLIMIT_NOFILE, &limit) < 0)
+                (void)getrlimit(RLIMIT_NOFILE, &limit);
+            }
+          if (limit.rlim_cur != RLIM_INFINITY)
+            tree.nopen = limit.rlim_cur > CPIO_TREE_FD_RESERVE ? limit.rlim_cur - CPIO_TREE_FD_RESERVE : 0;
+        }
+      if (cpioTreeMakeDirs(&tree) < 0)
+        tree.failed++;
+
+      cpioTreeRound(&tree, CPIO_TREE_CREATE, jobs);
+      for (size_t ne = 0; ne < archive->count; ne++)
+        if (cpioTreeIsLink(&archive->entries[ne]) && cpioTreeLink(&tree, ne) < 0)
+          tree.failed++;
+      cpioTreeRound(&tree, CPIO_TREE_ATTRS, jobs);
+
+      BOOTIMG_LOG(BOOTIMG_LOG_RAMDISK, BOOTIMG_LOG_INFO,
+                  "%lu entries & %lu directories created in '%s' with %u threads",
+                  archive->count, tree.ndirs, dir, CPIO_MAX(1, CPIO_MIN(jobs, CPIO_MAX_JOBS)));
+      rc = tree.failed ? -1 : 0;
+    }
+  while (0);
+
+  if (tree.dirs)
+    for (size_t nd = 0; nd < tree.ndirs; nd++)
+      if (tree.dirs[nd].fd >= 0 && tree.dirs[nd].fd != tree.rootfd)
+        close(tree.dirs[nd].fd);
+  if (tree.rootfd >= 0)
+    close(tree.rootfd);
+  free((void *)tree.dirs);
+  free((void *)tree.names);
+  free((void *)tree.lens);
+
+  return rc;
+}
+
+/*
+ * fs_config tables: one "<path> <uid> <gid> <mode> [capabilities=<n>]"
+ * line per rule, '#' starting comments. A path ending with '*' is a
+ * prefix rule. Exact rules come first, then the longest prefix; for a
+ * same path, the first rule of the file wins.
+ */
+
+static int
+cpioCompareRules(const void *a, const void *b)
+{
+  const bootimgFsConfigRule_t *ra = (const bootimgFsConfigRule_t *)a, *rb = (const bootimgFsConfigRule_t *)b;
+  int rc = memcmp((const void *)ra->path, (const void *)rb->path, CPIO_MIN(ra->len, rb->len));
+
+  if (!rc)
+    rc = (ra->len > rb->len) - (ra->len < rb->len);
+  return rc ? rc : (ra->line > rb->line) - (ra->line < rb->line);
+}
+
+/* bsearch key: path & len only */
+static int
+cpioMatchRule(const void *key, const void *elt)
+{
+  const bootimgFsConfigRule_t *rk = (const bootimgFsConfigRule_t *)key, *re = (const bootimgFsConfigRule_t *)elt;
+  int rc = memcmp((const void *)rk->path, (const void *)re->path, CPIO_MIN(rk->len, re->len));
+
+  return rc ? rc : (rk->len > re->len) - (rk->len < re->len);
+}
+
+static int
+cpioCompareLens(const void *a, const void *b)
+{
+  size_t la = *(const size_t *)a, lb = *(const size_t *)b;
+
+  return (la < lb) - (la > lb);
+}
+
+/*
+ * Sort rules, keep the first one of each path
+ */
+static size_t
+cpioSortRules(bootimgFsConfigRule_p rules, size_t count)
+{
+  size_t kept = 0;
+
+  qsort((void *)rules, count, sizeof(bootimgFsConfigRule_t), cpioCompareRules);
+  for (size_t nr = 0; nr < count; nr++)
+    {
+      if (kept && !cpioMatchRule((const void *)&rules[kept -1], (const void *)&rules[nr]))
+        {
+          free((void *)rules[nr].path);
+          continue;
+        }
+      rules[kept++] = rules[nr];
+    }
+
+  return kept;
+}
+
+void
+cpioFsConfigRelease(bootimgFsConfig_p config)
+{
+  for (size_t nr = 0; nr < config->nexact; nr++)
+    free((void *)config->exact[nr].path);
+  for (size_t nr = 0; nr < config->nprefix; nr++)
+    free((void *)config->prefix[nr].path);
+  free((void *)config->exact);
+  free((void *)config->prefix);
+  free((void *)config->lens);
+  bzero((void *)config, sizeof(bootimgFsConfig_t));
+}
+
+/*
+ * Load & compile an fs_config table
+ */
+int
+cpioFsConfigLoad(const char *filename, bootimgFsConfig_p config)
+{
+  FILE *fp;
+  char *line = (char *)NULL;
+  size_t linesz = 0, alloc = 0, count = 0;
+  bootimgFsConfigRule_p rules = (bootimgFsConfigRule_p)NULL;
+  unsigned lineno = 0;
+  int rc = 0;
+
+  bzero((void *)config, sizeof(bootimgFsConfig_t));
+  if (!(fp = fopen(filename, "r")))
+    {
+      fprintf(stderr, "%s: error: cannot open fs_config file '%s'!\n", progname, filename);
+      return -1;
+    }
+
+  while (rc == 0 && getline(&line, &linesz, fp) >= 0)
+    {
+      char path[PATH_MAX], extra[64];
+      unsigned long uid, gid, mode;
+      unsigned long long caps = 0;
+      int fields;
+
+      lineno++;
+      if (line[strspn(line, " \t\r\n")] == '#' || !line[strspn(line, " \t\r\n")])
+        continue;
+
+      fields = sscanf(line, "%4095s %lu %lu %lo %63s", path, &uid, &gid, &mode, extra);
+      if (fields < 4 || uid > UINT32_MAX || gid > UINT32_MAX || mode > 07777 ||
+          (fields == 5 && sscanf(extra, "capabilities=%lli", &caps) != 1))
+        {
+          fprintf(stderr, "%s: error: %s:%u: invalid fs_config rule!\n", progname, filename, lineno);
+          rc = -1;
+          break;
+        }
+
+      if (count == alloc)
+        {
+          bootimgFsConfigRule_p more = (bootimgFsConfigRule_p)realloc((void *)rules,
+                                                                      (alloc = alloc ? 2 * alloc : 256) * sizeof(bootimgFsConfigRule_t));
+
+          if (!more)
+            {
+              rc = -1;
+              break;
+            }
+          rules = more;
+        }
+
+      /* relative to the tree, as the archive names */
+      char *start = path;
+      size_t len;
+
+      while (*start == '/')
+        start++;
+      len = strlen(start);
+      rules[count].prefix = (len && start[len -1] == '*');
+      if (rules[count].prefix)
+        len--;
+      while (!rules[count].prefix && len && start[len -1] == '/')
+        len--;
+      if (!(rules[count].path = strndup(start, len)))
+        {
+          rc = -1;
+          break;
+        }
+      rules[count].len = len;
+      rules[count].uid = (uint32_t)uid;
+      rules[count].gid = (uint32_t)gid;
+      rules[count].mode = (uint32_t)mode;
+      rules[count].capabilities = caps;
+      rules[count].line = lineno;
+      count++;
+    }
+  free((void *)line);
+  fclose(fp);
+
+  /* split exact & prefix rules */
+  if (rc == 0 &&
+      (!(config->exact = (bootimgFsConfigRule_p)calloc(count +1, sizeof(bootimgFsConfigRule_t))) ||
+       !(config->prefix = (bootimgFsConfigRule_p)calloc(count +1, sizeof(bootimgFsConfigRule_t))) ||
+       !(config->lens = (size_t *)calloc(count +1, sizeof(size_t)))))
+    rc = -1;
+  for (size_t nr = 0; nr < count; nr++)
+    {
+      if (rc < 0)
+        free((void *)rules[nr].path);
+      else if (rules[nr].prefix)
+        config->prefix[config->nprefix++] = rules[nr];
+      else
+        config->exact[config->nexact++] = rules[nr];
+    }
+  free((void *)rules);
+  if (rc < 0)
+    {
+      fprintf(stderr, "%s: error: cannot load fs_config file '%s'!\n", progname, filename);
+      cpioFsConfigRelease(config);
+      return -1;
+    }
+
+  config->nexact = cpioSortRules(config->exact, config->nexact);
+  config->nprefix = cpioSortRules(config->prefix, config->nprefix);
+
+  /* prefix lengths to try, longest first */
+  for (size_t nr = 0; nr < config->nprefix; nr++)
+    config->lens[config->nlens++] = config->prefix[nr].len;
+  qsort((void *)config->lens, config->nlens, sizeof(size_t), cpioCompareLens);
+  count = 0;
+  for (size_t nl = 0; nl < config->nlens; nl++)
+    if (!count || config->lens[count -1] != config->lens[nl])
+      config->lens[count++] = config->lens[nl];
+  config->nlens = count;
+
+  BOOTIMG_LOG(BOOTIMG_LOG_RAMDISK, BOOTIMG_LOG_INFO, "%lu exact & %lu prefix fs_config rules loaded from '%s'",
+              config->nexact, config->nprefix, filename);
+  return 0;
+}
+
+/*
+ * Rule for a path of the tree, NULL if none applies
+ */
+bootimgFsConfigRule_p
+cpioFsConfigLookup(bootimgFsConfig_p config, const char *path)
+{
+  bootimgFsConfigRule_t key;
+  bootimgFsConfigRule_p rule;
+  size_t len = strlen(path);
+
+  key.path = (char *)path;
+  key.len = len;
+  if ((rule = (bootimgFsConfigRule_p)bsearch((const void *)&key, (const void *)config->exact, config->nexact,
+                                             sizeof(bootimgFsConfigRule_t), cpioMatchRule)))
+    return rule;
+
+  for (size_t nl = 0; nl < config->nlens; nl++)
+    {
+      if (config->lens[nl] > len)
+        continue;
+      key.len = config->lens[nl];
+      if ((rule = (bootimgFsConfigRule_p)bsearch((const void *)&key, (const void *)config->prefix, config->nprefix,
+                                                 sizeof(bootimgFsConfigRule_t), cpioMatchRule)))
+        return rule;
+    }
+
+  return (bootimgFsConfigRule_p)NULL;
+}
+
+/*
+ * Archive of a directory tree. Directories are listed (getdents64) and
+ * their entries stat'ed back to back relative to the directory fd, and
+ * file contents read, by a pool of threads; subdirectories are queued
+ * first so that the scan follows the archive order. The caller writes
+ * the entries sorted by name, parents first, as soon as the directory
+ * holding them is scanned, while the next ones are still being.
+ *
+ * Entries are owned by root, get inode numbers in archive order and
+ * no device; the data of a file with more links goes with its first
+ * one, the others sharing its inode number with no data. With a given
+ * mtime, the same tree contents always give the same archive. Owners &
+ * modes are then the ones of the fs_config rule of each entry, if any.
+ */
+
+#define CPIO_WALK_FIRST_INO     300000
+#define CPIO_WALK_DIRENTS       (32*1024)
+
+typedef struct _cpioWalkStat_st
+{
+  uint32_t mode;
+  uint32_t nlink;
+  uint64_t ino;
+  uint64_t dev;
+  uint64_t size;
+  uint32_t mtime;
+  uint32_t rdevmajor;
+  uint32_t rdevminor;
+} cpioWalkStat_t, *cpioWalkStat_p;
+
+typedef struct _cpioWalkDir_st cpioWalkDir_t, *cpioWalkDir_p;
+
+typedef struct _cpioWalkFile_st
+{
+  char *name;                           /* in its directory */
+  cpioWalkStat_t st;
+  uint8_t *data;                        /* file content or link target */
+  cpioWalkDir_p dir;                    /* if a directory */
+  int failed;
+} cpioWalkFile_t, *cpioWalkFile_p;
+
+struct _cpioWalkDir_st
+{
+  char *path;                           /* from the root, "" for it */
+  cpioWalkFile_p files;                 /* sorted by name */
+  size_t count;
+  int scanned;
+  cpioWalkDir_p next;                   /* in the scan queue */
+};
+
+typedef struct _cpioWalkLink_st
+{
+  uint64_t dev;
+  uint64_t ino;
+  uint32_t cpioIno;
+} cpioWalkLink_t, *cpioWalkLink_p;
+
+typedef struct _cpioWalk_st
+{
+  int rootfd;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  cpioWalkDir_p queue;
+  int done;
+  size_t failed;
+  /* writer side */
+  uint8_t *buf;
+  size_t len;
+  size_t alloc;
+  uint32_t ino;
+  int64_t mtime;                        /* of all entries if >= 0 */
+  bootimgFsConfig_p config;
+  void *links;                          /* tsearch tree of cpioWalkLink_t */
+} cpioWalk_t, *cpioWalk_p;
+
+static int
+cpioWalkStat(int dirfd, const char *name, cpioWalkStat_p st)
+{
+#ifdef STATX_BASIC_STATS
+  struct statx stx;
+
+  if (statx(dirfd, name, AT_SYMLINK_NOFOLLOW | AT_NO_AUTOMOUNT,
+            STATX_TYPE | STATX_MODE | STATX_NLINK | STATX_INO | STATX_SIZE | STATX_MTIME, &stx) < 0)
+    return -1;
+  st->mode = stx.stx_mode;
+  st->nlink = stx.stx_nlink;
+  st->ino = stx.stx_ino;
+  st->dev = makedev(stx.stx_dev_major, stx.stx_dev_minor);
+  st->size = stx.stx_size;
+  st->mtime = (uint32_t)stx.stx_mtime.tv_sec;
+  st->rdevmajor = stx.stx_rdev_major;
+  st->rdevminor = stx.stx_rdev_minor;
+#else
+  struct stat statbuf;
+
+  if (fstatat(dirfd, name, &statbuf, AT_SYMLINK_NOFOLLOW) < 0)
+    return -1;
+  st->mode = statbuf.st_mode;
+  st->nlink = statbuf.st_nlink;
+  st->ino = statbuf.st_ino;
+  st->dev = statbuf.st_dev;
+  st->size = statbuf.st_size;
+  st->mtime = (uint32_t)statbuf.st_mtime;
+  st->rdevmajor = major(statbuf.st_rdev);
+  st->rdevminor = minor(statbuf.st_rdev);
+#endif
+
+  return 0;
+}
+
+static int
+cpioCompareFiles(const void *a, const void *b)
+{
+  return strcmp(((const cpioWalkFile_t *)a)->name, ((const cpioWalkFile_t *)b)->name);
+}
+
+/*
+ * Content of a regular file or target of a symlink
+ */
+static int
+cpioWalkRead(int dirfd, cpioWalkFile_p file)
+{
+  size_t done = 0;
+  int fd;
+
+  if (file->st.size >= UINT32_MAX ||
+      !(file->data = (uint8_t *)malloc(file->st.size ? file->st.size : 1)))
+    return -1;
+  statsCount(BOOTIMG_STATS_CURRENT, BOOTIMG_STATS_ALLOCS, 1);
+
+  statsCount(BOOTIMG_STATS_CURRENT, BOOTIMG_STATS_SYSCALLS, 1);
+  if (S_ISLNK(file->st.mode))
+    return readlinkat(dirfd, file->name, (char *)file->data, file->st.size) == (ssize_t)file->st.size ? 0 : -1;
+
+  if ((fd = openat(dirfd, file->name, O_RDONLY | O_NOFOLLOW | O_CLOEXEC)) < 0)
+    return -1;
+  while (done < file->st.size)
+    {
+      ssize_t rd = read(fd, (void *)(file->data + done), file->st.size - done);
+
+      if (rd < 0 && errno == EINTR)
+        continue;
+      if (rd <= 0)
+        break;
+      statsCount(BOOTIMG_STATS_CURRENT, BOOTIMG_STATS_SYSCALLS, 1);
+      statsCount(BOOTIMG_STATS_CURRENT, BOOTIMG_STATS_READ, rd);
+      done += rd;
+    }
+  close(fd);
+
+  return done == file->st.size ? 0 : -1;
+}
+
+/*
+ * List, stat & read the entries of a directory; subdirectories get a
+ * node to be scanned
+ */
+static void
+cpioWalkScan(cpioWalk_p walk, cpioWalkDir_p dir)
+{
+  char dirents[CPIO_WALK_DIRENTS];
+  size_t alloc = 0;
+  long nread;
+  int fd;
+
+  statsCount(BOOTIMG_STATS_CURRENT, BOOTIMG_STATS_SYSCALLS, 1);
+  if ((fd = openat(walk->rootfd, dir->path[0] ? dir->path : ".", O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC)) < 0)
+    {
+      fprintf(stderr, "%s: error: cannot open directory '%s': %s!\n", progname, dir->path, strerror(errno));
+      __atomic_fetch_add(&walk->failed, 1, __ATOMIC_RELAXED);
+      return;
+    }
+
+  while ((nread = syscall(SYS_getdents64, fd, dirents, sizeof(dirents))) > 0)
+    {
+      statsCount(BOOTIMG_STATS_CURRENT, BOOTIMG_STATS_SYSCALLS, 1);
+      for (long pos = 0; pos < nread; )
+        {
+          struct cpioDirent64 {
+            uint64_t d_ino;
+            int64_t d_off;
+            unsigned short d_reclen;
+            unsigned char d_type;
+            char d_name[];
+          } *dent = (struct cpioDirent64 *)(dirents + pos);
+
+          pos += dent->d_reclen;
+          if (!strcmp(dent->d_name, ".") || !strcmp(dent->d_name, ".."))
+            continue;
+          if (dir->count == alloc)
+            {
+              cpioWalkFile_p files = (cpioWalkFile_p)realloc((void *)dir->files,
+                                                             (alloc = alloc ? 2 * alloc : 64) * sizeof(cpioWalkFile_t));
+
+              if (!files)
+                {
+                  nread = -1;
+                  break;
+                }
+              dir->files = files;
+            }
+          bzero((void *)&dir->files[dir->count], sizeof(cpioWalkFile_t));
+          if (!(dir->files[dir->count].name = strdup(dent->d_name)))
+            {
+              nread = -1;
+              break;
+            }
+          dir->count++;
+        }
+      if (nread < 0)
+        break;
+    }
+  if (nread < 0)
+    {
+      fprintf(stderr, "%s: error: cannot list directory '%s'!\n", progname, dir->path);
+      __atomic_fetch_add(&walk->failed, 1, __ATOMIC_RELAXED);
+    }
+
+  qsort((void *)dir->files, dir->count, sizeof(cpioWalkFile_t), cpioCompareFiles);
+
+  for (size_t nf = 0; nf < dir->count; nf++)
+    {
+      cpioWalkFile_p file = &dir->files[nf];
+
+      statsCount(BOOTIMG_STATS_CURRENT, BOOTIMG_STATS_SYSCALLS, 1);
+      if (cpioWalkStat(fd, file->name, &file->st) < 0 ||
+          ((S_ISREG(file->st.mode) || S_ISLNK(file->st.mode)) && cpioWalkRead(fd, file) < 0))
+        file->failed = 1;
+      else if (S_ISDIR(file->st.mode))
+        {
+          size_t len = strlen(dir->path) + strlen(file->name) + 2;
+
+          if ((file->dir = (cpioWalkDir_p)calloc(1, sizeof(cpioWalkDir_t))) &&
+              (file->dir->path = (char *)malloc(len)))
+            snprintf(file->dir->path, len, "%s%s%s", dir->path, dir->path[0] ? "/" : "", file->name);
+          else
+            {
+              free((void *)file->dir);
+              file->dir = (cpioWalkDir_p)NULL;
+              file->failed = 1;
+            }
+        }
+
+      if (file->failed)
+        {
+          fprintf(stderr, "%s: error: cannot read '%s%s%s': %s!\n",
+                  progname, dir->path, dir->path[0] ? "/" : "", file->name, strerror(errno));
+          __atomic_fetch_add(&walk->failed, 1, __ATOMIC_RELAXED);
+        }
+    }
+
+  close(fd);
+}
+
+static void *
+cpioWalkThread(void *arg)
+{
+  cpioWalk_p walk = (cpioWalk_p)arg;
+  uint64_t start = statsBegin(BOOTIMG_STATS_RAMDISK_PACK);
+
+  pthread_mutex_lock(&walk->lock);
+  while (1)
+    {
+      cpioWalkDir_p dir;
+
+      while (!walk->queue && !walk->done)
+        pthread_cond_wait(&walk->cond, &walk->lock);
+      if (!(dir = walk->queue))
+        break;
+      walk->queue = dir->next;
+      pthread_mutex_unlock(&walk->lock);
+
+      cpioWalkScan(walk, dir);
+
+      /* in reverse order: the first subdirectory is scanned next */
+      pthread_mutex_lock(&walk->lock);
+      for (size_t nf = dir->count; nf > 0; nf--)
+        if (dir->files[nf -1].dir)
+          {
+            dir->files[nf -1].dir->next = walk->queue;
+            walk->queue = dir->files[nf -1].dir;
+          }
+      dir->scanned = 1;
+      pthread_cond_broadcast(&walk->cond);
+    }
+  pthread_mutex_unlock(&walk->lock);
+  statsEnd(BOOTIMG_STATS_RAMDISK_PACK, start);
+
+  return NULL;
+}
+
+static int
+cpioCompareLinks(const void *a, const void *b)
+{
+  const cpioWalkLink_t *la = (const cpioWalkLink_t *)a, *lb = (const cpioWalkLink_t *)b;
+
+  if (la->dev != lb->dev)
+    return la->dev < lb->dev ? -1 : 1;
+  return (la->ino > lb->ino) - (la->ino < lb->ino);
+}
+
+/*
+ * Append an entry to the archive buffer
+ */
+static int
+cpioWalkAppend(cpioWalk_p walk, const bootimgCpioEntry_t *entry, const char *name)
+{
+  size_t len = CPIO_ALIGN4(CPIO_NEWC_HEADER_SIZE + strlen(name) +1) + CPIO_ALIGN4(entry->filesize);
+
+  if (walk->len + len > walk->alloc)
+    {
+      size_t alloc = CPIO_MAX(2 * walk->alloc, walk->len + len + CPIO_INFLATE_CHUNK);
+      uint8_t *buf = (uint8_t *)realloc((void *)walk->buf, alloc);
+
+      if (!buf)
+        return -1;
+      statsCount(BOOTIMG_STATS_CURRENT, BOOTIMG_STATS_ALLOCS, 1);
+      bzero((void *)(buf + walk->alloc), alloc - walk->alloc);
+      walk->buf = buf;
+      walk->alloc = alloc;
+    }
+
+  walk->len += cpioWriteHeader(walk->buf + walk->len, entry, name, entry->filesize);
+  if (entry->filesize)
+    memcpy((void *)(walk->buf + walk->len), (const void *)entry->data, entry->filesize);
+  walk->len += CPIO_ALIGN4(entry->filesize);
+
+  return 0;
+}
+
+/*
+ * Write the entries of a directory once scanned, then the ones of its
+ * subdirectories. File data are freed once written.
+ */
+static int
+cpioWalkWrite(cpioWalk_p walk, cpioWalkDir_p dir)
+{
+  pthread_mutex_lock(&walk->lock);
+  while (!dir->scanned)
+    pthread_cond_wait(&walk->cond, &walk->lock);
+  pthread_mutex_unlock(&walk->lock);
+
+  for (size_t nf = 0; nf < dir->count; nf++)
+    {
+      cpioWalkFile_p file = &dir->files[nf];
+      char name[PATH_MAX];
+      bootimgCpioEntry_t entry;
+      bootimgFsConfigRule_p rule;
+
+      if (file->failed)
+        continue;
+      if ((size_t)snprintf(name, sizeof(name), "%s%s%s", dir->path, dir->path[0] ? "/" : "", file->name) >= sizeof(name))
+        {
+          fprintf(stderr, "%s: error: name too long for '%s/%s'!\n", progname, dir->path, file->name);
+          __atomic_fetch_add(&walk->failed, 1, __ATOMIC_RELAXED);
+          continue;
+        }
+
+      bzero((void *)&entry, sizeof(bootimgCpioEntry_t));
+      entry.ino = walk->ino++;
+      entry.mode = file->st.mode;
+      entry.nlink = S_ISDIR(file->st.mode) ? 2 : 1;
+      entry.mtime = walk->mtime < 0 ? file->st.mtime : (uint32_t)walk->mtime;
+      entry.rdevmajor = file->st.rdevmajor;
+      entry.rdevminor = file->st.rdevminor;
+      if (walk->config && (rule = cpioFsConfigLookup(walk->config, name)))
+        {
+          entry.uid = rule->uid;
+          entry.gid = rule->gid;
+          entry.mode = (entry.mode & S_IFMT) | rule->mode;
+          if (rule->capabilities)
+            fprintf(stderr, "%s: warning: capabilities of '%s' cannot be stored in the ramdisk!\n", progname, name);
+        }
+      if (S_ISREG(file->st.mode) || S_ISLNK(file->st.mode))
+        {
+          entry.filesize = (uint32_t)file->st.size;
+          entry.data = file->data;
+        }
+
+      /* a file with more links: the first one found holds the data */
+      if (S_ISREG(file->st.mode) && file->st.nlink > 1)
+        {
+          cpioWalkLink_p link = (cpioWalkLink_p)malloc(sizeof(cpioWalkLink_t));
+          cpioWalkLink_p *found;
+
+          if (!link)
+            return -1;
+          link->dev = file->st.dev;
+          link->ino = file->st.ino;
+          link->cpioIno = entry.ino;
+          if (!(found = (cpioWalkLink_p *)tsearch((void *)link, &walk->links, cpioCompareLinks)))
+            {
+              free((void *)link);
+              return -1;
+            }
+          if (*found != link)
+            {
+              free((void *)link);
+              entry.ino = (*found)->cpioIno;
+              entry.filesize = 0;
+              walk->ino--;
+            }
+          entry.nlink = file->st.nlink;
+        }
+
+      if (cpioWalkAppend(walk, &entry, name) < 0)
+        return -1;
+      free((void *)file->data);
+      file->data = (uint8_t *)NULL;
+
+      if (file->dir && cpioWalkWrite(walk, file->dir) < 0)
+        return -1;
+    }
+
+  return 0;
+}
+
+static void
+cpioWalkFree(cpioWalkDir_p dir)
+{
+  for (size_t nf = 0; nf < dir->count; nf++)
+    {
+      if (dir->files[nf].dir)
+        cpioWalkFree(dir->files[nf].dir);
+      free((void *)dir->files[nf].data);
+      free((void *)dir->files[nf].name);
+    }
+  free((void *)dir->files);
+  free((void *)dir->path);
+  free((void *)dir);
+}
+
+/*
+ * Load an archive of the tree below dir, scanned with jobs threads.
+ * Entries get the mtime given, or the one of their file if < 0, and
+ * owner & mode from config if not NULL. Returns -1 if an entry could
+ * not be read.
+ */
+int
+cpioLoadTree(const char *dir, bootimgCpioArchive_p archive, unsigned jobs, int64_t mtime,
+             bootimgFsConfig_p config)
+{
+  pthread_t threads[CPIO_MAX_JOBS];
+  unsigned nthreads = 0;
+  cpioWalk_t walk;
+  cpioWalkDir_p root;
+  bootimgCpioEntry_t trailer;
+  int rc = -1;
+
+  bzero((void *)archive, sizeof(bootimgCpioArchive_t));
+  bzero((void *)&walk, sizeof(cpioWalk_t));
+  pthread_mutex_init(&walk.lock, NULL);
+  pthread_cond_init(&walk.cond, NULL);
+  walk.ino = CPIO_WALK_FIRST_INO;
+  walk.mtime = mtime;
+  walk.config = config;
+
+  if (!(root = (cpioWalkDir_p)calloc(1, sizeof(cpioWalkDir_t))) || !(root->path = strdup("")))
+    {
+      free((void *)root);
+      return -1;
+    }
+
+  do
+    {
+      if ((walk.rootfd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) < 0)
+        {
+          fprintf(stderr, "%s: error: cannot open directory '%s': %s!\n", progname, dir, strerror(errno));
+          break;
+        }
+
+      walk.queue = root;
+      for (; nthreads < CPIO_MAX(1, CPIO_MIN(jobs, CPIO_MAX_JOBS)); nthreads++)
+        if (pthread_create(&threads[nthreads], NULL, cpioWalkThread, (void *)&walk))
+          break;
+      if (!nthreads)
+        {
+          /* scan it all first */
+          walk.done = 1;
+          cpioWalkThread((void *)&walk);
+        }
+
+      if (cpioWalkWrite(&walk, root) < 0)
+        fprintf(stderr, "%s: error: cannot allocate memory for the ramdisk archive!\n", progname);
+      else
+        {
+          /* trailer, then zeros up to a 512 bytes block as cpio does */
+          bzero((void *)&trailer, sizeof(bootimgCpioEntry_t));
+          trailer.nlink = 1;
+          if (cpioWalkAppend(&walk, &trailer, CPIO_TRAILER_NAME) == 0 &&
+              (walk.len = (walk.len + 511) & ~(size_t)511) <= walk.alloc)
+            rc = 0;
+        }
+
+      pthread_mutex_lock(&walk.lock);
+      walk.done = 1;
+      pthread_cond_broadcast(&walk.cond);
+      pthread_mutex_unlock(&walk.lock);
+      for (unsigned nt = 0; nt < nthreads; nt++)
+        pthread_join(threads[nt], NULL);
+
+      if (rc == 0)
+        {
+          archive->buf = walk.buf;
+          archive->len = walk.len;
+          walk.buf = (uint8_t *)NULL;
+          if ((rc = cpioParse(archive)) < 0)
+            cpioRelease(archive);
+          else
+            BOOTIMG_LOG(BOOTIMG_LOG_RAMDISK, BOOTIMG_LOG_INFO,
+                        "%lu entries of '%s' archived with %u threads", archive->count, dir, nthreads);
+        }
+      if (walk.failed)
+        rc = -1;
+    }
+  while (0);
+
+  if (walk.rootfd >= 0)
+    close(walk.rootfd);
+  cpioWalkFree(root);
+  tdestroy(walk.links, free);
+  free((void *)walk.buf);
+  pthread_mutex_destroy(&walk.lock);
+  pthread_cond_destroy(&walk.cond);
+
+  return rc;
+}
+
+/* Local Variables:                                                */
+/* mode: C                                                         */
+/* comment-column: 0                                               */
+/* End:                                                            */
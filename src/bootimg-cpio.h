@@ -0,0 +1,143 @@
+/* bootimg-tools/bootimg-cpio.h
+ *
+ * Copyright 2007, The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef __BOOTIMG_CPIO_H__
+#define __BOOTIMG_CPIO_H__
+
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+/*
+ * In memory access to ramdisk archives: gzip'ed (or raw) cpio in the
+ * "newc" format, the one used by the Android build for ramdisks.
+ * Loaded entries point into the archive buffer: nothing is copied.
+ * Streams decode entries from a reader instead, a chunk at a time.
+ */
+
+#define CPIO_NEWC_MAGIC                 "070701"
+#define CPIO_NEWC_MAGIC_SIZE            6
+#define CPIO_NEWC_HEADER_SIZE           110
+#define CPIO_TRAILER_NAME               "TRAILER!!!"
+#define CPIO_NAME_MAX                   4096
+
+/* Most threads creating or scanning a tree */
+#define CPIO_MAX_JOBS                   16
+
+#define GZIP_MAGIC_0                    0x1f
+#define GZIP_MAGIC_1                    0x8b
+
+typedef struct _bootimgCpioEntry_st
+{
+  const char *name;                     /* NUL terminated, in archive */
+  uint32_t ino;
+  uint32_t mode;
+  uint32_t uid;
+  uint32_t gid;
+  uint32_t nlink;
+  uint32_t mtime;
+  uint32_t filesize;
+  uint32_t devmajor;
+  uint32_t devminor;
+  uint32_t rdevmajor;
+  uint32_t rdevminor;
+  const uint8_t *data;                  /* filesize bytes, in archive */
+} bootimgCpioEntry_t, *bootimgCpioEntry_p;
+
+typedef struct _bootimgCpioArchive_st
+{
+  uint8_t *buf;                         /* uncompressed archive (owned) */
+  size_t len;
+  int compressed;                       /* source was gzip'ed */
+  bootimgCpioEntry_p entries;           /* without trailer */
+  size_t count;
+  size_t alloc;
+  bootimgCpioEntry_t trailer;           /* as found, written back as is */
+  size_t padding;                       /* zeros after the trailer */
+} bootimgCpioArchive_t, *bootimgCpioArchive_p;
+
+/*
+ * Source of a stream: reads up to len bytes, returns 0 at its end
+ */
+typedef ssize_t (*bootimgCpioRead_t)(void *, void *, size_t);
+
+typedef struct _bootimgCpioStream_st
+{
+  bootimgCpioRead_t read;
+  void *arg;
+  void *zs;                             /* inflate state if gzip'ed */
+  uint8_t *in;                          /* source chunk */
+  uint8_t *out;                         /* archive chunk */
+  size_t pos;
+  size_t len;
+  int eof;
+  uint64_t offset;                      /* in the archive */
+  uint64_t left;                        /* data of the entry not read yet */
+  char name[CPIO_NAME_MAX];             /* of the current entry */
+} bootimgCpioStream_t, *bootimgCpioStream_p;
+
+/*
+ * fs_config rules: owner & mode of the paths of a ramdisk tree
+ */
+typedef struct _bootimgFsConfigRule_st
+{
+  char *path;                           /* relative, without the '*' of a prefix */
+  size_t len;
+  int prefix;
+  uint32_t uid;
+  uint32_t gid;
+  uint32_t mode;                        /* permissions only */
+  uint64_t capabilities;
+  unsigned line;
+} bootimgFsConfigRule_t, *bootimgFsConfigRule_p;
+
+typedef struct _bootimgFsConfig_st
+{
+  bootimgFsConfigRule_p exact;          /* sorted */
+  size_t nexact;
+  bootimgFsConfigRule_p prefix;         /* sorted */
+  size_t nprefix;
+  size_t *lens;                         /* of the prefixes, longest first */
+  size_t nlens;
+} bootimgFsConfig_t, *bootimgFsConfig_p;
+
+int                 cpioInflate      (const void *, size_t, uint8_t **, size_t *);
+int                 cpioLoad         (const void *, size_t, bootimgCpioArchive_p);
+void                cpioRelease      (bootimgCpioArchive_p);
+bootimgCpioEntry_p  cpioFindEntry    (bootimgCpioArchive_p, const char *);
+int                 cpioSameEntries  (bootimgCpioArchive_p, bootimgCpioArchive_p);
+void                cpioSortEntries  (bootimgCpioArchive_p);
+int                 cpioAppendEntry  (bootimgCpioArchive_p, const bootimgCpioEntry_t *);
+void                cpioRemoveEntry  (bootimgCpioArchive_p, size_t);
+int                 cpioWrite        (bootimgCpioArchive_p, uint8_t **, size_t *);
+int                 cpioStreamOpen   (bootimgCpioStream_p, bootimgCpioRead_t, void *);
+int                 cpioStreamNext   (bootimgCpioStream_p, bootimgCpioEntry_p);
+ssize_t             cpioStreamRead   (bootimgCpioStream_p, void *, size_t);
+void                cpioStreamClose  (bootimgCpioStream_p);
+int                 cpioExtractTree  (bootimgCpioArchive_p, const char *, unsigned);
+int                 cpioLoadTree     (const char *, bootimgCpioArchive_p, unsigned, int64_t,
+                                      bootimgFsConfig_p);
+int                 cpioFsConfigLoad (const char *, bootimgFsConfig_p);
+void                cpioFsConfigRelease(bootimgFsConfig_p);
+bootimgFsConfigRule_p cpioFsConfigLookup(bootimgFsConfig_p, const char *);
+
+#endif /* __BOOTIMG_CPIO_H__ */
+
+/* Local Variables:                                                */
+/* mode: C                                                         */
+/* comment-column: 0                                               */
+/* End:                                                            */
@@ -40,6 +40,9 @@
 #ifdef HAVE_FCNTL_H
 # include <fcntl.h>
 #endif
+#ifdef HAVE_SYS_STAT_H
+# include <sys/stat.h>
+#endif
 #ifdef HAVE_ALLOCA_H
 # include <alloca.h>
 #endif
@@ -63,11 +66,14 @@
 #include "bootimg.h"
 #include "bootimg-priv.h"
 #include "bootimg-utils.h"
+#include "bootimg-meta.h"
+#include "bootimg-tar.h"
+#include "bootimg-cpio.h"
+#include "bootimg-gzip.h"
+#include "bootimg-io.h"
+#include "bootimg-stats.h"
+#include "bootimg-log.h"
 
-#define BOOTIMG_SHA_CTX	SHA_CTX
-#define BOOTIMG_SHA_Init SHA1_Init
-#define BOOTIMG_SHA_Update SHA1_Update
-#define BOOTIMG_SHA_Final SHA1_Final
 
 /*
  * Options flags & values
@@ -76,6 +82,13 @@
  * - i: display image id. iflag € [0, 1]
  * - p: page size. pflag € [0, 1]
  * - f: force overwrite. fflag € [0, 1]
+ * - t: tar stream in & image out. tflag € [0, 1]
+ * - D: keep image data out of the page cache. Dflag € [0, 1]
+ * - R: reproducible ramdisk. Rflag € [0, 1]
+ * - c: fs_config table of the ramdisk. cflag € [0, 1]
+ * - S: per phase timings & counters on stderr. Sflag € [0, 1]
+ * - z: pick the ramdisk compression for a goal. zflag € [0, 1]
+ * - m: boot image size ceiling for -z. mflag € [0, 1]
  */
 int vflag = 0;
 int oflag = 0;
@@ -83,6 +96,14 @@ int pflag = 0;
 int fflag = 0;
 int iflag = 0;
 int Fflag = 0;
+int Cflag = 0;
+int tflag = 0;
+int Dflag = 0;
+int Rflag = 0;
+int cflag = 0;
+int Sflag = 0;
+int zflag = 0;
+int mflag = 0;
 
 /* nval: basename */
 char *nval = (char *)NULL;
@@ -92,6 +113,40 @@ char *oval = (char *)NULL;
 size_t pval = 0L;
 /* Fval: ramdisk files directory */
 char *Fval = (char *)NULL;
+/* Cval: metadata conversion target format */
+int Cval = BOOTIMG_META_FORMAT_XML;
+/* Sval: stats report format */
+int Sval = BOOTIMG_STATS_FORMAT_TEXT;
+/* Rval: mtime of the ramdisk entries (SOURCE_DATE_EPOCH or 0) */
+time_t Rval = 0;
+/* cval: fs_config table of the ramdisk, loaded from the file given */
+bootimgFsConfig_t cval;
+/* zval: --optimize goal */
+int zval = GZIP_TUNE_BALANCED;
+/* mval: image size ceiling */
+uint64_t mval = 0;
+
+/*
+ * Tar mode: files read from the stream, looked up by their name without
+ * directory, and descriptor the image is written to
+ */
+typedef struct _tarMember_st
+{
+  char *name;
+  void *data;
+  size_t size;
+} tarMember_t, *tarMember_p;
+
+static tarMember_p tarMembers = (tarMember_p)NULL;
+static size_t tarMemberCount = 0;
+static int imgoutfd = -1;
+
+/*
+ * --stats: the metadata phase lasts from the start of reading a
+ * metadata file to the image creation
+ */
+static uint64_t metadataStart = 0;
+static int metadataOpened = 0;
 
 /*
  * progname & blankname are program name and space string with progname size
@@ -105,7 +160,7 @@ char *blankname = (char *)NULL;
  */
 static const char *progusage =
   "usage: %s [options] metadatafile1 [metadatafile2 ...]\n"
-  "       %s --help\n";
+  "       %s [options] --tar < archive.tar > boot.img\n";
 static const char *proghelp =
   "\n"
   "       basic user options:\n"
@@ -125,12 +180,47 @@ static const char *proghelp =
   "       %s                               the one specified in the file.\n"
   "       %s --fs/-F [=<fsdir>]             Create the cpio archive from the files\n"
   "       %s                               in <fsdir>.\n"
+  "       %s --tar -t                      Read the metadata & component files\n"
+  "       %s                               from a tar stream on stdin (as written\n"
+  "       %s                               by bootimg-extract --tar) and write\n"
+  "       %s                               the image on stdout.\n"
+  "       %s --no-cache -D                 Keep component & image data out of\n"
+  "       %s                               the page cache: their pages are\n"
+  "       %s                               dropped once read or written.\n"
+  "       %s --reproducible -R             Make the same image from the same\n"
+  "       %s                               --fs tree contents: its entries get\n"
+  "       %s                               SOURCE_DATE_EPOCH (or 0) as mtime.\n"
+  "       %s                               Implied when SOURCE_DATE_EPOCH is set.\n"
+  "       %s --fs-config=/-c <file>         Set owner & mode of the --fs tree\n"
+  "       %s                               entries from the fs_config rules in\n"
+  "       %s                               <file> (<path> <uid> <gid> <mode>,\n"
+  "       %s                               a path ending with * for a prefix).\n"
+  "       %s --optimize=/-z <goal>          Pick how the --fs ramdisk is stored\n"
+  "       %s                               (raw or gzip level) by trials for a\n"
+  "       %s                               <goal>: size, boot-speed (fastest to\n"
+  "       %s                               inflate) or balanced (fastest of the\n"
+  "       %s                               ones near the smallest). The choice\n"
+  "       %s                               is recorded in the xml or json\n"
+  "       %s                               metadata file.\n"
+  "       %s --max-size=/-m <size>          With --optimize, largest boot image\n"
+  "       %s                               allowed (K, M or G suffix).\n"
+  "       %s --stats -S [=text|json]       Report time, bytes read & written,\n"
+  "       %s                               syscalls and allocations of each\n"
+  "       %s                               phase on stderr, for each image and\n"
+  "       %s                               for the whole batch.\n"
   "\n"
   "       options for getting extra infos:\n"
   "       %s --identify -i                 display the ID field for this boot image.\n"
   "\n"
-  "       %s The metadata files are either xml or json files as created by\n"
-  "       %s bootimg-extract command.\n";
+  "       options for converting metadata:\n"
+  "       %s --convert=/-C <fmt>            Do not create image but convert the\n"
+  "       %s                               metadata files to <fmt> (one of xml,\n"
+  "       %s                               json or binary). Output is written\n"
+  "       %s                               beside the input with the <fmt>\n"
+  "       %s                               extension.\n"
+  "\n"
+  "       %s The metadata files are either xml, json or binary (.bmeta) files\n"
+  "       %s as created by bootimg-extract command.\n";
 
 /*
  * Long options struct
@@ -143,9 +233,17 @@ struct option long_options[] = {
   {"pagesize", required_argument, 0,  'p' },
   {"help",     no_argument,       0,  'h' },
   {"fs",       optional_argument, 0,  'F' },
+  {"convert",  required_argument, 0,  'C' },
+  {"tar",      no_argument,       0,  't' },
+  {"no-cache", no_argument,       0,  'D' },
+  {"reproducible", no_argument,   0,  'R' },
+  {"fs-config", required_argument, 0, 'c' },
+  {"stats",    optional_argument, 0,  'S' },
+  {"optimize", required_argument, 0,  'z' },
+  {"max-size", required_argument, 0,  'm' },
   {0,          0,                 0,   0  }
 };
-#define BOOTIMG_OPTSTRING "v::fF::io:h:"
+#define BOOTIMG_OPTSTRING "v::fF::io:p:hC:tDRc:S::z:m:"
 const char *unknown_option = "????";
 
 /* padding buffer */
@@ -160,18 +258,25 @@ extern int optind;
 /*
  * Forward decl
  */
-static void *loadImage                       (const char *, size_t *);
        void *my_malloc_fn                    (size_t);
        void  my_free_fn                      (void *);
        int   writeImage                      (bootimgParsingContext_p);
        void  printusage                      (int);
        void  createBootImageFromXmlMetadata  (const char *, const char *);
        void  createBootImageFromJsonMetadata (const char *, const char *);
-       int   writePaddingToFd                (int, size_t, size_t);
+       void  createBootImageFromBinaryMetadata (const char *, const char *);
+       int   createBootImageFromBinaryData   (const void *, size_t, const char *);
+       int   createBootImageFromJsonData     (const char *, const char *);
+       int   createBootImageFromTarStream    (int);
+       void *loadComponent                   (const char *, size_t *);
+       int   processParsingContext           (bootimgParsingContext_p, const char *);
+       void  metadataPhaseBegin              (void);
+       void  metadataPhaseEnd                (void);
        void  writeStringToFile               (char *, char *);
        void  readerErrorFunc                 (void *, const char *, xmlParserSeverities, xmlTextReaderLocatorPtr);
        int   createBootImageProcessXmlNode   (bootimgParsingContext_t *, xmlTextReaderPtr);
        void  createBootImageFromXmlMetadata  (const char *, const char *);
+       int   createBootImageFromXmlReader    (xmlTextReaderPtr, const char *);
        void  createBootImageFromJsonMetadata (const char *, const char *);
 
 /*
@@ -192,57 +297,6 @@ my_free_fn(void *ptr)
   free(ptr);
 }
 
-static void *
-loadImage(const char *filename, size_t *sz_p)
-{
-  void *data = (void *)NULL;
-  size_t sz = 0;
-  int fd = -1;
-
-  do
-    {
-      fd = open(filename, O_RDONLY);
-      if (fd < 0)
-        break;
-
-      sz = lseek(fd, 0, SEEK_END);
-      if (sz < 0)
-        break;
-
-      do
-        {
-          if (lseek(fd, 0, SEEK_SET) != 0)
-            break;
-
-          data = (void *)malloc(sz);
-          if (data == (void *)NULL)
-            break;
-
-          if (read(fd, data, sz) != sz)
-            break;
-
-          close(fd);
-          fd = -1;
-
-          if (sz)
-            *sz_p = sz;
-          return data;
-        }
-      while (0);
-
-      if (fd != -1)
-        close(fd);
-
-      if (data != (void *)NULL)
-        free(data);
-
-      data = (void *)NULL;
-    }
-  while (0);
-
-  return data;
-}
-
 /*
  * compute a digest from images and images' sizes
  * then store it in id header field
@@ -250,46 +304,12 @@ loadImage(const char *filename, size_t *sz_p)
 void
 updateIdHeaderField(bootimgParsingContext_t *ctxt, data_context_t *dctxt)
 {
-  /* init sha512 context */
-  BOOTIMG_SHA_CTX sha;
-  (void)BOOTIMG_SHA_Init(&sha);
-
-  /* start computation with kernel image */
-  (void)BOOTIMG_SHA_Update(&sha,
-                      dctxt->kernel_data,
-                      ctxt->hdr.kernel_size);
-  /* update with the kernel_size field */
-  (void)BOOTIMG_SHA_Update(&sha,
-                      (const void *)&ctxt->hdr.kernel_size,
-                      sizeof(ctxt->hdr.kernel_size));
-  /* add the ramdisk image */
-  (void)BOOTIMG_SHA_Update(&sha,
-                      dctxt->ramdisk_data,
-                      ctxt->hdr.ramdisk_size);
-  /* and its size field */
-  (void)BOOTIMG_SHA_Update(&sha,
-                      (const void *)&ctxt->hdr.ramdisk_size,
-                      sizeof(ctxt->hdr.ramdisk_size));
-  /* second loader image is available */
-  if (dctxt->second_data)
-    (void)BOOTIMG_SHA_Update(&sha,
-                        dctxt->second_data,
-                        ctxt->hdr.second_size);
-  /* and its size field */
-  (void)BOOTIMG_SHA_Update(&sha,
-                      (const void *)&ctxt->hdr.second_size,
-                      sizeof(ctxt->hdr.second_size));
-  /* then the device tree blob image */
-  if (dctxt->dtb_data)
-    (void)BOOTIMG_SHA_Update(&sha,
-                        dctxt->dtb_data,
-                        ctxt->hdr.dt_size);
-  /* and its size field */
-  (void)BOOTIMG_SHA_Update(&sha,
-                      (const void *)&ctxt->hdr.dt_size,
-                      sizeof(ctxt->hdr.dt_size));
-  /* get the digest in the id field of the header */
-  (void)BOOTIMG_SHA_Final((unsigned char *)&ctxt->hdr.id, &sha);
+  computeImageId(&ctxt->hdr,
+                 dctxt->kernel_data,
+                 dctxt->ramdisk_data,
+                 dctxt->second_data,
+                 dctxt->dtb_data,
+                 (unsigned char *)&ctxt->hdr.id);
 }
 
 /*
@@ -299,56 +319,47 @@ void
 setHeaderValuesFromParsingContext(bootimgParsingContext_p ctxt)
 {
   ctxt->hdr.page_size = ctxt->pageSize;
-  if (vflag > 2)
-    {
-      fprintf(stdout, "%s: hdr.page_size = 0x%x\n", progname, ctxt->hdr.page_size);
-      fprintf(stdout, "%s: ctxt->kernelOffset = 0x%lx\n", progname, ctxt->kernelOffset);
-    }
+  BOOTIMG_LOG(BOOTIMG_LOG_IMAGE, BOOTIMG_LOG_DEBUG, "hdr.page_size = 0x%x", ctxt->hdr.page_size);
+  BOOTIMG_LOG(BOOTIMG_LOG_IMAGE, BOOTIMG_LOG_DEBUG, "ctxt->kernelOffset = 0x%lx", ctxt->kernelOffset);
 
   ctxt->hdr.kernel_addr  = ctxt->baseAddr + ctxt->kernelOffset;
-  if (vflag > 2)
-    fprintf(stdout,
-            "%s: hdr.kernel_addr = baseAddr (0x%lx) + kernelOffset (0x%lx) = 0x%x\n",
-            progname, ctxt->baseAddr, ctxt->kernelOffset, ctxt->hdr.kernel_addr);
+  BOOTIMG_LOG(BOOTIMG_LOG_IMAGE, BOOTIMG_LOG_DEBUG,
+              "hdr.kernel_addr = baseAddr (0x%lx) + kernelOffset (0x%lx) = 0x%x",
+              ctxt->baseAddr, ctxt->kernelOffset, ctxt->hdr.kernel_addr);
   ctxt->hdr.ramdisk_addr = ctxt->baseAddr + ctxt->ramdiskOffset;
-  if (vflag > 2)
-    fprintf(stdout,
-            "%s: hdr.ramdisk_addr = baseAddr (0x%lx) + ramdiskOffset (0x%lx) = 0x%x\n",
-            progname, ctxt->baseAddr, ctxt->ramdiskOffset, ctxt->hdr.ramdisk_addr);
+  BOOTIMG_LOG(BOOTIMG_LOG_IMAGE, BOOTIMG_LOG_DEBUG,
+              "hdr.ramdisk_addr = baseAddr (0x%lx) + ramdiskOffset (0x%lx) = 0x%x",
+              ctxt->baseAddr, ctxt->ramdiskOffset, ctxt->hdr.ramdisk_addr);
   ctxt->hdr.second_addr  = ctxt->baseAddr + ctxt->secondOffset;
-  if (vflag > 2)
-    fprintf(stdout,
-            "%s: hdr.second_addr = baseAddr (0x%lx) + secondOffset (0x%lx) = 0x%x\n",
-            progname, ctxt->baseAddr, ctxt->secondOffset, ctxt->hdr.second_addr);
+  BOOTIMG_LOG(BOOTIMG_LOG_IMAGE, BOOTIMG_LOG_DEBUG,
+              "hdr.second_addr = baseAddr (0x%lx) + secondOffset (0x%lx) = 0x%x",
+              ctxt->baseAddr, ctxt->secondOffset, ctxt->hdr.second_addr);
   ctxt->hdr.tags_addr    = ctxt->baseAddr + ctxt->tagsOffset;
-  if (vflag > 2)
-    fprintf(stdout,
-            "%s: hdr.tags_addr = baseAddr (0x%lx) + tagsOffset (0x%lx) = 0x%x\n",
-            progname, ctxt->baseAddr, ctxt->tagsOffset, ctxt->hdr.tags_addr);
-
-  if (vflag > 2)
-    fprintf(stdout,
-            "%s: ctxt->osVersion = 0x%x  ctxt->osPatchLvl = 0x%x\n",
-            progname, ctxt->osVersion, ctxt->osPatchLvl);
+  BOOTIMG_LOG(BOOTIMG_LOG_IMAGE, BOOTIMG_LOG_DEBUG,
+              "hdr.tags_addr = baseAddr (0x%lx) + tagsOffset (0x%lx) = 0x%x",
+              ctxt->baseAddr, ctxt->tagsOffset, ctxt->hdr.tags_addr);
+
+  BOOTIMG_LOG(BOOTIMG_LOG_IMAGE, BOOTIMG_LOG_DEBUG,
+              "ctxt->osVersion = 0x%x  ctxt->osPatchLvl = 0x%x", ctxt->osVersion, ctxt->osPatchLvl);
   ctxt->hdr.os_version = ((ctxt->osVersion & BOOTIMG_OSVERSION_MASK) << 11) |
     (ctxt->osPatchLvl & BOOTIMG_OSPATCHLVL_MASK);
-  if (vflag > 2)
+  if (logEnabled(BOOTIMG_LOG_IMAGE, BOOTIMG_LOG_DEBUG))
     {
-      fprintf(stdout,
-              "%s: ctxt->osVersion & 0x1ffff = 0x%x\n",
-              progname, ctxt->osVersion & BOOTIMG_OSVERSION_MASK);
-      fprintf(stdout,
-              "%s: (ctxt->osVersion & 0x1ffff) << 11 = 0x%x\n",
-              progname, (ctxt->osVersion & BOOTIMG_OSVERSION_MASK) << 11);
-      fprintf(stdout,
-              "%s: ctxt->osPatchLvl & 0x7FF = 0x%x\n",
-              progname, ctxt->osPatchLvl & BOOTIMG_OSPATCHLVL_MASK);
-      fprintf(stdout,
-              "%s: ctxt->hdr.os_version = ((ctxt->osVersion & 0x1ffff) << 11) | (ctxt->osPatchLvl&0x7ff) = 0x%x\n",
-              progname, ((ctxt->osVersion & BOOTIMG_OSVERSION_MASK) << 11) | (ctxt->osPatchLvl & BOOTIMG_OSPATCHLVL_MASK));
-      fprintf(stdout,
-              "%s: ctxt->hdr.os_version = 0x%x\n",
-              progname, ctxt->hdr.os_version);
+      logWrite(BOOTIMG_LOG_IMAGE, BOOTIMG_LOG_DEBUG,
+               "ctxt->osVersion & 0x1ffff = 0x%x",
+               ctxt->osVersion & BOOTIMG_OSVERSION_MASK);
+      logWrite(BOOTIMG_LOG_IMAGE, BOOTIMG_LOG_DEBUG,
+               "(ctxt->osVersion & 0x1ffff) << 11 = 0x%x",
+               (ctxt->osVersion & BOOTIMG_OSVERSION_MASK) << 11);
+      logWrite(BOOTIMG_LOG_IMAGE, BOOTIMG_LOG_DEBUG,
+               "ctxt->osPatchLvl & 0x7FF = 0x%x",
+               ctxt->osPatchLvl & BOOTIMG_OSPATCHLVL_MASK);
+      logWrite(BOOTIMG_LOG_IMAGE, BOOTIMG_LOG_DEBUG,
+               "ctxt->hdr.os_version = ((ctxt->osVersion & 0x1ffff) << 11) | (ctxt->osPatchLvl&0x7ff) = 0x%x",
+               ((ctxt->osVersion & BOOTIMG_OSVERSION_MASK) << 11) | (ctxt->osPatchLvl & BOOTIMG_OSPATCHLVL_MASK));
+      logWrite(BOOTIMG_LOG_IMAGE, BOOTIMG_LOG_DEBUG,
+               "ctxt->hdr.os_version = 0x%x",
+               ctxt->hdr.os_version);
     }
 
   if (strlen(ctxt->cmdLine) > BOOT_ARGS_SIZE + BOOT_EXTRA_ARGS_SIZE)
@@ -371,49 +382,323 @@ setHeaderValuesFromParsingContext(bootimgParsingContext_p ctxt)
   strncpy(ctxt->hdr.name, ctxt->boardName, BOOTIMG_MIN(strlen(ctxt->boardName), BOOT_NAME_SIZE));
 }
 
-int
-createRamdiskImage(const char *fsdir, const char *ramdisk)
+/*
+ * Image bytes left for the ramdisk under the --max-size ceiling, in
+ * whole pages
+ */
+static size_t
+ramdiskBudget(bootimgParsingContext_p ctxt)
 {
-  int ret = 0;
+  const xmlChar *files[] = { ctxt->kernelImageFile, ctxt->secondImageFile, ctxt->dtbImageFile };
+  uint64_t pagesize = ctxt->hdr.page_size;
+  uint64_t used = alignOnPage(sizeof(boot_img_hdr), pagesize);
+  struct stat st;
+
+  for (size_t n = 0; n < sizeof(files) / sizeof(files[0]); n++)
+    if (files[n] && !stat((const char *)files[n], &st))
+      used += alignOnPage(st.st_size, pagesize);
 
+  if (used >= mval)
+    return 0;
+  return (mval - used) / pagesize * pagesize;
+}
+
+/*
+ * Record the --optimize choice in the context: fingerprint of the gzip
+ * member (none for a raw archive) and measurements
+ */
+static void
+recordRamdiskTuning(bootimgParsingContext_p ctxt, bootimgGzipTrial_p trial, size_t len, size_t max)
+{
+  bootimgGzipMember_t member;
+  char *tuning;
+
+  free((void *)ctxt->ramdiskGzip);
+  ctxt->ramdiskGzip = (xmlChar *)NULL;
+  if (trial->level != GZIP_LEVEL_NONE)
+    {
+      bzero((void *)&member, sizeof(bootimgGzipMember_t));
+      member.level = trial->level;
+      if (gzipParseHeader(trial->data, trial->size, &member.hdr_len) == 0)
+        {
+          member.deflate_len = trial->size - member.hdr_len - GZIP_TRAILER_SIZE;
+          ctxt->ramdiskGzip = (xmlChar *)gzipFingerprint(trial->data, &member);
+        }
+    }
+
+  free((void *)ctxt->ramdiskTuning);
+  if ((tuning = (char *)malloc(PATH_MAX)))
+    {
+      int n = snprintf(tuning, PATH_MAX,
+                       "optimize=%s,codec=%s,level=%d,size=%lu,inflate_ns=%llu,inflate_mbps=%.1f",
+                       gzipTuneGoalName(zval), trial->level == GZIP_LEVEL_NONE ? "none" : "gzip",
+                       trial->level, trial->size, (unsigned long long)trial->inflate_ns,
+                       len * 1e3 / trial->inflate_ns);
+
+      if (max != SIZE_MAX)
+        snprintf(tuning + n, PATH_MAX - n, ",max=%lu", max);
+    }
+  ctxt->ramdiskTuning = (xmlChar *)tuning;
+}
+
+/*
+ * Archive fsdir in the ramdisk file of the context. The tree is scanned
+ * by a thread per CPU. Owners & modes are the ones of the --fs-config
+ * rules, if any.
+ * With --optimize, the archive is stored as is or gzip'ed at the level
+ * best for the goal, under the --max-size ceiling, and the choice is
+ * recorded in the context.
+ * Otherwise, when the ramdisk file already holds the same entries, it
+ * is kept as is, but with -R which only depends on the tree. If not,
+ * the archive is compressed with the parameters & header of the
+ * fingerprint extracted with -F; at the best compression as gzip -9
+ * does with none. Whatever the ramdisk file holds is not looked at for
+ * them.
+ */
+int
+createRamdiskImage(const char *fsdir, bootimgParsingContext_p ctxt)
+{
+  static const uint8_t gzipHeader[] = { GZIP_MAGIC_0, GZIP_MAGIC_1, 8, 0, 0, 0, 0, 0, 2, 3 };
+  const char *ramdisk = (const char *)ctxt->ramdiskImageFile;
+  const char *fingerprint = (const char *)ctxt->ramdiskGzip;
+  bootimgCpioArchive_t archive, original;
+  uint8_t header[GZIP_HEADER_MAX_SIZE];
+  size_t header_len = sizeof(gzipHeader), tail_len = 0;
+  uint8_t *gz = (uint8_t *)NULL, *data = (uint8_t *)NULL;
+  size_t gzlen = 0, len = 0;
+  long jobs = sysconf(_SC_NPROCESSORS_ONLN);
+  int ret = -1, fd = -1, level = 9, same = 0;
+
+  memcpy((void *)header, (const void *)gzipHeader, sizeof(gzipHeader));
+  bzero((void *)&original, sizeof(bootimgCpioArchive_t));
   do
     {
-      char cpio_command[MAX_COMMAND_LENGTH+1];
-      FILE *cpio_fp;
-      char size_str[MAX_COMMAND_LENGTH+1];
-      struct stat statbuf;
-
-      const char *cwd = get_current_dir_name();
-      snprintf(cpio_command,
-    		   MAX_COMMAND_LENGTH,
-    		   "bash -c \"(rm -f %s >/dev/null 2>&1; cd %s >/dev/null 2>&1; find . -print0 | cpio -o0a -H newc -R root.root -O ramdisk.tmp 2>&1; gzip -c9 ramdisk.tmp > %s; rm -f ramdisk.tmp)\"",
-			   ramdisk, fsdir, ramdisk);
-      if (vflag >= 3)
-    	fprintf(stdout, "%s: pipe cpio command = '%s'\n", progname, cpio_command);
-      if ((cpio_fp = popen(cpio_command, "r")) != NULL)
+      if (cpioLoadTree(fsdir, &archive, jobs > 0 ? (unsigned)jobs : 1, Rflag ? (int64_t)Rval : -1,
+                       cflag ? &cval : (bootimgFsConfig_p)NULL) < 0)
+        {
+          fprintf(stderr, "%s: error: cannot archive ramdisk directory '%s'!\n", progname, fsdir);
+          break;
+        }
+
+      if (zflag)
         {
-          if (fgets(size_str, sizeof(size_str), cpio_fp) == NULL)
+          bootimgGzipTrial_t trials[GZIP_TUNE_CANDIDATES];
+          size_t max = mflag ? ramdiskBudget(ctxt) : SIZE_MAX;
+          int best = gzipTune(archive.buf, archive.len, gzipHeader, sizeof(gzipHeader),
+                              zval, max, jobs > 0 ? (unsigned)jobs : 1, trials);
+
+          if (best < 0)
             {
-              fprintf(stderr,
-		      "%s: error: cannot read from pipe for cpio command!\n",
-		      progname);
-              ret = -1;
+              fprintf(stderr, "%s: error: no ramdisk compression fits in a %llu bytes image!\n",
+                      progname, (unsigned long long)mval);
+              gzipTuneRelease(trials);
+              break;
             }
+          recordRamdiskTuning(ctxt, &trials[best], archive.len, max);
+          BOOTIMG_LOG(BOOTIMG_LOG_RAMDISK, BOOTIMG_LOG_INFO, "ramdisk tuning: %s", ctxt->ramdiskTuning);
 
+          gz = trials[best].data;
+          gzlen = trials[best].size;
+          trials[best].data = (uint8_t *)NULL;
+          gzipTuneRelease(trials);
+        }
+      else
+        {
+          /* an untouched tree gives back the original ramdisk */
+          if (!Rflag && !access(ramdisk, R_OK) && (data = (uint8_t *)loadImage(ramdisk, &len)) &&
+              cpioLoad(data, len, &original) == 0)
+            same = cpioSameEntries(&original, &archive);
+          if (same)
+            {
+              BOOTIMG_LOG(BOOTIMG_LOG_RAMDISK, BOOTIMG_LOG_INFO,
+                          "ramdisk image unchanged, original kept: %lu entries, %lu bytes", archive.count, len);
+              ret = 0;
+              break;
+            }
+
+          if (fingerprint && gzipParseFingerprint(fingerprint, &level, header, &header_len, &tail_len) < 0)
+            {
+              fprintf(stderr, "%s: warning: invalid ramdisk gzip fingerprint '%s'!\n", progname, fingerprint);
+              level = 9;
+              header_len = sizeof(gzipHeader);
+              tail_len = 0;
+              memcpy((void *)header, (const void *)gzipHeader, sizeof(gzipHeader));
+            }
+
+          if (level == GZIP_LEVEL_NONE)
+            {
+              BOOTIMG_LOG(BOOTIMG_LOG_RAMDISK, BOOTIMG_LOG_VERBOSE, "ramdisk not compressed");
+              gz = archive.buf;
+              gzlen = archive.len;
+              archive.buf = (uint8_t *)NULL;
+            }
           else
-            if (vflag)
-              fprintf(stdout,
-                      "%s: ramdisk image created: %s\n",
-                      progname, size_str);
-          pclose(cpio_fp);
+            {
+              BOOTIMG_LOG(BOOTIMG_LOG_RAMDISK, BOOTIMG_LOG_VERBOSE,
+                          "ramdisk gzip: level %d, strategy %d, memlevel %d, %lu header & %lu tail bytes",
+                          GZIP_PARAMS_LEVEL(level), GZIP_PARAMS_STRATEGY(level), GZIP_PARAMS_MEMLEVEL(level),
+                          header_len, tail_len);
+              if (gzipRebuild(archive.buf, archive.len, level, header, header_len,
+                              (const uint8_t *)NULL, tail_len, &gz, &gzlen) < 0)
+                {
+                  fprintf(stderr, "%s: error: cannot compress ramdisk archive!\n", progname);
+                  break;
+                }
+            }
+        }
+
+      struct iovec iov = { (void *)gz, gzlen };
+      if ((fd = open(ramdisk, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0 ||
+          ioWriteVector(ioDefault(), fd, &iov, 1, 0) < 0)
+        {
+          fprintf(stderr, "%s: error: cannot write ramdisk image '%s'!\n", progname, ramdisk);
+          break;
         }
-      free((void *)cwd);
+
+      BOOTIMG_LOG(BOOTIMG_LOG_RAMDISK, BOOTIMG_LOG_INFO,
+                  "ramdisk image created: %lu entries, %lu bytes", archive.count, gzlen);
+      ret = 0;
     }
   while (0);
 
+  if (fd >= 0)
+    close(fd);
+  cpioRelease(&original);
+  cpioRelease(&archive);
+  free((void *)data);
+  free((void *)gz);
+
   return ret;
 }
 
+/*
+ * Load a component image: from its file, or in tar mode from the
+ * stream member with the same name (directories ignored)
+ */
+void *
+loadComponent(const char *filename, size_t *size)
+{
+  const char *name = rindex(filename, '/') ? rindex(filename, '/') +1 : filename;
+
+  if (!tflag)
+    return loadImage(filename, size);
+
+  for (size_t n = 0; n < tarMemberCount; n++)
+    {
+      const char *member = tarMembers[n].name;
+
+      if (rindex(member, '/'))
+        member = rindex(member, '/') +1;
+      if (!strcmp(member, name))
+        {
+          *size = tarMembers[n].size;
+          return tarMembers[n].data;
+        }
+    }
+
+  fprintf(stderr, "%s: error: no '%s' file in the tar stream!\n", progname, name);
+  return (void *)NULL;
+}
+
+/*
+ * Load the component images of the context: files are read
+ * concurrently, tar members are already in memory
+ */
+static int
+loadComponents(bootimgParsingContext_p ctxt, data_context_t *dctxt)
+{
+  const char *what[BOOTIMG_COMPONENT_COUNT] = {
+    "kernel", "ramdisk", "second loader", "device tree blob"
+  };
+  const char *files[BOOTIMG_COMPONENT_COUNT] = {
+    (const char *)ctxt->kernelImageFile,
+    (const char *)ctxt->ramdiskImageFile,
+    (const char *)ctxt->secondImageFile,
+    (const char *)ctxt->dtbImageFile
+  };
+  const char *names[BOOTIMG_COMPONENT_COUNT];
+  void *data[BOOTIMG_COMPONENT_COUNT] = { NULL, };
+  size_t size[BOOTIMG_COMPONENT_COUNT] = { 0, };
+  unsigned idx[BOOTIMG_COMPONENT_COUNT];
+  unsigned n = 0;
+
+  for (unsigned nc = 0; nc < BOOTIMG_COMPONENT_COUNT; nc++)
+    {
+      if (!files[nc])
+        continue;
+      if (tflag)
+        {
+          if (!(data[nc] = loadComponent(files[nc], &size[nc])))
+            {
+              fprintf(stderr,
+                      "%s: error: couldn't load %s image file at '%s'\n",
+                      progname, what[nc], files[nc]);
+              return -1;
+            }
+          continue;
+        }
+      idx[n] = nc;
+      names[n++] = files[nc];
+    }
+
+  if (n)
+    {
+      void *loaded[BOOTIMG_COMPONENT_COUNT];
+      size_t loadedsz[BOOTIMG_COMPONENT_COUNT];
+      bootimgIo_p io = ioDefault();
+
+      if (!io || ioLoadFiles(io, n, names, loaded, loadedsz) < 0)
+        {
+          unsigned missing = 0;
+
+          /* find out which one is missing */
+          for (unsigned i = 0; i < n; i++)
+            if (access(names[i], R_OK) && ++missing)
+              fprintf(stderr,
+                      "%s: error: couldn't load %s image file at '%s'\n",
+                      progname, what[idx[i]], names[i]);
+          if (!missing)
+            fprintf(stderr, "%s: error: couldn't load component images\n", progname);
+          return -1;
+        }
+      for (unsigned i = 0; i < n; i++)
+        {
+          data[idx[i]] = loaded[i];
+          size[idx[i]] = loadedsz[i];
+        }
+    }
+
+  dctxt->kernel_data = data[BOOTIMG_COMPONENT_KERNEL];
+  ctxt->hdr.kernel_size = size[BOOTIMG_COMPONENT_KERNEL];
+  dctxt->ramdisk_data = data[BOOTIMG_COMPONENT_RAMDISK];
+  ctxt->hdr.ramdisk_size = size[BOOTIMG_COMPONENT_RAMDISK];
+  dctxt->second_data = data[BOOTIMG_COMPONENT_SECOND];
+  ctxt->hdr.second_size = size[BOOTIMG_COMPONENT_SECOND];
+  dctxt->dtb_data = data[BOOTIMG_COMPONENT_DTB];
+  ctxt->hdr.dt_size = size[BOOTIMG_COMPONENT_DTB];
+
+  return 0;
+}
+
+/*
+ * Append an item and its padding to the next page boundary
+ */
+static void
+addImageSegment(struct iovec *segments, unsigned *n, const void *data, size_t itemsize, size_t pagesize)
+{
+  unsigned pagemask = pagesize - 1;
+
+  segments[*n].iov_base = (void *)data;
+  segments[(*n)++].iov_len = itemsize;
+
+  /* padding unneeded */
+  if ((itemsize & pagemask) == 0)
+    return;
+
+  segments[*n].iov_base = (void *)padding;
+  segments[(*n)++].iov_len = pagesize - (itemsize & pagemask);
+}
+
 /*
  * Load images, compute last hdr fields and write boot image
  */
@@ -422,6 +707,7 @@ writeImage(bootimgParsingContext_p ctxt)
 {
   int rc = -1;
   data_context_t data_ctxt, *dctxt = &data_ctxt;
+  uint64_t start = statsBegin(BOOTIMG_STATS_IMAGE_WRITE);
 
   do
     {
@@ -431,68 +717,35 @@ writeImage(bootimgParsingContext_p ctxt)
       /* Report header data from parsing context to header struct */
       setHeaderValuesFromParsingContext(ctxt);
 
-      /* load the kernel image */
-      dctxt->kernel_data = loadImage(ctxt->kernelImageFile,
-                                     (size_t *)&ctxt->hdr.kernel_size);
-      if (!dctxt->kernel_data)
+      /* only the second loader & the dtb are optional, a -F ramdisk is written to its file */
+      if (!ctxt->kernelImageFile || !ctxt->ramdiskImageFile)
         {
-          fprintf(stderr,
-                  "%s: error: couldn't load kernel image file at '%s'\n",
-                  progname,
-                  ctxt->kernelImageFile);
+          fprintf(stderr, "%s: error: couldn't load %s image: no file given\n",
+                  progname, ctxt->kernelImageFile ? "ramdisk" : "kernel");
           break;
         }
 
-      if (Fflag && createRamdiskImage(Fval, ctxt->ramdiskImageFile))
-	break;
-
-      /* load the ramdisk image */
-      dctxt->ramdisk_data = loadImage(ctxt->ramdiskImageFile,
-                                      (size_t *)&ctxt->hdr.ramdisk_size);
-      if (!dctxt->ramdisk_data)
+      if (Fflag)
         {
-          fprintf(stderr,
-                  "%s: error: couldn't load ramdisk image file at '%s'\n",
-                  progname,
-                  ctxt->ramdiskImageFile);
-          break;
-        }
+          uint64_t packStart = statsBegin(BOOTIMG_STATS_RAMDISK_PACK);
+          int packrc = createRamdiskImage(Fval, ctxt);
 
-      /* load the second bootloader image if one is available */
-      if (ctxt->secondImageFile)
-        {
-          dctxt->second_data = loadImage(ctxt->secondImageFile,
-                                         (size_t *)&ctxt->hdr.second_size);
-          if (!dctxt->second_data)
-            {
-              fprintf(stderr,
-                      "%s: error: couldn't load second loader image file at '%s'\n",
-                      progname,
-                      ctxt->secondImageFile);
-              break;
-            }
+          statsEnd(BOOTIMG_STATS_RAMDISK_PACK, packStart);
+          if (packrc)
+            break;
         }
 
-      /* load the device tree blob image if one is available */
-      if (ctxt->dtbImageFile)
-        {
-          dctxt->dtb_data = loadImage(ctxt->dtbImageFile,
-                                      (size_t *)&ctxt->hdr.dt_size);
-          if (!dctxt->dtb_data)
-            {
-              fprintf(stderr,
-                      "%s: error: couldn't load device tree blob image file at '%s'\n",
-                      progname,
-                      ctxt->dtbImageFile);
-              break;
-            }
-        }
+      /* load all the component images at once */
+      if (loadComponents(ctxt, dctxt) < 0)
+        break;
 
       /* update boot image id */
       updateIdHeaderField(ctxt, dctxt);
 
-      /* open image file for writing */
-      int fd = open(ctxt->bootImageFile, O_CREAT | O_TRUNC | O_WRONLY, 0644);
+      /* open image file for writing (tar mode writes to stdout) */
+      int fd = tflag ? imgoutfd : open(ctxt->bootImageFile, O_CREAT | O_TRUNC | O_WRONLY, 0644);
+      if (!tflag)
+        statsCount(BOOTIMG_STATS_CURRENT, BOOTIMG_STATS_SYSCALLS, 1);
       if (fd < 0)
         {
           perror(progname);
@@ -504,114 +757,50 @@ writeImage(bootimgParsingContext_p ctxt)
         }
 
       /*
-       * Headerval
+       * Header, kernel, ramdisk, second & dtb images, each padded to
+       * the next page boundary
        */
-      /* write the header data */
-      size_t wrsz = 0;
-      if ((wrsz = write(fd, &ctxt->hdr, sizeof (ctxt->hdr))) != sizeof (ctxt->hdr))
-        {
-          fprintf(stderr,
-                  "%s: error: expected %lu header bytes written but got only %lu!\n",
-                  progname,
-                  sizeof (ctxt->hdr),
-                  wrsz);
-          break;
-        }
-      /* pad to the next page boundary */
-      if (writePaddingToFd(fd, ctxt->hdr.page_size, sizeof(ctxt->hdr)) == -1)
-        {
-          fprintf(stderr,
-                  "%s: error: failed to pad boot image header!\n",
-                  progname);
-          break;
-        }
+      struct iovec segments[2 * BOOTIMG_COMPONENT_COUNT + 2];
+      unsigned nsegments = 0;
 
-      /*
-       * Kernel image
-       */
-      if ((wrsz = write(fd, dctxt->kernel_data, ctxt->hdr.kernel_size)) != ctxt->hdr.kernel_size)
-        {
-          fprintf(stderr,
-                  "%s: error: expected %lu kernel bytes written but got only %lu!\n",
-                  progname,
-                  sizeof (ctxt->hdr.kernel_size),
-                  wrsz);
-          break;
-        }
-      /* pad to the next page boundary */
-      if (writePaddingToFd(fd, ctxt->hdr.page_size, ctxt->hdr.kernel_size) == -1)
-        {
-          fprintf(stderr,
-                  "%s: error: failed to pad kernel image!\n",
-                  progname);
-          break;
-        }
+      addImageSegment(segments, &nsegments, &ctxt->hdr, sizeof(ctxt->hdr), ctxt->hdr.page_size);
+      addImageSegment(segments, &nsegments, dctxt->kernel_data, ctxt->hdr.kernel_size, ctxt->hdr.page_size);
+      addImageSegment(segments, &nsegments, dctxt->ramdisk_data, ctxt->hdr.ramdisk_size, ctxt->hdr.page_size);
+      if (dctxt->second_data)
+        addImageSegment(segments, &nsegments, dctxt->second_data, ctxt->hdr.second_size, ctxt->hdr.page_size);
+      if (dctxt->dtb_data)
+        addImageSegment(segments, &nsegments, dctxt->dtb_data, ctxt->hdr.dt_size, ctxt->hdr.page_size);
 
-      /*
-       * Ramdisk image
-       */
-      if ((wrsz = write(fd, dctxt->ramdisk_data, ctxt->hdr.ramdisk_size)) != ctxt->hdr.ramdisk_size)
-        {
-          fprintf(stderr,
-                  "%s: error: expected %lu ramdisk bytes written but got only %lu!\n",
-                  progname,
-                  sizeof (ctxt->hdr.ramdisk_size),
-                  wrsz);
-          break;
-        }
-      /* pad to the next page boundary */
-      if (writePaddingToFd(fd, ctxt->hdr.page_size, ctxt->hdr.ramdisk_size) == -1)
+      /* a stream is written in order, a file by positioned writes all in flight */
+      if (tflag)
         {
-          fprintf(stderr,
-                  "%s: error: failed to pad ramdisk image!\n",
-                  progname);
-          break;
-        }
+          unsigned n;
 
-      /*
-       * Second boot loader image
-       */
-      if (dctxt->second_data)
-        {
-          if ((wrsz = write(fd, dctxt->second_data, ctxt->hdr.second_size)) != ctxt->hdr.second_size)
-            {
-              fprintf(stderr,
-                      "%s: error: expected %lu second bytes written but got only %lu!\n",
-                      progname,
-                      sizeof (ctxt->hdr.second_size),
-                      wrsz);
+          for (n = 0; n < nsegments; n++)
+            if (tarWriteFull(fd, segments[n].iov_base, segments[n].iov_len) < 0)
               break;
-            }
-          /* pad to the next page boundary */
-          if (writePaddingToFd(fd, ctxt->hdr.page_size, ctxt->hdr.second_size) == -1)
+          if (n < nsegments)
             {
               fprintf(stderr,
-                      "%s: error: failed to pad second image!\n",
+                      "%s: error: failed to write boot image on output stream!\n",
                       progname);
               break;
             }
         }
-
-      /*
-       * device tree blob image
-       */
-      if (dctxt->dtb_data)
+      else
         {
-          if ((wrsz = write(fd, dctxt->dtb_data, ctxt->hdr.dt_size)) != ctxt->hdr.dt_size)
+          int wrc = ioWriteVector(ioDefault(), fd, segments, nsegments, 0);
+
+          if (wrc < 0)
+            perror(progname);
+          close(fd);
+          statsCount(BOOTIMG_STATS_CURRENT, BOOTIMG_STATS_SYSCALLS, 1);
+          if (wrc < 0)
             {
               fprintf(stderr,
-                      "%s: error: expected %lu device tree blob image bytes written but got only %lu!\n",
+                      "%s: error: failed to write boot image file '%s'!\n",
                       progname,
-                      sizeof (ctxt->hdr.dt_size),
-                      wrsz);
-              break;
-            }
-          /* pad to the next page boundary */
-          if (writePaddingToFd(fd, ctxt->hdr.dt_size, ctxt->hdr.dt_size) == -1)
-            {
-              fprintf(stderr,
-                      "%s: error: failed to pad device tree blob image!\n",
-                      progname);
+                      ctxt->bootImageFile);
               break;
             }
         }
@@ -649,6 +838,7 @@ writeImage(bootimgParsingContext_p ctxt)
       rc = 0;
     }
   while (0);
+  statsEnd(BOOTIMG_STATS_IMAGE_WRITE, start);
 
   return rc;
 }
@@ -672,8 +862,9 @@ main(int argc, char **argv)
   
   progname = (rindex(argv[0], '/') ? rindex(argv[0], '/')+1 : argv[0]);
   blankname = (char *)alloca(strlen(progname) +1);
-  blankname[strlen(progname) +1] = 0;
+  blankname[strlen(progname)] = 0;
   memset((void *)blankname, (int)' ', (size_t)strlen(progname));
+  logInit();
   oval = get_current_dir_name();
 
 #ifdef USE_LIBXML2
@@ -705,9 +896,8 @@ main(int argc, char **argv)
             vflag += strtol(optarg, NULL, 10);
           else
             vflag++;
-          if (vflag > 3)
-            fprintf(stderr, "%s: option %s/%c set to %d\n",
-                    progname, getLongOptionName(long_options, c), c, vflag);
+          BOOTIMG_LOG(BOOTIMG_LOG_MAIN, BOOTIMG_LOG_TRACE,
+                      "option %s/%c set to %d", getLongOptionName(long_options, c), c, vflag);
           break;
 
         case 'f':
@@ -728,25 +918,24 @@ main(int argc, char **argv)
                 oval = strdup(newval);
               }
             free((void *)oldval);
-            if (vflag)
-              fprintf(stderr, "%s: option %s/%c (=%d) set to '%s'\n",
-                      progname, getLongOptionName(long_options, c), c, oflag, oval);
+            BOOTIMG_LOG(BOOTIMG_LOG_MAIN, BOOTIMG_LOG_INFO,
+                        "option %s/%c (=%d) set to '%s'",
+                        getLongOptionName(long_options, c), c, oflag, oval);
           }
           break;
           
         case 'i':
           iflag = 1;
-          if (vflag > 3)
-            fprintf(stderr, "%s: option %s/%c (=%d) set\n",
-                    progname, getLongOptionName(long_options, c), c, iflag);
+          BOOTIMG_LOG(BOOTIMG_LOG_MAIN, BOOTIMG_LOG_TRACE,
+                      "option %s/%c (=%d) set", getLongOptionName(long_options, c), c, iflag);
           break;
           
         case 'p':
           pflag = 1;
           pval = strtol(optarg, NULL, 10);
-          if (vflag > 3)
-            fprintf(stderr, "%s: option %s/%c (=%d) set with value '%lu'\n",
-                    progname, getLongOptionName(long_options, c), c, pflag, pval);
+          BOOTIMG_LOG(BOOTIMG_LOG_MAIN, BOOTIMG_LOG_TRACE,
+                      "option %s/%c (=%d) set with value '%lu'",
+                      getLongOptionName(long_options, c), c, pflag, pval);
           break;
 
         case 'F':
@@ -764,9 +953,91 @@ main(int argc, char **argv)
               optind++;
             }
 
-          if (vflag > 3)
-            fprintf(stderr, "%s: option %s/%c (=%d) set with value '%s'\n",
-                    progname, getLongOptionName(long_options, c), c, Fflag, Fval);
+          BOOTIMG_LOG(BOOTIMG_LOG_MAIN, BOOTIMG_LOG_TRACE,
+                      "option %s/%c (=%d) set with value '%s'",
+                      getLongOptionName(long_options, c), c, Fflag, Fval);
+          break;
+
+        case 'C':
+          Cflag = 1;
+          if (!strcmp(optarg, "xml"))
+            Cval = BOOTIMG_META_FORMAT_XML;
+          else if (!strcmp(optarg, "json"))
+            Cval = BOOTIMG_META_FORMAT_JSON;
+          else if (!strcmp(optarg, "binary"))
+            Cval = BOOTIMG_META_FORMAT_BINARY;
+          else
+            {
+              fprintf(stderr, "%s: error: unknown metadata format '%s'!\n", progname, optarg);
+              printusage(0);
+              exit(1);
+            }
+          BOOTIMG_LOG(BOOTIMG_LOG_MAIN, BOOTIMG_LOG_TRACE,
+                      "option %s/%c (=%d) set with value '%s'",
+                      getLongOptionName(long_options, c), c, Cflag, optarg);
+          break;
+
+        case 't':
+          tflag = 1;
+          BOOTIMG_LOG(BOOTIMG_LOG_MAIN, BOOTIMG_LOG_TRACE,
+                      "option %s/%c (=%d) set", getLongOptionName(long_options, c), c, tflag);
+          break;
+
+        case 'D':
+          Dflag = 1;
+          BOOTIMG_LOG(BOOTIMG_LOG_MAIN, BOOTIMG_LOG_TRACE,
+                      "option %s/%c (=%d) set", getLongOptionName(long_options, c), c, Dflag);
+          break;
+
+        case 'R':
+          Rflag = 1;
+          BOOTIMG_LOG(BOOTIMG_LOG_MAIN, BOOTIMG_LOG_TRACE,
+                      "option %s/%c (=%d) set", getLongOptionName(long_options, c), c, Rflag);
+          break;
+
+        case 'c':
+          if (cflag)
+            cpioFsConfigRelease(&cval);
+          cflag = 1;
+          if (cpioFsConfigLoad(optarg, &cval) < 0)
+            exit(1);
+          BOOTIMG_LOG(BOOTIMG_LOG_MAIN, BOOTIMG_LOG_TRACE,
+                      "option %s/%c (=%d) set with value '%s'",
+                      getLongOptionName(long_options, c), c, cflag, optarg);
+          break;
+
+        case 'S':
+          Sflag = 1;
+          if ((Sval = statsParseFormat(optarg)) < 0)
+            {
+              fprintf(stderr, "%s: error: unknown stats format '%s'!\n", progname, optarg);
+              exit(1);
+            }
+          statsEnable(Sval);
+          BOOTIMG_LOG(BOOTIMG_LOG_MAIN, BOOTIMG_LOG_TRACE,
+                      "option %s/%c (=%d) set with value '%s'",
+                      getLongOptionName(long_options, c), c, Sflag, optarg ? optarg : "text");
+          break;
+
+        case 'z':
+          zflag = 1;
+          if ((zval = gzipParseTuneGoal(optarg)) < 0)
+            {
+              fprintf(stderr, "%s: error: unknown optimization goal '%s'!\n", progname, optarg);
+              exit(1);
+            }
+          BOOTIMG_LOG(BOOTIMG_LOG_MAIN, BOOTIMG_LOG_TRACE,
+                      "option %s/%c (=%d) set with value '%s'",
+                      getLongOptionName(long_options, c), c, zflag, optarg);
+          break;
+
+        case 'm':
+          mflag = 1;
+          if (parseSize(optarg, "image size", UINT32_MAX * 4ULL, &mval) < 0)
+            exit(1);
+          BOOTIMG_LOG(BOOTIMG_LOG_MAIN, BOOTIMG_LOG_TRACE,
+                      "option %s/%c (=%d) set with value '%s'",
+                      getLongOptionName(long_options, c), c, mflag, optarg);
           break;
 
         case 'h':
@@ -783,6 +1054,54 @@ main(int argc, char **argv)
         }
     }
 
+  if (Dflag)
+    ioSetDefaultFlags(BOOTIMG_IO_FLAG_NOCACHE);
+
+  if ((zflag && !Fflag) || (mflag && !zflag))
+    {
+      fprintf(stderr, "%s: error: --optimize needs --fs and --max-size needs --optimize!\n", progname);
+      exit(1);
+    }
+
+  if (getenv("SOURCE_DATE_EPOCH"))
+    Rflag = 1;
+  if (Rflag)
+    Rval = getSourceDateEpoch(0);
+
+  if (tflag)
+    {
+      int rc;
+
+      if (Fflag || Cflag || optind < argc)
+        {
+          fprintf(stderr, "%s: error: --tar takes no metadata file and cannot be used with --fs or --convert!\n", progname);
+          exit(1);
+        }
+      if (isatty(STDOUT_FILENO))
+        {
+          fprintf(stderr, "%s: error: refusing to write an image to a terminal!\n", progname);
+          exit(1);
+        }
+
+      /* stdout carries the image: messages go to stderr */
+      fflush(stdout);
+      if ((imgoutfd = dup(STDOUT_FILENO)) < 0 || dup2(STDERR_FILENO, STDOUT_FILENO) < 0)
+        {
+          perror(progname);
+          exit(1);
+        }
+
+      rc = createBootImageFromTarStream(STDIN_FILENO);
+      close(imgoutfd);
+      statsImageDone("-");
+      statsBatchDone();
+
+#ifdef USE_LIBXML2
+      xmlCleanupParser();
+#endif
+      exit(rc < 0 ? 1 : 0);
+    }
+
   if (optind < argc)
     {
       if (optind != argc -1 && !fflag)
@@ -797,6 +1116,11 @@ main(int argc, char **argv)
       
       while (optind < argc)
         {
+          const char *metafile = argv[optind];
+
+          statsImageBegin();
+          metadataPhaseBegin();
+
           /* 
            * Create image from metadata file according to its type
            */
@@ -809,7 +1133,21 @@ main(int argc, char **argv)
           /* Ptr arithm: check filename ends with .json */
           else if (strstr(argv[optind], ".json") == (argv[optind] + strlen(argv[optind]) - 5))
             createBootImageFromJsonMetadata(argv[optind++], oval);
+
+          /* Ptr arithm: check filename ends with .bmeta */
+          else if (strstr(argv[optind], ".bmeta") == (argv[optind] + strlen(argv[optind]) - 6))
+            createBootImageFromBinaryMetadata(argv[optind++], oval);
+
+          else
+            fprintf(stderr,
+                    "%s: error: unknown metadata file type for '%s'!\n",
+                    progname, argv[optind++]);
+
+          /* not closed by processParsingContext on errors */
+          metadataPhaseEnd();
+          statsImageDone(metafile);
         }
+      statsBatchDone();
 
 #ifdef USE_LIBXML2
       /*
@@ -829,29 +1167,6 @@ main(int argc, char **argv)
   return(0);  
 }
 
-/*
- * write padding in a file until page border
- */
-int
-writePaddingToFd(int fd, size_t pagesize, size_t itemsize)
-{
-  unsigned pagemask = pagesize - 1;
-  ssize_t count;
-
-  /* padding unneeded */
-  if ((itemsize & pagemask) == 0)
-    return 0;
-
-  /* compute size to page border */
-  count = pagesize - (itemsize & pagemask);
-
-  /* if write fails return error */
-  if (write(fd, padding, count) != count)
-    return -1;
-  else
-    return 0;
-}
-
 /*
  * Write a C string in a file without the '\0'
  */
@@ -953,11 +1268,7 @@ createBootImageProcessXmlNode(bootimgParsingContext_t *ctxt, xmlTextReaderPtr xm
   int rc = 1, pc = 1;
   xmlChar *localName = xmlTextReaderLocalName(xmlReader);
 
-  if (vflag)
-    fprintf(stdout,
-            "%s: localName = '%s'\n",
-            progname,
-            localName);
+  BOOTIMG_LOG(BOOTIMG_LOG_META, BOOTIMG_LOG_INFO, "localName = '%s'", localName);
 
   do
     {
@@ -969,9 +1280,7 @@ createBootImageProcessXmlNode(bootimgParsingContext_t *ctxt, xmlTextReaderPtr xm
         }
 
       /* process #text nodes */
-      if (!memcmp((void *)localName,
-                  (const void *)BOOTIMG_XMLTYPE_TEXT_NAME,
-                  (size_t)sizeof(BOOTIMG_XMLTYPE_TEXT_NAME)-1))
+      if (!xmlStrcmp(localName, BOOTIMG_XMLTYPE_TEXT_NAME))
         {
           if (ELEMENT_OPENED(bootImage))
             {
@@ -1132,6 +1441,14 @@ createBootImageProcessXmlNode(bootimgParsingContext_t *ctxt, xmlTextReaderPtr xm
                 {
                   ProcessXmlText4String(dtbImageFile, PATH_MAX);
                 }
+              else if (ELEMENT_OPENED(ramdiskGzip))
+                {
+                  ProcessXmlText4String(ramdiskGzip, PATH_MAX);
+                }
+              else if (ELEMENT_OPENED(ramdiskTuning))
+                {
+                  ProcessXmlText4String(ramdiskTuning, PATH_MAX);
+                }
             }
         }
       
@@ -1150,24 +1467,18 @@ createBootImageProcessXmlNode(bootimgParsingContext_t *ctxt, xmlTextReaderPtr xm
                 }
               else
                 {
-                  if (vflag >= 3)
-                    fprintf(stdout,
-                            "%s: bootImage has %d attribute(s)\n",
-                            progname,
-                            xmlTextReaderAttributeCount(xmlReader));
+                  BOOTIMG_LOG(BOOTIMG_LOG_META, BOOTIMG_LOG_DEBUG,
+                              "bootImage has %d attribute(s)",
+                              xmlTextReaderAttributeCount(xmlReader));
                   ctxt->bootImageFile = xmlTextReaderGetAttribute(xmlReader, "bootImageFile");
-                  if (vflag)
-                    fprintf(stdout,
-                            "%s: bootImageFile = '%s'\n",
-                            progname,
-                            ctxt->bootImageFile);
+                  BOOTIMG_LOG(BOOTIMG_LOG_META, BOOTIMG_LOG_INFO,
+                              "bootImageFile = '%s'", ctxt->bootImageFile);
                 }
             }
           else if (ELEMENT_OPENED(bootImage))
             {
               /* Create bootImage */
-              if (vflag)
-                fprintf(stdout, "%s: bootImage element parsed\n", progname);
+              BOOTIMG_LOG(BOOTIMG_LOG_META, BOOTIMG_LOG_INFO, "bootImage element parsed");
             }
           ELEMENT_INCR(bootImage);
         }
@@ -1259,6 +1570,14 @@ createBootImageProcessXmlNode(bootimgParsingContext_t *ctxt, xmlTextReaderPtr xm
       /* process dtbImageFile */
       if (IS_ELEMENT(DTBIMAGEFILE))
         ELEMENT_INCR(dtbImageFile);
+
+      /* process ramdiskGzip */
+      if (IS_ELEMENT(RAMDISKGZIP))
+        ELEMENT_INCR(ramdiskGzip);
+
+      /* process ramdiskTuning */
+      if (IS_ELEMENT(RAMDISKTUNING))
+        ELEMENT_INCR(ramdiskTuning);
     }
   while (0);
   
@@ -1267,32 +1586,143 @@ createBootImageProcessXmlNode(bootimgParsingContext_t *ctxt, xmlTextReaderPtr xm
 }
 #endif /* !USE_LIBXML2 */
 
+/*
+ * Either write the boot image described by the parsing context or,
+ * if a conversion was requested, write the metadata in the target
+ * format beside the input file
+ */
+int
+processParsingContext(bootimgParsingContext_p ctxt, const char *filename)
+{
+  static const char *extensions[] = { ".xml", ".json", ".bmeta" };
+  const char *ext;
+  char *outname;
+  int rc = -1;
+
+  metadataPhaseEnd();
+  if (!Cflag)
+    {
+      if ((rc = writeImage(ctxt)) < 0)
+        fprintf(stderr,
+                "%s: error: couldn't write image file at '%s'\n",
+                progname,
+                ctxt->bootImageFile);
+      else
+        BOOTIMG_LOG(BOOTIMG_LOG_IMAGE, BOOTIMG_LOG_INFO,
+                    "image '%s' written!", ctxt->bootImageFile);
+
+      /* --optimize: the choice is recorded in the metadata file read */
+      ext = rindex(filename, '.');
+      if (rc == 0 && zflag)
+        {
+          if (!ext || !strcmp(ext, extensions[BOOTIMG_META_FORMAT_BINARY]))
+            fprintf(stderr, "%s: warning: ramdisk tuning not recorded in binary metadata '%s'!\n",
+                    progname, filename);
+          else if ((rc = writeMetadata(ctxt, strcmp(ext, extensions[BOOTIMG_META_FORMAT_JSON]) ?
+                                       BOOTIMG_META_FORMAT_XML : BOOTIMG_META_FORMAT_JSON,
+                                       filename, BOOTIMG_META_FLAG_NONE)) < 0)
+            fprintf(stderr, "%s: error: couldn't write metadata file at '%s'\n", progname, filename);
+        }
+      return rc;
+    }
+
+  ext = rindex(filename, '.');
+  if (ext && !strcmp(ext, extensions[Cval]))
+    {
+      fprintf(stderr,
+              "%s: error: '%s' is already in the requested format!\n",
+              progname, filename);
+      return -1;
+    }
+
+  outname = (char *)malloc(strlen(filename) + strlen(extensions[Cval]) +1);
+  if (!outname)
+    return -1;
+  strcpy(outname, filename);
+  if (ext)
+    outname[ext - filename] = '\0';
+  strcat(outname, extensions[Cval]);
+
+  do
+    {
+      /* binary metadata also holds sizes & digests of components */
+      if (Cval == BOOTIMG_META_FORMAT_BINARY &&
+          computeComponentsFromFiles(ctxt) < 0)
+        break;
+
+      if ((rc = writeMetadata(ctxt, Cval, outname, BOOTIMG_META_FLAG_NONE)) < 0)
+        fprintf(stderr,
+                "%s: error: couldn't write metadata file at '%s'\n",
+                progname, outname);
+      else
+        BOOTIMG_LOG(BOOTIMG_LOG_META, BOOTIMG_LOG_INFO, "metadata '%s' written!", outname);
+    }
+  while (0);
+
+  free((void *)outname);
+  return rc;
+}
+
+/*
+ * Open & close the metadata phase, spanning several functions
+ */
+void
+metadataPhaseBegin(void)
+{
+  metadataStart = statsBegin(BOOTIMG_STATS_METADATA);
+  metadataOpened = 1;
+}
+
+void
+metadataPhaseEnd(void)
+{
+  if (!metadataOpened)
+    return;
+  statsEnd(BOOTIMG_STATS_METADATA, metadataStart);
+  metadataOpened = 0;
+}
+
+/*
+ * createBootImageFromBinaryMetadata
+ */
 void
-releaseContextContent(bootimgParsingContext_t *ctxt)
+createBootImageFromBinaryMetadata(const char *filename, const char *outdir)
 {
-  /* release ctxt */
-  if (ctxt->boardName)
-    free((void *)ctxt->boardName);
-  ctxt->boardName = NULL;
-  if (ctxt->bootImageFile)
-    free((void *)ctxt->bootImageFile);
-  ctxt->bootImageFile = NULL;
-  if (ctxt->cmdLine)
-    free((void *)ctxt->cmdLine);
-  ctxt->cmdLine = NULL;
-  if (ctxt->dtbImageFile)
-    free((void *)ctxt->dtbImageFile);
-  ctxt->dtbImageFile = NULL;
-  if (ctxt->kernelImageFile)
-    free((void *)ctxt->kernelImageFile);
-  ctxt->kernelImageFile = NULL;
-  if (ctxt->ramdiskImageFile)
-    free((void *)ctxt->ramdiskImageFile);
-  ctxt->ramdiskImageFile = NULL;
-  if (ctxt->secondImageFile)
-    free((void *)ctxt->secondImageFile);
-  ctxt->secondImageFile = NULL;
-  bzero((void *)ctxt, sizeof(bootimgParsingContext_t));
+  size_t bmeta_sz = 0;
+  void *data = loadImage(filename, &bmeta_sz);
+
+  if (!data)
+    {
+      fprintf(stderr, "%s: error: cannot read binary metadata file '%s'!\n", progname, filename);
+      return;
+    }
+
+  (void)createBootImageFromBinaryData(data, bmeta_sz, filename);
+  free(data);
+}
+
+/*
+ * createBootImageFromBinaryData
+ */
+int
+createBootImageFromBinaryData(const void *data, size_t len, const char *filename)
+{
+  bootimgParsingContext_t ctxt;
+  int rc = -1;
+
+  bzero((void *)&ctxt, sizeof(bootimgParsingContext_t));
+  (void)initBootImgHeader(&ctxt.hdr);
+
+  /* Only bounds checks: values are used as stored */
+  if (readBinaryMetadata(data, len, &ctxt) < 0)
+    fprintf(stderr,
+            "%s: error: couldn't read data from binary metadata '%s'\n",
+            progname, filename);
+  else
+    rc = processParsingContext(&ctxt, filename);
+
+  releaseContextContent(&ctxt);
+  return rc;
 }
 
 #ifdef USE_LIBXML2
@@ -1303,77 +1733,75 @@ void
 createBootImageFromXmlMetadata(const char *filename, const char *outdir)
 {
   xmlTextReaderPtr xmlReader;
+
+  xmlReader = xmlReaderForFile(filename, NULL, 0);
+  if (xmlReader == (xmlTextReaderPtr)NULL)
+    fprintf(stderr, "%s: error: cannot create xml reader for '%s'!\n", progname, filename);
+
+  else
+    (void)createBootImageFromXmlReader(xmlReader, filename);
+}
+
+/*
+ * createBootImageFromXmlReader: parse the document & create the image.
+ * The reader is freed.
+ */
+int
+createBootImageFromXmlReader(xmlTextReaderPtr xmlReader, const char *filename)
+{
   xmlDocPtr xmlDoc;
   bootimgParsingContext_t ctxt;
   boot_img_hdr *hdr = (boot_img_hdr *)NULL;
+  int rc, pc = 1, ret = -1;
 
   bzero((void *)&ctxt, sizeof(bootimgParsingContext_t));
 
   ctxt.pageSize = BOOTIMG_DEFAULT_PAGESIZE;
   ctxt.baseAddr = BOOTIMG_DEFAULT_BASEADDR;
 
-  xmlReader = xmlReaderForFile(filename, NULL, 0);
-  if (xmlReader == (xmlTextReaderPtr)NULL)
-    fprintf(stderr, "%s: error: cannot create xml reader for '%s'!\n", progname, filename);
+  xmlTextReaderSetErrorHandler(xmlReader, readerErrorFunc, (void *)&ctxt);
 
-  else
-    {
-      int rc, pc;
+  /* init header struct */
+  hdr = initBootImgHeader(&ctxt.hdr);
 
-      xmlTextReaderSetErrorHandler(xmlReader, readerErrorFunc, (void *)&ctxt);
+  /* Parse document */
+  do
+    {
+      rc = xmlTextReaderRead(xmlReader);
+      if (rc == 1)
+        pc = createBootImageProcessXmlNode(&ctxt, xmlReader);
+    }
+  while (rc == 1 && pc == 1);
 
-      /* init header struct */
-      hdr = initBootImgHeader(&ctxt.hdr);
-      
-      /* Parse document */
-      do
-        {
-          rc = xmlTextReaderRead(xmlReader);
-          if (rc == 1)
-            pc = createBootImageProcessXmlNode(&ctxt, xmlReader);
-        }
-      while (rc == 1 && pc == 1);
+  /* An error was detected by parser */
+  if (rc < 0)
+    fprintf(stderr,
+            "%s: error: Parsing Failed! Malformed XML file at %d:%d!\n",
+            progname,
+            xmlTextReaderGetParserColumnNumber(xmlReader),
+            xmlTextReaderGetParserLineNumber(xmlReader));
 
-      /* An error was detected by parser */
-      if (rc < 0)
-        fprintf(stderr,
-                "%s: error: Parsing Failed! Malformed XML file at %d:%d!\n",
-                progname,
-                xmlTextReaderGetParserColumnNumber(xmlReader),
-                xmlTextReaderGetParserLineNumber(xmlReader));
+  /* An inconsistency in values was detected */
+  if (pc < 0)
+    fprintf(stderr,
+            "%s: error: Parsing Failed! Inconsistent XML metadata at %d:%d!\n",
+            progname,
+            xmlTextReaderGetParserColumnNumber(xmlReader),
+            xmlTextReaderGetParserLineNumber(xmlReader));
 
-      /* An inconsistency in values was detected */
-      if (pc < 0)
-        fprintf(stderr,
-                "%s: error: Parsing Failed! Inconsistent XML metadata at %d:%d!\n",
-                progname,
-                xmlTextReaderGetParserColumnNumber(xmlReader),
-                xmlTextReaderGetParserLineNumber(xmlReader));
-      
-      /* Cleanup xml parser */
-      xmlDoc = xmlTextReaderCurrentDoc(xmlReader);
-      if (xmlDoc != (xmlDocPtr)NULL)
-        xmlFreeDoc(xmlDoc);
+  /* Cleanup xml parser */
+  xmlDoc = xmlTextReaderCurrentDoc(xmlReader);
+  if (xmlDoc != (xmlDocPtr)NULL)
+    xmlFreeDoc(xmlDoc);
 
-      xmlFreeTextReader(xmlReader);
+  xmlFreeTextReader(xmlReader);
 
-      /* xml file was successfully parsed: create image */
-      if (rc == 0 && pc == 1)
-        {
-          if (writeImage(&ctxt) < 0)
-            fprintf(stderr,
-                    "%s: error: couldn't write image file at '%s'\n",
-                    progname,
-                    ctxt.bootImageFile);
-          else if (vflag)
-            fprintf(stdout,
-                    "%s: image '%s' written!\n",
-                    progname,
-                    ctxt.bootImageFile);
-        }
+  /* xml file was successfully parsed: create image */
+  if (rc == 0 && pc == 1)
+    ret = processParsingContext(&ctxt, filename);
 
-      releaseContextContent(&ctxt);
-    }
+  releaseContextContent(&ctxt);
+  return ret;
 }
 #endif /* !USE_LIBXML2 */
 
@@ -1483,6 +1911,24 @@ processJsonDoc(cJSON *jsonDoc, bootimgParsingContext_t *ctxt)
         }
       while (0);
 
+      /* read ramdiskGzip, only there after a bootimg-extract -F */
+      do
+        {
+          if (!cJSON_GetObjectItem(jsonDoc, "ramdiskGzip"))
+            break;
+          ProcessJsonObjectItem4String(ramdiskGzip);
+        }
+      while (0);
+
+      /* read ramdiskTuning, only there after a bootimg-create --optimize */
+      do
+        {
+          if (!cJSON_GetObjectItem(jsonDoc, "ramdiskTuning"))
+            break;
+          ProcessJsonObjectItem4String(ramdiskTuning);
+        }
+      while (0);
+
       rc = 0;
     }
   while (0);
@@ -1522,7 +1968,7 @@ createBootImageFromJsonMetadata(const char *filename, const char *outdir)
           json_sz = ftell(jfp);
 
           /* Alloc mem for storing json data */
-          buf = (char *)malloc(json_sz * sizeof(char));
+          buf = (char *)malloc((json_sz +1) * sizeof(char));
           if (buf == (char *)NULL)
             {
               /* Failed! cleanup */
@@ -1549,79 +1995,184 @@ createBootImageFromJsonMetadata(const char *filename, const char *outdir)
 
               else
                 {
-                  cJSON *jsonBootImageFile = (cJSON *)NULL;
-                  FILE *imgfp = (FILE *)NULL;
-                  bootimgParsingContext_t ctxt;
-                  boot_img_hdr *hdr = (boot_img_hdr *)NULL;
-
-                  /* zero parsing context */
-                  bzero((void *)&ctxt, sizeof(bootimgParsingContext_t));
-
-                  /* init some fields */
-                  ctxt.pageSize = BOOTIMG_DEFAULT_PAGESIZE;
-                  ctxt.baseAddr = BOOTIMG_DEFAULT_BASEADDR;
- 
-                  /* init header struct */
-                  hdr = initBootImgHeader(&ctxt.hdr);
-
                   /* Cleanup some resources we don't need anymore */
                   fclose(jfp);
 
-                  /* Ok. Parse json data in a json doc for usage. */
-                  cJSON *jsonDoc = cJSON_Parse(buf);
-                  if (!jsonDoc)
-                    fprintf(stderr,
-                            "%s: error: couldn't parse json document '%s'\n",
-                            progname,
-                            pathname);
-
-                  else
-                    do
-                      {
-                        if (processJsonDoc(jsonDoc, &ctxt))
-                          {
-                            fprintf(stderr,
-                                    "%s: error: couldn't read data from json document '%s'\n",
-                                    progname,
-                                    pathname);
-                            cJSON_Delete(jsonDoc);
-                            break;
-                          }
-
-                        /* Delete json doc */
-                        cJSON_Delete(jsonDoc);
-                      
-                        /* then write image file from ctxt */
-                        if (writeImage(&ctxt) < 0)
-                          fprintf(stderr,
-                                  "%s: error: couldn't write image file at '%s'\n",
-                                  progname,
-                                  ctxt.bootImageFile);
-                        else if (vflag)
-                          fprintf(stdout,
-                                  "%s: image '%s' written!\n",
-                                  progname,
-                                  ctxt.bootImageFile);
-                      }
-                    while (0);
+                  buf[json_sz] = '\0';
+                  (void)createBootImageFromJsonData(buf, pathname);
 
                   /* Release json data buffer memory */
                   free((void *)buf);
-
-                  /*
-                   * cleanup
-                   */
-                  releaseContextContent(&ctxt);
-                  
-                  if (imgfp)
-                    fclose(imgfp);
-                  imgfp = (FILE *)NULL;
                 }
             }
         }
     }
 }
 
+/*
+ * createBootImageFromJsonData: parse a NUL terminated json document
+ * & create the image
+ */
+int
+createBootImageFromJsonData(const char *buf, const char *pathname)
+{
+  bootimgParsingContext_t ctxt;
+  int rc = -1;
+
+  /* zero parsing context */
+  bzero((void *)&ctxt, sizeof(bootimgParsingContext_t));
+
+  /* init some fields */
+  ctxt.pageSize = BOOTIMG_DEFAULT_PAGESIZE;
+  ctxt.baseAddr = BOOTIMG_DEFAULT_BASEADDR;
+
+  /* init header struct */
+  (void)initBootImgHeader(&ctxt.hdr);
+
+  /* Ok. Parse json data in a json doc for usage. */
+  cJSON *jsonDoc = cJSON_Parse(buf);
+  if (!jsonDoc)
+    fprintf(stderr,
+            "%s: error: couldn't parse json document '%s'\n",
+            progname,
+            pathname);
+
+  else
+    do
+      {
+        if (processJsonDoc(jsonDoc, &ctxt))
+          {
+            fprintf(stderr,
+                    "%s: error: couldn't read data from json document '%s'\n",
+                    progname,
+                    pathname);
+            cJSON_Delete(jsonDoc);
+            break;
+          }
+
+        /* Delete json doc */
+        cJSON_Delete(jsonDoc);
+
+        /* then write image file from ctxt */
+        rc = processParsingContext(&ctxt, pathname);
+      }
+    while (0);
+
+  releaseContextContent(&ctxt);
+  return rc;
+}
+
+/*
+ * createBootImageFromTarStream: read the whole tar stream, then create
+ * the image from the first metadata file found in it. Components are
+ * looked up in the stream by loadComponent.
+ */
+int
+createBootImageFromTarStream(int fd)
+{
+  int rc = -1, ret;
+  char name[TAR_MAX_NAME +1];
+  uint64_t size;
+  tarMember_p meta = (tarMember_p)NULL;
+  size_t alloc = 0;
+
+  while ((ret = tarReadHeader(fd, name, sizeof(name), &size)) == 1)
+    {
+      tarMember_p member;
+
+      if (size > UINT32_MAX)
+        {
+          fprintf(stderr, "%s: error: tar member '%s' is too big for a boot image!\n", progname, name);
+          ret = -1;
+          break;
+        }
+
+      if (tarMemberCount == alloc)
+        {
+          tarMember_p newmembers;
+
+          alloc = alloc ? alloc * 2 : 8;
+          if (!(newmembers = (tarMember_p)realloc(tarMembers, alloc * sizeof(tarMember_t))))
+            {
+              fprintf(stderr, "%s: error: cannot allocate tar members!\n", progname);
+              ret = -1;
+              break;
+            }
+          tarMembers = newmembers;
+        }
+
+      member = &tarMembers[tarMemberCount];
+      /* one more byte: metadata are parsed as C strings */
+      member->name = strdup(name);
+      member->data = malloc(size +1);
+      member->size = size;
+      statsCount(BOOTIMG_STATS_CURRENT, BOOTIMG_STATS_ALLOCS, 1);
+      if (!member->name || !member->data)
+        {
+          fprintf(stderr, "%s: error: cannot allocate %lu bytes for '%s'!\n", progname, size, name);
+          free((void *)member->name);
+          free(member->data);
+          ret = -1;
+          break;
+        }
+      tarMemberCount++;
+      if (tarReadData(fd, member->data, size) < 0)
+        {
+          ret = -1;
+          break;
+        }
+      ((char *)member->data)[size] = '\0';
+
+      BOOTIMG_LOG(BOOTIMG_LOG_IMAGE, BOOTIMG_LOG_INFO, "%lu bytes read for '%s'", size, name);
+    }
+
+  /* the first metadata file found wins */
+  metadataPhaseBegin();
+  for (size_t n = 0; ret == 0 && !meta && n < tarMemberCount; n++)
+    {
+      const char *ext = rindex(tarMembers[n].name, '.');
+
+      if (ext && (!strcmp(ext, ".xml") || !strcmp(ext, ".json") || !strcmp(ext, ".bmeta")))
+        meta = &tarMembers[n];
+    }
+
+  if (ret < 0)
+    fprintf(stderr, "%s: error: cannot read the tar stream!\n", progname);
+
+  else if (!meta)
+    fprintf(stderr, "%s: error: no metadata file in the tar stream!\n", progname);
+
+#ifdef USE_LIBXML2
+  else if (!strcmp(rindex(meta->name, '.'), ".xml"))
+    {
+      xmlTextReaderPtr xmlReader = xmlReaderForMemory(meta->data, meta->size, meta->name, NULL, 0);
+
+      if (xmlReader == (xmlTextReaderPtr)NULL)
+        fprintf(stderr, "%s: error: cannot create xml reader for '%s'!\n", progname, meta->name);
+      else
+        rc = createBootImageFromXmlReader(xmlReader, meta->name);
+    }
+#endif
+
+  else if (!strcmp(rindex(meta->name, '.'), ".json"))
+    rc = createBootImageFromJsonData(meta->data, meta->name);
+
+  else if (!strcmp(rindex(meta->name, '.'), ".bmeta"))
+    rc = createBootImageFromBinaryData(meta->data, meta->size, meta->name);
+  metadataPhaseEnd();
+
+  for (size_t n = 0; n < tarMemberCount; n++)
+    {
+      free((void *)tarMembers[n].name);
+      free(tarMembers[n].data);
+    }
+  free((void *)tarMembers);
+  tarMembers = (tarMember_p)NULL;
+  tarMemberCount = 0;
+
+  return rc;
+}
+
 /* Local Variables:                                                */
 /* mode: C                                                         */
 /* comment-column: 0                                               */
@@ -0,0 +1,1426 @@
+/* bootimg-tools/bootimg-daemon.c
+ *
+ * Copyright 2007, The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#ifdef STDC_HEADERS
+# include <stdlib.h>
+# include <stddef.h>
+#else
+# ifdef HAVE_STDLIB_H
+#  include <stdlib.h>
+# endif
+# ifdef HAVE_STDDEF_H
+#  include <stddef.h>
+# endif
+#endif
+#ifdef HAVE_STRING_H
+# include <string.h>
+#endif
+#ifdef HAVE_STRINGS_H
+# include <strings.h>
+#endif
+#ifdef HAVE_FCNTL_H
+# include <fcntl.h>
+#endif
+#ifdef HAVE_SYS_TYPES_H
+# include <sys/types.h>
+#endif
+#ifdef HAVE_SYS_STAT_H
+# include <sys/stat.h>
+#endif
+#ifdef HAVE_UNISTD_H
+# include <unistd.h>
+#endif
+#include <getopt.h>
+#ifdef HAVE_ALLOCA_H
+# include <alloca.h>
+#endif
+#ifdef HAVE_ASSERT_H
+# include <assert.h>
+#endif
+#include <errno.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+
+#ifdef USE_OPENSSL
+# ifndef OPENSSL_NO_SHA256
+#  include <openssl/sha.h>
+#  include <openssl/err.h>
+# else
+#  error No SHA256 available in this openssl ! It is mandatory ...
+# endif
+#endif
+
+#include "bootimg.h"
+#include "bootimg-priv.h"
+#include "bootimg-utils.h"
+#include "bootimg-io.h"
+#include "bootimg-jsonw.h"
+#include "bootimg-daemon.h"
+#include "bootimg-log.h"
+#include "cJSON.h"
+
+/*
+ * Options flags & values
+ * - v: verbose. vflag € N+*
+ * - s: socket path. sflag € [0, 1]
+ * - j: worker threads. jflag € [0, 1]
+ * - c: image cache entries. cflag € [0, 1]
+ */
+int vflag = 0;
+int sflag = 0;
+int jflag = 0;
+int cflag = 0;
+
+/* sval: socket path */
+char *sval = (char *)BOOTIMG_DAEMON_DEFAULT_SOCKET;
+/* jval: worker threads */
+int jval = 0;
+/* cval: image cache entries */
+int cval = BOOTIMG_DAEMON_DEFAULT_CACHE;
+
+/*
+ * progname & blankname are program name and space string with progname size
+ * for displaying messsages and help
+ */
+char *progname = (char *)NULL;
+char *blankname = (char *)NULL;
+
+static const char *progusage =
+  "usage: %s [options]\n"
+  "       %s --help\n";
+static const char *proghelp =
+  "\n"
+  "       basic user options:\n"
+  "       %s -h --help                     display this message.\n"
+  "       %s -v --verbose[=<lvl>]          be verbose at runtime. <lvl> is\n"
+  "       %s                               added to current verbosity level.\n"
+  "\n"
+  "       options for the server:\n"
+  "       %s -s --socket=<path>            Unix socket to listen on\n"
+  "       %s                               (default /tmp/bootimg-daemon.sock).\n"
+  "       %s -j --jobs=<n>                 requests served in parallel\n"
+  "       %s                               (default: number of cpus).\n"
+  "       %s -c --cache=<n>                images kept in memory between\n"
+  "       %s                               requests (default 16).\n"
+  "\n"
+  "       %s Requests are JSON lines followed by raw component blobs:\n"
+  "       %s ping, inspect, extract & create. See bootimg-daemon.h.\n";
+
+/*
+ * Long options
+ */
+struct option long_options[] = {
+  {"verbose", optional_argument, 0,  'v' },
+  {"socket",  required_argument, 0,  's' },
+  {"jobs",    required_argument, 0,  'j' },
+  {"cache",   required_argument, 0,  'c' },
+  {"help",    no_argument,       0,  'h' },
+  {0,         0,                 0,   0  }
+};
+#define BOOTIMG_OPTSTRING "v::s:j:c:h"
+const char *unknown_option = "????";
+
+/*
+ * Getopt external defs
+ */
+extern char *optarg;
+extern int optind;
+
+static const char *component_names[BOOTIMG_COMPONENT_COUNT] = {
+  "kernel", "ramdisk", "second", "dtb"
+};
+
+/*
+ * An image, read from a file or received inline
+ */
+typedef struct _bootimgDaemonImage_st
+{
+  char *path;                           /* NULL if received inline */
+  dev_t dev;
+  ino_t ino;
+  off_t size;
+  struct timespec mtime;
+  uint8_t *map;
+  size_t len;
+  boot_img_hdr hdr;
+  off_t offset;
+  uint8_t digest[BOOTIMG_COMPONENT_COUNT][BOOTIMG_DIGEST_SIZE];
+  int refs;
+  int cached;
+  uint64_t used;
+} bootimgDaemonImage_t, *bootimgDaemonImage_p;
+
+typedef struct _bootimgDaemonBlob_st
+{
+  char name[BOOT_NAME_SIZE];
+  uint8_t *data;
+  size_t size;
+  int owned;
+} bootimgDaemonBlob_t, *bootimgDaemonBlob_p;
+
+typedef struct _bootimgDaemonRequest_st
+{
+  cJSON *json;
+  bootimgDaemonBlob_t blobs[BOOTIMG_DAEMON_MAX_BLOBS];          /* received */
+  int nblobs;
+  bootimgDaemonBlob_t replies[BOOTIMG_DAEMON_MAX_BLOBS];        /* sent back */
+  int nreplies;
+  bootimgDaemonImage_p image;
+  const char *error;
+} bootimgDaemonRequest_t, *bootimgDaemonRequest_p;
+
+typedef struct _bootimgDaemonConn_st
+{
+  int fd;
+  size_t pos;
+  size_t len;
+  uint8_t buf[BOOTIMG_DAEMON_BUF_SIZE];
+} bootimgDaemonConn_t, *bootimgDaemonConn_p;
+
+/*
+ * Image cache & queue of readable connections
+ */
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static bootimgDaemonImage_p *cache = (bootimgDaemonImage_p *)NULL;
+static uint64_t cache_tick = 0;
+
+static pthread_mutex_t queue_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t queue_cond = PTHREAD_COND_INITIALIZER;
+static bootimgDaemonConn_p queue[BOOTIMG_DAEMON_QUEUE_SIZE];
+static int queue_count = 0;
+static int active[BOOTIMG_DAEMON_MAX_THREADS];
+static int poll_fd = -1;
+
+static volatile sig_atomic_t running = 1;
+
+/*
+ * Forward decls
+ */
+void  printusage         (int);
+int   serveSocket        (const char *);
+
+static void
+stopHandler(int sig)
+{
+  (void)sig;
+  running = 0;
+}
+
+/*
+ * main
+ */
+int
+main(int argc, char **argv)
+{
+  int c;
+
+  progname = (rindex(argv[0], '/') ? rindex(argv[0], '/')+1 : argv[0]);
+  blankname = (char *)alloca(strlen(progname) +1);
+  memset((void *)blankname, (int)' ', (size_t)strlen(progname));
+  blankname[strlen(progname)] = 0;
+  logInit();
+
+  /* once for all requests */
+#ifdef USE_OPENSSL
+  ERR_load_crypto_strings();
+#endif
+
+  /*
+   * Process options
+   */
+  while (1)
+    {
+      int option_index = 0;
+
+      c = getopt_long(argc, argv, BOOTIMG_OPTSTRING,
+                      long_options, &option_index);
+      if (c == -1)
+        break;
+
+      switch (c)
+        {
+        case 'v':
+          if (optarg)
+            vflag += strtol(optarg, NULL, 10);
+          else
+            vflag++;
+          if (vflag > 3)
+            fprintf(stderr, "%s: option %s/%c set to %d\n",
+                    progname, getLongOptionName(long_options, c), c, vflag);
+          break;
+
+        case 's':
+          sflag = 1;
+          sval = optarg;
+          if (vflag > 3)
+            fprintf(stderr, "%s: option %s/%c (=%d) set with value '%s'\n",
+                    progname, getLongOptionName(long_options, c), c, sflag, sval);
+          break;
+
+        case 'j':
+          jflag = 1;
+          jval = strtol(optarg, NULL, 10);
+          if (jval < 1 || jval > BOOTIMG_DAEMON_MAX_THREADS)
+            {
+              fprintf(stderr, "%s: error: jobs must be in [1, %d]!\n", progname, BOOTIMG_DAEMON_MAX_THREADS);
+              exit(1);
+            }
+          if (vflag > 3)
+            fprintf(stderr, "%s: option %s/%c (=%d) set with value '%d'\n",
+                    progname, getLongOptionName(long_options, c), c, jflag, jval);
+          break;
+
+        case 'c':
+          cflag = 1;
+          cval = strtol(optarg, NULL, 10);
+          if (cval < 0)
+            {
+              fprintf(stderr, "%s: error: bad cache size '%s'!\n", progname, optarg);
+              exit(1);
+            }
+          if (vflag > 3)
+            fprintf(stderr, "%s: option %s/%c (=%d) set with value '%d'\n",
+                    progname, getLongOptionName(long_options, c), c, cflag, cval);
+          break;
+
+        case 'h':
+          printusage(1);
+          exit(1);
+
+        case '?':
+          printusage(0);
+          break;
+
+        default:
+          fprintf(stderr, "%s: getopt returned character code 0%o ??\n", progname, c);
+          printusage(0);
+        }
+    }
+
+  if (optind < argc)
+    {
+      fprintf(stderr, "%s: error: no argument expected !\n", progname);
+      printusage(0);
+      exit(1);
+    }
+
+  return(serveSocket(sval) < 0 ? 1 : 0);
+}
+
+/*
+ * Print usage message
+ */
+void
+printusage(int withhelp)
+{
+  char line[256];
+  char *tok = (char *)NULL;
+  char twolines = 2;
+  char *str;
+
+  if (withhelp)
+    {
+      str = (char *)malloc(strlen(progusage) +strlen(proghelp) +1);
+      assert(str);
+      memcpy(str, progusage, strlen(progusage));
+      memcpy(str +strlen(progusage), proghelp, strlen(proghelp) +1);
+    }
+  else
+    {
+      str = (char *)malloc(strlen(progusage) +1);
+      assert(str);
+      memcpy(str, progusage, strlen(progusage) +1);
+    }
+
+  while ((tok = strtok((char *)str, "\n")) != (char *)NULL)
+    {
+      if (twolines)
+        {
+          sprintf(line, tok, progname);
+          twolines--;
+        }
+      else
+        sprintf(line, tok, blankname);
+
+      str = (char *)NULL;
+      fprintf(stdout, "%s\n", line);
+    }
+
+  free((void *)str);
+}
+
+/*
+ * Images
+ */
+static void
+freeImage(bootimgDaemonImage_p img)
+{
+  free((void *)img->map);
+  free((void *)img->path);
+  free((void *)img);
+}
+
+/*
+ * Locate & check the header, digest the components
+ */
+static int
+setupImage(bootimgDaemonImage_p img, const char **error)
+{
+  size_t window = BOOTIMG_MIN(img->len, BOOT_MAGIC_SEEK_LIMIT + BOOT_MAGIC_SIZE);
+  uint8_t *magic = (uint8_t *)memmem(img->map, window, BOOT_MAGIC, BOOT_MAGIC_SIZE);
+
+  if (!magic || img->len - (magic - img->map) < sizeof(boot_img_hdr))
+    {
+      *error = "boot magic not found";
+      return -1;
+    }
+  img->offset = magic - img->map;
+  memcpy((void *)&img->hdr, (const void *)magic, sizeof(boot_img_hdr));
+
+  if ((*error = checkBootImgHeader(&img->hdr, img->offset, img->len)))
+    return -1;
+
+  for (int nc = 0; nc < BOOTIMG_COMPONENT_COUNT; nc++)
+    {
+      uint32_t sizes[BOOTIMG_COMPONENT_COUNT] = {
+        img->hdr.kernel_size, img->hdr.ramdisk_size, img->hdr.second_size, img->hdr.dt_size
+      };
+
+      SHA256(img->map + img->offset + computeComponentOffset(&img->hdr, nc), sizes[nc], img->digest[nc]);
+    }
+
+  return 0;
+}
+
+/*
+ * Read an image file into a private buffer: a mapping of a file that
+ * another process truncates would SIGBUS the whole daemon
+ */
+static bootimgDaemonImage_p
+readImage(const char *path, struct stat *st, const char **error)
+{
+  bootimgDaemonImage_p img = (bootimgDaemonImage_p)calloc(1, sizeof(bootimgDaemonImage_t));
+  size_t done = 0;
+  int fd;
+
+  if (!img || !(img->path = strdup(path)))
+    {
+      free((void *)img);
+      *error = "out of memory";
+      return (bootimgDaemonImage_p)NULL;
+    }
+  img->dev = st->st_dev;
+  img->ino = st->st_ino;
+  img->size = st->st_size;
+  img->mtime = st->st_mtim;
+  img->len = st->st_size;
+
+  if (!img->len || !(img->map = (uint8_t *)malloc(img->len)))
+    {
+      *error = img->len ? "out of memory" : "empty image";
+      freeImage(img);
+      return (bootimgDaemonImage_p)NULL;
+    }
+  if ((fd = open(path, O_RDONLY)) >= 0)
+    {
+      while (done < img->len)
+        {
+          ssize_t got = pread(fd, img->map + done, img->len - done, done);
+
+          if (got < 0 && errno == EINTR)
+            continue;
+          if (got <= 0)
+            break;
+          done += got;
+        }
+      close(fd);
+    }
+  if (done < img->len)
+    {
+      freeImage(img);
+      *error = "cannot read image";
+      return (bootimgDaemonImage_p)NULL;
+    }
+  if (setupImage(img, error) < 0)
+    {
+      freeImage(img);
+      return (bootimgDaemonImage_p)NULL;
+    }
+
+  return img;
+}
+
+/*
+ * Get an image by path, from the cache when the file did not change
+ */
+static bootimgDaemonImage_p
+acquireImage(const char *path, const char **error)
+{
+  bootimgDaemonImage_p img = (bootimgDaemonImage_p)NULL;
+  struct stat st;
+  int slot = -1;
+
+  if (stat(path, &st) < 0 || !S_ISREG(st.st_mode))
+    {
+      *error = "cannot stat image";
+      return (bootimgDaemonImage_p)NULL;
+    }
+
+  pthread_mutex_lock(&cache_lock);
+  for (int ni = 0; ni < cval; ni++)
+    {
+      bootimgDaemonImage_p cached = cache[ni];
+
+      if (!cached || strcmp(cached->path, path))
+        continue;
+      if (cached->dev == st.st_dev && cached->ino == st.st_ino && cached->size == st.st_size &&
+          cached->mtime.tv_sec == st.st_mtim.tv_sec && cached->mtime.tv_nsec == st.st_mtim.tv_nsec)
+        {
+          cached->refs++;
+          cached->used = ++cache_tick;
+          img = cached;
+          break;
+        }
+      /* stale: dropped now, freed by its last user */
+      cache[ni] = (bootimgDaemonImage_p)NULL;
+      cached->cached = 0;
+      if (!cached->refs)
+        freeImage(cached);
+    }
+  pthread_mutex_unlock(&cache_lock);
+
+  if (img)
+    {
+      if (vflag > 1)
+        fprintf(stderr, "%s: cache hit for '%s'\n", progname, path);
+      return img;
+    }
+
+  if (!(img = readImage(path, &st, error)))
+    return (bootimgDaemonImage_p)NULL;
+  img->refs = 1;
+
+  /* free slot, or least recently used one not in use */
+  pthread_mutex_lock(&cache_lock);
+  for (int ni = 0; ni < cval; ni++)
+    {
+      if (!cache[ni])
+        {
+          slot = ni;
+          break;
+        }
+      if (!cache[ni]->refs && (slot < 0 || cache[ni]->used < cache[slot]->used))
+        slot = ni;
+    }
+  if (slot >= 0)
+    {
+      if (cache[slot])
+        freeImage(cache[slot]);
+      cache[slot] = img;
+      img->cached = 1;
+      img->used = ++cache_tick;
+    }
+  pthread_mutex_unlock(&cache_lock);
+
+  return img;
+}
+
+static void
+releaseImage(bootimgDaemonImage_p img)
+{
+  if (!img)
+    return;
+  if (!img->path)
+    {
+      freeImage(img);
+      return;
+    }
+
+  pthread_mutex_lock(&cache_lock);
+  if (!--img->refs && !img->cached)
+    freeImage(img);
+  pthread_mutex_unlock(&cache_lock);
+}
+
+/*
+ * Socket I/O
+ */
+static int
+sendAll(int fd, const void *buf, size_t len)
+{
+  while (len)
+    {
+      ssize_t wrsz = write(fd, buf, len);
+      if (wrsz < 0)
+        {
+          if (errno == EINTR)
+            continue;
+          return -1;
+        }
+      buf = (const uint8_t *)buf + wrsz;
+      len -= wrsz;
+    }
+
+  return 0;
+}
+
+static int
+fillConn(bootimgDaemonConn_p conn)
+{
+  ssize_t rdsz;
+
+  do
+    rdsz = read(conn->fd, conn->buf, sizeof(conn->buf));
+  while (rdsz < 0 && errno == EINTR);
+  if (rdsz <= 0)
+    return -1;
+  conn->pos = 0;
+  conn->len = rdsz;
+
+  return 0;
+}
+
+/*
+ * Read a request line, without its '\n'. NULL at end of connection.
+ */
+static char *
+readLine(bootimgDaemonConn_p conn)
+{
+  char *line = (char *)NULL;
+  size_t len = 0;
+
+  while (1)
+    {
+      uint8_t *eol;
+      size_t chunk;
+      char *newline;
+
+      if (conn->pos == conn->len && fillConn(conn) < 0)
+        break;
+      eol = (uint8_t *)memchr(conn->buf + conn->pos, '\n', conn->len - conn->pos);
+      chunk = (eol ? (size_t)(eol - conn->buf) : conn->len) - conn->pos;
+      if (len + chunk > BOOTIMG_DAEMON_MAX_REQUEST ||
+          !(newline = (char *)realloc(line, len + chunk +1)))
+        break;
+      line = newline;
+      memcpy((void *)(line + len), (const void *)(conn->buf + conn->pos), chunk);
+      len += chunk;
+      line[len] = 0;
+      conn->pos += chunk;
+      if (eol)
+        {
+          conn->pos++;
+          return line;
+        }
+    }
+
+  free((void *)line);
+  return (char *)NULL;
+}
+
+static int
+readBytes(bootimgDaemonConn_p conn, uint8_t *dst, size_t len)
+{
+  while (len)
+    {
+      size_t chunk;
+
+      if (conn->pos == conn->len && fillConn(conn) < 0)
+        return -1;
+      chunk = BOOTIMG_MIN(len, conn->len - conn->pos);
+      memcpy((void *)dst, (const void *)(conn->buf + conn->pos), chunk);
+      conn->pos += chunk;
+      dst += chunk;
+      len -= chunk;
+    }
+
+  return 0;
+}
+
+/*
+ * Request helpers
+ */
+static bootimgDaemonBlob_p
+findBlob(bootimgDaemonRequest_p req, const char *name)
+{
+  for (int nb = 0; nb < req->nblobs; nb++)
+    if (!strcmp(req->blobs[nb].name, name))
+      return &req->blobs[nb];
+
+  return (bootimgDaemonBlob_p)NULL;
+}
+
+static const char *
+getString(cJSON *json, const char *key)
+{
+  cJSON *item = cJSON_GetObjectItem(json, key);
+
+  return (item && item->type == cJSON_String ? item->valuestring : (const char *)NULL);
+}
+
+/*
+ * Numbers may also be given as strings ("0x10000000"). -1 when the
+ * member is not an integer in [0, UINT32_MAX].
+ */
+static int
+getNumber(cJSON *json, const char *key, uint32_t defval, uint32_t *value)
+{
+  cJSON *item = cJSON_GetObjectItem(json, key);
+
+  *value = defval;
+  if (!item)
+    return 0;
+  if (item->type == cJSON_Number)
+    {
+      /* also false for NaN */
+      if (!(item->valuedouble >= 0 && item->valuedouble <= UINT32_MAX) ||
+          (double)(uint32_t)item->valuedouble != item->valuedouble)
+        return -1;
+      *value = (uint32_t)item->valuedouble;
+      return 0;
+    }
+  if (item->type == cJSON_String)
+    {
+      const char *str = item->valuestring;
+      unsigned long long number;
+      char *end;
+
+      /* strtoull would negate "-1" */
+      errno = 0;
+      number = strtoull(str, &end, 0);
+      if (errno || end == str || *end || strchr(str, '-') || number > UINT32_MAX)
+        return -1;
+      *value = (uint32_t)number;
+      return 0;
+    }
+
+  return -1;
+}
+
+static int
+addReply(bootimgDaemonRequest_p req, const char *name, uint8_t *data, size_t size, int owned)
+{
+  bootimgDaemonBlob_p blob;
+
+  if (req->nreplies == BOOTIMG_DAEMON_MAX_BLOBS)
+    return -1;
+  blob = &req->replies[req->nreplies++];
+  snprintf(blob->name, sizeof(blob->name), "%s", name);
+  blob->data = data;
+  blob->size = size;
+  blob->owned = owned;
+
+  return 0;
+}
+
+/*
+ * The image of an inspect or extract request: path or "image" blob
+ */
+static int
+requestImage(bootimgDaemonRequest_p req)
+{
+  const char *path = getString(req->json, "image");
+  bootimgDaemonBlob_p blob = findBlob(req, "image");
+
+  if (path)
+    req->image = acquireImage(path, &req->error);
+  else if (blob)
+    {
+      bootimgDaemonImage_p img = (bootimgDaemonImage_p)calloc(1, sizeof(bootimgDaemonImage_t));
+
+      if (!img)
+        {
+          req->error = "out of memory";
+          return -1;
+        }
+      /* the image takes the blob buffer */
+      img->map = blob->data;
+      img->len = blob->size;
+      blob->data = (uint8_t *)NULL;
+      blob->owned = 0;
+      if (setupImage(img, &req->error) < 0)
+        freeImage(img);
+      else
+        req->image = img;
+    }
+  else
+    req->error = "no image given";
+
+  return req->image ? 0 : -1;
+}
+
+/*
+ * ping
+ */
+static int
+opPing(bootimgDaemonRequest_p req, bootimgJsonWriter_p w)
+{
+  (void)req;
+  jsonWriterWriteString(w, "status", "ok");
+  jsonWriterWriteString(w, "version", PACKAGE_VERSION);
+
+  return 0;
+}
+
+/*
+ * inspect: header & component digests
+ */
+static int
+opInspect(bootimgDaemonRequest_p req, bootimgJsonWriter_p w)
+{
+  bootimgDaemonImage_p img;
+  boot_img_hdr *hdr;
+  cJSON *verify;
+  char str[BOOT_ARGS_SIZE + BOOT_EXTRA_ARGS_SIZE +1];
+  char hex[2 * BOOTIMG_DIGEST_SIZE +1];
+  off64_t sigoff;
+  int verity = -1;
+
+  if (requestImage(req) < 0)
+    return -1;
+  img = req->image;
+  hdr = &img->hdr;
+  sigoff = img->offset + computeSignatureBlockOffset(hdr);
+
+  verify = cJSON_GetObjectItem(req->json, "verify");
+  if (verify && verify->type == cJSON_True && (uint64_t)sigoff < img->len)
+    {
+      FILE *fp;
+
+      if (!img->path || img->offset != 0)
+        {
+          req->error = "verify needs an image file without prefix";
+          return -1;
+        }
+      if ((fp = fopen(img->path, "rb")) != NULL)
+        {
+          verity = (verityVerify(fp, hdr) == 0);
+          fclose(fp);
+        }
+    }
+
+  jsonWriterWriteString(w, "status", "ok");
+  jsonWriterWriteNumber(w, "magicOffset", img->offset);
+  jsonWriterWriteNumber(w, "size", img->len);
+
+  jsonWriterStartObject(w, "header");
+  jsonWriterWriteFormatString(w, "kernelAddr", "0x%08x", hdr->kernel_addr);
+  jsonWriterWriteFormatString(w, "ramdiskAddr", "0x%08x", hdr->ramdisk_addr);
+  jsonWriterWriteFormatString(w, "secondAddr", "0x%08x", hdr->second_addr);
+  jsonWriterWriteFormatString(w, "tagsAddr", "0x%08x", hdr->tags_addr);
+  jsonWriterWriteNumber(w, (const char *)BOOTIMG_XMLELT_PAGESIZE_NAME, hdr->page_size);
+  jsonWriterWriteFormatString(w, (const char *)BOOTIMG_XMLELT_BOARDOSVERSION_NAME, "%d.%d.%d",
+                              (hdr->os_version >> 25)&0x7f, (hdr->os_version >> 18)&0x7f,
+                              (hdr->os_version >> 11)&0x7f);
+  jsonWriterWriteFormatString(w, (const char *)BOOTIMG_XMLELT_BOARDOSPATCHLVL_NAME, "%d-%02d",
+                              ((hdr->os_version >> 4)&0x7f) + 2000, hdr->os_version&0xf);
+  snprintf(str, sizeof(str), "%.*s", BOOT_NAME_SIZE, hdr->name);
+  jsonWriterWriteString(w, (const char *)BOOTIMG_XMLELT_BOARDNAME_NAME, str);
+  snprintf(str, sizeof(str), "%.*s%.*s", BOOT_ARGS_SIZE, hdr->cmdline,
+           strnlen((const char *)hdr->cmdline, BOOT_ARGS_SIZE) == BOOT_ARGS_SIZE ? BOOT_EXTRA_ARGS_SIZE : 0,
+           hdr->extra_cmdline);
+  jsonWriterWriteString(w, (const char *)BOOTIMG_XMLELT_CMDLINE_NAME, str);
+  hexString((const uint8_t *)hdr->id, sizeof(hdr->id), str);
+  jsonWriterWriteString(w, "id", str);
+  jsonWriterEndObject(w);
+
+  jsonWriterStartObject(w, "components");
+  for (int nc = 0; nc < BOOTIMG_COMPONENT_COUNT; nc++)
+    {
+      uint32_t sizes[BOOTIMG_COMPONENT_COUNT] = {
+        hdr->kernel_size, hdr->ramdisk_size, hdr->second_size, hdr->dt_size
+      };
+
+      jsonWriterStartObject(w, component_names[nc]);
+      jsonWriterWriteNumber(w, "offset", img->offset + computeComponentOffset(hdr, nc));
+      jsonWriterWriteNumber(w, "size", sizes[nc]);
+      hexString(img->digest[nc], BOOTIMG_DIGEST_SIZE, hex);
+      jsonWriterWriteString(w, "digest", hex);
+      jsonWriterEndObject(w);
+    }
+  jsonWriterEndObject(w);
+
+  jsonWriterWriteBool(w, "signature", (uint64_t)sigoff < img->len);
+  if (verity >= 0)
+    jsonWriterWriteString(w, "verity", verity ? "valid" : "invalid");
+
+  return 0;
+}
+
+/*
+ * extract: components sent back as blobs, straight from the mapping
+ */
+static int
+opExtract(bootimgDaemonRequest_p req, bootimgJsonWriter_p w)
+{
+  cJSON *names;
+  int wanted[BOOTIMG_COMPONENT_COUNT] = { 0, };
+  uint32_t sizes[BOOTIMG_COMPONENT_COUNT];
+
+  if (requestImage(req) < 0)
+    return -1;
+  sizes[BOOTIMG_COMPONENT_KERNEL] = req->image->hdr.kernel_size;
+  sizes[BOOTIMG_COMPONENT_RAMDISK] = req->image->hdr.ramdisk_size;
+  sizes[BOOTIMG_COMPONENT_SECOND] = req->image->hdr.second_size;
+  sizes[BOOTIMG_COMPONENT_DTB] = req->image->hdr.dt_size;
+
+  if ((names = cJSON_GetObjectItem(req->json, "components")) != NULL)
+    {
+      for (int ni = 0; ni < cJSON_GetArraySize(names); ni++)
+        {
+          cJSON *name = cJSON_GetArrayItem(names, ni);
+          int nc;
+
+          for (nc = 0; nc < BOOTIMG_COMPONENT_COUNT; nc++)
+            if (name->type == cJSON_String && !strcmp(name->valuestring, component_names[nc]))
+              break;
+          if (nc == BOOTIMG_COMPONENT_COUNT)
+            {
+              req->error = "unknown component";
+              return -1;
+            }
+          wanted[nc] = 1;
+        }
+    }
+  else
+    for (int nc = 0; nc < BOOTIMG_COMPONENT_COUNT; nc++)
+      wanted[nc] = (sizes[nc] != 0);
+
+  for (int nc = 0; nc < BOOTIMG_COMPONENT_COUNT; nc++)
+    if (wanted[nc])
+      addReply(req, component_names[nc],
+               req->image->map + req->image->offset + computeComponentOffset(&req->image->hdr, nc),
+               sizes[nc], 0);
+
+  jsonWriterWriteString(w, "status", "ok");
+
+  return 0;
+}
+
+/*
+ * create: image from header fields & component blobs
+ */
+static int
+opCreate(bootimgDaemonRequest_p req, bootimgJsonWriter_p w)
+{
+  boot_img_hdr hdr;
+  bootimgDaemonBlob_p blobs[BOOTIMG_COMPONENT_COUNT];
+  const void *data[BOOTIMG_COMPONENT_COUNT];
+  const char *str, *output = getString(req->json, "output");
+  uint32_t base, pagesize, koff, roff, soff, toff;
+  uint8_t *image;
+  size_t len;
+  unsigned a = 0, b = 0, c = 0, y = 2000, m = 0;
+  char hex[2 * sizeof(hdr.id) +1];
+
+  initBootImgHeader(&hdr);
+  if (getNumber(req->json, (const char *)BOOTIMG_XMLELT_BASEADDR_NAME, BOOTIMG_DEFAULT_BASEADDR, &base) < 0 ||
+      getNumber(req->json, (const char *)BOOTIMG_XMLELT_PAGESIZE_NAME, BOOTIMG_DEFAULT_PAGESIZE,
+                &pagesize) < 0 ||
+      getNumber(req->json, (const char *)BOOTIMG_XMLELT_KERNELOFFSET_NAME, BOOTIMG_DEFAULT_KERNEL_OFFSET,
+                &koff) < 0 ||
+      getNumber(req->json, (const char *)BOOTIMG_XMLELT_RAMDISKOFFSET_NAME, BOOTIMG_DEFAULT_RAMDISK_OFFSET,
+                &roff) < 0 ||
+      getNumber(req->json, (const char *)BOOTIMG_XMLELT_SECONDOFFSET_NAME, BOOTIMG_DEFAULT_SECOND_OFFSET,
+                &soff) < 0 ||
+      getNumber(req->json, (const char *)BOOTIMG_XMLELT_TAGSOFFSET_NAME, BOOTIMG_DEFAULT_TAGS_OFFSET,
+                &toff) < 0)
+    {
+      req->error = "bad number";
+      return -1;
+    }
+  /* page size range checked as for any image read */
+  hdr.page_size = pagesize;
+  if ((req->error = checkBootImgHeader(&hdr, 0, 0)))
+    return -1;
+  hdr.kernel_addr = base + koff;
+  hdr.ramdisk_addr = base + roff;
+  hdr.second_addr = base + soff;
+  hdr.tags_addr = base + toff;
+
+  if ((str = getString(req->json, (const char *)BOOTIMG_XMLELT_BOARDOSVERSION_NAME)) &&
+      (sscanf(str, "%u.%u.%u", &a, &b, &c) < 1 || a > 127 || b > 127 || c > 127))
+    {
+      req->error = "bad boardOsVersion";
+      return -1;
+    }
+  if ((str = getString(req->json, (const char *)BOOTIMG_XMLELT_BOARDOSPATCHLVL_NAME)) &&
+      (sscanf(str, "%u-%u", &y, &m) != 2 || y < 2000 || y > 2127 || m > 15))
+    {
+      req->error = "bad boardOsPatchLvl";
+      return -1;
+    }
+  hdr.os_version = (((a << 14) | (b << 7) | c) << 11) | (((y - 2000) & 0x7f) << 4) | m;
+
+  if ((str = getString(req->json, (const char *)BOOTIMG_XMLELT_BOARDNAME_NAME)))
+    {
+      strncpy((char *)hdr.name, str, sizeof(hdr.name) -1);
+      hdr.name[sizeof(hdr.name) -1] = 0;
+    }
+  if ((str = getString(req->json, (const char *)BOOTIMG_XMLELT_CMDLINE_NAME)))
+    setCmdline(&hdr, str);
+
+  for (int nc = 0; nc < BOOTIMG_COMPONENT_COUNT; nc++)
+    {
+      blobs[nc] = findBlob(req, component_names[nc]);
+      data[nc] = blobs[nc] ? blobs[nc]->data : NULL;
+    }
+  if (!blobs[BOOTIMG_COMPONENT_KERNEL])
+    {
+      req->error = "no kernel given";
+      return -1;
+    }
+  hdr.kernel_size = blobs[BOOTIMG_COMPONENT_KERNEL]->size;
+  hdr.ramdisk_size = blobs[BOOTIMG_COMPONENT_RAMDISK] ? blobs[BOOTIMG_COMPONENT_RAMDISK]->size : 0;
+  hdr.second_size = blobs[BOOTIMG_COMPONENT_SECOND] ? blobs[BOOTIMG_COMPONENT_SECOND]->size : 0;
+  hdr.dt_size = blobs[BOOTIMG_COMPONENT_DTB] ? blobs[BOOTIMG_COMPONENT_DTB]->size : 0;
+
+  computeImageId(&hdr, data[BOOTIMG_COMPONENT_KERNEL], data[BOOTIMG_COMPONENT_RAMDISK],
+                 data[BOOTIMG_COMPONENT_SECOND], data[BOOTIMG_COMPONENT_DTB],
+                 (unsigned char *)&hdr.id);
+
+  /* zero padded header page & component slots */
+  len = computeSignatureBlockOffset(&hdr);
+  if (!(image = (uint8_t *)calloc(1, len)))
+    {
+      req->error = "out of memory";
+      return -1;
+    }
+  memcpy((void *)image, (const void *)&hdr, sizeof(boot_img_hdr));
+  for (int nc = 0; nc < BOOTIMG_COMPONENT_COUNT; nc++)
+    if (blobs[nc] && blobs[nc]->size)
+      memcpy((void *)(image + computeComponentOffset(&hdr, nc)), (const void *)blobs[nc]->data, blobs[nc]->size);
+
+  if (output)
+    {
+      char *tmpfile = (char *)alloca(strlen(output) + sizeof(".XXXXXX"));
+      int fd;
+
+      sprintf(tmpfile, "%s.XXXXXX", output);
+      if ((fd = mkstemp(tmpfile)) < 0)
+        {
+          free((void *)image);
+          req->error = "cannot create output file";
+          return -1;
+        }
+      if (fchmod(fd, 0644) < 0 || sendAll(fd, image, len) < 0 || close(fd) < 0 ||
+          rename(tmpfile, output) < 0)
+        {
+          unlink(tmpfile);
+          free((void *)image);
+          req->error = "cannot write output file";
+          return -1;
+        }
+      free((void *)image);
+    }
+  else
+    addReply(req, "image", image, len, 1);
+
+  jsonWriterWriteString(w, "status", "ok");
+  jsonWriterWriteNumber(w, "size", len);
+  hexString((const uint8_t *)hdr.id, sizeof(hdr.id), hex);
+  jsonWriterWriteString(w, "id", hex);
+  if (output)
+    jsonWriterWriteString(w, "output", output);
+
+  return 0;
+}
+
+/*
+ * Read the blobs announced by a request
+ */
+static int
+readBlobs(bootimgDaemonConn_p conn, bootimgDaemonRequest_p req)
+{
+  cJSON *blobs = cJSON_GetObjectItem(req->json, "blobs");
+
+  if (!blobs)
+    return 0;
+  if (blobs->type != cJSON_Array || cJSON_GetArraySize(blobs) > BOOTIMG_DAEMON_MAX_BLOBS)
+    {
+      req->error = "bad blob list";
+      return -1;
+    }
+
+  for (int nb = 0; nb < cJSON_GetArraySize(blobs); nb++)
+    {
+      cJSON *item = cJSON_GetArrayItem(blobs, nb);
+      const char *name = getString(item, "name");
+      cJSON *size = cJSON_GetObjectItem(item, "size");
+      bootimgDaemonBlob_p blob = &req->blobs[req->nblobs];
+
+      if (!name || !size || size->type != cJSON_Number ||
+          size->valuedouble < 0 || size->valuedouble > BOOTIMG_DAEMON_MAX_BLOB)
+        {
+          req->error = "bad blob";
+          return -1;
+        }
+      snprintf(blob->name, sizeof(blob->name), "%s", name);
+      blob->size = (size_t)size->valuedouble;
+      if (!(blob->data = (uint8_t *)malloc(blob->size ? blob->size : 1)))
+        {
+          req->error = "out of memory";
+          return -1;
+        }
+      blob->owned = 1;
+      req->nblobs++;
+      if (readBytes(conn, blob->data, blob->size) < 0)
+        {
+          req->error = "truncated blob";
+          return -1;
+        }
+    }
+
+  return 0;
+}
+
+/*
+ * Serve one request of a connection. Returns -1 when the connection
+ * is to be closed.
+ */
+static int
+serveRequest(bootimgDaemonConn_p conn)
+{
+  bootimgDaemonRequest_t req;
+  bootimgJsonWriter_p w;
+  const char *op;
+  char *line;
+  int ret = -1, broken = 0;
+
+  if (!(line = readLine(conn)))
+    return -1;
+
+  bzero((void *)&req, sizeof(bootimgDaemonRequest_t));
+  req.json = cJSON_Parse(line);
+  free((void *)line);
+
+  if (!req.json || req.json->type != cJSON_Object)
+    {
+      req.error = "bad request";
+      broken = 1;
+    }
+  else if (readBlobs(conn, &req) < 0)
+    broken = 1;
+
+  if (!(w = jsonWriterNew(conn->fd, JSON_WRITER_FLAG_COMPACT)))
+    broken = 1;
+  else
+    {
+      jsonWriterStartObject(w, NULL);
+      op = req.json ? getString(req.json, "op") : NULL;
+      if (vflag)
+        fprintf(stdout, "%s: request '%s'\n", progname, op ? op : "?");
+      if (req.error)
+        ;
+      else if (!op)
+        req.error = "no op";
+      else if (!strcmp(op, "ping"))
+        ret = opPing(&req, w);
+      else if (!strcmp(op, "inspect"))
+        ret = opInspect(&req, w);
+      else if (!strcmp(op, "extract"))
+        ret = opExtract(&req, w);
+      else if (!strcmp(op, "create"))
+        ret = opCreate(&req, w);
+      else
+        req.error = "unknown op";
+
+      if (ret < 0)
+        {
+          jsonWriterWriteString(w, "status", "error");
+          jsonWriterWriteString(w, "error", req.error ? req.error : "failed");
+          if (vflag)
+            fprintf(stderr, "%s: error: %s\n", progname, req.error ? req.error : "failed");
+        }
+      jsonWriterStartArray(w, "blobs");
+      for (int nr = 0; nr < req.nreplies; nr++)
+        {
+          jsonWriterStartObject(w, NULL);
+          jsonWriterWriteString(w, "name", req.replies[nr].name);
+          jsonWriterWriteNumber(w, "size", req.replies[nr].size);
+          jsonWriterEndObject(w);
+        }
+      jsonWriterEndArray(w);
+      jsonWriterEndObject(w);
+      if (jsonWriterFree(w) < 0 || sendAll(conn->fd, "\n", 1) < 0)
+        broken = 1;
+      for (int nr = 0; !broken && nr < req.nreplies; nr++)
+        if (sendAll(conn->fd, req.replies[nr].data, req.replies[nr].size) < 0)
+          broken = 1;
+    }
+
+  for (int nr = 0; nr < req.nreplies; nr++)
+    if (req.replies[nr].owned)
+      free((void *)req.replies[nr].data);
+  for (int nb = 0; nb < req.nblobs; nb++)
+    if (req.blobs[nb].owned)
+      free((void *)req.blobs[nb].data);
+  releaseImage(req.image);
+  if (req.json)
+    cJSON_Delete(req.json);
+
+  /* the stream cannot be resynchronized after a bad request */
+  return broken ? -1 : 0;
+}
+
+/*
+ * Workers serve the requests of readable connections, then give them
+ * back to the poller: idle clients do not hold a worker.
+ */
+static void *
+workerThread(void *arg)
+{
+  int slot = (int)(intptr_t)arg;
+
+  while (1)
+    {
+      bootimgDaemonConn_p conn;
+      int keep;
+
+      pthread_mutex_lock(&queue_lock);
+      while (!queue_count)
+        pthread_cond_wait(&queue_cond, &queue_lock);
+      conn = queue[0];
+      memmove((void *)&queue[0], (const void *)&queue[1], --queue_count * sizeof(bootimgDaemonConn_p));
+      active[slot] = conn ? conn->fd : -1;
+      pthread_cond_broadcast(&queue_cond);
+      pthread_mutex_unlock(&queue_lock);
+
+      /* stop */
+      if (!conn)
+        break;
+
+      /* pipelined requests already read are served at once */
+      do
+        keep = (serveRequest(conn) == 0);
+      while (keep && running && conn->pos < conn->len);
+
+      pthread_mutex_lock(&queue_lock);
+      active[slot] = -1;
+      pthread_mutex_unlock(&queue_lock);
+
+      if (keep && running)
+        {
+          struct epoll_event ev;
+
+          ev.events = EPOLLIN | EPOLLRDHUP | EPOLLONESHOT;
+          ev.data.ptr = (void *)conn;
+          if (epoll_ctl(poll_fd, EPOLL_CTL_MOD, conn->fd, &ev) == 0)
+            continue;
+        }
+      epoll_ctl(poll_fd, EPOLL_CTL_DEL, conn->fd, NULL);
+      close(conn->fd);
+      free((void *)conn);
+    }
+
+  ioReleaseDefault();
+  return NULL;
+}
+
+/*
+ * Queue a readable connection (or NULL to stop a worker)
+ */
+static void
+pushConnection(bootimgDaemonConn_p conn)
+{
+  pthread_mutex_lock(&queue_lock);
+  while (queue_count == BOOTIMG_DAEMON_QUEUE_SIZE)
+    pthread_cond_wait(&queue_cond, &queue_lock);
+  queue[queue_count++] = conn;
+  pthread_cond_broadcast(&queue_cond);
+  pthread_mutex_unlock(&queue_lock);
+}
+
+/*
+ * Accept the pending connections of the listening socket
+ */
+static void
+acceptConnections(int sock)
+{
+  while (1)
+    {
+      bootimgDaemonConn_p conn;
+      struct epoll_event ev;
+      struct timeval tv = { BOOTIMG_DAEMON_TIMEOUT, 0 };
+      int fd = accept4(sock, NULL, NULL, SOCK_CLOEXEC);
+
+      if (fd < 0)
+        {
+          if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR && errno != ECONNABORTED)
+            perror(progname);
+          if (errno == EINTR || errno == ECONNABORTED)
+            continue;
+          return;
+        }
+      /* a client stalled within a request is dropped, not waited for */
+      if (setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)) < 0 ||
+          setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv)) < 0 ||
+          !(conn = (bootimgDaemonConn_p)malloc(sizeof(bootimgDaemonConn_t))))
+        {
+          close(fd);
+          continue;
+        }
+      conn->fd = fd;
+      conn->pos = conn->len = 0;
+      ev.events = EPOLLIN | EPOLLRDHUP | EPOLLONESHOT;
+      ev.data.ptr = (void *)conn;
+      if (epoll_ctl(poll_fd, EPOLL_CTL_ADD, fd, &ev) < 0)
+        {
+          close(fd);
+          free((void *)conn);
+        }
+    }
+}
+
+/*
+ * Listen on the socket and dispatch readable connections to the
+ * workers until SIGINT or SIGTERM
+ */
+int
+serveSocket(const char *path)
+{
+  struct sockaddr_un addr;
+  struct sigaction sa;
+  struct epoll_event ev, events[BOOTIMG_DAEMON_MAX_EVENTS];
+  pthread_t threads[BOOTIMG_DAEMON_MAX_THREADS];
+  int nthreads = 0, sock = -1, ret = -1;
+
+  if (strlen(path) >= sizeof(addr.sun_path))
+    {
+      fprintf(stderr, "%s: error: socket path '%s' is too long!\n", progname, path);
+      return -1;
+    }
+
+  /* no SA_RESTART: epoll_wait(2) returns on signals */
+  bzero((void *)&sa, sizeof(sa));
+  sa.sa_handler = stopHandler;
+  sigaction(SIGINT, &sa, NULL);
+  sigaction(SIGTERM, &sa, NULL);
+  signal(SIGPIPE, SIG_IGN);
+
+  do
+    {
+      if (!(cache = (bootimgDaemonImage_p *)calloc(cval +1, sizeof(bootimgDaemonImage_p))))
+        break;
+
+      if ((poll_fd = epoll_create1(EPOLL_CLOEXEC)) < 0 ||
+          (sock = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) < 0)
+        {
+          perror(progname);
+          break;
+        }
+      bzero((void *)&addr, sizeof(addr));
+      addr.sun_family = AF_UNIX;
+      strcpy(addr.sun_path, path);
+      unlink(path);
+      if (bind(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(sock, SOMAXCONN) < 0)
+        {
+          perror(path);
+          fprintf(stderr, "%s: error: cannot listen on '%s'!\n", progname, path);
+          break;
+        }
+      ev.events = EPOLLIN;
+      ev.data.ptr = NULL;
+      if (epoll_ctl(poll_fd, EPOLL_CTL_ADD, sock, &ev) < 0)
+        {
+          perror(progname);
+          break;
+        }
+
+      nthreads = jflag ? jval : (int)sysconf(_SC_NPROCESSORS_ONLN);
+      nthreads = BOOTIMG_MAX(1, BOOTIMG_MIN(nthreads, BOOTIMG_DAEMON_MAX_THREADS));
+      for (int nt = 0; nt < nthreads; nt++)
+        {
+          active[nt] = -1;
+          if (pthread_create(&threads[nt], NULL, workerThread, (void *)(intptr_t)nt))
+            {
+              nthreads = nt;
+              break;
+            }
+        }
+      if (!nthreads)
+        {
+          fprintf(stderr, "%s: error: cannot start workers!\n", progname);
+          break;
+        }
+      if (vflag)
+        fprintf(stdout, "%s: listening on '%s' with %d workers\n", progname, path, nthreads);
+
+      while (running)
+        {
+          int nev = epoll_wait(poll_fd, events, BOOTIMG_DAEMON_MAX_EVENTS, -1);
+
+          if (nev < 0)
+            {
+              if (errno != EINTR)
+                perror(progname);
+              continue;
+            }
+          for (int ne = 0; ne < nev; ne++)
+            if (!events[ne].data.ptr)
+              acceptConnections(sock);
+            else
+              pushConnection((bootimgDaemonConn_p)events[ne].data.ptr);
+        }
+      if (vflag)
+        fprintf(stdout, "%s: stopping\n", progname);
+
+      ret = 0;
+    }
+  while (0);
+
+  if (sock >= 0)
+    {
+      close(sock);
+      unlink(path);
+    }
+
+  /* wake up workers waiting for their clients, then stop them */
+  pthread_mutex_lock(&queue_lock);
+  for (int nt = 0; nt < nthreads; nt++)
+    if (active[nt] >= 0)
+      shutdown(active[nt], SHUT_RDWR);
+  pthread_mutex_unlock(&queue_lock);
+  for (int nt = 0; nt < nthreads; nt++)
+    pushConnection((bootimgDaemonConn_p)NULL);
+  for (int nt = 0; nt < nthreads; nt++)
+    pthread_join(threads[nt], NULL);
+  if (poll_fd >= 0)
+    close(poll_fd);
+
+  if (cache)
+    {
+      for (int ni = 0; ni < cval; ni++)
+        if (cache[ni])
+          freeImage(cache[ni]);
+      free((void *)cache);
+    }
+
+  return ret;
+}
+
+/* Local Variables:                                                */
+/* mode: C                                                         */
+/* comment-column: 0                                               */
+/* End:                                                            */
@@ -0,0 +1,79 @@
+/* bootimg-tools/bootimg-daemon.h
+ *
+ * Copyright 2007, The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef __BOOTIMG_DAEMON_H__
+#define __BOOTIMG_DAEMON_H__
+
+/**==========================================================================
+ ** bootimg-daemon protocol
+ **==========================================================================
+ **
+ *
+ * A client connects to the Unix stream socket and sends any number of
+ * requests, each answered in order on the same connection:
+ *
+ * +------------------------------+
+ * | JSON object on a single line | terminated by '\n'
+ * +------------------------------+
+ * | blob bytes                   | for each entry of "blobs", in order
+ * +------------------------------+
+ *
+ * Responses have the same layout. "blobs" is an array of
+ * { "name": <string>, "size": <number> } announcing the raw bytes that
+ * follow the line, so components never go through the file system nor
+ * through any text encoding.
+ *
+ * Requests ("op" member):
+ * - ping:    { "op": "ping" }
+ * - inspect: { "op": "inspect", "image": <path> [, "verify": true] }
+ *            or with an "image" blob instead of the path. Answers the
+ *            header fields and, for each component, offset, size and
+ *            SHA256 digest.
+ * - extract: same as inspect, plus "components": [ <name>, ... ]
+ *            (all non empty ones by default). The components are sent
+ *            back as blobs named after them.
+ * - create:  header fields with the metadata names (baseAddr,
+ *            kernelOffset, ..., pageSize, boardName, cmdLine,
+ *            boardOsVersion "A.B.C", boardOsPatchLvl "YYYY-MM") and the
+ *            kernel, ramdisk, second & dtb blobs. The image is written
+ *            to "output" when given, sent back as an "image" blob
+ *            otherwise.
+ *
+ * Every response has "status": "ok" or "error" (with "error": <text>).
+ * Images given by path are read once and kept in a cache, keyed by path and
+ * checked against device, inode, size & mtime on each request.
+ * A connection that stays silent for BOOTIMG_DAEMON_TIMEOUT seconds in
+ * the middle of a request (or does not read its response) is closed.
+ */
+
+#define BOOTIMG_DAEMON_DEFAULT_SOCKET   "/tmp/bootimg-daemon.sock"
+#define BOOTIMG_DAEMON_DEFAULT_CACHE    16
+#define BOOTIMG_DAEMON_MAX_THREADS      64
+#define BOOTIMG_DAEMON_MAX_EVENTS       64
+#define BOOTIMG_DAEMON_QUEUE_SIZE       256
+#define BOOTIMG_DAEMON_MAX_REQUEST      (1024*1024)             /* JSON line */
+#define BOOTIMG_DAEMON_MAX_BLOB         (512*1024*1024UL)
+#define BOOTIMG_DAEMON_MAX_BLOBS        8
+#define BOOTIMG_DAEMON_BUF_SIZE         (64*1024)
+#define BOOTIMG_DAEMON_TIMEOUT          30                      /* seconds */
+
+#endif /* __BOOTIMG_DAEMON_H__ */
+
+/* Local Variables:                                                */
+/* mode: C                                                         */
+/* comment-column: 0                                               */
+/* End:                                                            */
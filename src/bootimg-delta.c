@@ -0,0 +1,860 @@
+/* bootimg-tools/bootimg-delta.c
+ *
+ * Copyright 2007, The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#ifdef STDC_HEADERS
+# include <stdlib.h>
+# include <stddef.h>
+#else
+# ifdef HAVE_STDLIB_H
+#  include <stdlib.h>
+# endif
+# ifdef HAVE_STDDEF_H
+#  include <stddef.h>
+# endif
+#endif
+#ifdef HAVE_STRING_H
+# include <string.h>
+#endif
+#ifdef HAVE_STRINGS_H
+# include <strings.h>
+#endif
+#ifdef HAVE_FCNTL_H
+# include <fcntl.h>
+#endif
+#ifdef HAVE_SYS_TYPES_H
+# include <sys/types.h>
+#endif
+#ifdef HAVE_SYS_STAT_H
+# include <sys/stat.h>
+#endif
+#ifdef HAVE_UNISTD_H
+# include <unistd.h>
+#endif
+#include <getopt.h>
+#ifdef HAVE_ALLOCA_H
+# include <alloca.h>
+#endif
+#ifdef HAVE_ASSERT_H
+# include <assert.h>
+#endif
+#include <errno.h>
+#include <endian.h>
+#include <sys/mman.h>
+#include <zlib.h>
+
+#ifdef USE_OPENSSL
+# ifndef OPENSSL_NO_SHA256
+#  include <openssl/sha.h>
+# else
+#  error No SHA256 available in this openssl ! It is mandatory ...
+# endif
+#endif
+
+#include "bootimg.h"
+#include "bootimg-priv.h"
+#include "bootimg-utils.h"
+#include "bootimg-cpio.h"
+#include "bootimg-gzip.h"
+#include "bootimg-bsdiff.h"
+#include "bootimg-delta.h"
+#include "bootimg-log.h"
+
+/*
+ * Options flags & values
+ * - v: verbose. vflag € N+*
+ * - a: apply a patch instead of creating it. aflag € [0, 1]
+ * - f: fast delta, without suffix sorting. fflag € [0, 1]
+ */
+int vflag = 0;
+int aflag = 0;
+int fflag = 0;
+
+/*
+ * progname & blankname are program name and space string with progname size
+ * for displaying messsages and help
+ */
+char *progname = (char *)NULL;
+char *blankname = (char *)NULL;
+
+static const char *progusage =
+  "usage: %s [options] oldimgfile newimgfile patchfile\n"
+  "       %s -a [options] oldimgfile patchfile newimgfile\n"
+  "       %s --help\n";
+static const char *proghelp =
+  "\n"
+  "       basic user options:\n"
+  "       %s -h --help                     display this message.\n"
+  "       %s -v --verbose[=<lvl>]          be verbose at runtime. <lvl> is\n"
+  "       %s                               added to current verbosity level.\n"
+  "\n"
+  "       options for controling the delta:\n"
+  "       %s -a --apply                    rebuild newimgfile from oldimgfile\n"
+  "       %s                               and patchfile.\n"
+  "       %s -f --fast                     only look for unchanged blocks,\n"
+  "       %s                               never sort suffixes. Faster and\n"
+  "       %s                               lighter but patches may be larger.\n"
+  "\n"
+  "       %s Each component is diff'ed with its old version. A gzip'ed\n"
+  "       %s ramdisk is diff'ed at the cpio level when zlib can rebuild\n"
+  "       %s it bit for bit. The rebuilt image is checked against the\n"
+  "       %s digest recorded in the patch and its id field.\n";
+
+/*
+ * Long options
+ */
+struct option long_options[] = {
+  {"verbose",  optional_argument, 0,  'v' },
+  {"apply",    no_argument,       0,  'a' },
+  {"fast",     no_argument,       0,  'f' },
+  {"help",     no_argument,       0,  'h' },
+  {0,          0,                 0,   0  }
+};
+#define BOOTIMG_OPTSTRING "v::afh"
+const char *unknown_option = "????";
+
+/*
+ * Getopt external defs
+ */
+extern char *optarg;
+extern int optind;
+
+static const char *section_names[BOOTIMG_DELTA_SECTION_COUNT] = {
+  "header", "kernel", "ramdisk", "second", "dtb", "tail"
+};
+
+static const char *method_names[] = {
+  "copy", "raw", "bsdiff", "bsdiff-gz"
+};
+
+/*
+ * A mapped file and its sections
+ */
+typedef struct _bootimgDeltaFile_st
+{
+  const char *path;
+  uint8_t *map;
+  size_t len;
+  off_t offset;                         /* of the boot magic */
+  boot_img_hdr hdr;
+  uint64_t section_offset[BOOTIMG_DELTA_SECTION_COUNT];
+  uint64_t section_size[BOOTIMG_DELTA_SECTION_COUNT];
+} bootimgDeltaFile_t, *bootimgDeltaFile_p;
+
+/*
+ * Forward decls
+ */
+void  printusage         (int);
+int   mapDeltaFile       (const char *, bootimgDeltaFile_p, int);
+void  unmapDeltaFile     (bootimgDeltaFile_p);
+int   createDelta        (bootimgDeltaFile_p, bootimgDeltaFile_p, const char *);
+int   applyDelta         (bootimgDeltaFile_p, bootimgDeltaFile_p, const char *);
+
+/*
+ * main
+ */
+int
+main(int argc, char **argv)
+{
+  int c, ret = 1;
+  bootimgDeltaFile_t oldimg, newfile;
+
+  progname = (rindex(argv[0], '/') ? rindex(argv[0], '/')+1 : argv[0]);
+  blankname = (char *)alloca(strlen(progname) +1);
+  memset((void *)blankname, (int)' ', (size_t)strlen(progname));
+  blankname[strlen(progname)] = 0;
+  logInit();
+
+  /*
+   * Process options
+   */
+  while (1)
+    {
+      int option_index = 0;
+
+      c = getopt_long(argc, argv, BOOTIMG_OPTSTRING,
+                      long_options, &option_index);
+      if (c == -1)
+        break;
+
+      switch (c)
+        {
+        case 'v':
+          if (optarg)
+            vflag += strtol(optarg, NULL, 10);
+          else
+            vflag++;
+          if (vflag > 3)
+            fprintf(stderr, "%s: option %s/%c set to %d\n",
+                    progname, getLongOptionName(long_options, c), c, vflag);
+          break;
+
+        case 'a':
+          aflag = 1;
+          if (vflag > 3)
+            fprintf(stderr, "%s: option %s/%c (=%d) set\n",
+                    progname, getLongOptionName(long_options, c), c, aflag);
+          break;
+
+        case 'f':
+          fflag = 1;
+          if (vflag > 3)
+            fprintf(stderr, "%s: option %s/%c (=%d) set\n",
+                    progname, getLongOptionName(long_options, c), c, fflag);
+          break;
+
+        case 'h':
+          printusage(1);
+          exit(1);
+
+        case '?':
+          printusage(0);
+          break;
+
+        default:
+          fprintf(stderr, "%s: getopt returned character code 0%o ??\n", progname, c);
+          printusage(0);
+        }
+    }
+
+  if (argc - optind != 3)
+    {
+      fprintf(stderr, "%s: error: three files are expected !\n", progname);
+      printusage(0);
+      exit(1);
+    }
+
+  /* old image, then new image or patch */
+  if (mapDeltaFile(argv[optind], &oldimg, 1) < 0)
+    exit(1);
+  if (mapDeltaFile(argv[optind +1], &newfile, !aflag) < 0)
+    {
+      unmapDeltaFile(&oldimg);
+      exit(1);
+    }
+
+  if (aflag)
+    ret = applyDelta(&oldimg, &newfile, argv[optind +2]);
+  else
+    ret = createDelta(&oldimg, &newfile, argv[optind +2]);
+
+  unmapDeltaFile(&oldimg);
+  unmapDeltaFile(&newfile);
+
+  return(ret < 0 ? 1 : 0);
+}
+
+/*
+ * Print usage message
+ */
+void
+printusage(int withhelp)
+{
+  char line[256];
+  char *tok = (char *)NULL;
+  char threelines = 3;
+  char *str;
+
+  if (withhelp)
+    {
+      str = (char *)malloc(strlen(progusage) +strlen(proghelp) +1);
+      assert(str);
+      memcpy(str, progusage, strlen(progusage));
+      memcpy(str +strlen(progusage), proghelp, strlen(proghelp) +1);
+    }
+  else
+    {
+      str = (char *)malloc(strlen(progusage) +1);
+      assert(str);
+      memcpy(str, progusage, strlen(progusage) +1);
+    }
+
+  while ((tok = strtok((char *)str, "\n")) != (char *)NULL)
+    {
+      if (threelines)
+        {
+          sprintf(line, tok, progname);
+          threelines--;
+        }
+      else
+        sprintf(line, tok, blankname);
+
+      str = (char *)NULL;
+      fprintf(stdout, "%s\n", line);
+    }
+
+  free((void *)str);
+}
+
+/*
+ * Map a file. For a boot image, locate its sections: the header page,
+ * the components with their padding (as laid out by computeComponentOffset)
+ * and the tail.
+ */
+int
+mapDeltaFile(const char *path, bootimgDeltaFile_p file, int image)
+{
+  struct stat statbuf;
+  const char *error = (const char *)NULL;
+  int fd;
+
+  bzero((void *)file, sizeof(bootimgDeltaFile_t));
+  file->path = path;
+
+  if ((fd = open(path, O_RDONLY)) < 0)
+    {
+      perror(path);
+      fprintf(stderr, "%s: error: cannot open file '%s'!\n", progname, path);
+      return -1;
+    }
+
+  do
+    {
+      uint64_t pos;
+
+      if (fstat(fd, &statbuf) < 0 || statbuf.st_size == 0)
+        {
+          fprintf(stderr, "%s: error: cannot stat file '%s'!\n", progname, path);
+          break;
+        }
+      file->len = statbuf.st_size;
+
+      if (image)
+        {
+          if (!findBootMagicFd(fd, &file->hdr, &file->offset, &error))
+            {
+              fprintf(stderr, "%s: error: %s in file '%s'\n", progname, error, path);
+              break;
+            }
+        }
+
+      file->map = (uint8_t *)mmap(NULL, file->len, PROT_READ, MAP_PRIVATE, fd, 0);
+      if (file->map == MAP_FAILED)
+        {
+          perror(path);
+          file->map = (uint8_t *)NULL;
+          break;
+        }
+      close(fd);
+
+      if (!image)
+        return 0;
+
+      file->section_size[BOOTIMG_DELTA_SECTION_HEAD] =
+        BOOTIMG_MIN((uint64_t)file->len, (uint64_t)file->offset + file->hdr.page_size);
+      pos = file->section_size[BOOTIMG_DELTA_SECTION_HEAD];
+      for (int nc = 0; nc < BOOTIMG_COMPONENT_COUNT; nc++)
+        {
+          uint32_t sizes[BOOTIMG_COMPONENT_COUNT] = {
+            file->hdr.kernel_size, file->hdr.ramdisk_size, file->hdr.second_size, file->hdr.dt_size
+          };
+
+          file->section_offset[nc +1] = pos;
+          file->section_size[nc +1] =
+            BOOTIMG_MIN(file->len - pos, alignOnPage(sizes[nc], file->hdr.page_size));
+          pos += file->section_size[nc +1];
+        }
+      file->section_offset[BOOTIMG_DELTA_SECTION_TAIL] = pos;
+      file->section_size[BOOTIMG_DELTA_SECTION_TAIL] = file->len - pos;
+
+      return 0;
+    }
+  while (0);
+
+  close(fd);
+  return -1;
+}
+
+void
+unmapDeltaFile(bootimgDeltaFile_p file)
+{
+  if (file->map)
+    munmap((void *)file->map, file->len);
+  bzero((void *)file, sizeof(bootimgDeltaFile_t));
+}
+
+/*
+ * write(2) all or fail
+ */
+static int
+writeAll(int fd, const void *buf, size_t len)
+{
+  while (len)
+    {
+      ssize_t wrsz = write(fd, buf, len);
+      if (wrsz < 0)
+        {
+          if (errno == EINTR)
+            continue;
+          return -1;
+        }
+      buf = (const uint8_t *)buf + wrsz;
+      len -= wrsz;
+    }
+
+  return 0;
+}
+
+/*
+ * Compute the raw payload of a section. *method is set accordingly.
+ */
+static int
+computeSectionPayload(bootimgDeltaFile_p oldimg, bootimgDeltaFile_p newimg, int ns,
+                      int *method, uint8_t **raw, size_t *rawlen)
+{
+  const uint8_t *old = oldimg->map + oldimg->section_offset[ns];
+  const uint8_t *new = newimg->map + newimg->section_offset[ns];
+  size_t oldsize = oldimg->section_size[ns], newsize = newimg->section_size[ns];
+  int flags = fflag ? BSDIFF_FLAG_FAST : BSDIFF_FLAG_NONE;
+
+  *raw = (uint8_t *)NULL;
+  *rawlen = 0;
+
+  if (oldsize == newsize && !memcmp((const void *)old, (const void *)new, newsize))
+    {
+      *method = BOOTIMG_DELTA_METHOD_COPY;
+      return 0;
+    }
+
+  if (!oldsize)
+    {
+      *method = BOOTIMG_DELTA_METHOD_RAW;
+      if (!(*raw = (uint8_t *)malloc(newsize)))
+        return -1;
+      memcpy((void *)*raw, (const void *)new, newsize);
+      *rawlen = newsize;
+      return 0;
+    }
+
+  /* ramdisk: diff cpio archives if the new gzip member can be rebuilt */
+  if (ns == BOOTIMG_DELTA_SECTION_RAMDISK)
+    {
+      bootimgGzipMember_t member;
+      uint8_t *olddata = (uint8_t *)NULL, *delta = (uint8_t *)NULL;
+      size_t olddata_len, delta_len;
+      long jobs = sysconf(_SC_NPROCESSORS_ONLN);
+      int done = 0;
+
+      if (!gzipProbe(new, newsize, &member, jobs > 0 ? (unsigned)jobs : 1))
+        {
+          if (member.level != GZIP_LEVEL_UNKNOWN &&
+              !cpioInflate(old, oldsize, &olddata, &olddata_len) &&
+              !bsdiffCreate(olddata, olddata_len, member.data, member.len, flags, &delta, &delta_len))
+            {
+              struct bootimg_delta_gz gz;
+              size_t len = sizeof(gz) + member.hdr_len + member.tail_len + delta_len;
+
+              gz.level = htole32(member.level);
+              gz.hdr_len = htole32(member.hdr_len);
+              gz.tail_len = htole64(member.tail_len);
+              gz.data_len = htole64(member.len);
+
+              if ((*raw = (uint8_t *)malloc(len)))
+                {
+                  uint8_t *p = *raw;
+
+                  memcpy((void *)p, (const void *)&gz, sizeof(gz));
+                  p += sizeof(gz);
+                  memcpy((void *)p, (const void *)new, member.hdr_len);
+                  p += member.hdr_len;
+                  memcpy((void *)p, (const void *)(new + newsize - member.tail_len), member.tail_len);
+                  p += member.tail_len;
+                  memcpy((void *)p, (const void *)delta, delta_len);
+                  *rawlen = len;
+                  *method = BOOTIMG_DELTA_METHOD_BSDIFF_GZ;
+                  done = 1;
+                }
+            }
+          else if (vflag)
+            fprintf(stderr, "%s: ramdisk gzip stream cannot be rebuilt, diff'ed compressed\n", progname);
+
+          free((void *)delta);
+          free((void *)olddata);
+          gzipRelease(&member);
+        }
+      if (done)
+        return 0;
+    }
+
+  *method = BOOTIMG_DELTA_METHOD_BSDIFF;
+  return bsdiffCreate(old, oldsize, new, newsize, flags, raw, rawlen);
+}
+
+/*
+ * Create a patch from oldimg to newimg
+ */
+int
+createDelta(bootimgDeltaFile_p oldimg, bootimgDeltaFile_p newimg, const char *patchfile)
+{
+  struct bootimg_delta_hdr hdr;
+  int fd, ns, ret = -1;
+  uint64_t total = sizeof(hdr);
+
+  if ((fd = open(patchfile, O_WRONLY|O_CREAT|O_TRUNC, 0644)) < 0)
+    {
+      perror(patchfile);
+      fprintf(stderr, "%s: error: cannot open patch file '%s' for writing!\n", progname, patchfile);
+      return -1;
+    }
+
+  bzero((void *)&hdr, sizeof(hdr));
+  memcpy((void *)hdr.magic, (const void *)BOOTIMG_DELTA_MAGIC, BOOTIMG_DELTA_MAGIC_SIZE);
+  hdr.version = htole32(BOOTIMG_DELTA_VERSION);
+  hdr.old_size = htole64(oldimg->len);
+  hdr.new_size = htole64(newimg->len);
+  hdr.new_magic_offset = htole64(newimg->offset);
+  SHA256(oldimg->map, oldimg->len, hdr.old_digest);
+  SHA256(newimg->map, newimg->len, hdr.new_digest);
+  for (ns = 0; ns < BOOTIMG_DELTA_SECTION_COUNT; ns++)
+    if (newimg->section_size[ns])
+      hdr.section_count++;
+  hdr.section_count = htole32(hdr.section_count);
+
+  do
+    {
+      if (writeAll(fd, &hdr, sizeof(hdr)) < 0)
+        break;
+
+      for (ns = 0; ns < BOOTIMG_DELTA_SECTION_COUNT; ns++)
+        {
+          struct bootimg_delta_section section;
+          uint8_t *raw = (uint8_t *)NULL, *payload = (uint8_t *)NULL;
+          size_t rawlen = 0;
+          uLongf payload_len = 0;
+          int method;
+
+          if (!newimg->section_size[ns])
+            continue;
+
+          if (computeSectionPayload(oldimg, newimg, ns, &method, &raw, &rawlen) < 0)
+            {
+              fprintf(stderr, "%s: error: cannot compute %s delta!\n", progname, section_names[ns]);
+              break;
+            }
+
+          if (rawlen)
+            {
+              payload_len = compressBound(rawlen);
+              if (!(payload = (uint8_t *)malloc(payload_len)) ||
+                  compress2(payload, &payload_len, raw, rawlen, Z_BEST_COMPRESSION) != Z_OK)
+                {
+                  fprintf(stderr, "%s: error: cannot compress %s delta!\n", progname, section_names[ns]);
+                  free((void *)raw);
+                  free((void *)payload);
+                  break;
+                }
+            }
+
+          section.type = htole32(ns);
+          section.method = htole32(method);
+          section.old_offset = htole64(oldimg->section_offset[ns]);
+          section.old_size = htole64(oldimg->section_size[ns]);
+          section.new_offset = htole64(newimg->section_offset[ns]);
+          section.new_size = htole64(newimg->section_size[ns]);
+          section.raw_size = htole64(rawlen);
+          section.payload_size = htole64(payload_len);
+
+          if (vflag)
+            fprintf(stdout, "%s: %-8s %-9s %8lu -> %8lu bytes\n",
+                    progname, section_names[ns], method_names[method],
+                    newimg->section_size[ns], payload_len);
+
+          ret = (writeAll(fd, &section, sizeof(section)) < 0 ||
+                 writeAll(fd, payload, payload_len) < 0) ? -1 : 0;
+          total += sizeof(section) + payload_len;
+          free((void *)raw);
+          free((void *)payload);
+          if (ret < 0)
+            break;
+        }
+      if (ns < BOOTIMG_DELTA_SECTION_COUNT)
+        {
+          ret = -1;
+          break;
+        }
+
+      if (vflag)
+        fprintf(stdout, "%s: patch is %lu bytes for a %lu bytes image\n",
+                progname, total, newimg->len);
+      ret = 0;
+    }
+  while (0);
+
+  if (close(fd) < 0 || ret < 0)
+    {
+      fprintf(stderr, "%s: error: cannot write patch file '%s'!\n", progname, patchfile);
+      unlink(patchfile);
+      ret = -1;
+    }
+
+  return ret;
+}
+
+/*
+ * Rebuild one section of the new image in out
+ */
+static int
+applySection(bootimgDeltaFile_p oldimg, struct bootimg_delta_section *section,
+             const uint8_t *payload, uint8_t *out)
+{
+  const uint8_t *old = oldimg->map + section->old_offset;
+  uint8_t *raw = (uint8_t *)NULL;
+  uLongf rawlen = section->raw_size;
+  int ret = -1;
+
+  if (section->method == BOOTIMG_DELTA_METHOD_COPY)
+    {
+      if (section->old_size != section->new_size)
+        return -1;
+      memcpy((void *)out, (const void *)old, section->new_size);
+      return 0;
+    }
+
+  /* sizes from the patch file, checked before anything is allocated */
+  if (section->raw_size > section->payload_size * BOOTIMG_DELTA_MAX_RATIO ||
+      (section->method == BOOTIMG_DELTA_METHOD_RAW && section->raw_size != section->new_size))
+    return -1;
+  if (!(raw = (uint8_t *)malloc(rawlen ? rawlen : 1)))
+    return -1;
+  if (uncompress(raw, &rawlen, payload, section->payload_size) != Z_OK ||
+      rawlen != section->raw_size)
+    {
+      free((void *)raw);
+      return -1;
+    }
+
+  switch (section->method)
+    {
+    case BOOTIMG_DELTA_METHOD_RAW:
+      if (rawlen == section->new_size)
+        {
+          memcpy((void *)out, (const void *)raw, rawlen);
+          ret = 0;
+        }
+      break;
+
+    case BOOTIMG_DELTA_METHOD_BSDIFF:
+      ret = bsdiffApply(old, section->old_size, raw, rawlen, out, section->new_size);
+      break;
+
+    case BOOTIMG_DELTA_METHOD_BSDIFF_GZ:
+      {
+        struct bootimg_delta_gz gz;
+        uint8_t *olddata = (uint8_t *)NULL, *newdata = (uint8_t *)NULL, *member = (uint8_t *)NULL;
+        size_t olddata_len, member_len;
+        const uint8_t *p = raw;
+
+        if (rawlen < sizeof(gz))
+          break;
+        memcpy((void *)&gz, (const void *)p, sizeof(gz));
+        gz.level = le32toh(gz.level);
+        gz.hdr_len = le32toh(gz.hdr_len);
+        gz.tail_len = le64toh(gz.tail_len);
+        gz.data_len = le64toh(gz.data_len);
+        p += sizeof(gz);
+        if (gz.hdr_len > rawlen - sizeof(gz) ||
+            gz.tail_len > rawlen - sizeof(gz) - gz.hdr_len ||
+            gz.data_len > section->new_size * BOOTIMG_DELTA_MAX_RATIO)
+          break;
+
+        if (!cpioInflate(old, section->old_size, &olddata, &olddata_len) &&
+            (newdata = (uint8_t *)malloc(gz.data_len ? gz.data_len : 1)) &&
+            !bsdiffApply(olddata, olddata_len,
+                         p + gz.hdr_len + gz.tail_len, rawlen - sizeof(gz) - gz.hdr_len - gz.tail_len,
+                         newdata, gz.data_len) &&
+            !gzipRebuild(newdata, gz.data_len, gz.level, p, gz.hdr_len, p + gz.hdr_len, gz.tail_len,
+                         &member, &member_len) &&
+            member_len == section->new_size)
+          {
+            memcpy((void *)out, (const void *)member, member_len);
+            ret = 0;
+          }
+
+        free((void *)member);
+        free((void *)newdata);
+        free((void *)olddata);
+      }
+      break;
+
+    default:
+      break;
+    }
+
+  free((void *)raw);
+  return ret;
+}
+
+/*
+ * Rebuild a new image from oldimg and a patch
+ */
+int
+applyDelta(bootimgDeltaFile_p oldimg, bootimgDeltaFile_p patch, const char *newimgfile)
+{
+  struct bootimg_delta_hdr hdr;
+  unsigned char digest[SHA256_DIGEST_LENGTH];
+  uint8_t *out = (uint8_t *)NULL;
+  size_t pos;
+  uint64_t expected = 0;
+  int fd, ret = -1;
+
+  do
+    {
+      boot_img_hdr *newhdr;
+      unsigned char id[SHA256_DIGEST_LENGTH];
+      const uint8_t *data[BOOTIMG_COMPONENT_COUNT];
+
+      if (patch->len < sizeof(hdr))
+        {
+          fprintf(stderr, "%s: error: '%s' is not a boot image patch!\n", progname, patch->path);
+          break;
+        }
+      memcpy((void *)&hdr, (const void *)patch->map, sizeof(hdr));
+      if (memcmp((const void *)hdr.magic, (const void *)BOOTIMG_DELTA_MAGIC, BOOTIMG_DELTA_MAGIC_SIZE) ||
+          le32toh(hdr.version) != BOOTIMG_DELTA_VERSION)
+        {
+          fprintf(stderr, "%s: error: '%s' is not a boot image patch!\n", progname, patch->path);
+          break;
+        }
+      hdr.section_count = le32toh(hdr.section_count);
+      hdr.old_size = le64toh(hdr.old_size);
+      hdr.new_size = le64toh(hdr.new_size);
+      hdr.new_magic_offset = le64toh(hdr.new_magic_offset);
+
+      /* the patch only applies to the very same old image */
+      SHA256(oldimg->map, oldimg->len, digest);
+      if (hdr.old_size != oldimg->len ||
+          memcmp((const void *)digest, (const void *)hdr.old_digest, SHA256_DIGEST_LENGTH))
+        {
+          fprintf(stderr, "%s: error: patch '%s' was not made for image '%s'!\n",
+                  progname, patch->path, oldimg->path);
+          break;
+        }
+
+      /* at most one section of each type, copied or inflated from the patch */
+      if (hdr.section_count > BOOTIMG_DELTA_SECTION_COUNT ||
+          hdr.new_size > BOOTIMG_DELTA_SECTION_COUNT * oldimg->len + patch->len * BOOTIMG_DELTA_MAX_RATIO ||
+          hdr.new_magic_offset + sizeof(boot_img_hdr) > hdr.new_size ||
+          !(out = (uint8_t *)malloc(hdr.new_size)))
+        {
+          fprintf(stderr, "%s: error: bad patch header!\n", progname);
+          break;
+        }
+
+      pos = sizeof(hdr);
+      for (uint32_t n = 0; n < hdr.section_count; n++)
+        {
+          struct bootimg_delta_section section;
+
+          if (patch->len - pos < sizeof(section))
+            break;
+          memcpy((void *)&section, (const void *)(patch->map + pos), sizeof(section));
+          pos += sizeof(section);
+          section.type = le32toh(section.type);
+          section.method = le32toh(section.method);
+          section.old_offset = le64toh(section.old_offset);
+          section.old_size = le64toh(section.old_size);
+          section.new_offset = le64toh(section.new_offset);
+          section.new_size = le64toh(section.new_size);
+          section.raw_size = le64toh(section.raw_size);
+          section.payload_size = le64toh(section.payload_size);
+
+          /* sections tile the new image, old ranges within old image */
+          if (section.type >= BOOTIMG_DELTA_SECTION_COUNT ||
+              section.new_offset != expected ||
+              section.new_size > hdr.new_size - expected ||
+              section.old_offset > oldimg->len ||
+              section.old_size > oldimg->len - section.old_offset ||
+              section.payload_size > patch->len - pos)
+            break;
+
+          if (applySection(oldimg, &section, patch->map + pos, out + section.new_offset) < 0)
+            {
+              fprintf(stderr, "%s: error: cannot rebuild %s!\n", progname, section_names[section.type]);
+              break;
+            }
+          if (vflag)
+            fprintf(stdout, "%s: %-8s %-9s %8lu bytes\n", progname, section_names[section.type],
+                    section.method < sizeof(method_names)/sizeof(method_names[0]) ?
+                    method_names[section.method] : unknown_option, section.new_size);
+
+          pos += section.payload_size;
+          expected += section.new_size;
+        }
+      if (expected != hdr.new_size)
+        {
+          fprintf(stderr, "%s: error: truncated or corrupted patch '%s'!\n", progname, patch->path);
+          break;
+        }
+
+      SHA256(out, hdr.new_size, digest);
+      if (memcmp((const void *)digest, (const void *)hdr.new_digest, SHA256_DIGEST_LENGTH))
+        {
+          fprintf(stderr, "%s: error: rebuilt image digest mismatch!\n", progname);
+          break;
+        }
+
+      /* id field must match the rebuilt components, as create computes it */
+      newhdr = (boot_img_hdr *)(out + hdr.new_magic_offset);
+      for (int nc = 0; nc < BOOTIMG_COMPONENT_COUNT; nc++)
+        data[nc] = out + hdr.new_magic_offset + computeComponentOffset(newhdr, nc);
+      if (hdr.new_magic_offset + computeSignatureBlockOffset(newhdr) > hdr.new_size)
+        {
+          fprintf(stderr, "%s: error: rebuilt image is truncated!\n", progname);
+          break;
+        }
+      bzero((void *)id, sizeof(id));
+      computeImageId(newhdr,
+                     data[BOOTIMG_COMPONENT_KERNEL],
+                     data[BOOTIMG_COMPONENT_RAMDISK],
+                     newhdr->second_size ? data[BOOTIMG_COMPONENT_SECOND] : NULL,
+                     newhdr->dt_size ? data[BOOTIMG_COMPONENT_DTB] : NULL,
+                     id);
+      if (memcmp((const void *)id, (const void *)newhdr->id, sizeof(newhdr->id)))
+        {
+          fprintf(stderr, "%s: error: rebuilt image id does not match its components!\n", progname);
+          break;
+        }
+
+      if ((fd = open(newimgfile, O_WRONLY|O_CREAT|O_TRUNC, 0644)) < 0)
+        {
+          perror(newimgfile);
+          fprintf(stderr, "%s: error: cannot open image file '%s' for writing!\n", progname, newimgfile);
+          break;
+        }
+      ret = writeAll(fd, out, hdr.new_size);
+      if (close(fd) < 0 || ret < 0)
+        {
+          ret = -1;
+          fprintf(stderr, "%s: error: cannot write image file '%s'!\n", progname, newimgfile);
+          unlink(newimgfile);
+          break;
+        }
+
+      ret = 0;
+    }
+  while (0);
+
+  free((void *)out);
+  return ret;
+}
+
+/* Local Variables:                                                */
+/* mode: C                                                         */
+/* comment-column: 0                                               */
+/* End:                                                            */
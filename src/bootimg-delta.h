@@ -0,0 +1,106 @@
+/* bootimg-tools/bootimg-delta.h
+ *
+ * Copyright 2007, The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef __BOOTIMG_DELTA_H__
+#define __BOOTIMG_DELTA_H__
+
+#include <stdint.h>
+
+/**==========================================================================
+ ** Boot image patch file format
+ **==========================================================================
+ **
+ *
+ * +------------------------------+
+ * | struct bootimg_delta_hdr     |
+ * +------------------------------+
+ * | struct bootimg_delta_section | section_count times, in new image order
+ * | payload                      | payload_size bytes, zlib compressed
+ * +------------------------------+
+ *
+ * An image is cut in sections: the header page (and anything before the
+ * boot magic), each component with its page padding, then whatever
+ * follows the last component (signature block). Each section of the new
+ * image is rebuilt from the same section of the old image.
+ * All values are little endian.
+ */
+
+#define BOOTIMG_DELTA_MAGIC             "BIMGDLT"
+#define BOOTIMG_DELTA_MAGIC_SIZE        8
+#define BOOTIMG_DELTA_VERSION           1
+
+/* Sections */
+#define BOOTIMG_DELTA_SECTION_HEAD      0
+#define BOOTIMG_DELTA_SECTION_KERNEL    1
+#define BOOTIMG_DELTA_SECTION_RAMDISK   2
+#define BOOTIMG_DELTA_SECTION_SECOND    3
+#define BOOTIMG_DELTA_SECTION_DTB       4
+#define BOOTIMG_DELTA_SECTION_TAIL      5
+#define BOOTIMG_DELTA_SECTION_COUNT     6
+
+/* Methods */
+#define BOOTIMG_DELTA_METHOD_COPY       0       /* old section as is, no payload */
+#define BOOTIMG_DELTA_METHOD_RAW        1       /* payload is the new section */
+#define BOOTIMG_DELTA_METHOD_BSDIFF     2       /* payload is a bsdiff delta */
+#define BOOTIMG_DELTA_METHOD_BSDIFF_GZ  3       /* bsdiff delta of inflated data */
+
+/* deflate does not expand data more than this: bounds the sizes read back */
+#define BOOTIMG_DELTA_MAX_RATIO         1032
+
+struct bootimg_delta_hdr
+{
+  uint8_t magic[BOOTIMG_DELTA_MAGIC_SIZE];
+  uint32_t version;
+  uint32_t section_count;
+  uint64_t old_size;
+  uint64_t new_size;
+  uint64_t new_magic_offset;
+  uint8_t old_digest[32];               /* SHA256 of the whole old image */
+  uint8_t new_digest[32];               /* SHA256 of the whole new image */
+} __attribute__((packed));
+
+struct bootimg_delta_section
+{
+  uint32_t type;                        /* BOOTIMG_DELTA_SECTION_* */
+  uint32_t method;                      /* BOOTIMG_DELTA_METHOD_* */
+  uint64_t old_offset;
+  uint64_t old_size;
+  uint64_t new_offset;
+  uint64_t new_size;
+  uint64_t raw_size;                    /* payload once uncompressed */
+  uint64_t payload_size;
+} __attribute__((packed));
+
+/*
+ * Start of a BOOTIMG_DELTA_METHOD_BSDIFF_GZ payload, followed by the
+ * gzip header, the tail bytes and the delta between the inflated old
+ * and new sections. The new gzip member is rebuilt with zlib at level.
+ */
+struct bootimg_delta_gz
+{
+  uint32_t level;
+  uint32_t hdr_len;
+  uint64_t tail_len;
+  uint64_t data_len;                    /* inflated new section */
+} __attribute__((packed));
+
+#endif /* __BOOTIMG_DELTA_H__ */
+
+/* Local Variables:                                                */
+/* mode: C                                                         */
+/* comment-column: 0                                               */
+/* End:                                                            */
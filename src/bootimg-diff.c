@@ -0,0 +1,769 @@
+/* bootimg-tools/bootimg-diff.c
+ *
+ * Copyright 2007, The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#ifdef STDC_HEADERS
+# include <stdlib.h>
+# include <stddef.h>
+#else
+# ifdef HAVE_STDLIB_H
+#  include <stdlib.h>
+# endif
+# ifdef HAVE_STDDEF_H
+#  include <stddef.h>
+# endif
+#endif
+#ifdef HAVE_STRING_H
+# include <string.h>
+#endif
+#ifdef HAVE_STRINGS_H
+# include <strings.h>
+#endif
+#ifdef HAVE_FCNTL_H
+# include <fcntl.h>
+#endif
+#ifdef HAVE_SYS_TYPES_H
+# include <sys/types.h>
+#endif
+#ifdef HAVE_SYS_STAT_H
+# include <sys/stat.h>
+#endif
+#ifdef HAVE_UNISTD_H
+# include <unistd.h>
+#endif
+#include <getopt.h>
+#ifdef HAVE_ALLOCA_H
+# include <alloca.h>
+#endif
+#ifdef HAVE_ASSERT_H
+# include <assert.h>
+#endif
+#include <errno.h>
+#include <sys/mman.h>
+
+#ifdef USE_OPENSSL
+# ifndef OPENSSL_NO_SHA256
+#  include <openssl/sha.h>
+# else
+#  error No SHA256 available in this openssl ! It is mandatory ...
+# endif
+#endif
+
+#include "bootimg.h"
+#include "bootimg-priv.h"
+#include "bootimg-utils.h"
+#include "bootimg-jsonw.h"
+#include "bootimg-cpio.h"
+#include "bootimg-log.h"
+
+/* Equal runs shorter than this do not split a differing range */
+#define DIFF_MERGE_GAP          16
+#define DIFF_BLOCK_SIZE         4096
+#define DIFF_DEFAULT_RANGES     32
+
+/* Exit status, as diff(1) */
+#define DIFF_STATUS_SAME        0
+#define DIFF_STATUS_DIFFER      1
+#define DIFF_STATUS_TROUBLE     2
+
+/*
+ * Options flags & values
+ * - v: verbose. vflag € N+*
+ * - o: report file. oflag € [0, 1]
+ * - c: compact json report. cflag € [0, 1]
+ * - r: max byte ranges per component. rflag € [0, 1]
+ */
+int vflag = 0;
+int oflag = 0;
+int cflag = 0;
+int rflag = 0;
+
+/* oval: report file */
+char *oval = (char *)NULL;
+/* rval: max byte ranges reported per component */
+long rval = DIFF_DEFAULT_RANGES;
+
+/*
+ * progname & blankname are program name and space string with progname size
+ * for displaying messsages and help
+ */
+char *progname = (char *)NULL;
+char *blankname = (char *)NULL;
+
+static const char *progusage =
+  "usage: %s [options] oldimgfile newimgfile\n"
+  "       %s --help\n";
+static const char *proghelp =
+  "\n"
+  "       basic user options:\n"
+  "       %s -h --help                     display this message.\n"
+  "       %s -v --verbose[=<lvl>]          be verbose at runtime. <lvl> is\n"
+  "       %s                               added to current verbosity level.\n"
+  "\n"
+  "       options for controling the report:\n"
+  "       %s -o --output=<file>            write the json report in <file>\n"
+  "       %s                               instead of stdout.\n"
+  "       %s -c --compact                  write the json report without any\n"
+  "       %s                               whitespace.\n"
+  "       %s -r --ranges=<n>               report at most <n> differing byte\n"
+  "       %s                               ranges per component (default 32).\n"
+  "\n"
+  "       %s Header fields and component digests are compared. Only\n"
+  "       %s differing components are looked at: the ramdisk cpio entry\n"
+  "       %s lists are compared, other components byte per byte.\n"
+  "       %s Exit status is 0 if images are the same, 1 if they differ\n"
+  "       %s and 2 on trouble.\n";
+
+/*
+ * Long options
+ */
+struct option long_options[] = {
+  {"verbose",  optional_argument, 0,  'v' },
+  {"output",   required_argument, 0,  'o' },
+  {"compact",  no_argument,       0,  'c' },
+  {"ranges",   required_argument, 0,  'r' },
+  {"help",     no_argument,       0,  'h' },
+  {0,          0,                 0,   0  }
+};
+#define BOOTIMG_OPTSTRING "v::o:cr:h"
+const char *unknown_option = "????";
+
+/*
+ * Getopt external defs
+ */
+extern char *optarg;
+extern int optind;
+
+static const char *component_names[BOOTIMG_COMPONENT_COUNT] = {
+  "kernel", "ramdisk", "second", "dtb"
+};
+
+/*
+ * A mapped boot image
+ */
+typedef struct _bootimgDiffImage_st
+{
+  const char *path;
+  uint8_t *map;
+  size_t len;
+  off_t offset;                         /* of the boot magic */
+  boot_img_hdr hdr;
+  const uint8_t *data[BOOTIMG_COMPONENT_COUNT];
+  size_t size[BOOTIMG_COMPONENT_COUNT];
+  unsigned char digest[BOOTIMG_COMPONENT_COUNT][BOOTIMG_DIGEST_SIZE];
+} bootimgDiffImage_t, *bootimgDiffImage_p;
+
+/*
+ * Forward decls
+ */
+void  printusage         (int);
+int   loadDiffImage      (const char *, bootimgDiffImage_p);
+void  releaseDiffImage   (bootimgDiffImage_p);
+int   diffHeaders        (bootimgJsonWriter_p, bootimgDiffImage_p, bootimgDiffImage_p);
+int   diffComponent      (bootimgJsonWriter_p, bootimgDiffImage_p, bootimgDiffImage_p, int);
+
+/*
+ * main
+ */
+int
+main(int argc, char **argv)
+{
+  int c;
+  int status = DIFF_STATUS_TROUBLE;
+  bootimgDiffImage_t oldimg, newimg;
+  bootimgJsonWriter_p w;
+
+  progname = (rindex(argv[0], '/') ? rindex(argv[0], '/')+1 : argv[0]);
+  blankname = (char *)alloca(strlen(progname) +1);
+  memset((void *)blankname, (int)' ', (size_t)strlen(progname));
+  blankname[strlen(progname)] = 0;
+  logInit();
+
+  /*
+   * Process options
+   */
+  while (1)
+    {
+      int option_index = 0;
+
+      c = getopt_long(argc, argv, BOOTIMG_OPTSTRING,
+                      long_options, &option_index);
+      if (c == -1)
+        break;
+
+      switch (c)
+        {
+        case 'v':
+          if (optarg)
+            vflag += strtol(optarg, NULL, 10);
+          else
+            vflag++;
+          if (vflag > 3)
+            fprintf(stderr, "%s: option %s/%c set to %d\n",
+                    progname, getLongOptionName(long_options, c), c, vflag);
+          break;
+
+        case 'o':
+          oflag = 1;
+          oval = optarg;
+          if (vflag > 3)
+            fprintf(stderr, "%s: option %s/%c (=%d) set with value '%s'\n",
+                    progname, getLongOptionName(long_options, c), c, oflag, oval);
+          break;
+
+        case 'c':
+          cflag = 1;
+          if (vflag > 3)
+            fprintf(stderr, "%s: option %s/%c (=%d) set\n",
+                    progname, getLongOptionName(long_options, c), c, cflag);
+          break;
+
+        case 'r':
+          rflag = 1;
+          rval = strtol(optarg, NULL, 10);
+          if (rval < 0)
+            rval = 0;
+          if (vflag > 3)
+            fprintf(stderr, "%s: option %s/%c (=%d) set with value '%ld'\n",
+                    progname, getLongOptionName(long_options, c), c, rflag, rval);
+          break;
+
+        case 'h':
+          printusage(1);
+          exit(DIFF_STATUS_TROUBLE);
+
+        case '?':
+          printusage(0);
+          break;
+
+        default:
+          fprintf(stderr, "%s: getopt returned character code 0%o ??\n", progname, c);
+          printusage(0);
+        }
+    }
+
+  if (argc - optind != 2)
+    {
+      fprintf(stderr, "%s: error: two image files are expected !\n", progname);
+      printusage(0);
+      exit(DIFF_STATUS_TROUBLE);
+    }
+
+  if (loadDiffImage(argv[optind], &oldimg) < 0)
+    exit(DIFF_STATUS_TROUBLE);
+  if (loadDiffImage(argv[optind +1], &newimg) < 0)
+    {
+      releaseDiffImage(&oldimg);
+      exit(DIFF_STATUS_TROUBLE);
+    }
+
+  if (oflag)
+    w = jsonWriterNewFilename(oval, cflag ? JSON_WRITER_FLAG_COMPACT : JSON_WRITER_FLAG_NONE);
+  else
+    w = jsonWriterNew(STDOUT_FILENO, cflag ? JSON_WRITER_FLAG_COMPACT : JSON_WRITER_FLAG_NONE);
+
+  if (!w)
+    fprintf(stderr, "%s: error: cannot open json report '%s' for writing !\n",
+            progname, oflag ? oval : "stdout");
+
+  else
+    {
+      int differ = 0;
+
+      jsonWriterStartObject(w, NULL);
+      jsonWriterWriteString(w, "old", oldimg.path);
+      jsonWriterWriteString(w, "new", newimg.path);
+
+      jsonWriterStartObject(w, "header");
+      differ |= diffHeaders(w, &oldimg, &newimg);
+      jsonWriterEndObject(w);
+
+      jsonWriterStartObject(w, "components");
+      for (int nc = 0; nc < BOOTIMG_COMPONENT_COUNT; nc++)
+        differ |= diffComponent(w, &oldimg, &newimg, nc);
+      jsonWriterEndObject(w);
+
+      jsonWriterWriteBool(w, "identical", !differ);
+      jsonWriterEndObject(w);
+
+      if (jsonWriterFree(w) < 0)
+        fprintf(stderr, "%s: error: cannot write json report !\n", progname);
+      else
+        {
+          if (!oflag)
+            fputc('\n', stdout);
+          status = differ ? DIFF_STATUS_DIFFER : DIFF_STATUS_SAME;
+        }
+    }
+
+  releaseDiffImage(&oldimg);
+  releaseDiffImage(&newimg);
+
+  return(status);
+}
+
+/*
+ * Print usage message
+ */
+void
+printusage(int withhelp)
+{
+  char line[256];
+  char *tok = (char *)NULL;
+  char twolines = 2;
+  char *str;
+
+  if (withhelp)
+    {
+      str = (char *)malloc(strlen(progusage) +strlen(proghelp) +1);
+      assert(str);
+      memcpy(str, progusage, strlen(progusage));
+      memcpy(str +strlen(progusage), proghelp, strlen(proghelp) +1);
+    }
+  else
+    {
+      str = (char *)malloc(strlen(progusage) +1);
+      assert(str);
+      memcpy(str, progusage, strlen(progusage) +1);
+    }
+
+  while ((tok = strtok((char *)str, "\n")) != (char *)NULL)
+    {
+      if (twolines)
+        {
+          sprintf(line, tok, progname);
+          twolines--;
+        }
+      else
+        sprintf(line, tok, blankname);
+
+      str = (char *)NULL;
+      fprintf(stdout, "%s\n", line);
+    }
+
+  free((void *)str);
+}
+
+/*
+ * Map an image, locate its components and digest them
+ */
+int
+loadDiffImage(const char *path, bootimgDiffImage_p img)
+{
+  struct stat statbuf;
+  const char *error = (const char *)NULL;
+  int fd;
+
+  bzero((void *)img, sizeof(bootimgDiffImage_t));
+  img->path = path;
+
+  if ((fd = open(path, O_RDONLY)) < 0)
+    {
+      perror(path);
+      fprintf(stderr, "%s: error: cannot open image file '%s'!\n", progname, path);
+      return -1;
+    }
+
+  do
+    {
+      if (fstat(fd, &statbuf) < 0 || statbuf.st_size == 0)
+        {
+          fprintf(stderr, "%s: error: cannot stat image file '%s'!\n", progname, path);
+          break;
+        }
+      img->len = statbuf.st_size;
+
+      if (!findBootMagicFd(fd, &img->hdr, &img->offset, &error))
+        {
+          fprintf(stderr, "%s: error: %s in file '%s'\n", progname, error, path);
+          break;
+        }
+
+      img->map = (uint8_t *)mmap(NULL, img->len, PROT_READ, MAP_PRIVATE, fd, 0);
+      if (img->map == MAP_FAILED)
+        {
+          perror(path);
+          img->map = (uint8_t *)NULL;
+          break;
+        }
+      close(fd);
+
+      img->size[BOOTIMG_COMPONENT_KERNEL] = img->hdr.kernel_size;
+      img->size[BOOTIMG_COMPONENT_RAMDISK] = img->hdr.ramdisk_size;
+      img->size[BOOTIMG_COMPONENT_SECOND] = img->hdr.second_size;
+      img->size[BOOTIMG_COMPONENT_DTB] = img->hdr.dt_size;
+
+      for (int nc = 0; nc < BOOTIMG_COMPONENT_COUNT; nc++)
+        {
+          uint64_t start = img->offset + computeComponentOffset(&img->hdr, nc);
+
+          if (!img->size[nc])
+            continue;
+          /* truncated image: keep what is there */
+          if (start >= img->len)
+            {
+              fprintf(stderr, "%s: warning: %s missing in truncated image '%s'\n",
+                      progname, component_names[nc], path);
+              img->size[nc] = 0;
+              continue;
+            }
+          if (img->size[nc] > img->len - start)
+            {
+              fprintf(stderr, "%s: warning: %s truncated in image '%s'\n",
+                      progname, component_names[nc], path);
+              img->size[nc] = img->len - start;
+            }
+          img->data[nc] = img->map + start;
+          SHA256(img->data[nc], img->size[nc], img->digest[nc]);
+        }
+
+      return 0;
+    }
+  while (0);
+
+  close(fd);
+  return -1;
+}
+
+void
+releaseDiffImage(bootimgDiffImage_p img)
+{
+  if (img->map)
+    munmap((void *)img->map, img->len);
+  bzero((void *)img, sizeof(bootimgDiffImage_t));
+}
+
+/*
+ * Emit "key": { "old": ..., "new": ... } for a differing string value
+ */
+static int
+diffStrings(bootimgJsonWriter_p w, const char *key, const char *oldval, const char *newval)
+{
+  if (!strcmp(oldval, newval))
+    return 0;
+
+  jsonWriterStartObject(w, key);
+  jsonWriterWriteString(w, "old", oldval);
+  jsonWriterWriteString(w, "new", newval);
+  jsonWriterEndObject(w);
+
+  return 1;
+}
+
+static int
+diffAddresses(bootimgJsonWriter_p w, const char *key, uint32_t oldval, uint32_t newval)
+{
+  char o[16], n[16];
+
+  snprintf(o, sizeof(o), "0x%08x", oldval);
+  snprintf(n, sizeof(n), "0x%08x", newval);
+
+  return diffStrings(w, key, o, n);
+}
+
+static void
+getCmdline(boot_img_hdr *hdr, char *cmdline)
+{
+  size_t len = strnlen((const char *)hdr->cmdline, BOOT_ARGS_SIZE);
+
+  memcpy((void *)cmdline, (const void *)hdr->cmdline, len);
+  if (len == BOOT_ARGS_SIZE)
+    {
+      size_t extra_len = strnlen((const char *)hdr->extra_cmdline, BOOT_EXTRA_ARGS_SIZE);
+      memcpy((void *)&cmdline[len], (const void *)hdr->extra_cmdline, extra_len);
+      len += extra_len;
+    }
+  cmdline[len] = '\0';
+}
+
+/*
+ * Compare header fields. Component sizes are reported with components.
+ */
+int
+diffHeaders(bootimgJsonWriter_p w, bootimgDiffImage_p oldimg, bootimgDiffImage_p newimg)
+{
+  boot_img_hdr *o = &oldimg->hdr, *n = &newimg->hdr;
+  char ostr[BOOT_ARGS_SIZE + BOOT_EXTRA_ARGS_SIZE +1], nstr[BOOT_ARGS_SIZE + BOOT_EXTRA_ARGS_SIZE +1];
+  int differ = 0;
+
+  if (oldimg->offset != newimg->offset)
+    {
+      jsonWriterStartObject(w, "magicOffset");
+      jsonWriterWriteNumber(w, "old", oldimg->offset);
+      jsonWriterWriteNumber(w, "new", newimg->offset);
+      jsonWriterEndObject(w);
+      differ = 1;
+    }
+
+  differ |= diffAddresses(w, "kernelAddr", o->kernel_addr, n->kernel_addr);
+  differ |= diffAddresses(w, "ramdiskAddr", o->ramdisk_addr, n->ramdisk_addr);
+  differ |= diffAddresses(w, "secondAddr", o->second_addr, n->second_addr);
+  differ |= diffAddresses(w, "tagsAddr", o->tags_addr, n->tags_addr);
+
+  snprintf(ostr, sizeof(ostr), "%u", o->page_size);
+  snprintf(nstr, sizeof(nstr), "%u", n->page_size);
+  differ |= diffStrings(w, (const char *)BOOTIMG_XMLELT_PAGESIZE_NAME, ostr, nstr);
+
+  snprintf(ostr, sizeof(ostr), "%d.%d.%d",
+           (o->os_version >> 25)&0x7f, (o->os_version >> 18)&0x7f, (o->os_version >> 11)&0x7f);
+  snprintf(nstr, sizeof(nstr), "%d.%d.%d",
+           (n->os_version >> 25)&0x7f, (n->os_version >> 18)&0x7f, (n->os_version >> 11)&0x7f);
+  differ |= diffStrings(w, (const char *)BOOTIMG_XMLELT_BOARDOSVERSION_NAME, ostr, nstr);
+
+  snprintf(ostr, sizeof(ostr), "%d-%02d",
+           ((o->os_version >> 4)&0x7f) + 2000, o->os_version&0xf);
+  snprintf(nstr, sizeof(nstr), "%d-%02d",
+           ((n->os_version >> 4)&0x7f) + 2000, n->os_version&0xf);
+  differ |= diffStrings(w, (const char *)BOOTIMG_XMLELT_BOARDOSPATCHLVL_NAME, ostr, nstr);
+
+  snprintf(ostr, sizeof(ostr), "%.*s", BOOT_NAME_SIZE, o->name);
+  snprintf(nstr, sizeof(nstr), "%.*s", BOOT_NAME_SIZE, n->name);
+  differ |= diffStrings(w, (const char *)BOOTIMG_XMLELT_BOARDNAME_NAME, ostr, nstr);
+
+  getCmdline(o, ostr);
+  getCmdline(n, nstr);
+  differ |= diffStrings(w, (const char *)BOOTIMG_XMLELT_CMDLINE_NAME, ostr, nstr);
+
+  hexString((const uint8_t *)o->id, sizeof(o->id), ostr);
+  hexString((const uint8_t *)n->id, sizeof(n->id), nstr);
+  differ |= diffStrings(w, "id", ostr, nstr);
+
+  return differ;
+}
+
+/*
+ * Report differing byte ranges. Equal blocks are skipped with memcmp.
+ */
+static void
+diffBytes(bootimgJsonWriter_p w, const uint8_t *a, size_t alen, const uint8_t *b, size_t blen)
+{
+  size_t common = BOOTIMG_MIN(alen, blen);
+  size_t differing = 0, nranges = 0, i = 0;
+
+  jsonWriterStartArray(w, "ranges");
+  while (i < common)
+    {
+      size_t start, last;
+
+      if (!(i % DIFF_BLOCK_SIZE) && common - i >= DIFF_BLOCK_SIZE &&
+          !memcmp((const void *)(a + i), (const void *)(b + i), DIFF_BLOCK_SIZE))
+        {
+          i += DIFF_BLOCK_SIZE;
+          continue;
+        }
+      if (a[i] == b[i])
+        {
+          i++;
+          continue;
+        }
+
+      /* grow the range until a long enough equal run */
+      start = last = i;
+      for (i++; i < common && i - last <= DIFF_MERGE_GAP; i++)
+        if (a[i] != b[i])
+          {
+            last = i;
+            differing++;
+          }
+      differing++;
+
+      if (nranges++ < (size_t)rval)
+        {
+          jsonWriterStartArray(w, NULL);
+          jsonWriterWriteNumber(w, NULL, start);
+          jsonWriterWriteNumber(w, NULL, last - start +1);
+          jsonWriterEndArray(w);
+        }
+      i = last +1;
+    }
+  jsonWriterEndArray(w);
+
+  jsonWriterWriteNumber(w, "differingBytes", differing);
+  jsonWriterWriteNumber(w, "rangeCount", nranges);
+  if (nranges > (size_t)rval)
+    jsonWriterWriteBool(w, "rangesTruncated", 1);
+  if (alen != blen)
+    jsonWriterWriteNumber(w, "sizeDelta", (long long)blen - (long long)alen);
+}
+
+/*
+ * Compare the entry lists of two ramdisks. Returns -1 if one of them
+ * is not a (gzip'ed) newc cpio archive.
+ */
+static int
+diffRamdisk(bootimgJsonWriter_p w, bootimgDiffImage_p oldimg, bootimgDiffImage_p newimg)
+{
+  bootimgCpioArchive_t oa, na;
+  size_t no = 0, nn = 0;
+
+  if (cpioLoad(oldimg->data[BOOTIMG_COMPONENT_RAMDISK], oldimg->size[BOOTIMG_COMPONENT_RAMDISK], &oa) < 0)
+    return -1;
+  if (cpioLoad(newimg->data[BOOTIMG_COMPONENT_RAMDISK], newimg->size[BOOTIMG_COMPONENT_RAMDISK], &na) < 0)
+    {
+      cpioRelease(&oa);
+      return -1;
+    }
+  cpioSortEntries(&oa);
+  cpioSortEntries(&na);
+
+  jsonWriterStartObject(w, "entries");
+  jsonWriterWriteNumber(w, "oldCount", oa.count);
+  jsonWriterWriteNumber(w, "newCount", na.count);
+
+  /* three passes on the merged sorted lists keep the arrays contiguous */
+  jsonWriterStartArray(w, "added");
+  for (no = 0, nn = 0; nn < na.count; )
+    {
+      int cmp = no < oa.count ? strcmp(oa.entries[no].name, na.entries[nn].name) : 1;
+      if (cmp < 0)
+        no++;
+      else if (cmp > 0)
+        jsonWriterWriteString(w, NULL, na.entries[nn++].name);
+      else
+        no++, nn++;
+    }
+  jsonWriterEndArray(w);
+
+  jsonWriterStartArray(w, "removed");
+  for (no = 0, nn = 0; no < oa.count; )
+    {
+      int cmp = nn < na.count ? strcmp(oa.entries[no].name, na.entries[nn].name) : -1;
+      if (cmp < 0)
+        jsonWriterWriteString(w, NULL, oa.entries[no++].name);
+      else if (cmp > 0)
+        nn++;
+      else
+        no++, nn++;
+    }
+  jsonWriterEndArray(w);
+
+  jsonWriterStartArray(w, "changed");
+  for (no = 0, nn = 0; no < oa.count && nn < na.count; )
+    {
+      bootimgCpioEntry_p oe = &oa.entries[no], ne = &na.entries[nn];
+      int cmp = strcmp(oe->name, ne->name);
+
+      if (cmp < 0)
+        {
+          no++;
+          continue;
+        }
+      if (cmp > 0)
+        {
+          nn++;
+          continue;
+        }
+      no++, nn++;
+
+      if (oe->mode == ne->mode && oe->uid == ne->uid && oe->gid == ne->gid &&
+          oe->mtime == ne->mtime && oe->rdevmajor == ne->rdevmajor &&
+          oe->rdevminor == ne->rdevminor && oe->filesize == ne->filesize &&
+          !memcmp((const void *)oe->data, (const void *)ne->data, oe->filesize))
+        continue;
+
+      jsonWriterStartObject(w, NULL);
+      jsonWriterWriteString(w, "name", oe->name);
+      jsonWriterStartArray(w, "fields");
+      if (oe->mode != ne->mode)
+        jsonWriterWriteString(w, NULL, "mode");
+      if (oe->uid != ne->uid)
+        jsonWriterWriteString(w, NULL, "uid");
+      if (oe->gid != ne->gid)
+        jsonWriterWriteString(w, NULL, "gid");
+      if (oe->mtime != ne->mtime)
+        jsonWriterWriteString(w, NULL, "mtime");
+      if (oe->rdevmajor != ne->rdevmajor || oe->rdevminor != ne->rdevminor)
+        jsonWriterWriteString(w, NULL, "rdev");
+      if (oe->filesize != ne->filesize)
+        jsonWriterWriteString(w, NULL, "size");
+      if (oe->filesize != ne->filesize ||
+          memcmp((const void *)oe->data, (const void *)ne->data, oe->filesize))
+        jsonWriterWriteString(w, NULL, "content");
+      jsonWriterEndArray(w);
+      if (oe->filesize == ne->filesize &&
+          memcmp((const void *)oe->data, (const void *)ne->data, oe->filesize))
+        diffBytes(w, oe->data, oe->filesize, ne->data, ne->filesize);
+      jsonWriterEndObject(w);
+    }
+  jsonWriterEndArray(w);
+  jsonWriterEndObject(w);
+
+  cpioRelease(&oa);
+  cpioRelease(&na);
+
+  return 0;
+}
+
+/*
+ * Compare one component: digests first, then details if they differ
+ */
+int
+diffComponent(bootimgJsonWriter_p w, bootimgDiffImage_p oldimg, bootimgDiffImage_p newimg, int nc)
+{
+  char hex[2 * BOOTIMG_DIGEST_SIZE +1];
+  const char *status;
+  int differ = 1;
+
+  if (!oldimg->size[nc] && !newimg->size[nc])
+    return 0;
+
+  if (!oldimg->size[nc])
+    status = "added";
+  else if (!newimg->size[nc])
+    status = "removed";
+  else if (oldimg->size[nc] == newimg->size[nc] &&
+           !memcmp((const void *)oldimg->digest[nc], (const void *)newimg->digest[nc], BOOTIMG_DIGEST_SIZE))
+    status = "same", differ = 0;
+  else
+    status = "changed";
+
+  jsonWriterStartObject(w, component_names[nc]);
+  jsonWriterWriteString(w, "status", status);
+  if (oldimg->size[nc])
+    {
+      jsonWriterWriteNumber(w, "oldSize", oldimg->size[nc]);
+      hexString(oldimg->digest[nc], BOOTIMG_DIGEST_SIZE, hex);
+      jsonWriterWriteString(w, "oldDigest", hex);
+    }
+  if (newimg->size[nc])
+    {
+      jsonWriterWriteNumber(w, "newSize", newimg->size[nc]);
+      hexString(newimg->digest[nc], BOOTIMG_DIGEST_SIZE, hex);
+      jsonWriterWriteString(w, "newDigest", hex);
+    }
+
+  /* descend only in changed components */
+  if (oldimg->size[nc] && newimg->size[nc] && differ)
+    {
+      if (nc != BOOTIMG_COMPONENT_RAMDISK || diffRamdisk(w, oldimg, newimg) < 0)
+        {
+          jsonWriterStartObject(w, "bytes");
+          diffBytes(w, oldimg->data[nc], oldimg->size[nc], newimg->data[nc], newimg->size[nc]);
+          jsonWriterEndObject(w);
+        }
+    }
+  jsonWriterEndObject(w);
+
+  return differ;
+}
+
+/* Local Variables:                                                */
+/* mode: C                                                         */
+/* comment-column: 0                                               */
+/* End:                                                            */
@@ -52,6 +52,9 @@
 # include <assert.h>
 #endif
 #include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <ftw.h>
 
 #ifdef USE_LIBXML2
 # include <libxml/xmlversion.h>
@@ -63,7 +66,6 @@
 # endif /* defined(LIBXML_WRITER_ENABLED) && defined(LIBXML_OUTPUT_ENABLED) */
 #endif
 
-#include "cJSON.h"
 
 #ifdef USE_OPENSSL
 # ifndef OPENSSL_NO_SHA256
@@ -77,24 +79,18 @@
 #include "bootimg.h"
 #include "bootimg-priv.h"
 #include "bootimg-utils.h"
+#include "bootimg-jsonw.h"
+#include "bootimg-meta.h"
+#include "bootimg-tar.h"
+#include "bootimg-cpio.h"
+#include "bootimg-gzip.h"
+#include "bootimg-io.h"
+#include "bootimg-input.h"
+#include "bootimg-stats.h"
+#include "bootimg-log.h"
 
 #define BUF_LENGTH 1024
-
-#define BOARD_OS_VERSION_COMMENT                                        \
-  "This is the version of the board Operating System. It is ususally "  \
-  "the Android version with major, minor, micro format. Values are computed " \
-  "as: major = (os_version >> 14) & 0x7f, minor = (os_version >> 7) & 0x7f, " \
-  "micro = os_version & 0x7f"
-
-#define BOARD_OS_PATCH_LEVEL_COMMENT                                    \
-  "This is the version of the board Operating System patch Level (Month & Year). " \
-  "Values are computed as: year = (os_patch_level >> 4) + 2000, month = " \
-  "os_patch_level & 0xf"
-
-/*
- * TODO
- * Some comments for others fields of image are missing
- */
+#define STREAM_CHUNK (256*1024)
 
 /*
  * Options flags & values
@@ -102,8 +98,15 @@
  * - o: outdir. oflag € [0, 1]
  * - x: xml metadata file. xflag € [0, 1]
  * - j: json metadata file. jflag € [0, 1]
+ * - c: compact json metadata. cflag € [0, 1]
+ * - b: binary metadata file. bflag € [0, 1]
  * - p: page size. pflag € [0, 1]
  * - n: basename for metadata file. nflag € [0, 1]
+ * - t: tar stream on stdout. tflag € [0, 1]
+ * - D: keep image data out of the page cache. Dflag € [0, 1]
+ * - S: per phase timings & counters on stderr. Sflag € [0, 1]
+ * - O: extract only some components. Oflag € [0, 1]
+ * - L: list the ramdisk entries. Lflag € [0, 1]
  */
 int vflag = 0;
 int oflag = 0;
@@ -111,12 +114,19 @@ int oflag = 0;
 int xflag = 0;
 #endif
 int jflag = 0;
+int cflag = 0;
+int bflag = 0;
 int nflag = 0;
 int iflag = 0;
 int pflag = 0;
 int Fflag = 0;
 int Vflag = 0;
 int dflag = 0;
+int tflag = 0;
+int Dflag = 0;
+int Sflag = 0;
+int Oflag = 0;
+int Lflag = 0;
 int rrflag = 0;
 int brrflag = 0;
 int errflag = 0;
@@ -131,6 +141,14 @@ char *oval = (char *)NULL;
 size_t pval = 0L;
 /* Fval: ramdisk FS dir */
 char *Fval = (char *)NULL;
+/* Sval: stats report format */
+int Sval = BOOTIMG_STATS_FORMAT_TEXT;
+/* Oval: components to extract, a bit per BOOTIMG_COMPONENT_* */
+unsigned Oval = 0;
+/* Lval: SHA256 of the regular files in the ramdisk listing */
+int Lval = 0;
+
+#define EXTRACT_COMPONENT(nc) (!Oflag || (Oval & (1 << (nc))))
 
 /* rewrite rules */
 char *basename_rr = (char *)NULL;
@@ -156,6 +174,12 @@ static const char *progusage =
   "usage: %s [options] imgfile1 [imgfile2 ... imgfileN]\n"
   "       %s --help\n";
 static const char *proghelp =
+  "\n"
+  "       image files:\n"
+  "       %s An imgfile may also be gzip or lz4 compressed, an Android\n"
+  "       %s sparse image or a zip archive, possibly nested:\n"
+  "       %s 'archive.zip!path/boot.img' picks an entry, boot.img by\n"
+  "       %s default.\n"
   "\n"
   "       basic user options:\n"
   "       %s -h --help                     display this message.\n"
@@ -184,6 +208,11 @@ static const char *proghelp =
   "       %s                               This option is exclusive with xml.\n"
   "       %s                               Only the last one will be taken into\n"
   "       %s                               account.\n"
+  "       %s -c --compact                  write the json metadata without any\n"
+  "       %s                               whitespace (for machine consumers).\n"
+  "       %s -b --binary                   generate a binary metadata file\n"
+  "       %s                               (.bmeta) with component offsets\n"
+  "       %s                               and digests for fast reloading.\n"
   "       %s --image-basename-rewrite-cmd=<sed-cmd>\n"
   "       %s --image-ext-rewrite-cmd=<sed-cmd>\n"
   "       %s --image-filename-rewrite-cmd=<sed-cmd>\n"
@@ -192,6 +221,16 @@ static const char *proghelp =
   "       %s                               a sed command string that will be\n"
   "       %s                               on resp. basename, extension,\n"
   "       %s                               filename and pathname.\n"
+  "       %s -O --only=<list>              Only extract the components of the\n"
+  "       %s                               comma separated <list> among kernel,\n"
+  "       %s                               ramdisk, second & dtb. The others\n"
+  "       %s                               are not read at all but are still\n"
+  "       %s                               described in the metadata.\n"
+  "       %s -L --list-ramdisk[=sha256]    Do not extract anything but list the\n"
+  "       %s                               ramdisk entries (path, mode, uid,\n"
+  "       %s                               gid & size) as JSON lines on stdout,\n"
+  "       %s                               with the SHA256 of regular files if\n"
+  "       %s                               asked. Nothing is written to disk.\n"
   "       %s -F --fs=[<fsdir>]             Extract the filesystem cpio archive.\n"
   "       %s                               in <fsdir>.\n"
 #ifdef USE_OPENSSL
@@ -200,6 +239,18 @@ static const char *proghelp =
 #endif
   "       %s -d --dummy                    Dummy run: display id and verity but\n"
   "       %s                               do not extract/create anything\n"
+  "       %s -t --tar                      Write components & metadata as a tar\n"
+  "       %s                               stream on stdout instead of files.\n"
+  "       %s                               The image is read in a single forward\n"
+  "       %s                               pass: use '-' as imgfile for stdin.\n"
+  "       %s -D --no-cache                 Keep image data out of the page cache:\n"
+  "       %s                               O_DIRECT reads for digests & verity,\n"
+  "       %s                               pages dropped once read or written\n"
+  "       %s                               otherwise. For big image archives.\n"
+  "       %s -S --stats[=text|json]        Report time, bytes read & written,\n"
+  "       %s                               syscalls and allocations of each\n"
+  "       %s                               phase on stderr, for each image and\n"
+  "       %s                               for the whole batch.\n"
   "       %s -n --name=<basename>          provide a basename template for the\n"
   "       %s                               metadata file.\n";
 
@@ -214,6 +265,8 @@ struct option long_options[] = {
   {"xml",                        no_argument,       0,      'x' },
 #endif
   {"json",                       no_argument,       0,      'j' },
+  {"compact",                    no_argument,       0,      'c' },
+  {"binary",                     no_argument,       0,      'b' },
   {"identity",                   no_argument,       0,      'i' },
   {"fs",                         optional_argument, 0,      'F' },
   {"pagesize",                   required_argument, 0,      'p' },
@@ -226,19 +279,24 @@ struct option long_options[] = {
   {"verity",                     no_argument,       0,      'V' },
 #endif
   {"dummy",                      no_argument,       0,      'd' },
+  {"tar",                        no_argument,       0,      't' },
+  {"no-cache",                   no_argument,       0,      'D' },
+  {"stats",                      optional_argument, 0,      'S' },
+  {"only",                       required_argument, 0,      'O' },
+  {"list-ramdisk",               optional_argument, 0,      'L' },
   {0,                            0,                 0,       0  }
 };
 #ifdef USE_LIBXML2
 # ifdef USE_OPENSSL
-#  define BOOTIMG_OPTSTRING "v::o:n:xjiF::p:hVd"
+#  define BOOTIMG_OPTSTRING "v::o:n:xjcbiF::p:hVdtDS::O:L::"
 # else
-#  define BOOTIMG_OPTSTRING "v::o:n:xjiF::p:hd"
+#  define BOOTIMG_OPTSTRING "v::o:n:xjcbiF::p:hdtDS::O:L::"
 # endif
 #else
 # ifdef USE_OPENSSL
-#  define BOOTIMG_OPTSTRING "v::o:n:jiF::p:hVd"
+#  define BOOTIMG_OPTSTRING "v::o:n:jcbiF::p:hVdtDS::O:L::"
 # else
-#  define BOOTIMG_OPTSTRING "v::o:n:jiF::p:hd"
+#  define BOOTIMG_OPTSTRING "v::o:n:jcbiF::p:hdtDS::O:L::"
 # endif
 #endif
 const char *unknown_option = "????";
@@ -253,32 +311,15 @@ extern int optind;
  * Forward decls
  */
 int           extractBootImageMetadata(const char *, const char *);
+int           streamBootImage(const char *, int);
+int           listRamdisk(const char *, bootimgJsonWriter_p);
 void          printusage(int);
-boot_img_hdr *findBootMagic(FILE *, boot_img_hdr *, off_t *);
-int           readPadding(FILE*, unsigned, int);
-size_t        extractKernelImage(FILE *, boot_img_hdr *, const char *, const char *);
-size_t        extractRamdiskImage(FILE *, boot_img_hdr *, const char *, const char *);
-size_t        extractSecondBootloaderImage(FILE *, boot_img_hdr *, const char *, const char *);
-size_t        extractDeviceTreeImage(FILE *, boot_img_hdr *, const char *, const char *);
-void          extractRamdiskFiles(const char *, const char *);
-
-/*
- * Used for cJSON allocations
- */
-void *
-my_malloc_fn(size_t sz)
-{
-  return malloc(sz);
-}
-
-/*
- * Used for cJSON allocations
- */
-void
-my_free_fn(void *ptr)
-{
-  free(ptr);
-}
+unsigned      pagePadding(unsigned, int);
+int           extractComponentImage(bootimgIo_p, bootimgInput_p, off64_t, uint32_t, const char *,
+                                    const char *, int, unsigned char *, size_t *, unsigned *);
+void         *extractRamdiskProbe(const char *, size_t *, char **);
+void          extractRamdiskFiles(const char *, const char *, void *, size_t);
+unsigned      parseComponentList(const char *);
 
 /*
  * main
@@ -288,17 +329,12 @@ main(int argc, char **argv)
 {
   int c;
   int digit_optind = 0;
-  cJSON_Hooks hooks;
-  
-  hooks.malloc_fn = my_malloc_fn;
-  hooks.free_fn = my_free_fn;
-  
-  cJSON_InitHooks(&hooks);
   
   progname = (rindex(argv[0], '/') ? rindex(argv[0], '/')+1 : argv[0]);
   blankname = (char *)alloca(strlen(progname) +1);
-  blankname[strlen(progname) +1] = 0;
+  blankname[strlen(progname)] = 0;
   memset((void *)blankname, (int)' ', (size_t)strlen(progname));
+  logInit();
   oval = get_current_dir_name();
   
 #ifdef USE_LIBXML2
@@ -335,29 +371,33 @@ main(int argc, char **argv)
             case 0:
               basename_rr = optarg;
               brrflag = 0;
-              if (vflag > 3)
-                fprintf(stdout, "%s: option %s set to '%s'\n", progname, getLongOptionName(long_options, rrflag), basename_rr);
+              BOOTIMG_LOG(BOOTIMG_LOG_MAIN, BOOTIMG_LOG_TRACE,
+                          "option %s set to '%s'",
+                          getLongOptionName(long_options, rrflag), basename_rr);
               break;
 
             case 1:
               extension_rr = optarg;
               errflag = 0;
-              if (vflag > 3)
-                fprintf(stdout, "%s: option %s set to '%s'\n", progname, getLongOptionName(long_options, rrflag), extension_rr);
+              BOOTIMG_LOG(BOOTIMG_LOG_MAIN, BOOTIMG_LOG_TRACE,
+                          "option %s set to '%s'",
+                          getLongOptionName(long_options, rrflag), extension_rr);
               break;
 
             case 2:
               filename_rr = optarg;
               frrflag = 0;
-              if (vflag > 3)
-                fprintf(stdout, "%s: option %s set to '%s'\n", progname, getLongOptionName(long_options, rrflag), filename_rr);
+              BOOTIMG_LOG(BOOTIMG_LOG_MAIN, BOOTIMG_LOG_TRACE,
+                          "option %s set to '%s'",
+                          getLongOptionName(long_options, rrflag), filename_rr);
               break;
 
             case 3:
               pathname_rr = optarg;
               prrflag = 0;
-              if (vflag > 3)
-                fprintf(stdout, "%s: option %s set to '%s'\n", progname, getLongOptionName(long_options, rrflag), pathname_rr);
+              BOOTIMG_LOG(BOOTIMG_LOG_MAIN, BOOTIMG_LOG_TRACE,
+                          "option %s set to '%s'",
+                          getLongOptionName(long_options, rrflag), pathname_rr);
               break;
             }
           rrflag = 0;
@@ -368,9 +408,8 @@ main(int argc, char **argv)
             vflag += strtol(optarg, NULL, 10);
           else
             vflag++;
-          if (vflag > 3)
-            fprintf(stderr, "%s: option %s/%c set to %d\n",
-                    progname, getLongOptionName(long_options, c), c, vflag);
+          BOOTIMG_LOG(BOOTIMG_LOG_MAIN, BOOTIMG_LOG_TRACE,
+                      "option %s/%c set to %d", getLongOptionName(long_options, c), c, vflag);
           break;
 
         case 'o':
@@ -393,63 +432,123 @@ main(int argc, char **argv)
                 oval = newval;
               }
             free((void *)oldval);
-            if (vflag)
-              fprintf(stderr, "%s: option %s/%c (=%d) set to '%s'\n",
-                      progname, getLongOptionName(long_options, c), c, oflag, oval);
+            BOOTIMG_LOG(BOOTIMG_LOG_MAIN, BOOTIMG_LOG_INFO,
+                        "option %s/%c (=%d) set to '%s'",
+                        getLongOptionName(long_options, c), c, oflag, oval);
           }
           break;
 
 #ifdef USE_LIBXML2
         case 'x':
           xflag = 1;
-          if (vflag > 3)
-            fprintf(stderr, "%s: option %s/%c (=%d) set\n",
-                    progname, getLongOptionName(long_options, c), c, xflag);
+          BOOTIMG_LOG(BOOTIMG_LOG_MAIN, BOOTIMG_LOG_TRACE,
+                      "option %s/%c (=%d) set", getLongOptionName(long_options, c), c, xflag);
           break;
 #endif
           
         case 'j':
           jflag = 1;
-          if (vflag > 3)
-            fprintf(stderr, "%s: option %s/%c (=%d) set\n",
-                    progname, getLongOptionName(long_options, c), c, jflag);
+          BOOTIMG_LOG(BOOTIMG_LOG_MAIN, BOOTIMG_LOG_TRACE,
+                      "option %s/%c (=%d) set", getLongOptionName(long_options, c), c, jflag);
+          break;
+          
+        case 'c':
+          cflag = 1;
+          BOOTIMG_LOG(BOOTIMG_LOG_MAIN, BOOTIMG_LOG_TRACE,
+                      "option %s/%c (=%d) set", getLongOptionName(long_options, c), c, cflag);
+          break;
+          
+        case 'b':
+          bflag = 1;
+          BOOTIMG_LOG(BOOTIMG_LOG_MAIN, BOOTIMG_LOG_TRACE,
+                      "option %s/%c (=%d) set", getLongOptionName(long_options, c), c, bflag);
           break;
           
         case 'n':
           nflag = 1;
           nval = optarg;
-          if (vflag > 3)
-            fprintf(stderr, "%s: option %s/%c (=%d) set with value '%s'\n",
-                    progname, getLongOptionName(long_options, c), c, nflag, nval);
+          BOOTIMG_LOG(BOOTIMG_LOG_MAIN, BOOTIMG_LOG_TRACE,
+                      "option %s/%c (=%d) set with value '%s'",
+                      getLongOptionName(long_options, c), c, nflag, nval);
           break;
 
         case 'i':
           iflag = 1;
-          if (vflag > 3)
-            fprintf(stderr, "%s: option %s/%c set\n",
-                    progname, getLongOptionName(long_options, c), c);
+          BOOTIMG_LOG(BOOTIMG_LOG_MAIN, BOOTIMG_LOG_TRACE,
+                      "option %s/%c set", getLongOptionName(long_options, c), c);
           break;
           
         case 'V':
           Vflag = 1;
-          if (vflag > 3)
-            fprintf(stderr, "%s: option %s/%c set\n",
-                    progname, getLongOptionName(long_options, c), c);
+          BOOTIMG_LOG(BOOTIMG_LOG_MAIN, BOOTIMG_LOG_TRACE,
+                      "option %s/%c set", getLongOptionName(long_options, c), c);
           break;
           
         case 'd':
           dflag = 1;
-          if (vflag > 3)
-            fprintf(stderr, "%s: option %s/%c set\n",
-                    progname, getLongOptionName(long_options, c), c);
+          BOOTIMG_LOG(BOOTIMG_LOG_MAIN, BOOTIMG_LOG_TRACE,
+                      "option %s/%c set", getLongOptionName(long_options, c), c);
+          break;
+          
+        case 't':
+          tflag = 1;
+          BOOTIMG_LOG(BOOTIMG_LOG_MAIN, BOOTIMG_LOG_TRACE,
+                      "option %s/%c set", getLongOptionName(long_options, c), c);
+          break;
+          
+        case 'D':
+          Dflag = 1;
+          BOOTIMG_LOG(BOOTIMG_LOG_MAIN, BOOTIMG_LOG_TRACE,
+                      "option %s/%c set", getLongOptionName(long_options, c), c);
+          break;
+          
+        case 'S':
+          Sflag = 1;
+          if ((Sval = statsParseFormat(optarg)) < 0)
+            {
+              fprintf(stderr, "%s: error: unknown stats format '%s'!\n", progname, optarg);
+              exit(1);
+            }
+          statsEnable(Sval);
+          BOOTIMG_LOG(BOOTIMG_LOG_MAIN, BOOTIMG_LOG_TRACE,
+                      "option %s/%c (=%d) set with value '%s'",
+                      getLongOptionName(long_options, c), c, Sflag, optarg ? optarg : "text");
           break;
           
+        case 'O':
+          Oflag = 1;
+          if (!(Oval = parseComponentList(optarg)))
+            {
+              fprintf(stderr, "%s: error: invalid component list '%s'!\n", progname, optarg);
+              exit(1);
+            }
+          BOOTIMG_LOG(BOOTIMG_LOG_MAIN, BOOTIMG_LOG_TRACE,
+                      "option %s/%c (=%d) set with value '%s'",
+                      getLongOptionName(long_options, c), c, Oflag, optarg);
+          break;
+
+        case 'L':
+          Lflag = 1;
+          /* -L=sha256 as with the long option */
+          if (optarg && *optarg == '=')
+            optarg++;
+          if (optarg && strcmp(optarg, "sha256"))
+            {
+              fprintf(stderr, "%s: error: unknown ramdisk listing digest '%s'!\n", progname, optarg);
+              exit(1);
+            }
+          Lval = (optarg != (char *)NULL);
+          BOOTIMG_LOG(BOOTIMG_LOG_MAIN, BOOTIMG_LOG_TRACE,
+                      "option %s/%c (=%d) set with value '%s'",
+                      getLongOptionName(long_options, c), c, Lflag, optarg ? optarg : "");
+          break;
+
         case 'p':
           pflag = 1;
           pval = strtol(optarg, NULL, 10);
-          if (vflag > 3)
-            fprintf(stderr, "%s: option %s/%c (=%d) set with value '%lu'\n",
-                    progname, getLongOptionName(long_options, c), c, pflag, pval);
+          BOOTIMG_LOG(BOOTIMG_LOG_MAIN, BOOTIMG_LOG_TRACE,
+                      "option %s/%c (=%d) set with value '%lu'",
+                      getLongOptionName(long_options, c), c, pflag, pval);
           break;
 
         case 'F':
@@ -467,9 +566,9 @@ main(int argc, char **argv)
               optind++;
             }
           
-          if (vflag > 3)
-            fprintf(stderr, "%s: option %s/%c (=%d) set with value '%s'\n",
-                    progname, getLongOptionName(long_options, c), c, Fflag, Fval);
+          BOOTIMG_LOG(BOOTIMG_LOG_MAIN, BOOTIMG_LOG_TRACE,
+                      "option %s/%c (=%d) set with value '%s'",
+                      getLongOptionName(long_options, c), c, Fflag, Fval);
           break;
 
         case 'h':
@@ -494,10 +593,103 @@ main(int argc, char **argv)
 
 #ifdef USE_LIBXML2
   /* XML is default metadata format */
-  if (!xflag && !jflag)
+  if (!xflag && !jflag && !bflag)
     xflag = 1;
 #endif
 
+  if (Fflag && !EXTRACT_COMPONENT(BOOTIMG_COMPONENT_RAMDISK))
+    {
+      fprintf(stderr, "%s: error: option --fs needs the ramdisk in --only!\n", progname);
+      exit(1);
+    }
+
+  if (Dflag)
+    ioSetDefaultFlags(BOOTIMG_IO_FLAG_NOCACHE);
+
+  if (Lflag && optind < argc)
+    {
+      bootimgJsonWriter_p w;
+      int rc = 0;
+
+      if (tflag || Fflag)
+        {
+          fprintf(stderr, "%s: error: options --fs and --tar cannot be used with --list-ramdisk!\n", progname);
+          exit(1);
+        }
+      if (!(w = jsonWriterNew(STDOUT_FILENO, JSON_WRITER_FLAG_COMPACT | JSON_WRITER_FLAG_LINES)))
+        {
+          fprintf(stderr, "%s: error: cannot allocate memory for the ramdisk listing!\n", progname);
+          exit(1);
+        }
+
+      while (optind < argc)
+        {
+          statsImageBegin();
+          if (listRamdisk(argv[optind++], w) < 0)
+            {
+              fprintf(stderr, "%s: error: cannot list the ramdisk of '%s'!\n", progname, argv[optind-1]);
+              rc = 1;
+            }
+          statsImageDone(argv[optind-1]);
+        }
+
+      if (jsonWriterFree(w) < 0)
+        {
+          fprintf(stderr, "%s: error: cannot write the ramdisk listing!\n", progname);
+          rc = 1;
+        }
+      statsBatchDone();
+      exit(rc);
+    }
+
+  if (tflag && optind < argc)
+    {
+      int outfd, rc = 0;
+
+      if (Fflag || Vflag)
+        {
+          fprintf(stderr, "%s: error: options --fs and --verity cannot be used with --tar!\n", progname);
+          exit(1);
+        }
+      if (isatty(STDOUT_FILENO))
+        {
+          fprintf(stderr, "%s: error: refusing to write a tar stream to a terminal!\n", progname);
+          exit(1);
+        }
+
+      /* stdout carries the archive: messages go to stderr */
+      fflush(stdout);
+      if ((outfd = dup(STDOUT_FILENO)) < 0 || dup2(STDERR_FILENO, STDOUT_FILENO) < 0)
+        {
+          perror(progname);
+          exit(1);
+        }
+
+      while (optind < argc)
+        {
+          statsImageBegin();
+          if (streamBootImage(argv[optind++], outfd) < 0)
+            {
+              fprintf(stderr, "%s: error: image data streaming failure for '%s'\n", progname, argv[optind-1]);
+              rc = 1;
+            }
+          statsImageDone(argv[optind-1]);
+        }
+
+      if (tarWriteEnd(outfd) < 0)
+        {
+          fprintf(stderr, "%s: error: cannot write tar stream!\n", progname);
+          rc = 1;
+        }
+      close(outfd);
+      statsBatchDone();
+
+#ifdef USE_LIBXML2
+      xmlCleanupParser();
+#endif
+      exit(rc);
+    }
+
   if (optind < argc)
     {
       while (optind < argc)
@@ -545,15 +737,28 @@ main(int argc, char **argv)
                 }
             }
 
-          if (extractBootImageMetadata(argv[optind++], oval) && vflag)
-            fprintf(stdout, "%s: image data successfully extracted from '%s'\n", progname, argv[optind-1]);
-          else if (vflag)
-            fprintf(stderr, "%s: error: image data extraction failure for '%s'\n", progname, argv[optind-1]);
+          statsImageBegin();
+          if (extractBootImageMetadata(argv[optind++], oval))
+            BOOTIMG_LOG(BOOTIMG_LOG_IMAGE, BOOTIMG_LOG_INFO,
+                        "image data successfully extracted from '%s'", argv[optind-1]);
+          else
+            BOOTIMG_LOG(BOOTIMG_LOG_IMAGE, BOOTIMG_LOG_INFO,
+                        "error: image data extraction failure for '%s'", argv[optind-1]);
+          if (Sflag)
+            {
+              /* the image is done once its files are written */
+              ioWaitAll(ioDefault());
+              statsImageDone(argv[optind-1]);
+            }
 
           if (!oflag)
             free(oval);
         }
 
+      /* component files still being written */
+      ioReleaseDefault();
+      statsBatchDone();
+
 #ifdef USE_LIBXML2
       /*
        * Cleanup function for the XML library.
@@ -615,151 +820,312 @@ printusage(int withhelp)
 }
 
 /*
- * Extract the kernel image in a file
+ * A component being extracted: read from the image, then written to
+ * its file once the read is done. The job outlives the call that
+ * queued it until the write completes.
  */
-size_t
-extractKernelImage(FILE *fp, boot_img_hdr *hdr, const char *outdir, const char *basename)
+typedef struct _extractJob_st
 {
-  size_t readsz = 0;
-  const char *filename = getImageFilename(basename, outdir, BOOTIMG_KERNEL_FILENAME);
-  FILE *k = fopen(filename, "w");
-  
-  if (k)
+  bootimgIo_p          io;
+  const char          *what;
+  int                  phase;           /* --stats phase */
+  char                *filename;
+  int                  fd;
+  byte                *data;
+  uint32_t             size;
+  unsigned char       *digest;
+  size_t              *readsz;
+  unsigned            *readsLeft;
+} extractJob_t, *extractJob_p;
+
+static void
+extractJobFree(extractJob_p job)
+{
+  if (job->fd >= 0)
+    {
+      close(job->fd);
+      statsCount(job->phase, BOOTIMG_STATS_SYSCALLS, 1);
+    }
+  free((void *)job->data);
+  free((void *)job->filename);
+  free((void *)job);
+}
+
+static void
+extractWriteDone(void *arg, ssize_t res)
+{
+  extractJob_p job = (extractJob_p)arg;
+  uint64_t start = statsBegin(job->phase);
+  int phase = job->phase;
+
+  if (res != (ssize_t)job->size)
+    fprintf(stderr, "%s: error: cannot write %s image file '%s': %s\n",
+            progname, job->what, job->filename, res < 0 ? strerror(-res) : "short write");
+  extractJobFree(job);
+  statsEnd(phase, start);
+}
+
+static void
+extractReadDone(void *arg, ssize_t res)
+{
+  extractJob_p job = (extractJob_p)arg;
+  int phase = job->phase;
+  uint64_t start = statsBegin(phase);
+
+  (*job->readsLeft)--;
+  do
     {
-      byte* kernel = (byte*)malloc(hdr->kernel_size);
-      if (kernel)
+      if (res != (ssize_t)job->size)
         {
-          readsz = fread(kernel, hdr->kernel_size, 1, fp);
-          if (readsz != 1)
-            fprintf(stderr, "%s: error: expected %d bytes read but got %ld !\n",
-                    progname, hdr->kernel_size, readsz * hdr->kernel_size);
-          fwrite(kernel, hdr->kernel_size, 1, k);
-          free(kernel);
+          fprintf(stderr, "%s: error: expected %u bytes read but got %ld !\n",
+                  progname, job->size, (long)(res < 0 ? 0 : res));
+          extractJobFree(job);
+          break;
         }
-      fclose(k);
-      free((void *)filename);
+
+      if (job->digest)
+        {
+          uint64_t hashStart = statsBegin(BOOTIMG_STATS_HASH);
+
+          SHA256(job->data, job->size, job->digest);
+          statsEnd(BOOTIMG_STATS_HASH, hashStart);
+        }
+      *job->readsz = job->size;
+
+      if (ioWrite(job->io, job->fd, job->data, job->size, 0, -1, extractWriteDone, job) < 0)
+        extractJobFree(job);
     }
-  else
-    fprintf(stderr,
-            "%s: error: cannot open kernel image file '%s' for writing !\n",
-            progname, filename);
+  while (0);
 
-  return(readsz * hdr->kernel_size);
+  statsEnd(phase, start);
 }
 
 /*
- * Extract the ramdisk image in a file
+ * Queue the extraction of the size bytes at offset in the image to
+ * filename. *readsz is set and *readsLeft decremented once the data is
+ * read (and hashed in digest if not NULL); the file is written
+ * afterwards. An image read in place is read by the I/O engine, one
+ * that is decoded right away. The I/O and work done for it are counted
+ * in the phase given for --stats.
  */
-size_t
-extractRamdiskImage(FILE *fp, boot_img_hdr *hdr, const char *outdir, const char *basename)
+int
+extractComponentImage(bootimgIo_p io, bootimgInput_p input, off64_t offset, uint32_t size,
+                      const char *filename, const char *what, int phase,
+                      unsigned char *digest, size_t *readsz, unsigned *readsLeft)
 {
-  size_t readsz = 0;
-  const char *filename = getImageFilename(basename, outdir, BOOTIMG_RAMDISK_FILENAME);
-  FILE *r = fopen(filename, "wb");
+  extractJob_p job = (extractJob_p)calloc(1, sizeof(extractJob_t));
+  uint64_t start, base;
+  int rc = -1, imgfd = inputFd(input, &base);
 
-  if (r)
+  *readsz = 0;
+  if (!job)
     {
-      byte* ramdisk = (byte*)malloc(hdr->ramdisk_size);
-      if (ramdisk)
-        {
-          readsz = fread(ramdisk, hdr->ramdisk_size, 1, fp);
-          if (readsz != 1)
-            fprintf(stderr, "%s: error: expected %d bytes read but got %ld !\n",
-                    progname, hdr->ramdisk_size, readsz * hdr->ramdisk_size);
-          
-          fwrite(ramdisk, hdr->ramdisk_size, 1, r);
-          fclose(r);
+      fprintf(stderr, "%s: error: cannot allocate memory for %s image!\n", progname, what);
+      free((void *)filename);
+      return -1;
+    }
 
-          if (Fflag)
-            {
-              const char fsdir[PATH_MAX+1];
+  job->io = io;
+  job->what = what;
+  job->phase = phase;
+  job->filename = (char *)filename;
+  job->size = size;
+  job->digest = digest;
+  job->readsz = readsz;
+  job->readsLeft = readsLeft;
+
+  start = statsBegin(phase);
+  statsCount(phase, BOOTIMG_STATS_ALLOCS, 1);
+  do
+    {
+      statsCount(phase, BOOTIMG_STATS_SYSCALLS, 1);
+      if ((job->fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0666)) < 0)
+        {
+          fprintf(stderr,
+                  "%s: error: cannot open %s image file '%s' for writing !\n",
+                  progname, what, filename);
+          extractJobFree(job);
+          break;
+        }
+      if (!(job->data = (byte *)malloc(size ? size : 1)))
+        {
+          fprintf(stderr, "%s: error: cannot allocate memory for %s image!\n", progname, what);
+          extractJobFree(job);
+          break;
+        }
+      statsCount(phase, BOOTIMG_STATS_ALLOCS, 1);
 
-              if (Fval && Fval[0] != '/')
-                sprintf((char *)fsdir, "%s/%s", outdir, Fval);
-              else if (!Fval)
-                memcpy((void *)fsdir, (void *)filename, strlen(filename)+1);
-              else
-            	memcpy((void *)fsdir, (void *)Fval, strlen(Fval)+1);
-              if (rindex(fsdir, '.'))
-                *(rindex(fsdir, '.')) = '\0';
-              extractRamdiskFiles(fsdir, filename);
-            }
-          
-          free((void *)filename);
+      (*readsLeft)++;
+      if (imgfd < 0)
+        extractReadDone((void *)job, inputRead(input, job->data, size, offset));
+      else if (ioRead(io, imgfd, job->data, size, base + offset, -1, extractReadDone, job) < 0)
+        {
+          (*readsLeft)--;
+          extractJobFree(job);
+          break;
         }
+
+      rc = 0;
     }
-  else
-    fprintf(stderr,
-            "%s: error: cannot open ramdisk image file '%s' for writing !\n",
-            progname, filename);
-  
-  return(readsz * hdr->ramdisk_size);
+  while (0);
+  statsEnd(phase, start);
+
+  return rc;
 }
 
 /*
- * Extract the 2nd bootloader image in a file
+ * Extraction of an image is split in a task per component, each one
+ * run by a thread with its own I/O engine: the component is read (and
+ * hashed), signaled as copied, then written. The ramdisk task goes on
+ * with the -F tree unpack while the metadata are written.
  */
-size_t
-extractSecondBootloaderImage(FILE *fp, boot_img_hdr *hdr, const char *outdir, const char *basename)
+typedef struct _extractTask_st
 {
-  size_t readsz = 0;
-  const char *filename = getImageFilename(basename, outdir, BOOTIMG_SECOND_LOADER_FILENAME);
-  FILE *s = fopen(filename, "wb");
+  bootimgInput_p       input;
+  off64_t              offset;
+  uint32_t             size;
+  const char          *filename;        /* given to extractComponentImage */
+  const char          *what;
+  int                  phase;
+  unsigned char       *digest;
+  char                *fsdir;           /* -F: ramdisk tree */
+  char                *ramdiskFile;
+  char                *ramdiskGzip;     /* -F: fingerprint of the ramdisk */
+  size_t               readsz;
+  int                  copied;
+  int                  probed;          /* -F: ramdiskGzip is set */
+  int                  started;
+  pthread_t            thread;
+} extractTask_t, *extractTask_p;
+
+static pthread_mutex_t tasks_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t tasks_cond = PTHREAD_COND_INITIALIZER;
+
+static void *
+extractTaskThread(void *arg)
+{
+  extractTask_p task = (extractTask_p)arg;
+  bootimgIo_p io = ioDefault();
+  unsigned readsLeft = 0;
 
-  if (s)
+  if (io == (bootimgIo_p)NULL)
     {
-      byte* second = (byte*)malloc(hdr->second_size);
-      if (second)
-        {
-          readsz = fread(second, hdr->second_size, 1, fp);
-          if (readsz != 1)
-            fprintf(stderr, "%s: error: expected %d bytes read but got %ld !\n",
-                    progname, hdr->second_size, readsz * hdr->second_size);
-          
-          fwrite(second, hdr->second_size, 1, s);
-          fclose(s);
-          free((void *)filename);
-        }
+      fprintf(stderr, "%s: error: cannot allocate the I/O engine!\n", progname);
+      free((void *)task->filename);
     }
   else
-    fprintf(stderr,
-            "%s: error: cannot open second bootloader image file '%s' for writing !\n",
-            progname, filename);
-  
-  return(readsz * hdr->second_size);
+    extractComponentImage(io, task->input, task->offset, task->size, task->filename,
+                          task->what, task->phase, task->digest, &task->readsz, &readsLeft);
+  while (readsLeft)
+    if (ioWait(io, 1) < 0)
+      break;
+
+  pthread_mutex_lock(&tasks_lock);
+  task->copied = 1;
+  pthread_cond_broadcast(&tasks_cond);
+  pthread_mutex_unlock(&tasks_lock);
+
+  if (io)
+    ioWaitAll(io);
+
+  /*
+   * The ramdisk file is complete: its fingerprint is given to the
+   * metadata writers before the tree is unpacked from the member the
+   * probe inflated.
+   */
+  if (task->fsdir)
+    {
+      uint64_t start = statsBegin(BOOTIMG_STATS_RAMDISK_UNPACK);
+      char *fingerprint = (char *)NULL;
+      void *data = (void *)NULL;
+      size_t len = 0;
+
+      if (task->readsz)
+        data = extractRamdiskProbe(task->ramdiskFile, &len, &fingerprint);
+
+      pthread_mutex_lock(&tasks_lock);
+      task->ramdiskGzip = fingerprint;
+      task->probed = 1;
+      pthread_cond_broadcast(&tasks_cond);
+      pthread_mutex_unlock(&tasks_lock);
+
+      if (data)
+        extractRamdiskFiles(task->fsdir, task->ramdiskFile, data, len);
+      statsEnd(BOOTIMG_STATS_RAMDISK_UNPACK, start);
+    }
+
+  /* after the unpack, that reads the ramdisk file with it */
+  ioReleaseDefault();
+
+  return NULL;
 }
 
 /*
- * Extract the DTB image in a file
+ * Start the tasks given a file name, a task is run by the caller if
+ * its thread cannot be created. An image that is decoded is read in
+ * order, a task being started once the one before has read its
+ * component. Returns once all components are read.
  */
-size_t
-extractDeviceTreeImage(FILE *fp, boot_img_hdr *hdr, const char *outdir, const char *basename)
+static void
+extractStartTasks(extractTask_p tasks, int count)
 {
-  size_t readsz = 0;
-  const char *filename = getImageFilename(basename, outdir, BOOTIMG_DTB_FILENAME);
-  FILE *d = fopen(filename, "wb");
-
-  if (d)
+  for (int nt = 0; nt < count; nt++)
     {
-      byte* dtb = (byte*)malloc(hdr->dt_size);
-      if (dtb)
+      uint64_t base;
+
+      if (!tasks[nt].filename)
+        continue;
+      if (pthread_create(&tasks[nt].thread, NULL, extractTaskThread, (void *)&tasks[nt]) == 0)
+        tasks[nt].started = 1;
+      else
+        (void)extractTaskThread((void *)&tasks[nt]);
+
+      if (inputFd(tasks[nt].input, &base) < 0)
         {
-          readsz = fread(dtb, hdr->dt_size, 1, fp);
-          if (readsz != 1)
-            fprintf(stderr, "%s: error: expected %d bytes read but got %ld !\n",
-                    progname, hdr->dt_size, readsz * hdr->dt_size);
-          
-          fwrite(dtb, hdr->dt_size, 1, d);
-          fclose(d);
-          free((void *)filename);
+          pthread_mutex_lock(&tasks_lock);
+          while (tasks[nt].started && !tasks[nt].copied)
+            pthread_cond_wait(&tasks_cond, &tasks_lock);
+          pthread_mutex_unlock(&tasks_lock);
         }
     }
-  else
-    fprintf(stderr,
-            "%s: error: cannot open device tree blob image file '%s' for writing !\n",
-            progname, filename);
-  
-  return(readsz * hdr->dt_size);
+
+  pthread_mutex_lock(&tasks_lock);
+  for (int nt = 0; nt < count; nt++)
+    while (tasks[nt].started && !tasks[nt].copied)
+      pthread_cond_wait(&tasks_cond, &tasks_lock);
+  pthread_mutex_unlock(&tasks_lock);
+}
+
+/*
+ * Wait for the fingerprint of the ramdisk, the unpack may go on
+ */
+static char *
+extractWaitProbe(extractTask_p task)
+{
+  char *fingerprint;
+
+  pthread_mutex_lock(&tasks_lock);
+  while (task->started && task->fsdir && !task->probed)
+    pthread_cond_wait(&tasks_cond, &tasks_lock);
+  fingerprint = task->ramdiskGzip;
+  pthread_mutex_unlock(&tasks_lock);
+
+  return fingerprint;
+}
+
+/*
+ * Wait for the writes & ramdisk unpack of the tasks
+ */
+static void
+extractJoinTasks(extractTask_p tasks, int count)
+{
+  for (int nt = 0; nt < count; nt++)
+    {
+      if (tasks[nt].started)
+        pthread_join(tasks[nt].thread, NULL);
+      free((void *)tasks[nt].fsdir);
+      free((void *)tasks[nt].ramdiskFile);
+    }
 }
 
 /*
@@ -774,10 +1140,7 @@ rewrite(char *str, const char *rule)
 
   bzero((void *)command, MAX_COMMAND_LENGTH+1);
   snprintf(command, MAX_COMMAND_LENGTH, "echo -n '%s' | sed -e '%s'", str, rule);
-  if (vflag > 3)
-    fprintf(stdout,
-            "%s: command = '%s'\n",
-            progname, command);
+  BOOTIMG_LOG(BOOTIMG_LOG_MAIN, BOOTIMG_LOG_TRACE, "command = '%s'", command);
   if ((fp = popen(command, "r")) != NULL)
     {
       if (!(rewrote = (char *)malloc(BUF_LENGTH)))
@@ -795,10 +1158,8 @@ rewrite(char *str, const char *rule)
             }
           else
             {
-              if (vflag)
-                fprintf(stdout,
-                        "%s: '%s' rewrote in '%s'\n",
-                        progname, str, rewrote);
+              BOOTIMG_LOG(BOOTIMG_LOG_IMAGE, BOOTIMG_LOG_INFO,
+                          "'%s' rewrote in '%s'", str, rewrote);
             }
         }
       pclose(fp);
@@ -838,10 +1199,7 @@ rewriteFilename(const char *pathname)
   if (rindex(base_name, '.'))
     *(rindex(base_name, '.')) = '\0';
 
-  if (vflag > 2)
-    fprintf(stdout,
-            "%s: basename = <%s>\n",
-            progname, base_name);
+  BOOTIMG_LOG(BOOTIMG_LOG_IMAGE, BOOTIMG_LOG_DEBUG, "basename = <%s>", base_name);
 
   if (brrflag)
     {
@@ -854,10 +1212,7 @@ rewriteFilename(const char *pathname)
         }
     }
 
-  if (vflag > 2)
-    fprintf(stdout,
-            "%s: extension = <%s>\n",
-            progname, extension);
+  BOOTIMG_LOG(BOOTIMG_LOG_IMAGE, BOOTIMG_LOG_DEBUG, "extension = <%s>", extension);
 
   if (extension && errflag)
     {
@@ -890,10 +1245,7 @@ rewriteFilename(const char *pathname)
            "%s%s%s",
            base_name, extension ? "." : "", extension ? extension : "");
 
-  if (vflag > 2)
-    fprintf(stdout,
-            "%s: filename = <%s>\n",
-            progname, file_name);
+  BOOTIMG_LOG(BOOTIMG_LOG_IMAGE, BOOTIMG_LOG_DEBUG, "filename = <%s>", file_name);
   
   free((void *)base_name);
   if (extension)
@@ -922,10 +1274,7 @@ rewriteFilename(const char *pathname)
            "%s/%s",
            dir_name, file_name);  
   free((void *)dir_name);
-  if (vflag > 2)
-    fprintf(stdout,
-            "%s: pathname = <%s>\n",
-            progname, path_name);
+  BOOTIMG_LOG(BOOTIMG_LOG_IMAGE, BOOTIMG_LOG_DEBUG, "pathname = <%s>", path_name);
   if (prrflag)
     {
       path_name = rewrite(path_name, pathname_rr);
@@ -939,6 +1288,35 @@ rewriteFilename(const char *pathname)
   return (char *)path_name;
 }
 
+static ssize_t
+extractReadAt(void *arg, void *buf, size_t len, uint64_t off)
+{
+  return inputRead((bootimgInput_p)arg, buf, len, off);
+}
+
+/*
+ * The signature checks want a descriptor on the whole image: an image
+ * that is not a plain file is decoded in a memory file for them
+ */
+static void
+extractVerify(bootimgInput_p input, boot_img_hdr *hdr, const char *imgfile)
+{
+  uint64_t base;
+  int fd = inputFd(input, &base);
+  FILE *fp;
+
+  fd = fd >= 0 && !base ? dup(fd) : inputCopy(input);
+  if (fd < 0 || !(fp = fdopen(fd, "rb")))
+    {
+      fprintf(stderr, "%s: error: cannot read image '%s' for its signature!\n", progname, imgfile);
+      if (fd >= 0)
+        close(fd);
+      return;
+    }
+  verityVerify(fp, hdr);
+  fclose(fp);
+}
+
 /*
  * Process an image file and extract metadata & images 
  */
@@ -947,40 +1325,31 @@ extractBootImageMetadata(const char *imgfile, const char *outdir)
 {
   int rc = 0;
   boot_img_hdr header, *hdr = (boot_img_hdr *)NULL;
-  FILE *imgfp = (FILE *)NULL,
-#ifdef USE_LIBXML2
-       *xfp = (FILE *)NULL,
-#endif
-       *jfp = (FILE *)NULL;
   off_t offset = 0;
   size_t total_read = 0;
-  const char *imgfilename;
-  const char *baseName = (const char *)(nval ? nval : imgfile);
-#ifdef USE_LIBXML2
-  const char *xml_filename = (const char *)NULL, *json_filename = (const char *)NULL;
-  xmlTextWriterPtr xmlWriter;
-  xmlDocPtr xmlDoc;
-#endif
-  cJSON *jsonDoc;
-  char tmp[PATH_MAX+1];
+  const char *baseName = (const char *)nval;
+  const char *error = (const char *)NULL;
+  char *inputName;
+  bootimgParsingContext_t ctxt;
+  size_t kernel_sz = 0, ramdisk_sz = 0, second_sz = 0, dtb_sz = 0;
+  extractTask_t tasks[BOOTIMG_COMPONENT_COUNT];
+  bootimgInput_p input;
   
-  if (vflag)
-    fprintf(stderr, "Image filename option: '%s'\n", imgfile);
+  BOOTIMG_LOG(BOOTIMG_LOG_IMAGE, BOOTIMG_LOG_INFO, "Image filename option: '%s'", imgfile);
 
-  if ((imgfp = fopen(imgfile, "rb")) == (FILE *)NULL)
-    {
-      fprintf(stderr, "%s: error: cannot open image file at '%s'\n", progname, imgfile);
-      return 1;
-    }
+  /* compressed, sparse or zipped images are decoded as they are read */
+  if (!(input = inputOpen(imgfile, &inputName)))
+    return 1;
+  if (!baseName)
+    baseName = inputName;
   
-  if ((hdr = findBootMagic(imgfp, &header, &offset)) != (boot_img_hdr *)NULL)
+  if ((hdr = findBootMagicAt(extractReadAt, (void *)input, inputLength(input),
+                             &header, &offset, &error)) != (boot_img_hdr *)NULL)
     {
       total_read = offset;
       
-      if (vflag)
-        fprintf(stdout,
-                "%s: Magic found at offset %ld in file '%s'\n",
-                progname, offset, imgfile);
+      BOOTIMG_LOG(BOOTIMG_LOG_IMAGE, BOOTIMG_LOG_INFO,
+                  "Magic found at offset %ld in file '%s'", offset, imgfile);
       
       if (iflag)
         {
@@ -1002,14 +1371,14 @@ extractBootImageMetadata(const char *imgfile, const char *outdir)
         }
       
       if (Vflag)
-	verityVerify(imgfp, hdr);
+	extractVerify(input, hdr, imgfile);
 
       base_addr = hdr->kernel_addr - kernel_offset;
 
       const char *tmpfname = getImageFilename(baseName, outdir, BOOTIMG_BOOTIMG_FILENAME);
       if (!(tmpfname = rewriteFilename(tmpfname)))
         fprintf(stderr,
-                "%s: error: cannot create the xml writer !\n",
+                "%s: error: cannot rewrite the boot image file name !\n",
                 progname);
 
       /* Ok let's go ... */
@@ -1018,346 +1387,22 @@ extractBootImageMetadata(const char *imgfile, const char *outdir)
           fprintf(stdout,
                   "%s: boot image file name = '%s'!\n",
                   progname, tmpfname);
-          
-#ifdef USE_LIBXML2
-          /* Create & start XML metadata file */
-          if (xflag)
-            do
-              {
-                int rc;
-                
-                xml_filename = getImageFilename(baseName, outdir, BOOTIMG_XML_FILENAME);
-                xml_filename = rewriteFilename(xml_filename);
-                if (!xml_filename)
-                  break;
-                xmlWriter = xmlNewTextWriterDoc(&xmlDoc, 0);
-                if (xmlWriter == NULL)
-                  {
-                    fprintf(stderr, "%s: error: cannot create the xml writer !\n", progname);
-                    xml_filename = (const char *)NULL;
-                    break;
-                  }
-                rc = xmlTextWriterSetIndent(xmlWriter, 4);
-                if (rc < 0)
-                  fprintf(stderr, "%s: error: cannot set indentation level !\n", progname);
-                rc = xmlTextWriterStartDocument(xmlWriter, NULL, BOOTIMG_ENCODING, NULL);
-                if (rc < 0)
-                  {
-                    fprintf(stderr, "%s: error: cannot start the xml document !\n", progname);
-                    xmlFreeTextWriter(xmlWriter);
-                    free((void *)xml_filename);
-                    xml_filename = (const char *)NULL;
-                    break;
-                  }
-                rc = xmlTextWriterStartElement(xmlWriter, BOOTIMG_XMLELT_BOOTIMAGE_NAME);
-                if (rc < 0)
-                  {
-                    fprintf(stderr, "%s: error: cannot start the bootImage root element !\n", progname);
-                    xmlFreeTextWriter(xmlWriter);
-                    free((void *)xml_filename);
-                    xml_filename = (const char *)NULL;
-                    break;
-                  }
-                
-                if (tmpfname)
-                  xmlTextWriterWriteAttribute(xmlWriter, BOOTIMG_XMLELT_BOOTIMAGEFILE_NAME, tmpfname);
-              }
-            while (0);
-#endif
-	  
-          /* Create and start JSON metadata file */
-          if (jflag)
-            do
-              {
-                json_filename = getImageFilename(baseName, outdir, BOOTIMG_JSON_FILENAME);
-                json_filename = rewriteFilename(json_filename);
-                if (!json_filename)
-                  break;
-                jfp = fopen(json_filename, "wb");
-                if (!jfp)
-                  {
-                    fprintf(stdout, "%s: error: cannot open json file '%s' for writing !\n", progname, json_filename);
-                    break;
-                  }
-                jsonDoc = cJSON_CreateObject();
-                if (!jsonDoc)
-                  {
-                    fprintf(stdout, "%s: error: cannot create json object !\n", progname);
-                    fclose(jfp);
-                    jfp = (FILE *)NULL;
-                    break;          
-                  }
-                if (tmpfname)
-                  cJSON_AddItemToObject(jsonDoc, "bootImageFile", cJSON_CreateString(tmpfname));
-
-                free((void *)tmpfname);
-              }
-            while(0);
 
+          /* Header values are kept in a parsing context for metadata writers */
+          uint64_t start = statsBegin(BOOTIMG_STATS_HEADER_DECODE);
+          bzero((void *)&ctxt, sizeof(bootimgParsingContext_t));
+          setParsingContextFromHeader(&ctxt, hdr, kernel_offset);
+          ctxt.bootImageFile = (xmlChar *)tmpfname;
+          statsEnd(BOOTIMG_STATS_HEADER_DECODE, start);
+          
           /* Process OS version value */
           if (hdr->os_version != 0)
             {
-              int os_version, os_patch_level;
-              int major, minor, micro;
-              int year, month;
-              char boardOsVersionStr[100], boardOsPatchLvlStr[100];
-              
-              os_version = hdr->os_version >> 11;
-              os_patch_level = hdr->os_version&0x7ff;
-              
-              major = (os_version >> 14)&0x7f;
-              minor = (os_version >> 7)&0x7f;
-              micro = os_version&0x7f;
-              if (vflag)
-                fprintf(stdout, "%s: OS_VERSION %d.%d.%d\n", progname, major, minor, micro);
-              
-              year = (os_patch_level >> 4) + 2000;
-              month = os_patch_level&0xf;
-              if (vflag)
-                fprintf(stdout, "%s: OS_PATCH_LEVEL %d-%02d\n", progname, year, month);
-              
-              sprintf(boardOsVersionStr, "%d.%d.%d", major, minor, micro);
-              sprintf(boardOsPatchLvlStr, "%d-%02d", year, month);
-              
-#ifdef USE_LIBXML2
-              /* If xml is requested */
-              if (xflag)
-                do
-                  {
-                    /* cmdLine */
-                    if (xmlTextWriterWriteFormatElement(xmlWriter,
-                                                        BOOTIMG_XMLELT_CMDLINE_NAME,
-                                                        "%s", hdr->cmdline) < 0)
-                      fprintf(stderr, "%s: error: cannot create xml element for cmdLine\n", progname);
-                    
-                    /* boardName */
-                    if (xmlTextWriterWriteFormatElement(xmlWriter,
-                                                        BOOTIMG_XMLELT_BOARDNAME_NAME,
-                                                        "%s", hdr->name) < 0)
-                      fprintf(stderr, "%s: error: cannot create xml element for boardName\n", progname);
-                    
-                    /* baseAddr */
-                    if (xmlTextWriterWriteFormatElement(xmlWriter,
-                                                        BOOTIMG_XMLELT_BASEADDR_NAME,
-                                                        "0x%08lx", base_addr) < 0)
-                      fprintf(stderr, "%s: error: cannot create xml element for baseAddr\n", progname);
-                    
-                    /* pageSize */
-                    if (xmlTextWriterWriteFormatElement(xmlWriter,
-                                                        BOOTIMG_XMLELT_PAGESIZE_NAME,
-                                                        "%d", hdr->page_size) < 0)
-                      fprintf(stderr, "%s: error: cannot create xml element for pageSize\n", progname);
-                    
-                    /* kernelOffset */
-                    if (xmlTextWriterWriteFormatElement(xmlWriter,
-                                                        BOOTIMG_XMLELT_KERNELOFFSET_NAME,
-                                                        "0x%08lx", hdr->kernel_addr - base_addr) < 0)
-                      fprintf(stderr, "%s: error: cannot create xml element for kernelOffset\n", progname);
-                    
-                    /* ramdiskOffset */
-                    if (xmlTextWriterWriteFormatElement(xmlWriter,
-                                                        BOOTIMG_XMLELT_RAMDISKOFFSET_NAME,
-                                                        "0x%08lx", hdr->ramdisk_addr - base_addr) < 0)
-                      fprintf(stderr, "%s: error: cannot create xml element for ramdiskOffset\n", progname);
-                    
-                    /* secondOffset */
-                    if (hdr->second_size != 0 &&
-                        xmlTextWriterWriteFormatElement(xmlWriter,
-                                                        BOOTIMG_XMLELT_SECONDOFFSET_NAME,
-                                                        "0x%08lx", hdr->second_addr - base_addr) < 0)
-                      fprintf(stderr, "%s: error: cannot create xml element for secondOffset\n", progname);
-                    
-                    /* tagsOffset */
-                    if (xmlTextWriterWriteFormatElement(xmlWriter,
-                                                        BOOTIMG_XMLELT_TAGSOFFSET_NAME,
-                                                        "0x%08lx", hdr->tags_addr - base_addr) < 0)
-                      fprintf(stderr, "%s: error: cannot create xml element for tagsOffset\n", progname);
-                    
-                    /* Add boardOsVersion element */
-                    if (xmlTextWriterStartElement(xmlWriter, BOOTIMG_XMLELT_BOARDOSVERSION_NAME) < 0)
-                      {
-                        fprintf(stderr, "%s: error: cannot create xml element for boardOsVersion\n", progname);
-                        break;
-                      }
-                    if (xmlTextWriterWriteFormatElement(xmlWriter,
-                                                        BOOTIMG_XMLELT_VALUE_NAME,
-                                                        "0x%x", os_version) < 0)
-                      {
-                        fprintf(stderr, "%s: error: cannot create xml element for boardOsVersion value\n", progname);
-                        break;
-                      }
-                    if (xmlTextWriterWriteFormatElement(xmlWriter,
-                                                        BOOTIMG_XMLELT_MAJOR_NAME,
-                                                        "%d", major) < 0)
-                      {
-                        fprintf(stderr, "%s: error: cannot create xml element for boardOsVersion major\n", progname);
-                        break;
-                      }
-                    if (xmlTextWriterWriteFormatElement(xmlWriter,
-                                                        BOOTIMG_XMLELT_MINOR_NAME,
-                                                        "%d", minor) < 0)
-                      {
-                        fprintf(stderr, "%s: error: cannot create xml element for boardOsVersion minor\n", progname);
-                        break;
-                      }
-                    if (xmlTextWriterWriteFormatElement(xmlWriter,
-                                                        BOOTIMG_XMLELT_MICRO_NAME,
-                                                        "%d", micro) < 0)
-                      {
-                        fprintf(stderr, "%s: error: cannot create xml element for boardOsVersion micro\n", progname);
-                        break;
-                      }
-                    if (xmlTextWriterWriteFormatElement(xmlWriter,
-                                                        BOOTIMG_XMLELT_VALUESTR_NAME,
-                                                        "%s", boardOsVersionStr) < 0)
-                      {
-                        fprintf(stderr, "%s: error: cannot create xml element for boardOsVersion valueStr\n", progname);
-                        break;
-                      }
-                    if (xmlTextWriterWriteFormatElement(xmlWriter,
-                                                        BOOTIMG_XMLELT_COMMENT_NAME,
-                                                        "%s", BOARD_OS_VERSION_COMMENT) < 0)
-                      {
-                        fprintf(stderr, "%s: error: cannot create xml element for boardOsVersion comment\n", progname);
-                        break;
-                      }
-                    if (xmlTextWriterEndElement(xmlWriter) < 0)
-                      {
-                        fprintf(stderr, "%s: error: cannot close xml element for boardOsVersion\n", progname);
-                        break;
-                      }
-                    
-                    /* Add boardOsPatchLvl element */
-                    if (xmlTextWriterStartElement(xmlWriter, BOOTIMG_XMLELT_BOARDOSPATCHLVL_NAME) < 0)
-                      {
-                        fprintf(stderr, "%s: error: cannot create xml element for boardOsPatchLvl\n", progname);
-                        break;
-                      }
-                    if (xmlTextWriterWriteFormatElement(xmlWriter,
-                                                        BOOTIMG_XMLELT_VALUE_NAME,
-                                                        "0x%x", os_patch_level) < 0)
-                      {
-                        fprintf(stderr, "%s: error: cannot create xml element for boardOsPatchLvl value\n", progname);
-                        break;
-                      }
-                    if (xmlTextWriterWriteFormatElement(xmlWriter,
-                                                        BOOTIMG_XMLELT_YEAR_NAME,
-                                                        "%d", year) < 0)
-                      {
-                        fprintf(stderr, "%s: error: cannot create xml element for boardOsPatchLvl year\n", progname);
-                        break;
-                      }
-                    if (xmlTextWriterWriteFormatElement(xmlWriter,
-                                                        BOOTIMG_XMLELT_MONTH_NAME,
-                                                        "%d", month) < 0)
-                      {
-                        fprintf(stderr, "%s: error: cannot create xml element for boardOsPatchLvl month\n", progname);
-                        break;
-                      }
-                    if (xmlTextWriterWriteFormatElement(xmlWriter,
-                                                        BOOTIMG_XMLELT_VALUESTR_NAME,
-                                                        "%s", boardOsPatchLvlStr) < 0)
-                      {
-                        fprintf(stderr, "%s: error: cannot create xml element for boardOsPatchLvl valueStr\n", progname);
-                        break;
-                      }
-                    if (xmlTextWriterWriteFormatElement(xmlWriter,
-                                                        BOOTIMG_XMLELT_COMMENT_NAME,
-                                                        "%s", BOARD_OS_PATCH_LEVEL_COMMENT) < 0)
-                      {
-                        fprintf(stderr, "%s: error: cannot create xml element for boardOsPatchLvl comment\n", progname);
-                        break;
-                      }
-                    if (xmlTextWriterEndElement(xmlWriter) < 0)
-                      {
-                        fprintf(stderr, "%s: error: cannot close xml element for boardOsPatchLvl\n", progname);
-                        break;
-                      }
-                  }
-                while (0);
-#endif
-            
-              if (jflag)
-                do
-                  {
-                    cJSON *boardOsVersion, *boardOsPatchLvl;
-                    
-                    cJSON_AddItemToObject(jsonDoc, BOOTIMG_XMLELT_CMDLINE_NAME, cJSON_CreateString(hdr->cmdline));
-                    cJSON_AddItemToObject(jsonDoc, BOOTIMG_XMLELT_BOARDNAME_NAME, cJSON_CreateString(hdr->name));
-                    sprintf(tmp, "0x%08lx", base_addr);
-                    cJSON_AddItemToObject(jsonDoc, BOOTIMG_XMLELT_BASEADDR_NAME, cJSON_CreateString(tmp));
-                    sprintf(tmp, "%d", hdr->page_size);
-                    cJSON_AddItemToObject(jsonDoc, BOOTIMG_XMLELT_PAGESIZE_NAME, cJSON_CreateString(tmp));
-                    sprintf(tmp, "0x%08lx", hdr->kernel_addr - base_addr);
-                    cJSON_AddItemToObject(jsonDoc, BOOTIMG_XMLELT_KERNELOFFSET_NAME, cJSON_CreateString(tmp));
-                    sprintf(tmp, "0x%08lx", hdr->ramdisk_addr - base_addr);
-                    cJSON_AddItemToObject(jsonDoc, BOOTIMG_XMLELT_RAMDISKOFFSET_NAME, cJSON_CreateString(tmp));
-                    if (hdr->second_size != 0)
-                      {
-                        sprintf(tmp, "0x%08lx", hdr->second_addr - base_addr);
-                        cJSON_AddItemToObject(jsonDoc, BOOTIMG_XMLELT_SECONDOFFSET_NAME, cJSON_CreateString(tmp));
-                      }
-                    sprintf(tmp, "0x%08lx", hdr->tags_addr - base_addr);
-                    cJSON_AddItemToObject(jsonDoc, BOOTIMG_XMLELT_TAGSOFFSET_NAME, cJSON_CreateString(tmp));
-                    
-                    boardOsVersion = cJSON_CreateObject();
-                    if (!boardOsVersion)
-                      {
-                        fprintf(stderr, "%s: error: cannot create json object for boardOsVersion", progname);
-                        break;
-                      }
-                    cJSON_AddItemToObject(boardOsVersion,
-                                          BOOTIMG_XMLELT_VALUE_NAME,
-                                          cJSON_CreateNumber(os_version));
-                    cJSON_AddItemToObject(boardOsVersion,
-                                          BOOTIMG_XMLELT_MAJOR_NAME,
-                                          cJSON_CreateNumber(major));
-                    cJSON_AddItemToObject(boardOsVersion,
-                                          BOOTIMG_XMLELT_MINOR_NAME,
-                                          cJSON_CreateNumber(minor));
-                    cJSON_AddItemToObject(boardOsVersion,
-                                          BOOTIMG_XMLELT_MICRO_NAME,
-                                          cJSON_CreateNumber(micro));
-                    cJSON_AddItemToObject(boardOsVersion,
-                                          BOOTIMG_XMLELT_VALUESTR_NAME,
-                                          cJSON_CreateString(boardOsVersionStr));
-                    cJSON_AddItemToObject(boardOsVersion,
-                                          BOOTIMG_XMLELT_COMMENT_NAME,
-                                          cJSON_CreateString(BOARD_OS_VERSION_COMMENT));
-                    
-                    cJSON_AddItemToObject(jsonDoc,
-                                          BOOTIMG_XMLELT_BOARDOSVERSION_NAME,
-                                          boardOsVersion);
-                    
-                    boardOsPatchLvl = cJSON_CreateObject();
-                    if (!boardOsPatchLvl)
-                      {
-                        fprintf(stderr, "%s: error: cannot create json object for boardOsPatchLvl\n", progname);
-                        cJSON_Delete(boardOsPatchLvl);
-                        break;
-                      }
-                    cJSON_AddItemToObject(boardOsPatchLvl,
-                                          BOOTIMG_XMLELT_VALUE_NAME,
-                                          cJSON_CreateNumber(os_patch_level));
-                    cJSON_AddItemToObject(boardOsPatchLvl,
-                                          BOOTIMG_XMLELT_YEAR_NAME,
-                                          cJSON_CreateNumber(year));
-                    cJSON_AddItemToObject(boardOsPatchLvl,
-                                          BOOTIMG_XMLELT_MONTH_NAME,
-                                          cJSON_CreateNumber(month));
-                    cJSON_AddItemToObject(boardOsPatchLvl,
-                                          BOOTIMG_XMLELT_VALUESTR_NAME,
-                                          cJSON_CreateString(boardOsPatchLvlStr));
-                    cJSON_AddItemToObject(boardOsPatchLvl,
-                                          BOOTIMG_XMLELT_COMMENT_NAME,
-                                          cJSON_CreateString(BOARD_OS_PATCH_LEVEL_COMMENT));
-                    
-                    cJSON_AddItemToObject(jsonDoc,
-                                          BOOTIMG_XMLELT_BOARDOSPATCHLVL_NAME,
-                                          boardOsPatchLvl);
-                  }
-                while(0);
-            }         
+              BOOTIMG_LOG(BOOTIMG_LOG_IMAGE, BOOTIMG_LOG_INFO, "OS_VERSION %d.%d.%d",
+                          (ctxt.osVersion >> 14)&0x7f, (ctxt.osVersion >> 7)&0x7f, ctxt.osVersion&0x7f);
+              BOOTIMG_LOG(BOOTIMG_LOG_IMAGE, BOOTIMG_LOG_INFO, "OS_PATCH_LEVEL %d-%02d",
+                          (ctxt.osPatchLvl >> 4) + 2000, ctxt.osPatchLvl&0xf);
+            }
           
           if (hdr->dt_size != 0)
             {
@@ -1368,259 +1413,910 @@ extractBootImageMetadata(const char *imgfile, const char *outdir)
           
           if (!pflag)
             {
-              if (vflag)
-                fprintf(stdout,
-                        "%s: page size (%u) from image used\n",
-                        progname, hdr->page_size);
+              BOOTIMG_LOG(BOOTIMG_LOG_IMAGE, BOOTIMG_LOG_INFO,
+                          "page size (%u) from image used", hdr->page_size);
               pval = hdr->page_size;
             }
           
           total_read += sizeof(header);
-          total_read += readPadding(imgfp, sizeof(header), pval);
-          
-          size_t kernel_sz = extractKernelImage(imgfp, hdr, outdir, baseName);
-          if (vflag && kernel_sz)
-            fprintf(stdout,
-                    "%s: %lu bytes kernel image extracted!\n",
-                    progname, kernel_sz);
-          
-          total_read += hdr->kernel_size;
-          total_read += readPadding(imgfp, hdr->kernel_size, pval);
-          
-          const char *tmpfname = getImageFilename(baseName, outdir, BOOTIMG_KERNEL_FILENAME);
-          if ((tmpfname = rewriteFilename(tmpfname)))
-            {
-#ifdef USE_LIBXML2
-              if (xflag)
-                xmlTextWriterWriteFormatElement(xmlWriter, BOOTIMG_XMLELT_KERNELIMAGEFILE_NAME, "%s", tmpfname);
-#endif
-              if (jflag)
-                cJSON_AddItemToObject(jsonDoc, BOOTIMG_XMLELT_KERNELIMAGEFILE_NAME, cJSON_CreateString(tmpfname));
-              free((void *)tmpfname);
-            }
-          
-          size_t ramdisk_sz = extractRamdiskImage(imgfp, hdr, outdir, baseName);
-          if (vflag && ramdisk_sz)
-            fprintf(stdout,
-                    "%s: %lu bytes ramdisk image extracted!\n",
-                    progname, ramdisk_sz);
-          
-          tmpfname = getImageFilename(baseName, outdir, BOOTIMG_RAMDISK_FILENAME);
-#ifdef USE_LIBXML2
-          if (xflag)
-            xmlTextWriterWriteFormatElement(xmlWriter, BOOTIMG_XMLELT_RAMDISKIMAGEFILE_NAME, "%s", tmpfname);
-#endif
-          if (jflag)
-            cJSON_AddItemToObject(jsonDoc, BOOTIMG_XMLELT_RAMDISKIMAGEFILE_NAME, cJSON_CreateString(tmpfname));
-          free((void *)tmpfname);
-          
-          total_read += hdr->ramdisk_size;
-          total_read += readPadding(imgfp, hdr->ramdisk_size, pval);
-          
-          if (hdr->second_size)
-            {
-              size_t second_sz = extractSecondBootloaderImage(imgfp, hdr, outdir, baseName);
-              if (vflag && second_sz)
-                fprintf(stdout,
-                        "%s: %lu bytes second bootloader image extracted!\n",
-                        progname, second_sz);
-              
-              tmpfname = getImageFilename(baseName, outdir, BOOTIMG_SECOND_LOADER_FILENAME);
-#ifdef USE_LIBXML2
-              if (xflag)
-                xmlTextWriterWriteFormatElement(xmlWriter, "secondBootloaderImageFile", "%s", tmpfname);
-#endif
-              if (jflag)
-                cJSON_AddItemToObject(jsonDoc, "secondBootloaderImageFile", cJSON_CreateString(tmpfname));
-              free((void *)tmpfname);
-              
-              total_read += hdr->second_size;
-            }
-          
-          total_read += readPadding(imgfp, hdr->second_size, pval);
-          
-          if (hdr->dt_size != 0)
+          total_read += pagePadding(sizeof(header), pval);
+
+          /*
+           * A task per component, those left out by --only are not read
+           * at all. Second & dtb are optional.
+           */
+          uint32_t sizes[BOOTIMG_COMPONENT_COUNT] = {
+            hdr->kernel_size, hdr->ramdisk_size, hdr->second_size, hdr->dt_size
+          };
+          static const int files[BOOTIMG_COMPONENT_COUNT] = {
+            BOOTIMG_KERNEL_FILENAME, BOOTIMG_RAMDISK_FILENAME,
+            BOOTIMG_SECOND_LOADER_FILENAME, BOOTIMG_DTB_FILENAME
+          };
+          static const char *names[BOOTIMG_COMPONENT_COUNT] = {
+            "kernel", "ramdisk", "second bootloader", "device tree blob"
+          };
+
+          bzero((void *)tasks, sizeof(tasks));
+          for (int nc = 0; nc < BOOTIMG_COMPONENT_COUNT; nc++)
             {
-              size_t dtb_sz = extractDeviceTreeImage(imgfp, hdr, outdir, baseName);
-              if (vflag && dtb_sz)
-                fprintf(stdout,
-                        "%s: %lu bytes device tree blob image extracted!\n",
-                        progname, dtb_sz);
-              
-              tmpfname = getImageFilename(baseName, outdir, BOOTIMG_DTB_FILENAME);
-              if ((tmpfname = rewriteFilename(tmpfname)))
+              if (sizes[nc] || nc < BOOTIMG_COMPONENT_SECOND)
                 {
-#ifdef USE_LIBXML2
-                  if (xflag)
-                    xmlTextWriterWriteFormatElement(xmlWriter, BOOTIMG_XMLELT_DTBIMAGEFILE_NAME, "%s", tmpfname);
-#endif
-                  if (jflag)
-                    cJSON_AddItemToObject(jsonDoc, BOOTIMG_XMLELT_DTBIMAGEFILE_NAME, cJSON_CreateString(tmpfname));
-                  free((void *)tmpfname);
+                  ctxt.component[nc].offset = total_read;
+                  if (EXTRACT_COMPONENT(nc))
+                    {
+                      tasks[nc].input = input;
+                      tasks[nc].offset = total_read;
+                      tasks[nc].size = sizes[nc];
+                      tasks[nc].filename = getImageFilename(baseName, outdir, files[nc]);
+                      tasks[nc].what = names[nc];
+                      tasks[nc].phase = BOOTIMG_STATS_KERNEL + nc;
+                      tasks[nc].digest = bflag ? ctxt.component[nc].digest : (unsigned char *)NULL;
+                    }
+                  total_read += sizes[nc];
                 }
-              
-              total_read += hdr->dt_size;
+              if (nc < BOOTIMG_COMPONENT_DTB)
+                total_read += pagePadding(sizes[nc], pval);
             }
-          
-          if (vflag > 2)
-            fprintf(stdout,
-                    "%s: total read: %ld\n",
-                    progname, total_read);
-          
-#ifdef USE_LIBXML2
+
+          if (Fflag && tasks[BOOTIMG_COMPONENT_RAMDISK].filename)
+            {
+              const char fsdir[PATH_MAX+1];
+              const char *filename = tasks[BOOTIMG_COMPONENT_RAMDISK].filename;
+
+              if (Fval && Fval[0] != '/')
+                sprintf((char *)fsdir, "%s/%s", outdir, Fval);
+              else if (!Fval)
+                memcpy((void *)fsdir, (void *)filename, strlen(filename)+1);
+              else
+            	memcpy((void *)fsdir, (void *)Fval, strlen(Fval)+1);
+              if (rindex(fsdir, '.'))
+                *(rindex(fsdir, '.')) = '\0';
+              tasks[BOOTIMG_COMPONENT_RAMDISK].fsdir = strdup(fsdir);
+              tasks[BOOTIMG_COMPONENT_RAMDISK].ramdiskFile = strdup(filename);
+            }
+
+          /* sizes & digests are needed now, the writes may go on */
+          extractStartTasks(tasks, BOOTIMG_COMPONENT_COUNT);
+          kernel_sz = tasks[BOOTIMG_COMPONENT_KERNEL].readsz;
+          ramdisk_sz = tasks[BOOTIMG_COMPONENT_RAMDISK].readsz;
+          second_sz = tasks[BOOTIMG_COMPONENT_SECOND].readsz;
+          dtb_sz = tasks[BOOTIMG_COMPONENT_DTB].readsz;
+
+          if (kernel_sz)
+            BOOTIMG_LOG(BOOTIMG_LOG_IMAGE, BOOTIMG_LOG_INFO,
+                        "%lu bytes kernel image extracted!", kernel_sz);
+          ctxt.component[BOOTIMG_COMPONENT_KERNEL].size =
+            EXTRACT_COMPONENT(BOOTIMG_COMPONENT_KERNEL) ? kernel_sz : hdr->kernel_size;
+          ctxt.component[BOOTIMG_COMPONENT_KERNEL].digestFlag = bflag && kernel_sz;
+
+          tmpfname = getImageFilename(baseName, outdir, BOOTIMG_KERNEL_FILENAME);
+          ctxt.kernelImageFile = (xmlChar *)rewriteFilename(tmpfname);
+
+          if (ramdisk_sz)
+            BOOTIMG_LOG(BOOTIMG_LOG_IMAGE, BOOTIMG_LOG_INFO,
+                        "%lu bytes ramdisk image extracted!", ramdisk_sz);
+          ctxt.component[BOOTIMG_COMPONENT_RAMDISK].size =
+            EXTRACT_COMPONENT(BOOTIMG_COMPONENT_RAMDISK) ? ramdisk_sz : hdr->ramdisk_size;
+          ctxt.component[BOOTIMG_COMPONENT_RAMDISK].digestFlag = bflag && ramdisk_sz;
+
+          ctxt.ramdiskImageFile = (xmlChar *)getImageFilename(baseName, outdir, BOOTIMG_RAMDISK_FILENAME);
+
+          if (hdr->second_size)
+            {
+              if (second_sz)
+                BOOTIMG_LOG(BOOTIMG_LOG_IMAGE, BOOTIMG_LOG_INFO,
+                            "%lu bytes second bootloader image extracted!", second_sz);
+              ctxt.component[BOOTIMG_COMPONENT_SECOND].size =
+                EXTRACT_COMPONENT(BOOTIMG_COMPONENT_SECOND) ? second_sz : hdr->second_size;
+              ctxt.component[BOOTIMG_COMPONENT_SECOND].digestFlag = bflag && second_sz;
+
+              ctxt.secondImageFile = (xmlChar *)getImageFilename(baseName, outdir, BOOTIMG_SECOND_LOADER_FILENAME);
+            }
+
+          if (hdr->dt_size != 0)
+            {
+              if (dtb_sz)
+                BOOTIMG_LOG(BOOTIMG_LOG_IMAGE, BOOTIMG_LOG_INFO,
+                            "%lu bytes device tree blob image extracted!", dtb_sz);
+              ctxt.component[BOOTIMG_COMPONENT_DTB].size =
+                EXTRACT_COMPONENT(BOOTIMG_COMPONENT_DTB) ? dtb_sz : hdr->dt_size;
+              ctxt.component[BOOTIMG_COMPONENT_DTB].digestFlag = bflag && dtb_sz;
+
+              tmpfname = getImageFilename(baseName, outdir, BOOTIMG_DTB_FILENAME);
+              ctxt.dtbImageFile = (xmlChar *)rewriteFilename(tmpfname);
+            }
+
+          BOOTIMG_LOG(BOOTIMG_LOG_IMAGE, BOOTIMG_LOG_DEBUG, "total read: %ld", total_read);
+          
+          /* with -F, the ramdisk fingerprint is probed ahead of its unpack */
+          if (Fflag)
+            ctxt.ramdiskGzip = (xmlChar *)extractWaitProbe(&tasks[BOOTIMG_COMPONENT_RAMDISK]);
+
+          /* Then write metadata files in each requested format */
+          rc = 1;
+          start = statsBegin(BOOTIMG_STATS_METADATA);
+#ifdef USE_LIBXML2
           if (xflag)
-            do
-              {
-                (void)xmlTextWriterEndDocument(xmlWriter);
-                (void)xmlTextWriterFlush(xmlWriter);
-                xmlFreeTextWriter(xmlWriter);
-                xmlSaveFileEnc(xml_filename, xmlDoc, BOOTIMG_ENCODING);
-                xmlFreeDoc(xmlDoc);
-                free((void *)xml_filename);
-              }
-            while (0);
+            {
+              const char *xml_filename = rewriteFilename(getImageFilename(baseName, outdir, BOOTIMG_XML_FILENAME));
+              if (!xml_filename || writeXmlMetadata(&ctxt, xml_filename) < 0)
+                rc = 0;
+              free((void *)xml_filename);
+            }
 #endif
-          
           if (jflag)
-            do
-              {
-                char *buf = cJSON_Print(jsonDoc);
-                (void)fwrite((void *)buf, strlen(buf), 1, jfp);
-                free((void *)buf);
-                free((void *)json_filename);
-                fclose(jfp);
-              }
-            while (0);
-          
-          rc = 1;
-        }
+            {
+              const char *json_filename = rewriteFilename(getImageFilename(baseName, outdir, BOOTIMG_JSON_FILENAME));
+              if (!json_filename ||
+                  writeJsonMetadata(&ctxt, json_filename, cflag ? BOOTIMG_META_FLAG_COMPACT : BOOTIMG_META_FLAG_NONE) < 0)
+                rc = 0;
+              free((void *)json_filename);
+            }
+          if (bflag)
+            {
+              const char *bmeta_filename = rewriteFilename(getImageFilename(baseName, outdir, BOOTIMG_BMETA_FILENAME));
+              if (!bmeta_filename || writeBinaryMetadata(&ctxt, bmeta_filename) < 0)
+                rc = 0;
+              free((void *)bmeta_filename);
+            }
+          statsEnd(BOOTIMG_STATS_METADATA, start);
 
-      fclose(imgfp);
+          extractJoinTasks(tasks, BOOTIMG_COMPONENT_COUNT);
+          releaseContextContent(&ctxt);
+        }
     }
   else
     fprintf(stderr,
-            "%s: error: Magic not found in file '%s'\n",
-            progname, imgfile);
+            "%s: error: %s in file '%s'\n",
+            progname, error, imgfile);
+  inputClose(input);
+  free((void *)inputName);
       
   return rc;
 }
-  
-boot_img_hdr *
-findBootMagic(FILE *fp, boot_img_hdr *hdr, off_t *off)
+
+/*
+ * Forward only reader for streaming: bytes read ahead while looking
+ * for the magic are served first, then the input (the descriptor for
+ * stdin) is read.
+ */
+typedef struct _streamReader_st
 {
-  size_t total_read = 0;
-  size_t base = 0;
-  off_t i;
-  off_t seeklimit = 4096;
-  char tmp[PATH_MAX];
-  
-  if (vflag > 3)
-    fprintf(stderr, "%s: Reading header...\n", progname);
+  int fd;
+  bootimgInput_p input;                 /* NULL for stdin */
+  uint64_t off;                         /* next byte of the input */
+  char window[BOOT_MAGIC_SEEK_LIMIT + sizeof(boot_img_hdr)];
+  size_t pos;
+  size_t len;
+  off64_t dropped;                      /* page cache dropped up to there */
+} streamReader_t, *streamReader_p;
+
+/*
+ * With --no-cache, drop what was read so far from a regular file
+ */
+static void
+streamDropCache(streamReader_p sr)
+{
+  uint64_t base, end;
+  int fd;
+
+  if (!Dflag || !sr->input || (fd = inputFd(sr->input, &base)) < 0)
+    return;
+  end = base + sr->off;
+  if (sr->dropped < 0 || end <= (uint64_t)sr->dropped)
+    return;
+  posix_fadvise(fd, sr->dropped, end - (uint64_t)sr->dropped, POSIX_FADV_DONTNEED);
+  statsCount(BOOTIMG_STATS_CURRENT, BOOTIMG_STATS_SYSCALLS, 1);
+  sr->dropped = end;
+}
+
+/*
+ * Next bytes of the input
+ */
+static ssize_t
+streamReadIn(streamReader_p sr, void *buf, size_t len)
+{
+  ssize_t rdsz;
+
+  if (!sr->input)
+    return tarReadFull(sr->fd, buf, len);
+  if ((rdsz = inputRead(sr->input, buf, len, sr->off)) > 0)
+    sr->off += rdsz;
+
+  return rdsz;
+}
+
+static ssize_t
+streamRead(streamReader_p sr, void *buf, size_t len)
+{
+  size_t done = 0;
+  ssize_t rdsz;
+
+  if (sr->pos < sr->len)
+    {
+      done = BOOTIMG_MIN(len, sr->len - sr->pos);
+      memcpy(buf, sr->window + sr->pos, done);
+      sr->pos += done;
+    }
+  if (done < len)
+    {
+      if ((rdsz = streamReadIn(sr, (char *)buf + done, len - done)) < 0)
+        return -1;
+      done += rdsz;
+      streamDropCache(sr);
+    }
+
+  return done;
+}
 
-  for (i = 0; i <= seeklimit; i++)
+/*
+ * Skip len bytes of the image stream: seek in an input, read stdin
+ */
+static int
+streamSkip(streamReader_p sr, uint64_t len)
+{
+  byte buf[BUF_LENGTH];
+
+  if (sr->pos < sr->len)
     {
-      fseek(fp, i, SEEK_SET);
-      size_t rdsz = fread(tmp, BOOT_MAGIC_SIZE, 1, fp);
-      if (vflag)
-        fprintf(stdout, "%s: %lu bytes read for header\n", progname, rdsz * BOOT_MAGIC_SIZE);
-      if (rdsz != 1)
-        fprintf(stderr, "%s: error: expected %d bytes read, but got %lu\n", progname, BOOT_MAGIC_SIZE, rdsz* BOOT_MAGIC_SIZE);
-      if (memcmp(tmp, BOOT_MAGIC, BOOT_MAGIC_SIZE) == 0)
+      size_t done = BOOTIMG_MIN(len, sr->len - sr->pos);
+
+      sr->pos += done;
+      len -= done;
+    }
+  if (!len)
+    return 0;
+
+  if (sr->input)
+    {
+      sr->off += len;
+      return 0;
+    }
+
+  while (len)
+    {
+      size_t chunk = BOOTIMG_MIN(len, sizeof(buf));
+
+      if (streamRead(sr, buf, chunk) != (ssize_t)chunk)
+        return -1;
+      len -= chunk;
+    }
+
+  return 0;
+}
+
+/*
+ * Copy a component from the image stream to a tar entry, then skip its
+ * padding. The SHA256 is computed on the way when digest is not NULL.
+ */
+static int
+streamComponent(streamReader_p sr, int outfd, const char *name, uint32_t size,
+                uint32_t pagesize, time_t mtime, unsigned char *digest)
+{
+  int rc = -1;
+  uint32_t left = size;
+  size_t padding = (pagesize - (size & (pagesize - 1))) & (pagesize - 1);
+  byte *buf = (byte *)malloc(BOOTIMG_MAX(STREAM_CHUNK, pagesize));
+  SHA256_CTX sha;
+
+  if (!buf)
+    {
+      fprintf(stderr, "%s: error: cannot allocate stream buffer!\n", progname);
+      return -1;
+    }
+  statsCount(BOOTIMG_STATS_CURRENT, BOOTIMG_STATS_ALLOCS, 1);
+
+  do
+    {
+      if (digest)
+        SHA256_Init(&sha);
+
+      if (tarWriteHeader(outfd, name, size, 0644, mtime) < 0)
+        {
+          fprintf(stderr, "%s: error: cannot write tar header for '%s'!\n", progname, name);
+          break;
+        }
+
+      while (left)
+        {
+          size_t chunk = BOOTIMG_MIN(left, STREAM_CHUNK);
+
+          if (streamRead(sr, buf, chunk) != (ssize_t)chunk)
+            {
+              fprintf(stderr, "%s: error: image truncated while reading '%s'!\n", progname, name);
+              break;
+            }
+          if (digest)
+            {
+              uint64_t start = statsBegin(BOOTIMG_STATS_HASH);
+
+              SHA256_Update(&sha, buf, chunk);
+              statsEnd(BOOTIMG_STATS_HASH, start);
+            }
+          if (tarWriteFull(outfd, buf, chunk) < 0)
+            {
+              fprintf(stderr, "%s: error: cannot write tar data for '%s'!\n", progname, name);
+              break;
+            }
+          left -= chunk;
+        }
+      if (left || tarWritePadding(outfd, size) < 0)
         break;
+
+      if (digest)
+        SHA256_Final(digest, &sha);
+
+      /* the padding of the last component may be missing */
+      (void)streamRead(sr, buf, padding);
+      rc = 0;
     }
-  total_read = (size_t)i;
-  if (i > seeklimit)
+  while (0);
+
+  free((void *)buf);
+  return rc;
+}
+
+/*
+ * Name of a tar entry: the file name extract would use, without its
+ * directory. As for files, ramdisk & second loader names are not
+ * rewritten.
+ */
+static char *
+streamEntryName(const char *baseName, int kind)
+{
+  const char *filename = getImageFilename(baseName, ".", kind);
+  char *pathname = (char *)NULL;
+  char *name = (char *)NULL;
+
+  if (!filename)
+    return (char *)NULL;
+
+  if (kind == BOOTIMG_RAMDISK_FILENAME || kind == BOOTIMG_SECOND_LOADER_FILENAME)
+    pathname = strdup(filename);
+  else
+    pathname = rewriteFilename(filename);
+  if (pathname)
+    name = strdup(rindex(pathname, '/') ? rindex(pathname, '/') +1 : pathname);
+  free((void *)filename);
+  free((void *)pathname);
+
+  return name;
+}
+
+/*
+ * Metadata writers work on files: write a temporary one and copy it
+ * to the stream
+ */
+static int
+streamMetadata(bootimgParsingContext_p ctxt, int outfd, int format, int kind,
+               const char *baseName, time_t mtime)
+{
+  int rc = -1, fd;
+  char tmpname[PATH_MAX+1];
+  const char *tmpdir = getenv("TMPDIR");
+  char *name = streamEntryName(baseName, kind);
+  void *data = (void *)NULL;
+  size_t len = 0;
+  uint64_t start;
+
+  if (!name)
+    return -1;
+
+  snprintf(tmpname, PATH_MAX, "%s/bootimg-meta.XXXXXX", tmpdir ? tmpdir : P_tmpdir);
+  if ((fd = mkstemp(tmpname)) < 0)
     {
-      fprintf(stderr, "%s: error: Android boot magic not found.\n", progname);
-      return (boot_img_hdr *)NULL;
+      perror(progname);
+      fprintf(stderr, "%s: error: cannot create temporary metadata file!\n", progname);
+      free((void *)name);
+      return -1;
     }
-  fseek(fp, i, SEEK_SET);
-  
-  if (vflag && i > 0)
+  close(fd);
+
+  start = statsBegin(BOOTIMG_STATS_METADATA);
+  do
+    {
+      if (writeMetadata(ctxt, format, tmpname, cflag ? BOOTIMG_META_FLAG_COMPACT : BOOTIMG_META_FLAG_NONE) < 0)
+        break;
+      if (!(data = loadImage(tmpname, &len)))
+        break;
+      if (tarWriteEntry(outfd, name, data, len, 0644, mtime) < 0)
+        {
+          fprintf(stderr, "%s: error: cannot write tar entry '%s'!\n", progname, name);
+          break;
+        }
+      rc = 0;
+    }
+  while (0);
+  statsEnd(BOOTIMG_STATS_METADATA, start);
+
+  unlink(tmpname);
+  free(data);
+  free((void *)name);
+  return rc;
+}
+
+/*
+ * Stream an image ('-' for stdin) to a tar archive in a single forward
+ * pass: components first, with the names extract would give to their
+ * files, then the requested metadata files. Component file names in
+ * the metadata are the tar entry names, as bootimg-create --tar expects.
+ * Entries are dated SOURCE_DATE_EPOCH if set, now otherwise.
+ */
+int
+streamBootImage(const char *imgfile, int outfd)
+{
+  int rc = -1;
+  streamReader_t sr;
+  boot_img_hdr header, *hdr = &header;
+  bootimgParsingContext_t ctxt;
+  char *magic;
+  off_t offset = 0;
+  size_t pagesize;
+  time_t mtime = getSourceDateEpoch(time((time_t *)NULL));
+  const char *baseName = nval;
+  char *inputName = (char *)NULL;
+  ssize_t rdsz;
+  struct stat statbuf;
+  const char *error;
+  uint64_t start;
+  static const int kinds[BOOTIMG_COMPONENT_COUNT] = {
+    BOOTIMG_KERNEL_FILENAME, BOOTIMG_RAMDISK_FILENAME,
+    BOOTIMG_SECOND_LOADER_FILENAME, BOOTIMG_DTB_FILENAME
+  };
+
+  bzero((void *)&sr, sizeof(streamReader_t));
+  bzero((void *)&ctxt, sizeof(bootimgParsingContext_t));
+
+  /* standard input is read as is */
+  sr.fd = STDIN_FILENO;
+  if (strcmp(imgfile, "-") && !(sr.input = inputOpen(imgfile, &inputName)))
+    return -1;
+
+  if (!baseName)
+    baseName = inputName ? inputName : "boot.img";
+  if (rindex(baseName, '/'))
+    baseName = rindex(baseName, '/') +1;
+
+  do
     {
-      fprintf(stderr, "Android magic found at offset: %ld\n", i);
+      /* The magic is looked for in the first window only */
+      start = statsBegin(BOOTIMG_STATS_MAGIC_SCAN);
+      magic = (char *)NULL;
+      if ((rdsz = streamReadIn(&sr, sr.window, sizeof(sr.window))) >= 0)
+        magic = memmem(sr.window, rdsz, BOOT_MAGIC, BOOT_MAGIC_SIZE);
+      statsEnd(BOOTIMG_STATS_MAGIC_SCAN, start);
+      if (!magic || magic - sr.window + sizeof(boot_img_hdr) > (size_t)rdsz)
+        {
+          fprintf(stderr, "%s: error: Magic not found in file '%s'\n", progname, imgfile);
+          break;
+        }
+      start = statsBegin(BOOTIMG_STATS_HEADER_DECODE);
+      sr.len = rdsz;
+      offset = magic - sr.window;
+      memcpy((void *)hdr, magic, sizeof(boot_img_hdr));
+      sr.pos = offset + sizeof(boot_img_hdr);
+      /* the length of stdin or a stream is unknown, sizes are then checked by the copies */
+      error = checkBootImgHeader(hdr, offset, sr.input ? inputLength(sr.input) : 0);
+      if (!error)
+        setParsingContextFromHeader(&ctxt, hdr, kernel_offset);
+      statsEnd(BOOTIMG_STATS_HEADER_DECODE, start);
+      if (error)
+        {
+          fprintf(stderr, "%s: error: invalid boot image header in '%s': %s!\n", progname, imgfile, error);
+          break;
+        }
+
+      BOOTIMG_LOG(BOOTIMG_LOG_IMAGE, BOOTIMG_LOG_INFO,
+                  "Magic found at offset %ld in file '%s'", offset, imgfile);
+
+      pagesize = pflag ? pval : hdr->page_size;
+      if (pagesize < sizeof(boot_img_hdr) || (pagesize & (pagesize - 1)))
+        {
+          fprintf(stderr, "%s: error: invalid page size %lu in '%s'!\n", progname, pagesize, imgfile);
+          break;
+        }
+
+      if (iflag)
+        {
+          char id[2*BOOTIMG_DIGEST_SIZE +1];
+
+          for (int n = 0; n < 8; n++)
+            sprintf(&id[8*n], "%08x", hdr->id[n]);
+          fprintf(stderr,
+                  "%s: Boot Image Identification:\n%s  \t%s\t %s\n",
+                  progname, blankname, id, imgfile);
+        }
+
+      if (!(ctxt.bootImageFile = (xmlChar *)streamEntryName(baseName, BOOTIMG_BOOTIMG_FILENAME)))
+        break;
+
+      /* skip the header padding */
+      {
+        byte *buf = (byte *)malloc(pagesize);
+
+        if (!buf)
+          break;
+        rdsz = streamRead(&sr, buf, pagesize - sizeof(boot_img_hdr));
+        free((void *)buf);
+        if (rdsz != (ssize_t)(pagesize - sizeof(boot_img_hdr)))
+          {
+            fprintf(stderr, "%s: error: image '%s' truncated after header!\n", progname, imgfile);
+            break;
+          }
+      }
+
+      off_t total = offset + pagesize;
+      int nc;
+      for (nc = 0; nc < BOOTIMG_COMPONENT_COUNT; nc++)
+        {
+          bootimgComponent_p comp = &ctxt.component[nc];
+          uint32_t size = 0;
+          char *name;
+
+          switch (nc)
+            {
+            case BOOTIMG_COMPONENT_KERNEL:  size = hdr->kernel_size;  break;
+            case BOOTIMG_COMPONENT_RAMDISK: size = hdr->ramdisk_size; break;
+            case BOOTIMG_COMPONENT_SECOND:  size = hdr->second_size;  break;
+            case BOOTIMG_COMPONENT_DTB:     size = hdr->dt_size;      break;
+            }
+          /* kernel & ramdisk are always written, even empty */
+          if (!size && nc != BOOTIMG_COMPONENT_KERNEL && nc != BOOTIMG_COMPONENT_RAMDISK)
+            continue;
+
+          if (!(name = streamEntryName(baseName, kinds[nc])))
+            break;
+          comp->offset = total;
+          comp->size = size;
+          if (!EXTRACT_COMPONENT(nc))
+            {
+              /* left out by --only: in the metadata but not in the archive */
+              if (streamSkip(&sr, size) < 0)
+                {
+                  fprintf(stderr, "%s: error: image truncated while skipping '%s'!\n", progname, name);
+                  free((void *)name);
+                  break;
+                }
+              /* the padding of the last component may be missing */
+              (void)streamSkip(&sr, alignOnPage(size, pagesize) - size);
+            }
+          else
+            {
+              comp->digestFlag = bflag && size;
+              start = statsBegin(BOOTIMG_STATS_KERNEL + nc);
+              rdsz = streamComponent(&sr, outfd, name, size, pagesize, mtime,
+                                     comp->digestFlag ? comp->digest : (unsigned char *)NULL);
+              statsEnd(BOOTIMG_STATS_KERNEL + nc, start);
+              if (rdsz < 0)
+                {
+                  free((void *)name);
+                  break;
+                }
+              BOOTIMG_LOG(BOOTIMG_LOG_IMAGE, BOOTIMG_LOG_INFO,
+                          "%u bytes component '%s' streamed!", size, name);
+            }
+
+          switch (nc)
+            {
+            case BOOTIMG_COMPONENT_KERNEL:  ctxt.kernelImageFile = (xmlChar *)name;  break;
+            case BOOTIMG_COMPONENT_RAMDISK: ctxt.ramdiskImageFile = (xmlChar *)name; break;
+            case BOOTIMG_COMPONENT_SECOND:  ctxt.secondImageFile = (xmlChar *)name;  break;
+            case BOOTIMG_COMPONENT_DTB:     ctxt.dtbImageFile = (xmlChar *)name;     break;
+            }
+          total += alignOnPage(size, pagesize);
+        }
+      if (nc < BOOTIMG_COMPONENT_COUNT)
+        break;
+
+      /* Then the metadata files in each requested format */
+#ifdef USE_LIBXML2
+      if (xflag && streamMetadata(&ctxt, outfd, BOOTIMG_META_FORMAT_XML, BOOTIMG_XML_FILENAME, baseName, mtime) < 0)
+        break;
+#endif
+      if (jflag && streamMetadata(&ctxt, outfd, BOOTIMG_META_FORMAT_JSON, BOOTIMG_JSON_FILENAME, baseName, mtime) < 0)
+        break;
+      if (bflag && streamMetadata(&ctxt, outfd, BOOTIMG_META_FORMAT_BINARY, BOOTIMG_BMETA_FILENAME, baseName, mtime) < 0)
+        break;
+
+      rc = 0;
     }
+  while (0);
+
+  /* Drain a pipe so that the writer does not get a SIGPIPE */
+  if (rc == 0 && !sr.input && fstat(sr.fd, &statbuf) == 0 && !S_ISREG(statbuf.st_mode))
+    {
+      char buf[BUF_LENGTH];
+
+      while (tarReadFull(sr.fd, buf, sizeof(buf)) > 0)
+        ;
+    }
+
+  releaseContextContent(&ctxt);
+  inputClose(sr.input);
+  free((void *)inputName);
+
+  return rc;
+}
   
-  size_t rdsz = fread(hdr, sizeof(boot_img_hdr), 1, fp);
-  if (rdsz != 1)
-    fprintf(stderr,
-            "%s: error: expected %lu bytes read, but got %lu\n",
-            progname, sizeof(boot_img_hdr), rdsz * sizeof(boot_img_hdr));
-  if (vflag > 1)
+/*
+ * Ramdisk bytes of an image, read where they are
+ */
+typedef struct _listSource_st
+{
+  bootimgInput_p input;
+  off64_t offset;
+  uint64_t left;
+} listSource_t, *listSource_p;
+
+static ssize_t
+listRead(void *arg, void *buf, size_t len)
+{
+  listSource_p src = (listSource_p)arg;
+  ssize_t rdsz;
+
+  if (!(len = BOOTIMG_MIN(len, src->left)))
+    return 0;
+  if ((rdsz = inputRead(src->input, buf, len, src->offset)) > 0)
     {
-      base = hdr->kernel_addr - 0x00008000;
-      fprintf(stderr, "%s: KERNEL_CMDLINE %s\n", progname, hdr->cmdline);
-      fprintf(stderr, "%s: KERNEL_BASE %08lx\n", progname, base);
-      fprintf(stderr, "%s: NAME %s\n", progname, hdr->name);
-      fprintf(stderr, "%s: PAGE_SIZE %d\n", progname, hdr->page_size);
-      fprintf(stderr, "%s: KERNEL_OFFSET %08lx\n", progname, hdr->kernel_addr - base);
-      fprintf(stderr, "%s: RAMDISK_OFFSET %08lx\n", progname, hdr->ramdisk_addr - base);
-      if (hdr->second_size != 0)
-        fprintf(stderr, "%s: SECOND_OFFSET %08lx\n", progname, hdr->second_addr - base);
-      fprintf(stderr, "%s: TAGS_OFFSET %08lx\n", progname, hdr->tags_addr - base);
+      src->offset += rdsz;
+      src->left -= rdsz;
     }
 
-  return hdr;
+  return rdsz;
 }
 
+/*
+ * List the ramdisk entries of an image as JSON lines: the ramdisk is
+ * inflated from the image file as its headers are decoded, file data
+ * being only read for --list-ramdisk=sha256. Hard links get their inode
+ * number, the digest going with the one holding the data. Returns -1
+ * on error.
+ */
 int
-readPadding(FILE* f, unsigned itemsize, int pagesize)
+listRamdisk(const char *imgfile, bootimgJsonWriter_p w)
 {
-  byte* buf = (byte*)malloc(sizeof(byte) * pagesize);
-  unsigned pagemask = pagesize - 1;
-  unsigned count;
+  int rc = -1;
+  boot_img_hdr header, *hdr;
+  off_t offset = 0;
+  const char *error = (const char *)NULL;
+  listSource_t src;
+  bootimgCpioStream_t st;
+  bootimgCpioEntry_t entry;
+  byte *buf = (byte *)NULL;
+  int more;
+  uint64_t start;
+  char *inputName;
+
+  if (!(src.input = inputOpen(imgfile, &inputName)))
+    return -1;
+  free((void *)inputName);
 
-  assert(buf);  
-  if((itemsize & pagemask) == 0)
+  do
     {
-      free(buf);
-      return 0;
+      /* the header is checked against the image size there, if known */
+      if (!(hdr = findBootMagicAt(extractReadAt, (void *)src.input, inputLength(src.input),
+                                  &header, &offset, &error)))
+        {
+          fprintf(stderr, "%s: error: %s in file '%s'\n", progname, error, imgfile);
+          break;
+        }
+      if (pflag)
+        hdr->page_size = pval;
+
+      src.offset = offset + computeComponentOffset(hdr, BOOTIMG_COMPONENT_RAMDISK);
+      src.left = hdr->ramdisk_size;
+      if (Lval && !(buf = (byte *)malloc(STREAM_CHUNK)))
+        {
+          fprintf(stderr, "%s: error: cannot allocate stream buffer!\n", progname);
+          break;
+        }
+
+      start = statsBegin(BOOTIMG_STATS_RAMDISK_UNPACK);
+      if (cpioStreamOpen(&st, listRead, (void *)&src) < 0)
+        {
+          statsEnd(BOOTIMG_STATS_RAMDISK_UNPACK, start);
+          fprintf(stderr, "%s: error: cannot read the ramdisk of '%s'!\n", progname, imgfile);
+          break;
+        }
+
+      while ((more = cpioStreamNext(&st, &entry)) > 0)
+        {
+          char sha[2*SHA256_DIGEST_LENGTH +1];
+          /* the data of hard links is stored with one of them only */
+          int hashed = Lval && S_ISREG(entry.mode) && (entry.nlink < 2 || entry.filesize);
+
+          if (hashed)
+            {
+              unsigned char digest[SHA256_DIGEST_LENGTH];
+              uint64_t hstart = statsBegin(BOOTIMG_STATS_HASH);
+              SHA256_CTX sha256;
+              ssize_t rdsz;
+
+              SHA256_Init(&sha256);
+              while ((rdsz = cpioStreamRead(&st, buf, STREAM_CHUNK)) > 0)
+                SHA256_Update(&sha256, buf, rdsz);
+              SHA256_Final(digest, &sha256);
+              statsEnd(BOOTIMG_STATS_HASH, hstart);
+              if (rdsz < 0)
+                {
+                  more = -1;
+                  break;
+                }
+              hexString(digest, SHA256_DIGEST_LENGTH, sha);
+            }
+
+          jsonWriterStartObject(w, (const char *)NULL);
+          jsonWriterWriteString(w, "image", imgfile);
+          jsonWriterWriteString(w, "path", entry.name);
+          jsonWriterWriteNumber(w, "mode", entry.mode);
+          jsonWriterWriteNumber(w, "uid", entry.uid);
+          jsonWriterWriteNumber(w, "gid", entry.gid);
+          jsonWriterWriteNumber(w, "size", entry.filesize);
+          if (entry.nlink > 1 && !S_ISDIR(entry.mode))
+            {
+              jsonWriterWriteNumber(w, "ino", entry.ino);
+              jsonWriterWriteNumber(w, "nlink", entry.nlink);
+            }
+          if (hashed)
+            jsonWriterWriteString(w, "sha256", sha);
+          if (jsonWriterEndObject(w) < 0)
+            {
+              fprintf(stderr, "%s: error: cannot write the ramdisk listing!\n", progname);
+              more = -1;
+              break;
+            }
+        }
+      cpioStreamClose(&st);
+      statsEnd(BOOTIMG_STATS_RAMDISK_UNPACK, start);
+      if (more < 0)
+        break;
+
+      rc = 0;
     }
-  
-  count = pagesize - (itemsize & pagemask);
-    
-  size_t rdsz = fread(buf, count, 1, f);
-  if (rdsz != 1)
-    fprintf(stderr, "%s: error: expected %u bytes but got %lu\n", progname, count, count * rdsz);
+  while (0);
+
   free((void *)buf);
+  inputClose(src.input);
+  return rc;
+}
+
+/*
+ * --only argument: comma separated component names. Returns a mask
+ * with a bit per BOOTIMG_COMPONENT_*, or 0 if a name is unknown.
+ */
+unsigned
+parseComponentList(const char *list)
+{
+  static const char *names[BOOTIMG_COMPONENT_COUNT] = {
+    "kernel", "ramdisk", "second", "dtb"
+  };
+  char *str = strdup(list);
+  char *saveptr = (char *)NULL;
+  unsigned mask = 0;
+
+  if (!str)
+    return 0;
+
+  for (char *tok = strtok_r(str, ",", &saveptr); tok; tok = strtok_r((char *)NULL, ",", &saveptr))
+    {
+      int nc;
+
+      for (nc = 0; nc < BOOTIMG_COMPONENT_COUNT && strcmp(tok, names[nc]); nc++)
+        ;
+      if (nc == BOOTIMG_COMPONENT_COUNT)
+        {
+          mask = 0;
+          break;
+        }
+      mask |= 1 << nc;
+    }
+
+  free((void *)str);
+  return mask;
+}
 
-  return count;
+/*
+ * Bytes of padding after an item of itemsize bytes
+ */
+unsigned
+pagePadding(unsigned itemsize, int pagesize)
+{
+  unsigned pagemask = pagesize - 1;
+
+  if ((itemsize & pagemask) == 0)
+    return 0;
+
+  return pagesize - (itemsize & pagemask);
+}
+
+/*
+ * nftw callback removing a previous ramdisk tree
+ */
+static int
+removeTreeEntry(const char *path, const struct stat *sb, int typeflag, struct FTW *ftwbuf)
+{
+  (void)sb;
+  (void)typeflag;
+  (void)ftwbuf;
+
+  return (remove(path) < 0 && errno != ENOENT) ? -1 : 0;
+}
+
+/*
+ * Load the ramdisk image. A single gzip member is probed for the
+ * parameters that compress it again bit for bit, which are given back
+ * as a fingerprint (NULL if there are none) along with the member it
+ * inflated; otherwise the image is returned as is.
+ */
+void *
+extractRamdiskProbe(const char *ramdisk_image, size_t *len, char **fingerprint)
+{
+  bootimgGzipMember_t member;
+  void *data;
+  long jobs = sysconf(_SC_NPROCESSORS_ONLN);
+
+  *fingerprint = (char *)NULL;
+  if (!(data = loadImage(ramdisk_image, len)))
+    {
+      fprintf(stderr, "%s: error: cannot read ramdisk image '%s'!\n", progname, ramdisk_image);
+      return (void *)NULL;
+    }
+
+  if (*len >= 2 && ((uint8_t *)data)[0] == GZIP_MAGIC_0 && ((uint8_t *)data)[1] == GZIP_MAGIC_1 &&
+      gzipProbe((const uint8_t *)data, *len, &member, jobs > 0 ? (unsigned)jobs : 1) == 0)
+    {
+      if ((*fingerprint = gzipFingerprint((const uint8_t *)data, &member)))
+        {
+          BOOTIMG_LOG(BOOTIMG_LOG_RAMDISK, BOOTIMG_LOG_INFO, "ramdisk gzip: %s", *fingerprint);
+          free(data);
+          data = (void *)member.data;
+          *len = member.len;
+          member.data = (uint8_t *)NULL;
+        }
+      gzipRelease(&member);
+    }
+
+  return data;
 }
 
+/*
+ * Unpack the ramdisk archive loaded by extractRamdiskProbe in fsdir,
+ * replacing what was there. Entries are created by a thread per CPU.
+ * The data is freed.
+ */
 void
-extractRamdiskFiles(const char *fsdir, const char *ramdisk_image)
+extractRamdiskFiles(const char *fsdir, const char *ramdisk_image, void *data, size_t len)
 {
+  bootimgCpioArchive_t archive;
+  long jobs = sysconf(_SC_NPROCESSORS_ONLN);
+
+  bzero((void *)&archive, sizeof(bootimgCpioArchive_t));
   do
     {
-      char cpio_command[MAX_COMMAND_LENGTH+1];
-      FILE *cpio_fp;
-      char size_str[MAX_COMMAND_LENGTH+1];
-      struct stat statbuf;
-      
-      const char *cwd = get_current_dir_name();
-      snprintf(cpio_command,
-	       MAX_COMMAND_LENGTH,
-	       "bash -c \"(rm -rf %s >/dev/null 2>&1; mkdir -p %s >/dev/null 2>&1; cd %s >/dev/null 2>&1; zcat %s | cpio -i 2>&1)\"",
-	       fsdir, fsdir, fsdir, ramdisk_image);
-      if (vflag >= 3)
-    	fprintf(stdout, "%s: pipe cpio command = '%s'\n", progname, cpio_command);
-      if ((cpio_fp = popen(cpio_command, "r")) != NULL)
+      if (cpioLoad(data, len, &archive) < 0)
         {
-          if (fgets(size_str, sizeof(size_str), cpio_fp) == NULL)
-            fprintf(stderr,
-                    "%s: error: cannot read from pipe for cpio command!\n",
-                    progname);
+          fprintf(stderr, "%s: error: cannot load ramdisk archive '%s'!\n", progname, ramdisk_image);
+          break;
+        }
 
-          else
-            if (vflag)
-              fprintf(stdout,
-                      "%s: ramdisk extracted: %s\n",
-                      progname, size_str);
-          pclose(cpio_fp);
+      if (nftw(fsdir, removeTreeEntry, 32, FTW_DEPTH | FTW_PHYS) < 0 && errno != ENOENT)
+        fprintf(stderr, "%s: warning: cannot remove previous ramdisk tree '%s'!\n", progname, fsdir);
+      if (mkdir(fsdir, 0755) < 0 && errno != EEXIST)
+        {
+          fprintf(stderr, "%s: error: cannot create ramdisk directory '%s': %s!\n",
+                  progname, fsdir, strerror(errno));
+          break;
         }
-      free((void *)cwd);
+
+      if (cpioExtractTree(&archive, fsdir, jobs > 0 ? (unsigned)jobs : 1) < 0)
+        fprintf(stderr, "%s: error: ramdisk tree '%s' is incomplete!\n", progname, fsdir);
+      else
+        BOOTIMG_LOG(BOOTIMG_LOG_RAMDISK, BOOTIMG_LOG_INFO, "ramdisk extracted: %lu entries", archive.count);
     }
   while (0);
+
+  cpioRelease(&archive);
+  free(data);
 }
 
 /* Local Variables:                                                */
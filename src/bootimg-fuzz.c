@@ -0,0 +1,210 @@
+/* bootimg-tools/bootimg-fuzz.c
+ *
+ * Copyright 2007, The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#ifdef STDC_HEADERS
+# include <stdlib.h>
+# include <stddef.h>
+#else
+# ifdef HAVE_STDLIB_H
+#  include <stdlib.h>
+# endif
+# ifdef HAVE_STDDEF_H
+#  include <stddef.h>
+# endif
+#endif
+#ifdef HAVE_STRING_H
+# include <string.h>
+#endif
+#ifdef HAVE_STRINGS_H
+# include <strings.h>
+#endif
+#ifdef HAVE_SYS_TYPES_H
+# include <sys/types.h>
+#endif
+#ifdef HAVE_UNISTD_H
+# include <unistd.h>
+#endif
+#include <stdint.h>
+#include <sys/mman.h>
+
+#include "bootimg.h"
+#include "bootimg-priv.h"
+#include "bootimg-utils.h"
+
+/*
+ * Fuzzing of the header decoder: the input is taken as an image file
+ * and, when findBootMagicFd accepts it, whatever the extract functions
+ * would then trust (page size, component offsets & sizes) has to be
+ * within the input.
+ *
+ * Built with clang & -fsanitize=fuzzer -DHAVE_LIBFUZZER this is a
+ * libFuzzer target. Otherwise the files given are replayed, or with no
+ * file a few built in images (valid, truncated, bogus sizes, ...) are
+ * checked for the expected verdict.
+ */
+
+int vflag = 0;
+char *progname = "bootimg-fuzz";
+const char *unknown_option = "????";
+
+static int memfd = -1;
+
+/*
+ * Decode one input, returns 1 if a header was accepted
+ */
+static int
+fuzzOne(const uint8_t *data, size_t size)
+{
+  boot_img_hdr hdr;
+  off_t offset;
+
+  if (memfd < 0 && (memfd = memfd_create("bootimg-fuzz", 0)) < 0)
+    abort();
+  if (ftruncate(memfd, 0) < 0 ||
+      (size && pwrite(memfd, data, size, 0) != (ssize_t)size))
+    abort();
+
+  if (!findBootMagicFd(memfd, &hdr, &offset, (const char **)NULL))
+    return 0;
+
+  if (hdr.page_size < BOOTIMG_MIN_PAGESIZE || (hdr.page_size & (hdr.page_size -1)) ||
+      (uint64_t)offset + sizeof(boot_img_hdr) > size)
+    abort();
+  for (int nc = 0; nc < BOOTIMG_COMPONENT_COUNT; nc++)
+    {
+      uint32_t sizes[BOOTIMG_COMPONENT_COUNT] = {
+        hdr.kernel_size, hdr.ramdisk_size, hdr.second_size, hdr.dt_size
+      };
+      uint64_t end = offset + computeComponentOffset(&hdr, nc) + sizes[nc];
+
+      if (!sizes[nc])
+        continue;
+      if (end > size)
+        abort();
+      /* out of bounds for the sanitizer if the check above is wrong */
+      (void)*(volatile const uint8_t *)&data[end -1];
+    }
+
+  return 1;
+}
+
+int
+LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+  fuzzOne(data, size);
+  return 0;
+}
+
+#ifndef HAVE_LIBFUZZER
+
+#define FUZZ_PAGESIZE 2048
+
+typedef struct _fuzzSeed_st
+{
+  const char *what;
+  size_t offset;                        /* of the header */
+  uint32_t page_size;
+  uint32_t kernel_size;
+  long trim;                            /* bytes cut at the end, -1 in the header */
+  int accepted;
+} fuzzSeed_t, *fuzzSeed_p;
+
+static fuzzSeed_t seeds[] = {
+  { "valid image",                    0,                     FUZZ_PAGESIZE,    100,        0,  1 },
+  { "magic after some bytes",         512,                   FUZZ_PAGESIZE,    100,        0,  1 },
+  { "magic at the end of the window", BOOT_MAGIC_SEEK_LIMIT, FUZZ_PAGESIZE,    100,        0,  1 },
+  { "truncated dtb",                  0,                     FUZZ_PAGESIZE,    100,        1,  0 },
+  { "truncated header",               0,                     FUZZ_PAGESIZE,    100,        -1, 0 },
+  { "page size not a power of 2",     0,                     FUZZ_PAGESIZE +1, 100,        0,  0 },
+  { "page size too small",            0,                     1024,             100,        0,  0 },
+  { "page size too large",            0,                     1 << 20,          100,        0,  0 },
+  { "huge kernel",                    0,                     FUZZ_PAGESIZE,    0xffffffff, 0,  0 },
+};
+
+/*
+ * Built in image: header, 1 page of kernel, 2 of ramdisk then the dtb
+ * (not padded). Returns its size.
+ */
+static size_t
+fuzzSeed(uint8_t *buf, fuzzSeed_p seed)
+{
+  boot_img_hdr *hdr = (boot_img_hdr *)(buf + seed->offset);
+  size_t size = seed->offset + 4 * FUZZ_PAGESIZE + 50;
+
+  bzero((void *)buf, size);
+  memcpy((void *)hdr->magic, BOOT_MAGIC, BOOT_MAGIC_SIZE);
+  hdr->page_size = seed->page_size;
+  hdr->kernel_size = seed->kernel_size;
+  hdr->ramdisk_size = FUZZ_PAGESIZE +1;
+  hdr->dt_size = 50;
+
+  if (seed->trim < 0)
+    return seed->offset + sizeof(boot_img_hdr) -1;
+  return size - seed->trim;
+}
+
+int
+main(int argc, char **argv)
+{
+  static uint8_t buf[BOOT_MAGIC_SEEK_LIMIT + 5 * FUZZ_PAGESIZE];
+  int failed = 0;
+
+  /* replay */
+  if (argc > 1)
+    {
+      for (int n = 1; n < argc; n++)
+        {
+          size_t size;
+          void *data = loadImage(argv[n], &size);
+
+          if (!data)
+            {
+              fprintf(stderr, "%s: error: cannot read '%s'!\n", progname, argv[n]);
+              exit(1);
+            }
+          printf("%s: %s\n", argv[n], fuzzOne((const uint8_t *)data, size) ? "accepted" : "rejected");
+          free(data);
+        }
+      return 0;
+    }
+
+  for (size_t n = 0; n < sizeof(seeds) / sizeof(fuzzSeed_t); n++)
+    {
+      int accepted = fuzzOne(buf, fuzzSeed(buf, &seeds[n]));
+
+      printf("%s: %-32s %s\n", progname, seeds[n].what,
+             accepted == seeds[n].accepted ? "ok" : "FAILED");
+      failed |= (accepted != seeds[n].accepted);
+    }
+
+  /* empty file & no magic */
+  failed |= fuzzOne(buf, 0);
+  bzero((void *)buf, sizeof(buf));
+  failed |= fuzzOne(buf, sizeof(buf));
+
+  return failed;
+}
+
+#endif /* HAVE_LIBFUZZER */
+
+/* Local Variables:                                                */
+/* mode: C                                                         */
+/* comment-column: 0                                               */
+/* End:                                                            */
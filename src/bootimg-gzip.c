@@ -0,0 +1,641 @@
+/* bootimg-tools/bootimg-gzip.c
+ *
+ * Copyright 2007, The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#ifdef STDC_HEADERS
+# include <stdlib.h>
+# include <stddef.h>
+#else
+# ifdef HAVE_STDLIB_H
+#  include <stdlib.h>
+# endif
+# ifdef HAVE_STDDEF_H
+#  include <stddef.h>
+# endif
+#endif
+#ifdef HAVE_STRING_H
+# include <string.h>
+#endif
+#ifdef HAVE_STRINGS_H
+# include <strings.h>
+#endif
+#include <pthread.h>
+#include <time.h>
+#include <zlib.h>
+
+#include "bootimg-cpio.h"
+#include "bootimg-gzip.h"
+#include "bootimg-stats.h"
+#include "bootimg-log.h"
+
+#define GZIP_HEADER_MIN_SIZE    10
+#define GZIP_CHUNK              (64*1024)
+
+/* External decls */
+extern int vflag;
+extern char *progname;
+
+/* Levels tried when looking for the one used to compress a member */
+static const int gzip_levels[] = { 9, 6, 1, 2, 3, 4, 5, 7, 8 };
+
+/* then with each of these strategy & memLevel */
+static const int gzip_variants[][2] = {
+  { Z_DEFAULT_STRATEGY, 8 }, { Z_DEFAULT_STRATEGY, 9 },
+  { Z_FILTERED, 8 },         { Z_FILTERED, 9 }
+};
+
+#define GZIP_LEVEL_COUNT        (sizeof(gzip_levels) / sizeof(gzip_levels[0]))
+#define GZIP_CANDIDATE_COUNT    (int)(GZIP_LEVEL_COUNT * sizeof(gzip_variants) / sizeof(gzip_variants[0]))
+
+/*
+ * Parameters search shared by the threads: candidates are taken in
+ * order, the first one matching wins
+ */
+typedef struct _gzipSearch_st
+{
+  const uint8_t *data;
+  size_t len;
+  const uint8_t *stream;
+  size_t stream_len;
+  int next;
+  int found;                            /* GZIP_CANDIDATE_COUNT if none */
+} gzipSearch_t, *gzipSearch_p;
+
+/*
+ * Trials of gzipTune, taken in order by the threads
+ */
+typedef struct _gzipTune_st
+{
+  const uint8_t *data;
+  size_t len;
+  const uint8_t *hdr;
+  size_t hdr_len;
+  bootimgGzipTrial_p trials;
+  int next;
+} gzipTune_t, *gzipTune_p;
+
+static const char *gzip_goals[] = { "size", "boot-speed", "balanced" };
+
+static uint32_t
+gzipLe32(const uint8_t *p)
+{
+  return (uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static void
+gzipPutLe32(uint8_t *p, uint32_t v)
+{
+  p[0] = v & 0xff;
+  p[1] = (v >> 8) & 0xff;
+  p[2] = (v >> 16) & 0xff;
+  p[3] = (v >> 24) & 0xff;
+}
+
+/*
+ * Get the size of a gzip member header
+ */
+int
+gzipParseHeader(const uint8_t *in, size_t inlen, size_t *hdrlen)
+{
+  size_t pos = GZIP_HEADER_MIN_SIZE;
+  uint8_t flags;
+
+  if (inlen < GZIP_HEADER_MIN_SIZE ||
+      in[0] != GZIP_MAGIC_0 || in[1] != GZIP_MAGIC_1 || in[2] != Z_DEFLATED)
+    return -1;
+  flags = in[3];
+
+  if (flags & GZIP_FLAG_FEXTRA)
+    {
+      if (inlen - pos < 2)
+        return -1;
+      pos += 2 + (in[pos] | in[pos +1] << 8);
+    }
+  if (flags & GZIP_FLAG_FNAME)
+    {
+      const uint8_t *nul = pos < inlen ? memchr(in + pos, 0, inlen - pos) : NULL;
+      if (!nul)
+        return -1;
+      pos = nul - in + 1;
+    }
+  if (flags & GZIP_FLAG_FCOMMENT)
+    {
+      const uint8_t *nul = pos < inlen ? memchr(in + pos, 0, inlen - pos) : NULL;
+      if (!nul)
+        return -1;
+      pos = nul - in + 1;
+    }
+  if (flags & GZIP_FLAG_FHCRC)
+    pos += 2;
+  if (pos > inlen)
+    return -1;
+
+  *hdrlen = pos;
+  return 0;
+}
+
+/*
+ * Compress data at a packed level and compare with a deflate stream as
+ * the output is produced: a mismatch stops at once.
+ */
+static int
+gzipMatchLevel(const uint8_t *data, size_t len, int level, const uint8_t *stream, size_t stream_len)
+{
+  uint8_t *chunk;
+  z_stream zs;
+  size_t pos = 0;
+  int zrc = Z_OK, match = 0;
+
+  if (!(chunk = (uint8_t *)malloc(GZIP_CHUNK)))
+    return 0;
+  statsCount(BOOTIMG_STATS_CURRENT, BOOTIMG_STATS_ALLOCS, 1);
+
+  bzero((void *)&zs, sizeof(z_stream));
+  if (deflateInit2(&zs, GZIP_PARAMS_LEVEL(level), Z_DEFLATED, -15,
+                   GZIP_PARAMS_MEMLEVEL(level), GZIP_PARAMS_STRATEGY(level)) != Z_OK)
+    {
+      free((void *)chunk);
+      return 0;
+    }
+  zs.next_in = (Bytef *)data;
+  zs.avail_in = len;
+
+  do
+    {
+      size_t produced;
+
+      zs.next_out = chunk;
+      zs.avail_out = GZIP_CHUNK;
+      zrc = deflate(&zs, Z_FINISH);
+      if (zrc == Z_STREAM_ERROR)
+        break;
+
+      produced = GZIP_CHUNK - zs.avail_out;
+      if (produced > stream_len - pos ||
+          memcmp((const void *)chunk, (const void *)(stream + pos), produced))
+        break;
+      pos += produced;
+      match = (zrc == Z_STREAM_END && pos == stream_len);
+    }
+  while (zrc == Z_OK || zrc == Z_BUF_ERROR);
+
+  deflateEnd(&zs);
+  free((void *)chunk);
+
+  return match;
+}
+
+static int
+gzipCandidate(int n)
+{
+  const int *variant = gzip_variants[n / GZIP_LEVEL_COUNT];
+
+  return GZIP_PARAMS(gzip_levels[n % GZIP_LEVEL_COUNT], variant[0], variant[1]);
+}
+
+static void *
+gzipSearchThread(void *arg)
+{
+  gzipSearch_p search = (gzipSearch_p)arg;
+  int n, found;
+
+  while ((n = __atomic_fetch_add(&search->next, 1, __ATOMIC_RELAXED)) < GZIP_CANDIDATE_COUNT)
+    {
+      /* a candidate before this one already matched */
+      if (n > (found = __atomic_load_n(&search->found, __ATOMIC_RELAXED)))
+        break;
+      if (!gzipMatchLevel(search->data, search->len, gzipCandidate(n), search->stream, search->stream_len))
+        continue;
+
+      while (n < found &&
+             !__atomic_compare_exchange_n(&search->found, &found, n, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        ;
+      break;
+    }
+
+  return NULL;
+}
+
+/*
+ * Split a gzip member, inflate it and look for the zlib parameters that
+ * reproduce its deflate stream, trying them with jobs threads.
+ */
+int
+gzipProbe(const uint8_t *in, size_t inlen, bootimgGzipMember_p member, unsigned jobs)
+{
+  pthread_t threads[GZIP_MAX_JOBS];
+  gzipSearch_t search;
+  unsigned started = 0;
+  uint8_t *buf = (uint8_t *)NULL;
+  size_t alloc = 0, len = 0, trailer;
+  z_stream zs;
+  int zrc = Z_OK;
+
+  bzero((void *)member, sizeof(bootimgGzipMember_t));
+  member->level = GZIP_LEVEL_UNKNOWN;
+
+  if (gzipParseHeader(in, inlen, &member->hdr_len) < 0)
+    return -1;
+
+  bzero((void *)&zs, sizeof(z_stream));
+  if (inflateInit2(&zs, -15) != Z_OK)
+    return -1;
+  zs.next_in = (Bytef *)(in + member->hdr_len);
+  zs.avail_in = inlen - member->hdr_len;
+
+  do
+    {
+      if (alloc - len < GZIP_CHUNK)
+        {
+          uint8_t *newbuf;
+
+          alloc = alloc ? alloc * 2 : (inlen * 4 > GZIP_CHUNK ? inlen * 4 : GZIP_CHUNK);
+          if (!(newbuf = (uint8_t *)realloc(buf, alloc)))
+            {
+              zrc = Z_MEM_ERROR;
+              break;
+            }
+          buf = newbuf;
+          statsCount(BOOTIMG_STATS_CURRENT, BOOTIMG_STATS_ALLOCS, 1);
+        }
+      zs.next_out = buf + len;
+      zs.avail_out = alloc - len;
+      zrc = inflate(&zs, Z_NO_FLUSH);
+      len = alloc - zs.avail_out;
+    }
+  while (zrc == Z_OK);
+
+  member->deflate_len = zs.total_in;
+  inflateEnd(&zs);
+
+  trailer = member->hdr_len + member->deflate_len;
+  if (zrc != Z_STREAM_END || inlen - trailer < GZIP_TRAILER_SIZE ||
+      gzipLe32(in + trailer) != crc32(crc32(0L, Z_NULL, 0), buf, len) ||
+      gzipLe32(in + trailer + 4) != (uint32_t)len)
+    {
+      BOOTIMG_LOG(BOOTIMG_LOG_RAMDISK, BOOTIMG_LOG_INFO, "error: bad gzip member (%d)!", zrc);
+      free((void *)buf);
+      return -1;
+    }
+
+  member->tail_len = inlen - trailer - GZIP_TRAILER_SIZE;
+  member->data = buf;
+  member->len = len;
+
+  search.data = buf;
+  search.len = len;
+  search.stream = in + member->hdr_len;
+  search.stream_len = member->deflate_len;
+  search.next = 0;
+  search.found = GZIP_CANDIDATE_COUNT;
+
+  /* the caller is one of the threads */
+  jobs = jobs < 1 ? 1 : (jobs > GZIP_MAX_JOBS ? GZIP_MAX_JOBS : jobs);
+  while (started < jobs -1 &&
+         !pthread_create(&threads[started], (const pthread_attr_t *)NULL, gzipSearchThread, (void *)&search))
+    started++;
+  gzipSearchThread((void *)&search);
+  while (started)
+    pthread_join(threads[--started], (void **)NULL);
+
+  if (search.found < GZIP_CANDIDATE_COUNT)
+    member->level = gzipCandidate(search.found);
+  BOOTIMG_LOG(BOOTIMG_LOG_RAMDISK, BOOTIMG_LOG_VERBOSE,
+              "gzip member: header %lu, deflate %lu, tail %lu, level %d",
+              member->hdr_len, member->deflate_len, member->tail_len, member->level);
+
+  return 0;
+}
+
+void
+gzipRelease(bootimgGzipMember_p member)
+{
+  free((void *)member->data);
+  bzero((void *)member, sizeof(bootimgGzipMember_t));
+}
+
+/*
+ * Rebuild a gzip member from its inflated data, packed level, header
+ * and tail (zeros if NULL)
+ */
+int
+gzipRebuild(const uint8_t *data, size_t len, int level,
+            const uint8_t *hdr, size_t hdr_len, const uint8_t *tail, size_t tail_len,
+            uint8_t **out, size_t *outlen)
+{
+  uint8_t *buf;
+  z_stream zs;
+  size_t bound, pos;
+  int zrc;
+
+  bzero((void *)&zs, sizeof(z_stream));
+  if (deflateInit2(&zs, GZIP_PARAMS_LEVEL(level), Z_DEFLATED, -15,
+                   GZIP_PARAMS_MEMLEVEL(level), GZIP_PARAMS_STRATEGY(level)) != Z_OK)
+    return -1;
+
+  bound = deflateBound(&zs, len);
+  if (!(buf = (uint8_t *)malloc(hdr_len + bound + GZIP_TRAILER_SIZE + tail_len)))
+    {
+      deflateEnd(&zs);
+      return -1;
+    }
+  statsCount(BOOTIMG_STATS_CURRENT, BOOTIMG_STATS_ALLOCS, 1);
+
+  memcpy((void *)buf, (const void *)hdr, hdr_len);
+  zs.next_in = (Bytef *)data;
+  zs.avail_in = len;
+  zs.next_out = buf + hdr_len;
+  zs.avail_out = bound;
+  zrc = deflate(&zs, Z_FINISH);
+  pos = hdr_len + zs.total_out;
+  deflateEnd(&zs);
+
+  if (zrc != Z_STREAM_END)
+    {
+      free((void *)buf);
+      return -1;
+    }
+
+  gzipPutLe32(buf + pos, crc32(crc32(0L, Z_NULL, 0), data, len));
+  gzipPutLe32(buf + pos + 4, (uint32_t)len);
+  pos += GZIP_TRAILER_SIZE;
+  if (tail)
+    memcpy((void *)(buf + pos), (const void *)tail, tail_len);
+  else
+    bzero((void *)(buf + pos), tail_len);
+
+  *out = buf;
+  *outlen = pos + tail_len;
+  return 0;
+}
+
+/*
+ * Text form of the parameters, header & tail of a probed member, e.g.
+ * "level=9,strategy=0,memlevel=8,header=1f8b0800000000000203,tail=0".
+ * NULL if the member cannot be rebuilt from it: parameters not found,
+ * header too long or tail not made of zeros.
+ */
+char *
+gzipFingerprint(const uint8_t *in, bootimgGzipMember_p member)
+{
+  const uint8_t *tail = in + member->hdr_len + member->deflate_len + GZIP_TRAILER_SIZE;
+  char hex[2*GZIP_HEADER_MAX_SIZE +1];
+  char *str;
+
+  if (member->level == GZIP_LEVEL_UNKNOWN || member->hdr_len > GZIP_HEADER_MAX_SIZE)
+    return (char *)NULL;
+  for (size_t n = 0; n < member->tail_len; n++)
+    if (tail[n])
+      return (char *)NULL;
+
+  for (size_t n = 0; n < member->hdr_len; n++)
+    sprintf(&hex[2*n], "%02x", in[n]);
+  if (!(str = (char *)malloc(sizeof(hex) + 96)))
+    return (char *)NULL;
+  snprintf(str, sizeof(hex) + 96, "level=%d,strategy=%d,memlevel=%d,header=%s,tail=%lu",
+           GZIP_PARAMS_LEVEL(member->level), GZIP_PARAMS_STRATEGY(member->level),
+           GZIP_PARAMS_MEMLEVEL(member->level), hex, member->tail_len);
+
+  return str;
+}
+
+/*
+ * Parse a fingerprint: packed level, header (hdr holds
+ * GZIP_HEADER_MAX_SIZE bytes) & tail length. Returns -1 if invalid.
+ */
+int
+gzipParseFingerprint(const char *str, int *level, uint8_t *hdr, size_t *hdr_len, size_t *tail_len)
+{
+  char hex[2*GZIP_HEADER_MAX_SIZE +1];
+  int lvl, strategy, memlevel;
+  size_t len, parsed;
+  unsigned long tail;
+
+  if (!str || sscanf(str, "level=%d,strategy=%d,memlevel=%d,header=%512[0-9a-f],tail=%lu",
+                     &lvl, &strategy, &memlevel, hex, &tail) != 5)
+    return -1;
+  if (lvl < 1 || lvl > 9 || (strategy != Z_DEFAULT_STRATEGY && strategy != Z_FILTERED) ||
+      memlevel < 1 || memlevel > 9 || (len = strlen(hex)) & 1)
+    return -1;
+
+  for (size_t n = 0; n < len / 2; n++)
+    {
+      unsigned byte;
+
+      sscanf(&hex[2*n], "%2x", &byte);
+      hdr[n] = byte;
+    }
+  if (gzipParseHeader(hdr, len / 2, &parsed) < 0 || parsed != len / 2)
+    return -1;
+
+  *level = GZIP_PARAMS(lvl, strategy, memlevel);
+  *hdr_len = parsed;
+  *tail_len = tail;
+
+  return 0;
+}
+
+/*
+ * --optimize argument: size, boot-speed or balanced. Returns -1 if unknown.
+ */
+int
+gzipParseTuneGoal(const char *goal)
+{
+  for (int n = GZIP_TUNE_SIZE; n <= GZIP_TUNE_BALANCED; n++)
+    if (goal && !strcmp(goal, gzip_goals[n]))
+      return n;
+
+  return -1;
+}
+
+const char *
+gzipTuneGoalName(int goal)
+{
+  return gzip_goals[goal];
+}
+
+static uint64_t
+gzipNow(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void *
+gzipTuneThread(void *arg)
+{
+  gzipTune_p tune = (gzipTune_p)arg;
+  int n;
+
+  while ((n = __atomic_fetch_add(&tune->next, 1, __ATOMIC_RELAXED)) < GZIP_TUNE_CANDIDATES)
+    {
+      bootimgGzipTrial_p trial = &tune->trials[n];
+
+      trial->level = n;
+      if (n != GZIP_LEVEL_NONE)
+        {
+          if (gzipRebuild(tune->data, tune->len, n, tune->hdr, tune->hdr_len,
+                          (const uint8_t *)NULL, 0, &trial->data, &trial->size) < 0)
+            trial->data = (uint8_t *)NULL;
+        }
+      else if ((trial->data = (uint8_t *)malloc(tune->len ? tune->len : 1)))
+        {
+          statsCount(BOOTIMG_STATS_CURRENT, BOOTIMG_STATS_ALLOCS, 1);
+          memcpy((void *)trial->data, (const void *)tune->data, tune->len);
+          trial->size = tune->len;
+        }
+    }
+
+  return NULL;
+}
+
+/*
+ * Benchmark of a trial: best time to get the archive back in out, as
+ * the kernel does (gzip header & trailer checked). 0 if it fails.
+ */
+static uint64_t
+gzipInflateTime(bootimgGzipTrial_p trial, uint8_t *out, size_t len)
+{
+  uint64_t best = UINT64_MAX;
+
+  for (int run = 0; run < GZIP_TUNE_RUNS; run++)
+    {
+      uint64_t start = gzipNow(), elapsed;
+
+      if (trial->level == GZIP_LEVEL_NONE)
+        memcpy((void *)out, (const void *)trial->data, len);
+      else
+        {
+          z_stream zs;
+          int zrc;
+
+          bzero((void *)&zs, sizeof(z_stream));
+          if (inflateInit2(&zs, 16 + MAX_WBITS) != Z_OK)
+            return 0;
+          zs.next_in = (Bytef *)trial->data;
+          zs.avail_in = trial->size;
+          zs.next_out = out;
+          zs.avail_out = len;
+          zrc = inflate(&zs, Z_FINISH);
+          inflateEnd(&zs);
+          if (zrc != Z_STREAM_END || zs.total_out != len)
+            return 0;
+        }
+
+      if ((elapsed = gzipNow() - start) < best)
+        best = elapsed;
+    }
+
+  return best ? best : 1;
+}
+
+/*
+ * Compress the archive data in all the GZIP_TUNE_CANDIDATES ways (gzip
+ * members with the header hdr), with jobs threads, and benchmark them.
+ * Returns the index of the trial best for the goal of the ones not
+ * larger than max, -1 if none. trials are released by gzipTuneRelease.
+ */
+int
+gzipTune(const uint8_t *data, size_t len, const uint8_t *hdr, size_t hdr_len,
+         int goal, size_t max, unsigned jobs, bootimgGzipTrial_p trials)
+{
+  pthread_t threads[GZIP_MAX_JOBS];
+  gzipTune_t tune;
+  unsigned started = 0;
+  uint8_t *out;
+  size_t smallest = SIZE_MAX;
+  int best = -1;
+
+  bzero((void *)trials, GZIP_TUNE_CANDIDATES * sizeof(bootimgGzipTrial_t));
+  tune.data = data;
+  tune.len = len;
+  tune.hdr = hdr;
+  tune.hdr_len = hdr_len;
+  tune.trials = trials;
+  tune.next = 0;
+
+  /* the caller is one of the threads */
+  jobs = jobs < 1 ? 1 : (jobs > GZIP_MAX_JOBS ? GZIP_MAX_JOBS : jobs);
+  while (started < jobs -1 &&
+         !pthread_create(&threads[started], (const pthread_attr_t *)NULL, gzipTuneThread, (void *)&tune))
+    started++;
+  gzipTuneThread((void *)&tune);
+  while (started)
+    pthread_join(threads[--started], (void **)NULL);
+
+  /* one at a time, not to share the CPU & memory bandwidth */
+  if (!(out = (uint8_t *)malloc(len ? len : 1)))
+    return -1;
+  statsCount(BOOTIMG_STATS_CURRENT, BOOTIMG_STATS_ALLOCS, 1);
+  for (int n = 0; n < GZIP_TUNE_CANDIDATES; n++)
+    {
+      bootimgGzipTrial_p trial = &trials[n];
+
+      if (trial->data && !(trial->inflate_ns = gzipInflateTime(trial, out, len)))
+        {
+          free((void *)trial->data);
+          trial->data = (uint8_t *)NULL;
+        }
+      if (!trial->data)
+        continue;
+
+      BOOTIMG_LOG(BOOTIMG_LOG_RAMDISK, BOOTIMG_LOG_VERBOSE,
+                  "ramdisk trial level %d: %lu bytes, inflated in %.3f ms (%.1f MB/s)",
+                  trial->level, trial->size, trial->inflate_ns / 1e6, len * 1e3 / trial->inflate_ns);
+      if (trial->size <= max && trial->size < smallest)
+        smallest = trial->size;
+    }
+  free((void *)out);
+
+  for (int n = 0; n < GZIP_TUNE_CANDIDATES; n++)
+    {
+      bootimgGzipTrial_p trial = &trials[n], current = best < 0 ? NULL : &trials[best];
+
+      if (!trial->data || trial->size > max)
+        continue;
+      if (goal == GZIP_TUNE_BALANCED && trial->size > smallest + smallest * GZIP_TUNE_BALANCED_SLACK / 100)
+        continue;
+
+      if (!current ||
+          (goal == GZIP_TUNE_SIZE &&
+           (trial->size < current->size ||
+            (trial->size == current->size && trial->inflate_ns < current->inflate_ns))) ||
+          (goal != GZIP_TUNE_SIZE &&
+           (trial->inflate_ns < current->inflate_ns ||
+            (trial->inflate_ns == current->inflate_ns && trial->size < current->size))))
+        best = n;
+    }
+
+  return best;
+}
+
+void
+gzipTuneRelease(bootimgGzipTrial_p trials)
+{
+  for (int n = 0; n < GZIP_TUNE_CANDIDATES; n++)
+    free((void *)trials[n].data);
+  bzero((void *)trials, GZIP_TUNE_CANDIDATES * sizeof(bootimgGzipTrial_t));
+}
+
+/* Local Variables:                                                */
+/* mode: C                                                         */
+/* comment-column: 0                                               */
+/* End:                                                            */
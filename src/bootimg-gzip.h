@@ -0,0 +1,119 @@
+/* bootimg-tools/bootimg-gzip.h
+ *
+ * Copyright 2007, The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef __BOOTIMG_GZIP_H__
+#define __BOOTIMG_GZIP_H__
+
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+ * A single gzip member split in its parts:
+ *
+ * +--------+----------------+---------+--------+
+ * | header | deflate stream | trailer | tail   |
+ * +--------+----------------+---------+--------+
+ *
+ * When the deflate stream is what zlib produces at some level from the
+ * inflated data, the member can be rebuilt bit for bit from the data,
+ * the level, the header and the tail (padding after the member). The
+ * fingerprint of a member is the text form of all but the data, for
+ * metadata files.
+ */
+
+#define GZIP_TRAILER_SIZE               8
+#define GZIP_LEVEL_UNKNOWN              -1
+
+/*
+ * The deflate parameters found by gzipProbe are packed in a level:
+ * zlib level, strategy & memLevel. A plain zlib level is the packed
+ * level of the default strategy & memLevel.
+ */
+#define GZIP_PARAMS(level, strategy, memlevel) \
+  ((level) | (strategy) << 4 | ((memlevel) == 8 ? 0 : (memlevel)) << 8)
+#define GZIP_PARAMS_LEVEL(p)            ((p) & 0xf)
+#define GZIP_PARAMS_STRATEGY(p)         (((p) >> 4) & 0xf)
+#define GZIP_PARAMS_MEMLEVEL(p)         (((p) >> 8) & 0xf ? ((p) >> 8) & 0xf : 8)
+
+/* Longest header kept in a fingerprint */
+#define GZIP_HEADER_MAX_SIZE            256
+
+/* Most threads looking for the parameters of a member */
+#define GZIP_MAX_JOBS                   16
+
+/*
+ * Ramdisk compressions compared by gzipTune: the raw archive (the
+ * kernel takes an uncompressed initramfs) and the gzip levels. Trials
+ * are compressed with a thread per CPU, then inflated one at a time
+ * (the best of GZIP_TUNE_RUNS) for their decompression time. The goal
+ * picks the smallest, the fastest to inflate or, balanced, the fastest
+ * of the ones at most GZIP_TUNE_BALANCED_SLACK % larger than the
+ * smallest; among the ones not over the size ceiling.
+ */
+#define GZIP_LEVEL_NONE                 0       /* raw archive */
+#define GZIP_TUNE_CANDIDATES            10      /* raw & levels 1 to 9 */
+#define GZIP_TUNE_RUNS                  5
+#define GZIP_TUNE_BALANCED_SLACK        10
+
+#define GZIP_TUNE_SIZE                  0
+#define GZIP_TUNE_BOOT_SPEED            1
+#define GZIP_TUNE_BALANCED              2
+
+/* Header flags (RFC 1952) */
+#define GZIP_FLAG_FHCRC                 0x02
+#define GZIP_FLAG_FEXTRA                0x04
+#define GZIP_FLAG_FNAME                 0x08
+#define GZIP_FLAG_FCOMMENT              0x10
+
+typedef struct _bootimgGzipMember_st
+{
+  size_t hdr_len;
+  size_t deflate_len;
+  size_t tail_len;
+  int level;                            /* packed, GZIP_LEVEL_UNKNOWN if not found */
+  uint8_t *data;                        /* inflated data (owned) */
+  size_t len;
+} bootimgGzipMember_t, *bootimgGzipMember_p;
+
+typedef struct _bootimgGzipTrial_st
+{
+  int level;                            /* GZIP_LEVEL_NONE or zlib level */
+  uint8_t *data;                        /* ramdisk image (owned), NULL if failed */
+  size_t size;
+  uint64_t inflate_ns;                  /* best time to inflate (copy if raw) */
+} bootimgGzipTrial_t, *bootimgGzipTrial_p;
+
+int   gzipParseHeader   (const uint8_t *, size_t, size_t *);
+int   gzipProbe         (const uint8_t *, size_t, bootimgGzipMember_p, unsigned);
+void  gzipRelease       (bootimgGzipMember_p);
+int   gzipRebuild       (const uint8_t *, size_t, int,
+                         const uint8_t *, size_t, const uint8_t *, size_t,
+                         uint8_t **, size_t *);
+char *gzipFingerprint   (const uint8_t *, bootimgGzipMember_p);
+int   gzipParseFingerprint(const char *, int *, uint8_t *, size_t *, size_t *);
+int   gzipParseTuneGoal (const char *);
+const char *gzipTuneGoalName(int);
+int   gzipTune          (const uint8_t *, size_t, const uint8_t *, size_t,
+                         int, size_t, unsigned, bootimgGzipTrial_p);
+void  gzipTuneRelease   (bootimgGzipTrial_p);
+
+#endif /* __BOOTIMG_GZIP_H__ */
+
+/* Local Variables:                                                */
+/* mode: C                                                         */
+/* comment-column: 0                                               */
+/* End:                                                            */
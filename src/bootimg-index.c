@@ -0,0 +1,1200 @@
+/* bootimg-tools/bootimg-index.c
+ *
+ * Copyright 2007, The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#ifdef STDC_HEADERS
+# include <stdlib.h>
+# include <stddef.h>
+#else
+# ifdef HAVE_STDLIB_H
+#  include <stdlib.h>
+# endif
+# ifdef HAVE_STDDEF_H
+#  include <stddef.h>
+# endif
+#endif
+#ifdef HAVE_STRING_H
+# include <string.h>
+#endif
+#ifdef HAVE_STRINGS_H
+# include <strings.h>
+#endif
+#ifdef HAVE_FCNTL_H
+# include <fcntl.h>
+#endif
+#ifdef HAVE_SYS_TYPES_H
+# include <sys/types.h>
+#endif
+#ifdef HAVE_SYS_STAT_H
+# include <sys/stat.h>
+#endif
+#ifdef HAVE_UNISTD_H
+# include <unistd.h>
+#endif
+#include <getopt.h>
+#ifdef HAVE_ALLOCA_H
+# include <alloca.h>
+#endif
+#ifdef HAVE_ASSERT_H
+# include <assert.h>
+#endif
+#ifdef HAVE_LIMITS_H
+# include <limits.h>
+#endif
+#include <errno.h>
+#include <ftw.h>
+#include <fnmatch.h>
+#include <pthread.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+
+#ifdef USE_OPENSSL
+# ifndef OPENSSL_NO_SHA256
+#  include <openssl/sha.h>
+#  include <openssl/err.h>
+# else
+#  error No SHA256 available in this openssl ! It is mandatory ...
+# endif
+#endif
+
+#include "bootimg.h"
+#include "bootimg-priv.h"
+#include "bootimg-utils.h"
+#include "bootimg-io.h"
+#include "bootimg-index.h"
+#include "bootimg-log.h"
+
+#define BOOTIMG_INDEX_MAX_QUERIES       16
+#define BOOTIMG_INDEX_MAX_JOBS          64
+
+/*
+ * Options flags & values
+ * - v: verbose. vflag € N+*
+ * - d: index file. dflag € [0, 1]
+ * - j: scanning threads. jflag € [0, 1]
+ * - q: query expression. qflag € [0, BOOTIMG_INDEX_MAX_QUERIES]
+ * - l: long listing. lflag € [0, 1]
+ * - V: check verity signatures while indexing. Vflag € [0, 1]
+ */
+int vflag = 0;
+int dflag = 0;
+int jflag = 0;
+int qflag = 0;
+int lflag = 0;
+int Vflag = 0;
+
+/* dval: index file */
+char *dval = (char *)BOOTIMG_INDEX_FILENAME;
+/* jval: scanning threads */
+long jval = 0;
+/* qval: query expressions */
+char *qval[BOOTIMG_INDEX_MAX_QUERIES];
+
+/*
+ * progname & blankname are program name and space string with progname size
+ * for displaying messsages and help
+ */
+char *progname = (char *)NULL;
+char *blankname = (char *)NULL;
+
+static const char *progusage =
+  "usage: %s [options] [dir|imgfile ...]\n"
+  "       %s --help\n";
+static const char *proghelp =
+  "\n"
+  "       basic user options:\n"
+  "       %s -h --help                     display this message.\n"
+  "       %s -v --verbose[=<lvl>]          be verbose at runtime. <lvl> is\n"
+  "       %s                               added to current verbosity level.\n"
+  "\n"
+  "       options for controling the index:\n"
+  "       %s -d --db=<file>                index file (default bootimg.idx).\n"
+  "       %s -j --jobs=<n>                 number of scanning threads. Default\n"
+  "       %s                               is the number of online cpus.\n"
+  "       %s -V --verity                   Verify VERITY signature blocks while\n"
+  "       %s                               indexing (slow). Otherwise only their\n"
+  "       %s                               presence is recorded.\n"
+  "\n"
+  "       %s Directories and files on the command line are (re)indexed:\n"
+  "       %s files with unchanged mtime & size are not read again and\n"
+  "       %s vanished files are recorded as removed.\n"
+  "\n"
+  "       options for querying the index:\n"
+  "       %s -q --query=<field><op><value> select images. Several queries\n"
+  "       %s                               must all match. <op> is one of\n"
+  "       %s                               =, !=, <, <=, >, >=. Fields are:\n"
+  "       %s                               path, name (glob with = & !=),\n"
+  "       %s                               os-version (A.B.C), patch-level\n"
+  "       %s                               (YYYY-MM), page-size, size,\n"
+  "       %s                               kernel-size, ramdisk-size,\n"
+  "       %s                               kernel-digest, ramdisk-digest,\n"
+  "       %s                               second-digest, dtb-digest, id (hex\n"
+  "       %s                               prefix) and verity (none, present,\n"
+  "       %s                               valid, invalid).\n"
+  "       %s -l --long                     display header values of matches.\n";
+
+/*
+ * Long options
+ */
+struct option long_options[] = {
+  {"verbose",  optional_argument, 0,  'v' },
+  {"db",       required_argument, 0,  'd' },
+  {"jobs",     required_argument, 0,  'j' },
+  {"query",    required_argument, 0,  'q' },
+  {"long",     no_argument,       0,  'l' },
+  {"verity",   no_argument,       0,  'V' },
+  {"help",     no_argument,       0,  'h' },
+  {0,          0,                 0,   0  }
+};
+#define BOOTIMG_OPTSTRING "v::d:j:q:lVh"
+const char *unknown_option = "????";
+
+/*
+ * Getopt external defs
+ */
+extern char *optarg;
+extern int optind;
+
+/*
+ * Latest record of each path. Open addressing on a FNV-1a hash.
+ */
+typedef struct _bootimgIndexEntry_st
+{
+  uint64_t hash;
+  const struct bootimg_index_rec *rec;
+  int seen;
+} bootimgIndexEntry_t, *bootimgIndexEntry_p;
+
+typedef struct _bootimgIndex_st
+{
+  void *map;                            /* mmaped index file */
+  size_t maplen;
+  bootimgIndexEntry_p entries;
+  size_t capacity;                      /* power of 2 */
+  size_t count;
+} bootimgIndex_t, *bootimgIndex_p;
+
+/*
+ * Candidate files of a scan & the records computed for them
+ */
+typedef struct _bootimgIndexJobs_st
+{
+  char **paths;
+  struct bootimg_index_rec **recs;
+  size_t count;
+  size_t alloc;
+  size_t next;                          /* next job to take */
+  dev_t idx_dev;                        /* index file itself is skipped */
+  ino_t idx_ino;
+} bootimgIndexJobs_t, *bootimgIndexJobs_p;
+
+/* nftw has no user data pointer */
+static bootimgIndexJobs_p walk_jobs = (bootimgIndexJobs_p)NULL;
+
+/*
+ * Query terms
+ */
+#define QUERY_OP_EQ     0
+#define QUERY_OP_NE     1
+#define QUERY_OP_LT     2
+#define QUERY_OP_LE     3
+#define QUERY_OP_GT     4
+#define QUERY_OP_GE     5
+
+#define QUERY_KIND_NUMBER       0
+#define QUERY_KIND_STRING       1
+#define QUERY_KIND_DIGEST       2
+
+typedef struct _bootimgIndexQuery_st
+{
+  int field;
+  int kind;
+  int op;
+  uint64_t number;
+  const char *string;
+} bootimgIndexQuery_t, *bootimgIndexQuery_p;
+
+static const struct
+{
+  const char *name;
+  int kind;
+} query_fields[] = {
+#define QUERY_FIELD_PATH                0
+  { "path",           QUERY_KIND_STRING },
+#define QUERY_FIELD_NAME                1
+  { "name",           QUERY_KIND_STRING },
+#define QUERY_FIELD_OSVERSION           2
+  { "os-version",     QUERY_KIND_NUMBER },
+#define QUERY_FIELD_PATCHLEVEL          3
+  { "patch-level",    QUERY_KIND_NUMBER },
+#define QUERY_FIELD_PAGESIZE            4
+  { "page-size",      QUERY_KIND_NUMBER },
+#define QUERY_FIELD_SIZE                5
+  { "size",           QUERY_KIND_NUMBER },
+#define QUERY_FIELD_KERNELSIZE          6
+  { "kernel-size",    QUERY_KIND_NUMBER },
+#define QUERY_FIELD_RAMDISKSIZE         7
+  { "ramdisk-size",   QUERY_KIND_NUMBER },
+#define QUERY_FIELD_KERNELDIGEST        8
+  { "kernel-digest",  QUERY_KIND_DIGEST },
+#define QUERY_FIELD_RAMDISKDIGEST       9
+  { "ramdisk-digest", QUERY_KIND_DIGEST },
+#define QUERY_FIELD_SECONDDIGEST        10
+  { "second-digest",  QUERY_KIND_DIGEST },
+#define QUERY_FIELD_DTBDIGEST           11
+  { "dtb-digest",     QUERY_KIND_DIGEST },
+#define QUERY_FIELD_ID                  12
+  { "id",             QUERY_KIND_DIGEST },
+#define QUERY_FIELD_VERITY              13
+  { "verity",         QUERY_KIND_NUMBER },
+  { NULL,             0 }
+};
+
+static const char *verity_names[] = { "none", "present", "valid", "invalid" };
+
+/*
+ * Forward decls
+ */
+void  printusage            (int);
+int   loadIndex             (bootimgIndex_p, const char *);
+void  releaseIndex          (bootimgIndex_p);
+int   scanPaths             (bootimgIndex_p, char **, int);
+int   parseQuery            (const char *, bootimgIndexQuery_p);
+int   queryIndex            (bootimgIndex_p, bootimgIndexQuery_p, int);
+
+/*
+ * main
+ */
+int
+main(int argc, char **argv)
+{
+  int c;
+  int rc = 0;
+  bootimgIndex_t index;
+  bootimgIndexQuery_t queries[BOOTIMG_INDEX_MAX_QUERIES];
+
+  progname = (rindex(argv[0], '/') ? rindex(argv[0], '/')+1 : argv[0]);
+  blankname = (char *)alloca(strlen(progname) +1);
+  memset((void *)blankname, (int)' ', (size_t)strlen(progname));
+  blankname[strlen(progname)] = 0;
+  logInit();
+
+#ifdef USE_OPENSSL
+  ERR_load_crypto_strings();
+#endif
+
+  /*
+   * Process options
+   */
+  while (1)
+    {
+      int option_index = 0;
+
+      c = getopt_long(argc, argv, BOOTIMG_OPTSTRING,
+                      long_options, &option_index);
+      if (c == -1)
+        break;
+
+      switch (c)
+        {
+        case 'v':
+          if (optarg)
+            vflag += strtol(optarg, NULL, 10);
+          else
+            vflag++;
+          if (vflag > 3)
+            fprintf(stderr, "%s: option %s/%c set to %d\n",
+                    progname, getLongOptionName(long_options, c), c, vflag);
+          break;
+
+        case 'd':
+          dflag = 1;
+          dval = optarg;
+          if (vflag > 3)
+            fprintf(stderr, "%s: option %s/%c (=%d) set with value '%s'\n",
+                    progname, getLongOptionName(long_options, c), c, dflag, dval);
+          break;
+
+        case 'j':
+          jflag = 1;
+          jval = strtol(optarg, NULL, 10);
+          if (jval < 1 || jval > BOOTIMG_INDEX_MAX_JOBS)
+            {
+              fprintf(stderr, "%s: error: jobs must be in [1, %d]!\n",
+                      progname, BOOTIMG_INDEX_MAX_JOBS);
+              exit(1);
+            }
+          if (vflag > 3)
+            fprintf(stderr, "%s: option %s/%c (=%d) set with value '%ld'\n",
+                    progname, getLongOptionName(long_options, c), c, jflag, jval);
+          break;
+
+        case 'q':
+          if (qflag == BOOTIMG_INDEX_MAX_QUERIES)
+            {
+              fprintf(stderr, "%s: error: at most %d queries are allowed!\n",
+                      progname, BOOTIMG_INDEX_MAX_QUERIES);
+              exit(1);
+            }
+          if (parseQuery(optarg, &queries[qflag]) < 0)
+            exit(1);
+          qval[qflag++] = optarg;
+          if (vflag > 3)
+            fprintf(stderr, "%s: option %s/%c (=%d) set with value '%s'\n",
+                    progname, getLongOptionName(long_options, c), c, qflag, optarg);
+          break;
+
+        case 'l':
+          lflag = 1;
+          if (vflag > 3)
+            fprintf(stderr, "%s: option %s/%c (=%d) set\n",
+                    progname, getLongOptionName(long_options, c), c, lflag);
+          break;
+
+        case 'V':
+          Vflag = 1;
+          if (vflag > 3)
+            fprintf(stderr, "%s: option %s/%c (=%d) set\n",
+                    progname, getLongOptionName(long_options, c), c, Vflag);
+          break;
+
+        case 'h':
+          printusage(1);
+          exit(1);
+
+        case '?':
+          printusage(0);
+          break;
+
+        default:
+          fprintf(stderr, "%s: getopt returned character code 0%o ??\n", progname, c);
+          printusage(0);
+        }
+    }
+
+  if (optind == argc && !qflag)
+    {
+      fprintf(stderr, "%s: error: Nothing to index nor to query !\n", progname);
+      printusage(0);
+      exit(1);
+    }
+
+  if (loadIndex(&index, dval) < 0)
+    exit(1);
+
+  if (optind < argc && scanPaths(&index, &argv[optind], argc - optind) < 0)
+    rc = 1;
+
+  if (qflag && queryIndex(&index, queries, qflag) < 0)
+    rc = 1;
+
+  releaseIndex(&index);
+
+  return(rc);
+}
+
+/*
+ * Print usage message
+ */
+void
+printusage(int withhelp)
+{
+  char line[256];
+  char *tok = (char *)NULL;
+  char twolines = 2;
+  char *str;
+
+  if (withhelp)
+    {
+      str = (char *)malloc(strlen(progusage) +strlen(proghelp) +1);
+      assert(str);
+      memcpy(str, progusage, strlen(progusage));
+      memcpy(str +strlen(progusage), proghelp, strlen(proghelp) +1);
+    }
+  else
+    {
+      str = (char *)malloc(strlen(progusage) +1);
+      assert(str);
+      memcpy(str, progusage, strlen(progusage) +1);
+    }
+
+  while ((tok = strtok((char *)str, "\n")) != (char *)NULL)
+    {
+      if (twolines)
+        {
+          sprintf(line, tok, progname);
+          twolines--;
+        }
+      else
+        sprintf(line, tok, blankname);
+
+      str = (char *)NULL;
+      fprintf(stdout, "%s\n", line);
+    }
+
+  free((void *)str);
+}
+
+/*
+ * FNV-1a
+ */
+static uint64_t
+hashPath(const char *path)
+{
+  uint64_t hash = 0xcbf29ce484222325ULL;
+
+  while (*path)
+    {
+      hash ^= (unsigned char)*path++;
+      hash *= 0x100000001b3ULL;
+    }
+
+  return hash;
+}
+
+/*
+ * Find the slot of a path: either its entry or the empty slot to use
+ */
+static bootimgIndexEntry_p
+lookupEntry(bootimgIndex_p index, const char *path)
+{
+  uint64_t hash = hashPath(path);
+  size_t slot = hash & (index->capacity -1);
+
+  while (index->entries[slot].rec)
+    {
+      if (index->entries[slot].hash == hash &&
+          !strcmp(index->entries[slot].rec->path, path))
+        break;
+      slot = (slot +1) & (index->capacity -1);
+    }
+  index->entries[slot].hash = hash;
+
+  return &index->entries[slot];
+}
+
+/*
+ * Record a path's latest record, superseding the previous one
+ */
+static int
+insertEntry(bootimgIndex_p index, const struct bootimg_index_rec *rec)
+{
+  bootimgIndexEntry_p entry;
+
+  /* keep load factor under 1/2 */
+  if ((index->count +1) * 2 > index->capacity)
+    {
+      bootimgIndexEntry_p old = index->entries;
+      size_t oldcap = index->capacity;
+
+      index->capacity = oldcap ? oldcap * 2 : 1024;
+      index->entries = (bootimgIndexEntry_p)calloc(index->capacity, sizeof(bootimgIndexEntry_t));
+      if (!index->entries)
+        {
+          fprintf(stderr, "%s: error: cannot allocate memory for index!\n", progname);
+          index->entries = old;
+          index->capacity = oldcap;
+          return -1;
+        }
+      index->count = 0;
+      for (size_t n = 0; n < oldcap; n++)
+        if (old[n].rec)
+          {
+            entry = lookupEntry(index, old[n].rec->path);
+            *entry = old[n];
+            index->count++;
+          }
+      free((void *)old);
+    }
+
+  entry = lookupEntry(index, rec->path);
+  if (!entry->rec)
+    index->count++;
+  entry->rec = rec;
+
+  return 0;
+}
+
+/*
+ * Map an index file and build the table of latest records
+ */
+int
+loadIndex(bootimgIndex_p index, const char *filename)
+{
+  const struct bootimg_index_hdr *hdr;
+  struct stat statbuf;
+  size_t offset;
+  int fd;
+
+  bzero((void *)index, sizeof(bootimgIndex_t));
+
+  if ((fd = open(filename, O_RDONLY)) < 0)
+    {
+      /* a new index */
+      if (errno == ENOENT)
+        return 0;
+      perror(progname);
+      fprintf(stderr, "%s: error: cannot open index file '%s'!\n", progname, filename);
+      return -1;
+    }
+
+  if (fstat(fd, &statbuf) < 0 || statbuf.st_size == 0)
+    {
+      close(fd);
+      return 0;
+    }
+
+  index->maplen = statbuf.st_size;
+  index->map = mmap(NULL, index->maplen, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (index->map == MAP_FAILED)
+    {
+      perror(progname);
+      fprintf(stderr, "%s: error: cannot map index file '%s'!\n", progname, filename);
+      index->map = NULL;
+      return -1;
+    }
+
+  hdr = (const struct bootimg_index_hdr *)index->map;
+  if (index->maplen < sizeof(struct bootimg_index_hdr) ||
+      memcmp((const void *)hdr->magic, (const void *)BOOTIMG_INDEX_MAGIC, BOOTIMG_INDEX_MAGIC_SIZE) ||
+      hdr->version != BOOTIMG_INDEX_VERSION ||
+      hdr->rec_size != sizeof(struct bootimg_index_rec))
+    {
+      fprintf(stderr, "%s: error: '%s' is not an index file or has an unsupported version!\n",
+              progname, filename);
+      return -1;
+    }
+
+  offset = sizeof(struct bootimg_index_hdr);
+  while (offset < index->maplen)
+    {
+      const struct bootimg_index_rec *rec =
+        (const struct bootimg_index_rec *)((const char *)index->map + offset);
+      size_t left = index->maplen - offset;
+
+      /* a partial record at end (interrupted append) is dropped */
+      if (left < sizeof(struct bootimg_index_rec) ||
+          rec->rec_len > left ||
+          rec->rec_len < sizeof(struct bootimg_index_rec) + rec->path_len +1 ||
+          rec->path[rec->path_len] != '\0')
+        {
+          fprintf(stderr, "%s: warning: index file '%s' truncated at offset %lu!\n",
+                  progname, filename, offset);
+          break;
+        }
+
+      if (insertEntry(index, rec) < 0)
+        return -1;
+      offset += rec->rec_len;
+    }
+
+  if (vflag)
+    fprintf(stdout, "%s: %lu paths in index '%s'\n", progname, index->count, filename);
+
+  return 0;
+}
+
+/*
+ * Release index memory. Records appended during this run are in
+ * malloc'ed memory, loaded ones in the mapping.
+ */
+void
+releaseIndex(bootimgIndex_p index)
+{
+  for (size_t n = 0; n < index->capacity; n++)
+    {
+      const char *rec = (const char *)index->entries[n].rec;
+      if (rec && (!index->map ||
+                  rec < (const char *)index->map ||
+                  rec >= (const char *)index->map + index->maplen))
+        free((void *)rec);
+    }
+  free((void *)index->entries);
+  if (index->map)
+    munmap(index->map, index->maplen);
+  bzero((void *)index, sizeof(bootimgIndex_t));
+}
+
+/*
+ * Add a candidate file to the scan
+ */
+static int
+addJob(bootimgIndexJobs_p jobs, const char *path)
+{
+  if (jobs->count == jobs->alloc)
+    {
+      size_t alloc = jobs->alloc ? jobs->alloc * 2 : 1024;
+      char **paths = (char **)realloc(jobs->paths, alloc * sizeof(char *));
+
+      if (!paths)
+        return -1;
+      jobs->paths = paths;
+      jobs->alloc = alloc;
+    }
+  if (!(jobs->paths[jobs->count] = strdup(path)))
+    return -1;
+  jobs->count++;
+
+  return 0;
+}
+
+static int
+walkCallback(const char *path, const struct stat *sb, int typeflag, struct FTW *ftwbuf)
+{
+  (void)ftwbuf;
+
+  if (typeflag != FTW_F || !S_ISREG(sb->st_mode))
+    return 0;
+  if (sb->st_dev == walk_jobs->idx_dev && sb->st_ino == walk_jobs->idx_ino)
+    return 0;
+
+  return addJob(walk_jobs, path) < 0 ? FTW_STOP : 0;
+}
+
+/*
+ * Compute the record of a file
+ */
+static struct bootimg_index_rec *
+indexFile(const char *path)
+{
+  struct bootimg_index_rec *rec;
+  size_t pathlen = strlen(path);
+  size_t reclen = BOOTIMG_INDEX_ALIGN(sizeof(struct bootimg_index_rec) + pathlen +1);
+  struct stat statbuf;
+  boot_img_hdr hdr;
+  off_t offset = 0;
+  int fd;
+
+  if (pathlen > UINT16_MAX)
+    return (struct bootimg_index_rec *)NULL;
+  if ((fd = open(path, O_RDONLY)) < 0)
+    {
+      if (vflag)
+        fprintf(stderr, "%s: warning: cannot open '%s'\n", progname, path);
+      return (struct bootimg_index_rec *)NULL;
+    }
+  if (fstat(fd, &statbuf) < 0 ||
+      !(rec = (struct bootimg_index_rec *)calloc(1, reclen)))
+    {
+      close(fd);
+      return (struct bootimg_index_rec *)NULL;
+    }
+
+  rec->rec_len = reclen;
+  rec->mtime_sec = statbuf.st_mtim.tv_sec;
+  rec->mtime_nsec = statbuf.st_mtim.tv_nsec;
+  rec->file_size = statbuf.st_size;
+  rec->path_len = pathlen;
+  memcpy((void *)rec->path, (const void *)path, pathlen +1);
+
+  if (findBootMagicFd(fd, &hdr, &offset, (const char **)NULL))
+    {
+      rec->flags |= BOOTIMG_INDEX_REC_BOOTIMG;
+      rec->magic_offset = offset;
+      rec->os_version = hdr.os_version >> 11;
+      rec->os_patch_lvl = hdr.os_version & BOOTIMG_OSPATCHLVL_MASK;
+      rec->page_size = hdr.page_size;
+      rec->size[BOOTIMG_COMPONENT_KERNEL] = hdr.kernel_size;
+      rec->size[BOOTIMG_COMPONENT_RAMDISK] = hdr.ramdisk_size;
+      rec->size[BOOTIMG_COMPONENT_SECOND] = hdr.second_size;
+      rec->size[BOOTIMG_COMPONENT_DTB] = hdr.dt_size;
+      memcpy((void *)rec->name, (const void *)hdr.name, BOOT_NAME_SIZE);
+      memcpy((void *)rec->id, (const void *)hdr.id, sizeof(rec->id));
+
+      /* sizes & offsets were checked against the file by findBootMagicFd */
+      off64_t sigoff = offset + computeSignatureBlockOffset(&hdr);
+
+      for (int nc = 0; nc < BOOTIMG_COMPONENT_COUNT; nc++)
+        if (rec->size[nc] &&
+            computeRangeDigest(fd, offset + computeComponentOffset(&hdr, nc),
+                               rec->size[nc], rec->digest[nc]) < 0)
+          bzero((void *)rec->digest[nc], BOOTIMG_DIGEST_SIZE);
+
+      if (statbuf.st_size > sigoff)
+        {
+          rec->verity = BOOTIMG_INDEX_VERITY_PRESENT;
+          if (Vflag && offset == 0)
+            {
+              FILE *fp = fdopen(dup(fd), "rb");
+              if (fp)
+                {
+                  rec->verity = verityVerify(fp, &hdr) ?
+                    BOOTIMG_INDEX_VERITY_INVALID : BOOTIMG_INDEX_VERITY_VALID;
+                  fclose(fp);
+                }
+            }
+        }
+    }
+  close(fd);
+
+  return rec;
+}
+
+static void *
+scanThread(void *arg)
+{
+  bootimgIndexJobs_p jobs = (bootimgIndexJobs_p)arg;
+  size_t job;
+
+  while ((job = __atomic_fetch_add(&jobs->next, 1, __ATOMIC_RELAXED)) < jobs->count)
+    if (jobs->paths[job])
+      jobs->recs[job] = indexFile(jobs->paths[job]);
+
+  ioReleaseDefault();
+  return NULL;
+}
+
+/*
+ * Append records to the index file in one write under an exclusive lock
+ */
+static int
+appendRecords(const char *filename, struct bootimg_index_rec **recs, size_t count)
+{
+  struct bootimg_index_hdr hdr;
+  struct stat statbuf;
+  size_t len = 0, done = 0;
+  char *buf;
+  int fd, rc = -1;
+
+  for (size_t n = 0; n < count; n++)
+    if (recs[n])
+      len += recs[n]->rec_len;
+  if (!len)
+    return 0;
+
+  if ((fd = open(filename, O_CREAT | O_WRONLY | O_APPEND, 0644)) < 0)
+    {
+      perror(progname);
+      fprintf(stderr, "%s: error: cannot open index file '%s' for writing!\n", progname, filename);
+      return -1;
+    }
+
+  do
+    {
+      if (flock(fd, LOCK_EX) < 0 || fstat(fd, &statbuf) < 0)
+        break;
+
+      if (!(buf = (char *)malloc(len + sizeof(hdr))))
+        break;
+
+      /* new file: header first */
+      if (statbuf.st_size == 0)
+        {
+          bzero((void *)&hdr, sizeof(hdr));
+          memcpy((void *)hdr.magic, (const void *)BOOTIMG_INDEX_MAGIC, BOOTIMG_INDEX_MAGIC_SIZE);
+          hdr.version = BOOTIMG_INDEX_VERSION;
+          hdr.rec_size = sizeof(struct bootimg_index_rec);
+          memcpy((void *)buf, (const void *)&hdr, sizeof(hdr));
+          done = sizeof(hdr);
+        }
+      for (size_t n = 0; n < count; n++)
+        if (recs[n])
+          {
+            memcpy((void *)(buf + done), (const void *)recs[n], recs[n]->rec_len);
+            done += recs[n]->rec_len;
+          }
+
+      if (write(fd, buf, done) == (ssize_t)done)
+        rc = 0;
+      else
+        fprintf(stderr, "%s: error: cannot append to index file '%s'!\n", progname, filename);
+      free((void *)buf);
+    }
+  while (0);
+
+  close(fd);
+  return rc;
+}
+
+/*
+ * Walk the paths, index new or changed files in parallel and record
+ * removed ones
+ */
+int
+scanPaths(bootimgIndex_p index, char **paths, int npaths)
+{
+  bootimgIndexJobs_t jobs;
+  pthread_t threads[BOOTIMG_INDEX_MAX_JOBS];
+  struct stat statbuf;
+  char **roots;
+  size_t nthreads, updated = 0, removed = 0, first_removed;
+  int rc = -1;
+
+  bzero((void *)&jobs, sizeof(bootimgIndexJobs_t));
+  if (stat(dval, &statbuf) == 0)
+    {
+      jobs.idx_dev = statbuf.st_dev;
+      jobs.idx_ino = statbuf.st_ino;
+    }
+
+  roots = (char **)calloc(npaths, sizeof(char *));
+  assert(roots);
+
+  do
+    {
+      /* Collect candidates with absolute paths so that runs from other dirs match */
+      walk_jobs = &jobs;
+      for (int np = 0; np < npaths; np++)
+        {
+          if (!(roots[np] = realpath(paths[np], NULL)))
+            {
+              perror(paths[np]);
+              continue;
+            }
+          if (nftw(roots[np], walkCallback, 32, FTW_PHYS) < 0)
+            {
+              perror(roots[np]);
+              fprintf(stderr, "%s: error: cannot walk '%s'!\n", progname, roots[np]);
+            }
+        }
+
+      /* unchanged files are skipped */
+      for (size_t job = 0; job < jobs.count; job++)
+        {
+          bootimgIndexEntry_p entry;
+
+          if (!index->capacity ||
+              !(entry = lookupEntry(index, jobs.paths[job]))->rec)
+            continue;
+          entry->seen = 1;
+          if (entry->rec->flags & BOOTIMG_INDEX_REC_REMOVED ||
+              stat(jobs.paths[job], &statbuf) < 0 ||
+              entry->rec->file_size != (uint64_t)statbuf.st_size ||
+              entry->rec->mtime_sec != (uint64_t)statbuf.st_mtim.tv_sec ||
+              entry->rec->mtime_nsec != (uint32_t)statbuf.st_mtim.tv_nsec)
+            continue;
+          free((void *)jobs.paths[job]);
+          jobs.paths[job] = (char *)NULL;
+        }
+
+      /* records of new files, then tombstones */
+      first_removed = jobs.count;
+      jobs.recs = (struct bootimg_index_rec **)calloc(jobs.count + index->count +1,
+                                                      sizeof(struct bootimg_index_rec *));
+      if (!jobs.recs)
+        break;
+
+      nthreads = jflag ? (size_t)jval : (size_t)sysconf(_SC_NPROCESSORS_ONLN);
+      nthreads = BOOTIMG_MAX(1, BOOTIMG_MIN(nthreads, BOOTIMG_INDEX_MAX_JOBS));
+      nthreads = BOOTIMG_MIN(nthreads, BOOTIMG_MAX(jobs.count, 1));
+      for (size_t nt = 0; nt < nthreads; nt++)
+        if (pthread_create(&threads[nt], NULL, scanThread, (void *)&jobs))
+          {
+            nthreads = nt;
+            break;
+          }
+      /* this thread works too (all of it if no thread could start) */
+      (void)scanThread((void *)&jobs);
+      for (size_t nt = 0; nt < nthreads; nt++)
+        pthread_join(threads[nt], NULL);
+
+      for (size_t nc = 0; nc < index->capacity; nc++)
+        {
+          const struct bootimg_index_rec *old = index->entries[nc].rec;
+          struct bootimg_index_rec *rec;
+          size_t reclen;
+
+          if (!old || index->entries[nc].seen || old->flags & BOOTIMG_INDEX_REC_REMOVED)
+            continue;
+          for (int np = 0; np < npaths; np++)
+            {
+              size_t rootlen;
+
+              if (!roots[np])
+                continue;
+              rootlen = strlen(roots[np]);
+              if (strncmp(old->path, roots[np], rootlen) ||
+                  (old->path[rootlen] != '\0' && old->path[rootlen] != '/'))
+                continue;
+
+              reclen = BOOTIMG_INDEX_ALIGN(sizeof(struct bootimg_index_rec) + old->path_len +1);
+              if (!(rec = (struct bootimg_index_rec *)calloc(1, reclen)))
+                break;
+              rec->rec_len = reclen;
+              rec->flags = BOOTIMG_INDEX_REC_REMOVED;
+              rec->path_len = old->path_len;
+              memcpy((void *)rec->path, (const void *)old->path, old->path_len +1);
+              jobs.recs[first_removed + removed++] = rec;
+              break;
+            }
+        }
+
+      if (appendRecords(dval, jobs.recs, first_removed + removed) < 0)
+        break;
+
+      /* the table now points to the new records */
+      for (size_t job = 0; job < first_removed + removed; job++)
+        if (jobs.recs[job])
+          {
+            if (job < first_removed)
+              updated++;
+            if (insertEntry(index, jobs.recs[job]) < 0)
+              break;
+            /* owned by the table from now on */
+            jobs.recs[job] = (struct bootimg_index_rec *)NULL;
+          }
+
+      if (vflag)
+        fprintf(stdout, "%s: %lu files scanned, %lu indexed, %lu removed\n",
+                progname, jobs.count, updated, removed);
+      rc = 0;
+    }
+  while (0);
+
+  for (size_t job = 0; job < jobs.count; job++)
+    free((void *)jobs.paths[job]);
+  if (jobs.recs)
+    for (size_t job = 0; job < jobs.count + removed; job++)
+      free((void *)jobs.recs[job]);
+  free((void *)jobs.paths);
+  free((void *)jobs.recs);
+  for (int np = 0; np < npaths; np++)
+    free((void *)roots[np]);
+  free((void *)roots);
+  walk_jobs = (bootimgIndexJobs_p)NULL;
+
+  return rc;
+}
+
+/*
+ * Parse <field><op><value>
+ */
+int
+parseQuery(const char *expr, bootimgIndexQuery_p query)
+{
+  const char *op = strpbrk(expr, "!<>=");
+  const char *value;
+  size_t fieldlen;
+
+  bzero((void *)query, sizeof(bootimgIndexQuery_t));
+  if (!op)
+    {
+      fprintf(stderr, "%s: error: no operator in query '%s'!\n", progname, expr);
+      return -1;
+    }
+  fieldlen = op - expr;
+
+  if (op[0] == '=')
+    query->op = QUERY_OP_EQ, value = op +1;
+  else if (op[0] == '!' && op[1] == '=')
+    query->op = QUERY_OP_NE, value = op +2;
+  else if (op[0] == '<')
+    query->op = op[1] == '=' ? QUERY_OP_LE : QUERY_OP_LT, value = op + (op[1] == '=' ? 2 : 1);
+  else if (op[0] == '>')
+    query->op = op[1] == '=' ? QUERY_OP_GE : QUERY_OP_GT, value = op + (op[1] == '=' ? 2 : 1);
+  else
+    {
+      fprintf(stderr, "%s: error: bad operator in query '%s'!\n", progname, expr);
+      return -1;
+    }
+
+  for (query->field = 0; query_fields[query->field].name; query->field++)
+    if (strlen(query_fields[query->field].name) == fieldlen &&
+        !strncmp(query_fields[query->field].name, expr, fieldlen))
+      break;
+  if (!query_fields[query->field].name)
+    {
+      fprintf(stderr, "%s: error: unknown field in query '%s'!\n", progname, expr);
+      return -1;
+    }
+  query->kind = query_fields[query->field].kind;
+  query->string = value;
+
+  if (query->kind == QUERY_KIND_DIGEST &&
+      query->op != QUERY_OP_EQ && query->op != QUERY_OP_NE)
+    {
+      fprintf(stderr, "%s: error: digests only support = and != in '%s'!\n", progname, expr);
+      return -1;
+    }
+
+  if (query->kind == QUERY_KIND_NUMBER)
+    {
+      unsigned a = 0, b = 0, cc = 0;
+      char *end = (char *)NULL;
+
+      switch (query->field)
+        {
+        case QUERY_FIELD_OSVERSION:
+          if (sscanf(value, "%u.%u.%u", &a, &b, &cc) < 1)
+            break;
+          query->number = (a & 0x7f) << 14 | (b & 0x7f) << 7 | (cc & 0x7f);
+          end = (char *)"";
+          break;
+
+        case QUERY_FIELD_PATCHLEVEL:
+          if (sscanf(value, "%u-%u", &a, &b) != 2 || a < 2000)
+            break;
+          query->number = (a - 2000) << 4 | (b & 0xf);
+          end = (char *)"";
+          break;
+
+        case QUERY_FIELD_VERITY:
+          for (a = 0; a < sizeof(verity_names)/sizeof(verity_names[0]); a++)
+            if (!strcmp(value, verity_names[a]))
+              {
+                query->number = a;
+                end = (char *)"";
+              }
+          break;
+
+        default:
+          query->number = strtoull(value, &end, 0);
+          break;
+        }
+      if (!end || *end)
+        {
+          fprintf(stderr, "%s: error: bad value in query '%s'!\n", progname, expr);
+          return -1;
+        }
+    }
+
+  return 0;
+}
+
+static int
+compareNumbers(uint64_t a, uint64_t b)
+{
+  return a < b ? -1 : a > b;
+}
+
+/*
+ * Check one query term against a record
+ */
+static int
+matchQuery(const struct bootimg_index_rec *rec, bootimgIndexQuery_p query)
+{
+  int cmp = 0;
+
+  switch (query->kind)
+    {
+    case QUERY_KIND_STRING:
+      {
+        char name[BOOT_NAME_SIZE +1];
+        const char *str = rec->path;
+
+        if (query->field == QUERY_FIELD_NAME)
+          {
+            memcpy((void *)name, (const void *)rec->name, BOOT_NAME_SIZE);
+            name[BOOT_NAME_SIZE] = '\0';
+            str = name;
+          }
+        /* globs for equality */
+        if (query->op == QUERY_OP_EQ || query->op == QUERY_OP_NE)
+          cmp = fnmatch(query->string, str, 0) ? 1 : 0;
+        else
+          cmp = strcmp(str, query->string);
+      }
+      break;
+
+    case QUERY_KIND_DIGEST:
+      {
+        const uint8_t *digest = rec->id;
+        size_t len = sizeof(rec->id);
+        char hex[2 * 32 +1];
+
+        switch (query->field)
+          {
+          case QUERY_FIELD_KERNELDIGEST:  digest = rec->digest[BOOTIMG_COMPONENT_KERNEL];  len = BOOTIMG_DIGEST_SIZE; break;
+          case QUERY_FIELD_RAMDISKDIGEST: digest = rec->digest[BOOTIMG_COMPONENT_RAMDISK]; len = BOOTIMG_DIGEST_SIZE; break;
+          case QUERY_FIELD_SECONDDIGEST:  digest = rec->digest[BOOTIMG_COMPONENT_SECOND];  len = BOOTIMG_DIGEST_SIZE; break;
+          case QUERY_FIELD_DTBDIGEST:     digest = rec->digest[BOOTIMG_COMPONENT_DTB];     len = BOOTIMG_DIGEST_SIZE; break;
+          }
+        for (size_t n = 0; n < len; n++)
+          sprintf(&hex[2*n], "%02x", digest[n]);
+        /* hex prefix */
+        cmp = strncasecmp(hex, query->string, strlen(query->string)) ? 1 : 0;
+      }
+      break;
+
+    default:
+      switch (query->field)
+        {
+        case QUERY_FIELD_OSVERSION:   cmp = compareNumbers(rec->os_version, query->number);   break;
+        case QUERY_FIELD_PATCHLEVEL:  cmp = compareNumbers(rec->os_patch_lvl, query->number); break;
+        case QUERY_FIELD_PAGESIZE:    cmp = compareNumbers(rec->page_size, query->number);    break;
+        case QUERY_FIELD_SIZE:        cmp = compareNumbers(rec->file_size, query->number);    break;
+        case QUERY_FIELD_KERNELSIZE:  cmp = compareNumbers(rec->size[BOOTIMG_COMPONENT_KERNEL], query->number);  break;
+        case QUERY_FIELD_RAMDISKSIZE: cmp = compareNumbers(rec->size[BOOTIMG_COMPONENT_RAMDISK], query->number); break;
+        case QUERY_FIELD_VERITY:      cmp = compareNumbers(rec->verity, query->number);       break;
+        }
+      break;
+    }
+
+  switch (query->op)
+    {
+    case QUERY_OP_EQ: return cmp == 0;
+    case QUERY_OP_NE: return cmp != 0;
+    case QUERY_OP_LT: return cmp < 0;
+    case QUERY_OP_LE: return cmp <= 0;
+    case QUERY_OP_GT: return cmp > 0;
+    case QUERY_OP_GE: return cmp >= 0;
+    }
+
+  return 0;
+}
+
+/*
+ * Display the latest records of boot images matching all queries
+ */
+int
+queryIndex(bootimgIndex_p index, bootimgIndexQuery_p queries, int nqueries)
+{
+  size_t matches = 0;
+
+  for (size_t n = 0; n < index->capacity; n++)
+    {
+      const struct bootimg_index_rec *rec = index->entries[n].rec;
+      int nq;
+
+      if (!rec || rec->flags & BOOTIMG_INDEX_REC_REMOVED ||
+          !(rec->flags & BOOTIMG_INDEX_REC_BOOTIMG))
+        continue;
+      for (nq = 0; nq < nqueries; nq++)
+        if (!matchQuery(rec, &queries[nq]))
+          break;
+      if (nq < nqueries)
+        continue;
+
+      matches++;
+      if (lflag)
+        {
+          fprintf(stdout, "%s\t%.*s\t%d.%d.%d\t%d-%02d\t%s\t",
+                  rec->path, BOOT_NAME_SIZE, rec->name,
+                  (rec->os_version >> 14)&0x7f, (rec->os_version >> 7)&0x7f, rec->os_version&0x7f,
+                  (rec->os_patch_lvl >> 4) + 2000, rec->os_patch_lvl&0xf,
+                  verity_names[rec->verity & 3]);
+          for (int nx = 0; nx < BOOTIMG_DIGEST_SIZE; nx++)
+            fprintf(stdout, "%02x", rec->digest[BOOTIMG_COMPONENT_KERNEL][nx]);
+          fprintf(stdout, "\n");
+        }
+      else
+        fprintf(stdout, "%s\n", rec->path);
+    }
+
+  if (vflag)
+    fprintf(stdout, "%s: %lu matching images\n", progname, matches);
+
+  return 0;
+}
+
+/* Local Variables:                                                */
+/* mode: C                                                         */
+/* comment-column: 0                                               */
+/* End:                                                            */
@@ -0,0 +1,99 @@
+/* bootimg-tools/bootimg-index.h
+ *
+ * Copyright 2007, The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef __BOOTIMG_INDEX_H__
+#define __BOOTIMG_INDEX_H__
+
+#include <stdint.h>
+
+#include "bootimg.h"
+#include "bootimg-priv.h"
+
+/**==========================================================================
+ ** Image index file format
+ **==========================================================================
+ **
+ *
+ * +---------------------------+
+ * | struct bootimg_index_hdr  |
+ * +---------------------------+
+ * | struct bootimg_index_rec  | variable length (path), 8 bytes aligned
+ * +---------------------------+
+ * | ...                       |
+ * +---------------------------+
+ *
+ * The file is append only: a new record for an already known path
+ * supersedes the previous ones and a record with the REMOVED flag
+ * records a file that vanished. Files without boot magic are recorded
+ * too so that they are not probed again while unchanged.
+ * Values are in host byte order: the version field doubles as a byte
+ * order mark, an index from another endianness is refused.
+ */
+
+#define BOOTIMG_INDEX_MAGIC             "BIMGIDX"
+#define BOOTIMG_INDEX_MAGIC_SIZE        8
+#define BOOTIMG_INDEX_VERSION           1
+#define BOOTIMG_INDEX_FILENAME          "bootimg.idx"
+
+/* Record flags */
+#define BOOTIMG_INDEX_REC_BOOTIMG       0x01    /* magic found, header fields valid */
+#define BOOTIMG_INDEX_REC_REMOVED       0x02    /* file is gone */
+
+/* Verity status */
+#define BOOTIMG_INDEX_VERITY_NONE       0       /* nothing after the image */
+#define BOOTIMG_INDEX_VERITY_PRESENT    1       /* signature block not checked */
+#define BOOTIMG_INDEX_VERITY_VALID      2
+#define BOOTIMG_INDEX_VERITY_INVALID    3
+
+#define BOOTIMG_INDEX_ALIGN(x)          (((x) + 7) & ~((size_t)7))
+
+struct bootimg_index_hdr
+{
+  uint8_t magic[BOOTIMG_INDEX_MAGIC_SIZE];
+  uint32_t version;
+  uint32_t rec_size;                    /* sizeof(struct bootimg_index_rec) */
+} __attribute__((packed));
+
+struct bootimg_index_rec
+{
+  uint32_t rec_len;                     /* with path & padding */
+  uint32_t flags;                       /* BOOTIMG_INDEX_REC_* */
+  uint64_t mtime_sec;
+  uint32_t mtime_nsec;
+  uint32_t verity;                      /* BOOTIMG_INDEX_VERITY_* */
+  uint64_t file_size;
+  uint64_t magic_offset;
+
+  uint32_t os_version;                  /* A << 14 | B << 7 | C */
+  uint32_t os_patch_lvl;                /* (Y - 2000) << 4 | M */
+  uint32_t page_size;
+  uint32_t size[BOOTIMG_COMPONENT_COUNT];
+  uint8_t name[BOOT_NAME_SIZE];
+  uint8_t id[32];                       /* header id field */
+  uint8_t digest[BOOTIMG_COMPONENT_COUNT][BOOTIMG_DIGEST_SIZE];
+
+  uint16_t path_len;                    /* without trailing NUL */
+  uint16_t reserved[3];
+  char path[];                          /* NUL terminated */
+} __attribute__((packed));
+
+#endif /* __BOOTIMG_INDEX_H__ */
+
+/* Local Variables:                                                */
+/* mode: C                                                         */
+/* comment-column: 0                                               */
+/* End:                                                            */
@@ -0,0 +1,1328 @@
+/* bootimg-tools/bootimg-input.c
+ *
+ * Copyright 2007, The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#ifdef STDC_HEADERS
+# include <stdlib.h>
+# include <stddef.h>
+#else
+# ifdef HAVE_STDLIB_H
+#  include <stdlib.h>
+# endif
+# ifdef HAVE_STDDEF_H
+#  include <stddef.h>
+# endif
+#endif
+#ifdef HAVE_STRING_H
+# include <string.h>
+#endif
+#ifdef HAVE_STRINGS_H
+# include <strings.h>
+#endif
+#ifdef HAVE_SYS_TYPES_H
+# include <sys/types.h>
+#endif
+#ifdef HAVE_SYS_STAT_H
+# include <sys/stat.h>
+#endif
+#ifdef HAVE_UNISTD_H
+# include <unistd.h>
+#endif
+#ifdef HAVE_FCNTL_H
+# include <fcntl.h>
+#endif
+#include <errno.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <zlib.h>
+
+#include "bootimg-input.h"
+#include "bootimg-stats.h"
+#include "bootimg-log.h"
+
+#define INPUT_CHUNK                     (1024*1024)
+#define INPUT_UNKNOWN_SIZE              UINT64_MAX
+
+#define INPUT_LZ4_FRAME_MAGIC           0x184D2204
+#define INPUT_LZ4_LEGACY_MAGIC          0x184C2102
+#define INPUT_LZ4_SKIP_MAGIC            0x184D2A50      /* low 4 bits free */
+#define INPUT_LZ4_HISTORY               (64*1024)
+#define INPUT_LZ4_BLOCK_MAX             (8*1024*1024)   /* legacy blocks */
+#define INPUT_LZ4_BOUND(n)              ((n) + (n) / 255 + 16)
+
+/* lz4 frame flags */
+#define INPUT_LZ4_FLAG_INDEPENDENT      0x20
+#define INPUT_LZ4_FLAG_BLOCK_CHECKSUM   0x10
+#define INPUT_LZ4_FLAG_CONTENT_SIZE     0x08
+#define INPUT_LZ4_FLAG_CONTENT_CHECKSUM 0x04
+#define INPUT_LZ4_FLAG_DICTID           0x01
+
+/* lz4 decoder states: looking for a magic, in a frame, in legacy blocks */
+#define INPUT_LZ4_MAGIC                 0
+#define INPUT_LZ4_FRAME                 1
+#define INPUT_LZ4_LEGACY                2
+
+#define INPUT_SPARSE_MAGIC              0xed26ff3a
+#define INPUT_SPARSE_HEADER_SIZE        28
+#define INPUT_SPARSE_CHUNK_HEADER_SIZE  12
+#define INPUT_SPARSE_RAW                0xcac1
+#define INPUT_SPARSE_FILL               0xcac2
+#define INPUT_SPARSE_DONT_CARE          0xcac3
+#define INPUT_SPARSE_CRC32              0xcac4
+
+#define INPUT_ZIP_LOCAL                 0x04034b50
+#define INPUT_ZIP_CENTRAL               0x02014b50
+#define INPUT_ZIP_END                   0x06054b50
+#define INPUT_ZIP64_LOCATOR             0x07064b50
+#define INPUT_ZIP64_END                 0x06064b50
+#define INPUT_ZIP_LOCAL_SIZE            30
+#define INPUT_ZIP_CENTRAL_SIZE          46
+#define INPUT_ZIP_END_SIZE              22
+#define INPUT_ZIP64_END_SIZE            56
+#define INPUT_ZIP_COMMENT_MAX           0xffff
+#define INPUT_ZIP_CD_MAX                (64*1024*1024)
+
+#define INPUT_MIN(a, b)                 ((a) < (b) ? (a) : (b))
+
+/* External decls */
+extern int vflag;
+extern char *progname;
+
+static const char *inputTypeNames[] = {
+  "file", "gzip", "lz4", "sparse", "zip", "zip"
+};
+
+/*
+ * Extent of a sparse image: raw data at in, a 32 bits pattern or zeros
+ */
+typedef struct _inputChunk_st
+{
+  uint64_t out;
+  uint64_t len;
+  uint64_t in;
+  uint32_t fill;
+  int type;
+} inputChunk_t, *inputChunk_p;
+
+typedef struct _inputZipEntry_st
+{
+  char *name;
+  int method;
+  int flags;
+  uint64_t csize;
+  uint64_t usize;
+  uint64_t offset;                      /* of the local header */
+} inputZipEntry_t, *inputZipEntry_p;
+
+/*
+ * A view reads its data from len bytes at start in its parent (the
+ * file if none) and gives size bytes
+ */
+typedef struct _inputView_st inputView_t, *inputView_p;
+struct _inputView_st
+{
+  int type;                             /* BOOTIMG_INPUT_* */
+  inputView_p parent;                   /* owned */
+  int fd;
+  uint64_t start;
+  uint64_t len;
+  uint64_t size;                        /* INPUT_UNKNOWN_SIZE until a stream ends */
+
+  /* sparse images */
+  inputChunk_p chunks;
+  size_t nchunks;
+
+  /* streams: out holds the decoded bytes from dpos on */
+  uint64_t in_pos;                      /* next byte of the data to read */
+  uint64_t dpos;
+  uint8_t *out;
+  size_t out_len;
+  int eof;
+  uint8_t *ibuf;
+  uint8_t *obuf;
+  z_stream zs;
+  int zinit;
+  int lz4_state;
+  int lz4_flags;
+  size_t lz4_block_max;
+  size_t lz4_last;                      /* size of the last block */
+  uint64_t lz4_frame_len;               /* decoded in the current frame */
+};
+
+/*
+ * An opened image: the last view of the chain. An image read in place
+ * is a range of the file, the views of the others decode & are shared
+ * by the readers.
+ */
+struct _bootimgInput_st
+{
+  inputView_p view;
+  pthread_mutex_t lock;                 /* views that decode */
+  int fd;                               /* read in place, -1 if not */
+  uint64_t base;                        /* of the image in the file */
+};
+
+static ssize_t inputViewRead (inputView_p, void *, size_t, uint64_t);
+
+static uint16_t
+inputLe16(const uint8_t *p)
+{
+  return (uint16_t)p[0] | (uint16_t)p[1] << 8;
+}
+
+static uint32_t
+inputLe32(const uint8_t *p)
+{
+  return (uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static uint64_t
+inputLe64(const uint8_t *p)
+{
+  return (uint64_t)inputLe32(p) | (uint64_t)inputLe32(p + 4) << 32;
+}
+
+static inputView_p
+inputViewNew(int type, inputView_p parent, uint64_t start, uint64_t len)
+{
+  inputView_p view = (inputView_p)calloc(1, sizeof(inputView_t));
+
+  if (!view)
+    return (inputView_p)NULL;
+  statsCount(BOOTIMG_STATS_CURRENT, BOOTIMG_STATS_ALLOCS, 1);
+
+  view->type = type;
+  view->parent = parent;
+  view->fd = -1;
+  view->start = start;
+  view->len = len;
+  view->size = INPUT_UNKNOWN_SIZE;
+
+  return view;
+}
+
+/*
+ * Free a view, but not its parent
+ */
+static void
+inputViewRelease(inputView_p view)
+{
+  if (!view)
+    return;
+
+  if (view->zinit)
+    inflateEnd(&view->zs);
+  free((void *)view->chunks);
+  free((void *)view->ibuf);
+  free((void *)view->obuf);
+  free((void *)view);
+}
+
+/*
+ * Free a view and its parents, closing the file
+ */
+static void
+inputViewClose(inputView_p view)
+{
+  while (view)
+    {
+      inputView_p parent = view->parent;
+
+      if (view->fd >= 0)
+        close(view->fd);
+      inputViewRelease(view);
+      view = parent;
+    }
+}
+
+static ssize_t
+inputFileRead(inputView_p view, uint8_t *buf, size_t len, uint64_t off)
+{
+  size_t done = 0;
+  ssize_t rdsz;
+
+  while (done < len)
+    {
+      do
+        rdsz = pread64(view->fd, buf + done, len - done, off + done);
+      while (rdsz < 0 && errno == EINTR);
+      statsCount(BOOTIMG_STATS_CURRENT, BOOTIMG_STATS_SYSCALLS, 1);
+      if (rdsz < 0)
+        {
+          fprintf(stderr, "%s: error: cannot read image input: %s!\n", progname, strerror(errno));
+          return -1;
+        }
+      if (!rdsz)
+        break;
+      statsCount(BOOTIMG_STATS_CURRENT, BOOTIMG_STATS_READ, rdsz);
+      done += rdsz;
+    }
+
+  return done;
+}
+
+/*
+ * Next bytes of the data of a stream
+ */
+static ssize_t
+inputReadIn(inputView_p view, void *buf, size_t len)
+{
+  ssize_t rdsz;
+
+  if (view->in_pos >= view->len)
+    return 0;
+  if ((rdsz = inputViewRead(view->parent, buf, INPUT_MIN(len, view->len - view->in_pos),
+                        view->start + view->in_pos)) > 0)
+    view->in_pos += rdsz;
+
+  return rdsz;
+}
+
+/*
+ * Sparse images: the chunk holding an offset is found in the index
+ */
+static ssize_t
+inputSparseRead(inputView_p view, uint8_t *buf, size_t len, uint64_t off)
+{
+  size_t done = 0;
+
+  while (done < len)
+    {
+      uint64_t pos = off + done;
+      size_t lo = 0, hi = view->nchunks, n;
+      inputChunk_p chunk;
+
+      while (hi - lo > 1)
+        {
+          size_t mid = (lo + hi) / 2;
+
+          if (view->chunks[mid].out <= pos)
+            lo = mid;
+          else
+            hi = mid;
+        }
+      chunk = &view->chunks[lo];
+      n = INPUT_MIN(len - done, chunk->out + chunk->len - pos);
+
+      switch (chunk->type)
+        {
+        case INPUT_SPARSE_RAW:
+          if (inputViewRead(view->parent, buf + done, n, chunk->in + pos - chunk->out) != (ssize_t)n)
+            {
+              fprintf(stderr, "%s: error: truncated sparse image!\n", progname);
+              return -1;
+            }
+          break;
+
+        case INPUT_SPARSE_FILL:
+          for (size_t b = 0; b < n; b++)
+            buf[done + b] = chunk->fill >> (8 * ((pos + b - chunk->out) & 3));
+          break;
+
+        default:
+          bzero((void *)(buf + done), n);
+          break;
+        }
+      done += n;
+    }
+
+  return done;
+}
+
+/*
+ * Build the chunk index of a sparse image. The chunks follow each other
+ * and zeros complete the image.
+ */
+static inputView_p
+inputSparseOpen(inputView_p parent)
+{
+  uint8_t hdr[INPUT_SPARSE_HEADER_SIZE], chdr[INPUT_SPARSE_CHUNK_HEADER_SIZE], fill[4];
+  inputView_p view = (inputView_p)NULL;
+  uint32_t hdr_sz, chunk_hdr_sz, blk_sz, total_chunks;
+  uint64_t in, out = 0;
+  uint32_t n;
+
+  do
+    {
+      if (inputViewRead(parent, hdr, sizeof(hdr), 0) != sizeof(hdr))
+        break;
+      hdr_sz = inputLe16(hdr + 8);
+      chunk_hdr_sz = inputLe16(hdr + 10);
+      blk_sz = inputLe32(hdr + 12);
+      total_chunks = inputLe32(hdr + 20);
+      if (inputLe16(hdr + 4) != 1 || hdr_sz < INPUT_SPARSE_HEADER_SIZE ||
+          chunk_hdr_sz < INPUT_SPARSE_CHUNK_HEADER_SIZE || !blk_sz || (blk_sz & 3))
+        break;
+
+      if (!(view = inputViewNew(BOOTIMG_INPUT_SPARSE, parent, 0, parent->size)) ||
+          !(view->chunks = (inputChunk_p)calloc((size_t)total_chunks +1, sizeof(inputChunk_t))))
+        break;
+      statsCount(BOOTIMG_STATS_CURRENT, BOOTIMG_STATS_ALLOCS, 1);
+      view->size = (uint64_t)inputLe32(hdr + 16) * blk_sz;
+
+      in = hdr_sz;
+      for (n = 0; n < total_chunks; n++)
+        {
+          inputChunk_p chunk = &view->chunks[view->nchunks];
+          uint32_t total_sz;
+
+          if (inputViewRead(parent, chdr, sizeof(chdr), in) != sizeof(chdr))
+            break;
+          chunk->type = inputLe16(chdr);
+          chunk->out = out;
+          chunk->len = (uint64_t)inputLe32(chdr + 4) * blk_sz;
+          chunk->in = in + chunk_hdr_sz;
+          total_sz = inputLe32(chdr + 8);
+
+          if ((chunk->type == INPUT_SPARSE_RAW && total_sz != chunk_hdr_sz + chunk->len) ||
+              (chunk->type == INPUT_SPARSE_FILL &&
+               (total_sz != chunk_hdr_sz + 4 || inputViewRead(parent, fill, 4, chunk->in) != 4)) ||
+              (chunk->type == INPUT_SPARSE_DONT_CARE && total_sz != chunk_hdr_sz) ||
+              (chunk->type == INPUT_SPARSE_CRC32 && total_sz != chunk_hdr_sz + 4) ||
+              chunk->type < INPUT_SPARSE_RAW || chunk->type > INPUT_SPARSE_CRC32 ||
+              out + chunk->len > view->size)
+            break;
+          if (chunk->type == INPUT_SPARSE_FILL)
+            chunk->fill = inputLe32(fill);
+
+          in += total_sz;
+          if (chunk->type == INPUT_SPARSE_CRC32 || !chunk->len)
+            continue;
+          out += chunk->len;
+          view->nchunks++;
+        }
+      if (n < total_chunks || (parent->size != INPUT_UNKNOWN_SIZE && in > parent->size))
+        break;
+
+      /* zeros up to the image size */
+      view->chunks[view->nchunks].type = INPUT_SPARSE_DONT_CARE;
+      view->chunks[view->nchunks].out = out;
+      view->chunks[view->nchunks].len = view->size - out;
+      view->nchunks++;
+
+      BOOTIMG_LOG(BOOTIMG_LOG_IMAGE, BOOTIMG_LOG_VERBOSE,
+                  "sparse image: %u chunks, %lu bytes", total_chunks, view->size);
+      return view;
+    }
+  while (0);
+
+  fprintf(stderr, "%s: error: invalid sparse image!\n", progname);
+  inputViewRelease(view);
+  return (inputView_p)NULL;
+}
+
+/*
+ * Decode an lz4 block in dst, which is preceded by hist bytes of the
+ * blocks before
+ */
+static int
+inputLz4Block(const uint8_t *src, size_t srclen, uint8_t *dst, size_t dstmax, size_t hist, size_t *dstlen)
+{
+  const uint8_t *ip = src, *iend = src + srclen;
+  uint8_t *op = dst, *oend = dst + dstmax;
+
+  for (;;)
+    {
+      size_t lit, mlen, offset;
+      unsigned token, b;
+
+      if (ip >= iend)
+        return -1;
+      token = *ip++;
+
+      lit = token >> 4;
+      if (lit == 15)
+        do
+          {
+            if (ip >= iend)
+              return -1;
+            lit += (b = *ip++);
+          }
+        while (b == 255);
+      if (lit > (size_t)(iend - ip) || lit > (size_t)(oend - op))
+        return -1;
+      memcpy((void *)op, (const void *)ip, lit);
+      op += lit;
+      ip += lit;
+
+      /* the last sequence has no match */
+      if (ip == iend)
+        break;
+
+      if (iend - ip < 2)
+        return -1;
+      offset = inputLe16(ip);
+      ip += 2;
+      if (!offset || offset > (size_t)(op - dst) + hist)
+        return -1;
+
+      mlen = token & 15;
+      if (mlen == 15)
+        do
+          {
+            if (ip >= iend)
+              return -1;
+            mlen += (b = *ip++);
+          }
+        while (b == 255);
+      mlen += 4;
+      if (mlen > (size_t)(oend - op))
+        return -1;
+
+      if (offset >= mlen)
+        memcpy((void *)op, (const void *)(op - offset), mlen);
+      else
+        for (size_t n = 0; n < mlen; n++)
+          op[n] = op[n - offset];
+      op += mlen;
+    }
+
+  *dstlen = op - dst;
+  return 0;
+}
+
+/*
+ * lz4 frame descriptor, after the magic
+ */
+static int
+inputLz4Frame(inputView_p view)
+{
+  static const size_t block_max[] = { 64*1024, 256*1024, 1024*1024, 4*1024*1024 };
+  uint8_t desc[2];
+
+  if (inputReadIn(view, desc, 2) != 2 || (desc[0] >> 6) != 1 || (desc[0] & INPUT_LZ4_FLAG_DICTID) ||
+      ((desc[1] >> 4) & 7) < 4)
+    return -1;
+
+  view->lz4_flags = desc[0];
+  view->lz4_block_max = block_max[((desc[1] >> 4) & 7) - 4];
+  view->lz4_state = INPUT_LZ4_FRAME;
+  view->lz4_frame_len = 0;
+  /* content size & header checksum */
+  view->in_pos += (desc[0] & INPUT_LZ4_FLAG_CONTENT_SIZE ? 8 : 0) + 1;
+
+  return 0;
+}
+
+/*
+ * Decode the next lz4 block: frames & legacy blocks may follow each
+ * other, anything else after them ends the stream
+ */
+static int
+inputLz4Fill(inputView_p view)
+{
+  uint8_t *dst = view->obuf + INPUT_LZ4_HISTORY;
+  uint8_t word[4];
+  uint32_t value, size;
+  size_t hist, dstlen;
+  ssize_t rdsz;
+
+  /* the last 64K decoded stay before dst for the blocks depending on them */
+  if (view->lz4_last)
+    memmove((void *)view->obuf, (const void *)(view->obuf + view->lz4_last), INPUT_LZ4_HISTORY);
+  view->lz4_last = 0;
+
+  for (;;)
+    {
+      if ((rdsz = inputReadIn(view, word, 4)) < 0)
+        return -1;
+      if (rdsz < 4)
+        {
+          if (view->lz4_state == INPUT_LZ4_FRAME)
+            break;
+          view->eof = 1;
+          return 0;
+        }
+      value = inputLe32(word);
+
+      if (view->lz4_state != INPUT_LZ4_FRAME && value == INPUT_LZ4_FRAME_MAGIC)
+        {
+          if (inputLz4Frame(view) < 0)
+            break;
+          continue;
+        }
+      if (view->lz4_state != INPUT_LZ4_FRAME && value == INPUT_LZ4_LEGACY_MAGIC)
+        {
+          view->lz4_state = INPUT_LZ4_LEGACY;
+          view->lz4_flags = INPUT_LZ4_FLAG_INDEPENDENT;
+          view->lz4_block_max = INPUT_LZ4_BLOCK_MAX;
+          continue;
+        }
+      if (view->lz4_state == INPUT_LZ4_MAGIC && (value & 0xfffffff0) == INPUT_LZ4_SKIP_MAGIC)
+        {
+          if (inputReadIn(view, word, 4) != 4)
+            break;
+          view->in_pos += inputLe32(word);
+          continue;
+        }
+
+      /* padding after the last frame or legacy block */
+      if (view->lz4_state == INPUT_LZ4_MAGIC || (view->lz4_state == INPUT_LZ4_LEGACY && !value))
+        {
+          view->eof = 1;
+          return 0;
+        }
+
+      /* end mark of a frame, then its content checksum */
+      if (!value)
+        {
+          if (view->lz4_flags & INPUT_LZ4_FLAG_CONTENT_CHECKSUM)
+            view->in_pos += 4;
+          view->lz4_state = INPUT_LZ4_MAGIC;
+          continue;
+        }
+
+      size = view->lz4_state == INPUT_LZ4_FRAME ? value & 0x7fffffff : value;
+      if (size > INPUT_LZ4_BOUND(view->lz4_block_max) || inputReadIn(view, view->ibuf, size) != size)
+        break;
+      if (view->lz4_state == INPUT_LZ4_FRAME && (view->lz4_flags & INPUT_LZ4_FLAG_BLOCK_CHECKSUM))
+        view->in_pos += 4;
+
+      hist = view->lz4_flags & INPUT_LZ4_FLAG_INDEPENDENT ? 0 : INPUT_MIN(INPUT_LZ4_HISTORY, view->lz4_frame_len);
+      if (view->lz4_state == INPUT_LZ4_FRAME && (value & 0x80000000))
+        {
+          /* stored block */
+          if (size > view->lz4_block_max)
+            break;
+          memcpy((void *)dst, (const void *)view->ibuf, size);
+          dstlen = size;
+        }
+      else if (inputLz4Block(view->ibuf, size, dst, view->lz4_block_max, hist, &dstlen) < 0)
+        break;
+
+      view->lz4_frame_len += dstlen;
+      view->lz4_last = dstlen;
+      view->out = dst;
+      view->out_len = dstlen;
+      if (dstlen)
+        return 0;
+    }
+
+  fprintf(stderr, "%s: error: invalid or truncated lz4 stream!\n", progname);
+  return -1;
+}
+
+/*
+ * Move what is left of the input to the buffer start and read more
+ */
+static ssize_t
+inputInflateInput(inputView_p view)
+{
+  z_stream *zs = &view->zs;
+  ssize_t rdsz;
+
+  if (zs->avail_in)
+    memmove((void *)view->ibuf, (const void *)zs->next_in, zs->avail_in);
+  zs->next_in = view->ibuf;
+  if ((rdsz = inputReadIn(view, view->ibuf + zs->avail_in, INPUT_CHUNK - zs->avail_in)) > 0)
+    zs->avail_in += rdsz;
+
+  return rdsz;
+}
+
+/*
+ * Inflate the next chunk of a gzip stream (members follow each other,
+ * anything else after them ends it) or of a deflated zip entry
+ */
+static int
+inputInflateFill(inputView_p view)
+{
+  z_stream *zs = &view->zs;
+  ssize_t rdsz;
+  int zrc;
+
+  view->out = view->obuf;
+  zs->next_out = view->obuf;
+  zs->avail_out = INPUT_CHUNK;
+  while (zs->avail_out && !view->eof)
+    {
+      if (!zs->avail_in && (rdsz = inputInflateInput(view)) <= 0)
+        {
+          if (!rdsz)
+            fprintf(stderr, "%s: error: truncated %s stream!\n", progname, inputTypeNames[view->type]);
+          return -1;
+        }
+
+      zrc = inflate(zs, Z_NO_FLUSH);
+      if (zrc == Z_STREAM_END)
+        {
+          if (view->type == BOOTIMG_INPUT_GZIP && zs->avail_in < 2 && inputInflateInput(view) < 0)
+            return -1;
+          if (view->type == BOOTIMG_INPUT_GZIP && zs->avail_in >= 2 &&
+              zs->next_in[0] == 0x1f && zs->next_in[1] == 0x8b)
+            inflateReset(zs);
+          else
+            view->eof = 1;
+        }
+      else if (zrc != Z_OK)
+        {
+          fprintf(stderr, "%s: error: corrupted %s stream (%d)!\n", progname, inputTypeNames[view->type], zrc);
+          return -1;
+        }
+    }
+  view->out_len = INPUT_CHUNK - zs->avail_out;
+
+  return 0;
+}
+
+/*
+ * Decode from the start again
+ */
+static void
+inputStreamReset(inputView_p view)
+{
+  view->in_pos = 0;
+  view->dpos = 0;
+  view->out_len = 0;
+  view->eof = 0;
+  view->lz4_state = INPUT_LZ4_MAGIC;
+  view->lz4_last = 0;
+  view->lz4_frame_len = 0;
+  if (view->zinit)
+    {
+      inflateReset(&view->zs);
+      view->zs.avail_in = 0;
+    }
+}
+
+/*
+ * Streams are decoded in order, from the start again to go back
+ */
+static ssize_t
+inputStreamRead(inputView_p view, uint8_t *buf, size_t len, uint64_t off)
+{
+  size_t done = 0;
+
+  if (off < view->dpos)
+    {
+      BOOTIMG_LOG(BOOTIMG_LOG_IMAGE, BOOTIMG_LOG_DEBUG,
+                  "%s stream decoded again for offset %lu", inputTypeNames[view->type], off);
+      inputStreamReset(view);
+    }
+
+  while (done < len)
+    {
+      uint64_t pos = off + done;
+
+      if (pos < view->dpos + view->out_len)
+        {
+          size_t skip = pos - view->dpos;
+          size_t n = INPUT_MIN(len - done, view->out_len - skip);
+
+          memcpy((void *)(buf + done), (const void *)(view->out + skip), n);
+          done += n;
+          continue;
+        }
+
+      if (view->eof)
+        {
+          view->size = view->dpos + view->out_len;
+          break;
+        }
+      view->dpos += view->out_len;
+      view->out_len = 0;
+      if ((view->type == BOOTIMG_INPUT_LZ4 ? inputLz4Fill(view) : inputInflateFill(view)) < 0)
+        return -1;
+    }
+
+  return done;
+}
+
+static inputView_p
+inputStreamOpen(int type, inputView_p parent, uint64_t start, uint64_t len, uint64_t size)
+{
+  inputView_p view = inputViewNew(type, parent, start, len);
+  size_t ilen = type == BOOTIMG_INPUT_LZ4 ? INPUT_LZ4_BOUND(INPUT_LZ4_BLOCK_MAX) : INPUT_CHUNK;
+  size_t olen = type == BOOTIMG_INPUT_LZ4 ? INPUT_LZ4_HISTORY + INPUT_LZ4_BLOCK_MAX : INPUT_CHUNK;
+
+  if (!view)
+    return (inputView_p)NULL;
+  view->size = size;
+
+  if (!(view->ibuf = (uint8_t *)malloc(ilen)) || !(view->obuf = (uint8_t *)calloc(1, olen)))
+    {
+      inputViewRelease(view);
+      return (inputView_p)NULL;
+    }
+  statsCount(BOOTIMG_STATS_CURRENT, BOOTIMG_STATS_ALLOCS, 2);
+
+  if (type != BOOTIMG_INPUT_LZ4)
+    {
+      if (inflateInit2(&view->zs, type == BOOTIMG_INPUT_GZIP ? 16 + MAX_WBITS : -MAX_WBITS) != Z_OK)
+        {
+          inputViewRelease(view);
+          return (inputView_p)NULL;
+        }
+      view->zinit = 1;
+    }
+
+  return view;
+}
+
+/*
+ * Read up to len bytes at off of a view, short only at its end
+ */
+static ssize_t
+inputViewRead(inputView_p view, void *buf, size_t len, uint64_t off)
+{
+  if (view->size != INPUT_UNKNOWN_SIZE)
+    {
+      if (off >= view->size)
+        return 0;
+      len = INPUT_MIN(len, view->size - off);
+    }
+
+  switch (view->type)
+    {
+    case BOOTIMG_INPUT_FILE:
+      return inputFileRead(view, (uint8_t *)buf, len, off);
+    case BOOTIMG_INPUT_ZIP:
+      return inputViewRead(view->parent, buf, len, view->start + off);
+    case BOOTIMG_INPUT_SPARSE:
+      return inputSparseRead(view, (uint8_t *)buf, len, off);
+    default:
+      return inputStreamRead(view, (uint8_t *)buf, len, off);
+    }
+}
+
+/*
+ * Size of a view: a stream of unknown size is decoded up to its end
+ */
+static uint64_t
+inputViewSize(inputView_p view)
+{
+  while (view->size == INPUT_UNKNOWN_SIZE)
+    {
+      uint8_t byte;
+
+      if (inputStreamRead(view, &byte, 1, view->dpos + view->out_len) < 0)
+        return INPUT_UNKNOWN_SIZE;
+    }
+
+  return view->size;
+}
+
+static void
+inputZipRelease(inputZipEntry_p entries, size_t count)
+{
+  for (size_t n = 0; n < count; n++)
+    free((void *)entries[n].name);
+  free((void *)entries);
+}
+
+/*
+ * Load the central directory of a zip archive (zip64 or not)
+ */
+static int
+inputZipEntries(inputView_p parent, inputZipEntry_p *entries, size_t *count)
+{
+  uint8_t *buf = (uint8_t *)NULL, *p, *end = (uint8_t *)NULL;
+  uint64_t size = inputViewSize(parent), tail, cdoff, cdsize, nentries = 0;
+  inputZipEntry_p list = (inputZipEntry_p)NULL;
+  size_t n = 0;
+
+  *entries = (inputZipEntry_p)NULL;
+  *count = 0;
+  if (size == INPUT_UNKNOWN_SIZE || size < INPUT_ZIP_END_SIZE)
+    return -1;
+
+  do
+    {
+      /* the end record is in the last bytes, before the comment */
+      tail = INPUT_MIN(size, INPUT_ZIP_END_SIZE + INPUT_ZIP_COMMENT_MAX);
+      if (!(buf = (uint8_t *)malloc(tail)) || inputViewRead(parent, buf, tail, size - tail) != (ssize_t)tail)
+        break;
+      statsCount(BOOTIMG_STATS_CURRENT, BOOTIMG_STATS_ALLOCS, 1);
+      for (size_t i = tail - INPUT_ZIP_END_SIZE +1; i-- > 0 && !end;)
+        if (inputLe32(buf + i) == INPUT_ZIP_END)
+          end = buf + i;
+      if (!end)
+        break;
+
+      nentries = inputLe16(end + 10);
+      cdsize = inputLe32(end + 12);
+      cdoff = inputLe32(end + 16);
+      if ((nentries == 0xffff || cdsize == 0xffffffff || cdoff == 0xffffffff) &&
+          end - buf >= 20 && inputLe32(end - 20) == INPUT_ZIP64_LOCATOR)
+        {
+          uint8_t z64[INPUT_ZIP64_END_SIZE];
+
+          if (inputViewRead(parent, z64, sizeof(z64), inputLe64(end - 20 + 8)) != sizeof(z64) ||
+              inputLe32(z64) != INPUT_ZIP64_END)
+            break;
+          nentries = inputLe64(z64 + 32);
+          cdsize = inputLe64(z64 + 40);
+          cdoff = inputLe64(z64 + 48);
+        }
+      free((void *)buf);
+      buf = (uint8_t *)NULL;
+
+      if (cdsize > INPUT_ZIP_CD_MAX || cdoff > size || cdsize > size - cdoff ||
+          nentries > cdsize / INPUT_ZIP_CENTRAL_SIZE)
+        break;
+      if (!(buf = (uint8_t *)malloc(cdsize ? cdsize : 1)) ||
+          !(list = (inputZipEntry_p)calloc(nentries ? nentries : 1, sizeof(inputZipEntry_t))) ||
+          inputViewRead(parent, buf, cdsize, cdoff) != (ssize_t)cdsize)
+        break;
+      statsCount(BOOTIMG_STATS_CURRENT, BOOTIMG_STATS_ALLOCS, 2);
+
+      for (p = buf; n < nentries; n++)
+        {
+          inputZipEntry_p entry = &list[n];
+          size_t nlen, xlen, clen;
+          const uint8_t *x, *xend;
+
+          if (buf + cdsize - p < INPUT_ZIP_CENTRAL_SIZE || inputLe32(p) != INPUT_ZIP_CENTRAL)
+            break;
+          nlen = inputLe16(p + 28);
+          xlen = inputLe16(p + 30);
+          clen = inputLe16(p + 32);
+          if ((size_t)(buf + cdsize - p) < INPUT_ZIP_CENTRAL_SIZE + nlen + xlen + clen ||
+              !(entry->name = strndup((const char *)p + INPUT_ZIP_CENTRAL_SIZE, nlen)))
+            break;
+          entry->flags = inputLe16(p + 8);
+          entry->method = inputLe16(p + 10);
+          entry->csize = inputLe32(p + 20);
+          entry->usize = inputLe32(p + 24);
+          entry->offset = inputLe32(p + 42);
+
+          /* 64 bits values in the zip64 extra field, for the ones saturated */
+          for (x = p + INPUT_ZIP_CENTRAL_SIZE + nlen, xend = x + xlen; xend - x >= 4; x += 4 + inputLe16(x + 2))
+            if (inputLe16(x) == 0x0001)
+              {
+                const uint8_t *v = x + 4, *vend = v + INPUT_MIN((size_t)inputLe16(x + 2), (size_t)(xend - v));
+
+                if (entry->usize == 0xffffffff && vend - v >= 8)
+                  entry->usize = inputLe64(v), v += 8;
+                if (entry->csize == 0xffffffff && vend - v >= 8)
+                  entry->csize = inputLe64(v), v += 8;
+                if (entry->offset == 0xffffffff && vend - v >= 8)
+                  entry->offset = inputLe64(v);
+              }
+          p += INPUT_ZIP_CENTRAL_SIZE + nlen + xlen + clen;
+        }
+      if (n < nentries)
+        break;
+
+      free((void *)buf);
+      *entries = list;
+      *count = n;
+      return 0;
+    }
+  while (0);
+
+  fprintf(stderr, "%s: error: invalid zip archive!\n", progname);
+  free((void *)buf);
+  inputZipRelease(list, n < nentries ? n +1 : n);
+  return -1;
+}
+
+/*
+ * View of the data of a zip entry, stored or deflated
+ */
+static inputView_p
+inputZipEntryOpen(inputView_p parent, inputZipEntry_p entry)
+{
+  uint8_t local[INPUT_ZIP_LOCAL_SIZE];
+  inputView_p view = (inputView_p)NULL;
+  uint64_t data;
+
+  if (entry->flags & 1)
+    {
+      fprintf(stderr, "%s: error: zip entry '%s' is encrypted!\n", progname, entry->name);
+      return (inputView_p)NULL;
+    }
+  if (inputViewRead(parent, local, sizeof(local), entry->offset) != sizeof(local) ||
+      inputLe32(local) != INPUT_ZIP_LOCAL)
+    {
+      fprintf(stderr, "%s: error: invalid zip entry '%s'!\n", progname, entry->name);
+      return (inputView_p)NULL;
+    }
+  data = entry->offset + INPUT_ZIP_LOCAL_SIZE + inputLe16(local + 26) + inputLe16(local + 28);
+
+  if (entry->method == Z_NO_COMPRESSION)
+    {
+      if ((view = inputViewNew(BOOTIMG_INPUT_ZIP, parent, data, entry->csize)))
+        view->size = entry->csize;
+    }
+  else if (entry->method == Z_DEFLATED)
+    view = inputStreamOpen(BOOTIMG_INPUT_DEFLATE, parent, data, entry->csize, entry->usize);
+  else
+    fprintf(stderr, "%s: error: zip entry '%s' compressed with unsupported method %d!\n",
+            progname, entry->name, entry->method);
+
+  return view;
+}
+
+/*
+ * Open the entry want of a zip archive or, with none, the one named
+ * BOOTIMG_INPUT_ZIP_DEFAULT in the archive or in the ones it holds.
+ * The name of the entry opened is set in found.
+ */
+static inputView_p
+inputZipOpen(inputView_p parent, const char *want, char **found)
+{
+  inputZipEntry_p entries;
+  inputView_p view = (inputView_p)NULL;
+  size_t count, n;
+
+  if (inputZipEntries(parent, &entries, &count) < 0)
+    return (inputView_p)NULL;
+
+  for (n = 0; n < count; n++)
+    {
+      const char *base = rindex(entries[n].name, '/') ? rindex(entries[n].name, '/') +1 : entries[n].name;
+
+      if (want ? !strcmp(entries[n].name, want) : !strcmp(base, BOOTIMG_INPUT_ZIP_DEFAULT))
+        break;
+    }
+
+  if (n < count)
+    {
+      if ((view = inputZipEntryOpen(parent, &entries[n])))
+        *found = strdup(entries[n].name);
+      BOOTIMG_LOG(BOOTIMG_LOG_IMAGE, BOOTIMG_LOG_VERBOSE,
+                  "zip entry '%s': %lu bytes, method %d", entries[n].name, entries[n].usize, entries[n].method);
+    }
+  else if (!want)
+    {
+      /* factory archives hold the images in a zip of their own */
+      for (n = 0; n < count && !view; n++)
+        {
+          size_t len = strlen(entries[n].name);
+          inputView_p sub;
+
+          if (len < 4 || strcasecmp(entries[n].name + len - 4, ".zip") ||
+              !(sub = inputZipEntryOpen(parent, &entries[n])))
+            continue;
+          if (!(view = inputZipOpen(sub, NULL, found)))
+            inputViewRelease(sub);
+        }
+      if (!view)
+        fprintf(stderr, "%s: error: no '%s' entry in zip archive!\n", progname, BOOTIMG_INPUT_ZIP_DEFAULT);
+    }
+  else
+    fprintf(stderr, "%s: error: no '%s' entry in zip archive!\n", progname, want);
+
+  inputZipRelease(entries, count);
+  return view;
+}
+
+/*
+ * Container type by the magic at the start of a view, -1 if it cannot
+ * be read
+ */
+static int
+inputDetect(inputView_p view)
+{
+  uint8_t magic[4];
+  uint32_t value;
+  ssize_t rdsz;
+
+  if ((rdsz = inputViewRead(view, magic, sizeof(magic), 0)) != sizeof(magic))
+    return rdsz < 0 ? -1 : BOOTIMG_INPUT_FILE;
+  value = inputLe32(magic);
+
+  if (magic[0] == 0x1f && magic[1] == 0x8b)
+    return BOOTIMG_INPUT_GZIP;
+  if (value == INPUT_LZ4_FRAME_MAGIC || value == INPUT_LZ4_LEGACY_MAGIC ||
+      (value & 0xfffffff0) == INPUT_LZ4_SKIP_MAGIC)
+    return BOOTIMG_INPUT_LZ4;
+  if (value == INPUT_SPARSE_MAGIC)
+    return BOOTIMG_INPUT_SPARSE;
+  if (value == INPUT_ZIP_LOCAL)
+    return BOOTIMG_INPUT_ZIP;
+
+  return BOOTIMG_INPUT_FILE;
+}
+
+/*
+ * Copy a view in an anonymous memory file, skipping zero runs
+ */
+static int
+inputViewCopy(inputView_p view)
+{
+  uint8_t *buf = (uint8_t *)malloc(INPUT_CHUNK);
+  uint64_t off = 0, data = 0;
+  ssize_t rdsz = -1;
+  int fd;
+
+  if (!buf)
+    return -1;
+  statsCount(BOOTIMG_STATS_CURRENT, BOOTIMG_STATS_ALLOCS, 1);
+  if ((fd = memfd_create("bootimg-input", MFD_CLOEXEC)) < 0)
+    {
+      fprintf(stderr, "%s: error: cannot create memory file: %s!\n", progname, strerror(errno));
+      free((void *)buf);
+      return -1;
+    }
+
+  while ((rdsz = inputViewRead(view, buf, INPUT_CHUNK, off)) > 0)
+    {
+      if (buf[0] || memcmp((const void *)buf, (const void *)(buf +1), rdsz -1))
+        {
+          if (pwrite64(fd, buf, rdsz, off) != rdsz)
+            {
+              rdsz = -1;
+              break;
+            }
+          statsCount(BOOTIMG_STATS_CURRENT, BOOTIMG_STATS_WRITE, rdsz);
+          statsCount(BOOTIMG_STATS_CURRENT, BOOTIMG_STATS_SYSCALLS, 1);
+          data += rdsz;
+        }
+      off += rdsz;
+    }
+  free((void *)buf);
+
+  if (rdsz < 0 || ftruncate(fd, off) < 0)
+    {
+      fprintf(stderr, "%s: error: cannot decode image input!\n", progname);
+      close(fd);
+      return -1;
+    }
+
+  BOOTIMG_LOG(BOOTIMG_LOG_IMAGE, BOOTIMG_LOG_INFO,
+              "image decoded: %lu bytes (%lu of data)", off, data);
+  return fd;
+}
+
+/*
+ * Image name given by a container to its content: the .gz or .lz4
+ * extension is dropped, a zip entry is named after its base name in
+ * the directory of the archive
+ */
+static void
+inputRename(char **name, int type, const char *archive, const char *entry)
+{
+  const char *ext = type == BOOTIMG_INPUT_GZIP ? ".gz" : ".lz4";
+  size_t len = strlen(*name);
+
+  if (type == BOOTIMG_INPUT_GZIP || type == BOOTIMG_INPUT_LZ4)
+    {
+      if (len > strlen(ext) && !strcasecmp(*name + len - strlen(ext), ext))
+        (*name)[len - strlen(ext)] = '\0';
+    }
+  else if (type == BOOTIMG_INPUT_ZIP && entry)
+    {
+      const char *base = rindex(entry, '/') ? rindex(entry, '/') +1 : entry;
+      size_t dirlen = rindex(archive, '/') ? rindex(archive, '/') - archive +1 : 0;
+      char *newname = (char *)malloc(dirlen + strlen(base) +1);
+
+      if (!newname)
+        return;
+      memcpy((void *)newname, (const void *)archive, dirlen);
+      strcpy(newname + dirlen, base);
+      free((void *)*name);
+      *name = newname;
+    }
+}
+
+/*
+ * Open an image input for reading: 'file' or 'file!entry[!entry...]'
+ * for zip entries. Only the headers of the containers are read. Returns
+ * the input & sets name to the name of the image (which the caller
+ * frees), or returns NULL after printing the error.
+ */
+bootimgInput_p
+inputOpen(const char *path, char **name)
+{
+  char *file = strdup(path), *select = (char *)NULL, *bang;
+  inputView_p view = (inputView_p)NULL, next;
+  bootimgInput_p input = (bootimgInput_p)NULL;
+  struct stat st;
+  int fd = -1, type, depth;
+  uint64_t start;
+
+  *name = (char *)NULL;
+  if (!file)
+    return (bootimgInput_p)NULL;
+
+  /* a '!' separates the archive from the entry, unless the file has it */
+  for (bang = strchr(file, '!'); bang && stat(path, &st) < 0; bang = strchr(bang +1, '!'))
+    {
+      *bang = '\0';
+      if (!stat(file, &st) && S_ISREG(st.st_mode))
+        {
+          select = bang +1;
+          break;
+        }
+      *bang = '!';
+    }
+
+  start = statsBegin(BOOTIMG_STATS_INPUT);
+  do
+    {
+      if ((fd = open(file, O_RDONLY)) < 0)
+        {
+          fprintf(stderr, "%s: error: cannot open image file at '%s'\n", progname, path);
+          break;
+        }
+      if (fstat(fd, &st) < 0 || !(view = inputViewNew(BOOTIMG_INPUT_FILE, (inputView_p)NULL, 0, st.st_size)) ||
+          !(*name = strdup(file)))
+        {
+          close(fd);
+          break;
+        }
+      view->fd = fd;
+      view->size = st.st_size;
+
+      for (depth = 0; (type = inputDetect(view)) > BOOTIMG_INPUT_FILE; depth++)
+        {
+          char *entry = (char *)NULL, *want = select;
+
+          if (depth == BOOTIMG_INPUT_MAX_DEPTH)
+            {
+              fprintf(stderr, "%s: error: image containers nested too deep in '%s'!\n", progname, path);
+              break;
+            }
+          BOOTIMG_LOG(BOOTIMG_LOG_IMAGE, BOOTIMG_LOG_INFO, "'%s': %s container", path, inputTypeNames[type]);
+          if (type == BOOTIMG_INPUT_ZIP)
+            {
+              if (select && (select = strchr(select, '!')))
+                *select++ = '\0';
+              next = inputZipOpen(view, want, &entry);
+            }
+          else if (type == BOOTIMG_INPUT_SPARSE)
+            next = inputSparseOpen(view);
+          else
+            next = inputStreamOpen(type, view, 0, view->size, INPUT_UNKNOWN_SIZE);
+          if (!next)
+            break;
+
+          inputRename(name, type, file, entry);
+          free((void *)entry);
+          view = next;
+        }
+      if (type != BOOTIMG_INPUT_FILE)
+        break;
+      if (select)
+        {
+          fprintf(stderr, "%s: error: no zip archive to look for '%s' in '%s'!\n", progname, select, path);
+          break;
+        }
+
+      if (!(input = (bootimgInput_p)calloc(1, sizeof(bootimgInput_t))))
+        break;
+      statsCount(BOOTIMG_STATS_CURRENT, BOOTIMG_STATS_ALLOCS, 1);
+      pthread_mutex_init(&input->lock, (const pthread_mutexattr_t *)NULL);
+      input->view = view;
+      input->fd = -1;
+
+      /* a plain file, or stored zip entries down to it, is read in place */
+      for (next = view; next && next->type == BOOTIMG_INPUT_ZIP; next = next->parent)
+        input->base += next->start;
+      if (next && next->type == BOOTIMG_INPUT_FILE)
+        input->fd = next->fd;
+      else
+        input->base = 0;
+      BOOTIMG_LOG(BOOTIMG_LOG_IMAGE, BOOTIMG_LOG_VERBOSE, "'%s': %s", path,
+                  input->fd >= 0 ? "read in place" : "decoded as read");
+      view = (inputView_p)NULL;
+    }
+  while (0);
+  statsEnd(BOOTIMG_STATS_INPUT, start);
+
+  inputViewClose(view);
+  free((void *)file);
+  if (!input)
+    {
+      free((void *)*name);
+      *name = (char *)NULL;
+    }
+
+  return input;
+}
+
+/*
+ * Read up to len bytes at off of an image, short only at its end.
+ * Returns -1 after printing the error.
+ */
+ssize_t
+inputRead(bootimgInput_p input, void *buf, size_t len, uint64_t off)
+{
+  ssize_t rdsz;
+
+  if (input->fd >= 0)
+    return inputViewRead(input->view, buf, len, off);
+
+  pthread_mutex_lock(&input->lock);
+  rdsz = inputViewRead(input->view, buf, len, off);
+  pthread_mutex_unlock(&input->lock);
+
+  return rdsz;
+}
+
+/*
+ * Length of an image, 0 while unknown: a stream is not decoded to its
+ * end for it
+ */
+uint64_t
+inputLength(bootimgInput_p input)
+{
+  uint64_t size;
+
+  pthread_mutex_lock(&input->lock);
+  size = input->view->size;
+  pthread_mutex_unlock(&input->lock);
+
+  return size == INPUT_UNKNOWN_SIZE ? 0 : size;
+}
+
+/*
+ * File descriptor an image read in place is at base in, -1 if it is
+ * decoded. The descriptor stays owned by the input.
+ */
+int
+inputFd(bootimgInput_p input, uint64_t *base)
+{
+  *base = input->base;
+  return input->fd;
+}
+
+/*
+ * Decode a whole image in an anonymous memory file (the caller closes
+ * it), -1 on error
+ */
+int
+inputCopy(bootimgInput_p input)
+{
+  int fd;
+
+  pthread_mutex_lock(&input->lock);
+  fd = inputViewCopy(input->view);
+  pthread_mutex_unlock(&input->lock);
+
+  return fd;
+}
+
+void
+inputClose(bootimgInput_p input)
+{
+  if (!input)
+    return;
+
+  inputViewClose(input->view);
+  pthread_mutex_destroy(&input->lock);
+  free((void *)input);
+}
+
+/* Local Variables:                                                */
+/* mode: C                                                         */
+/* comment-column: 0                                               */
+/* End:                                                            */
@@ -0,0 +1,71 @@
+/* bootimg-tools/bootimg-input.h
+ *
+ * Copyright 2007, The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef __BOOTIMG_INPUT_H__
+#define __BOOTIMG_INPUT_H__
+
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+/*
+ * Image inputs: a plain file or a container holding the image, found
+ * by its magic and possibly nested (a sparse image in a zip, ...):
+ * - gzip & lz4 (frame or legacy) streams, decoded in order; going back
+ *   restarts the decoding
+ * - Android sparse images, read through their chunk index
+ * - zip archives, the entry being read through the central directory:
+ *   'archive.zip!path/in/zip' (a '!' for each nested zip) or, with no
+ *   path, the entry named boot.img, looked for in nested zips too
+ *
+ * The readers of an image read it at offsets with inputRead, nothing
+ * being decoded before it is asked for: a stream is only decoded up to
+ * the last byte read so far. A plain file or a stored zip entry is read
+ * in place, inputFd giving the file & offset of the image for the I/O
+ * engine. Reads are serialized on the views that decode, which are
+ * best read in order. inputCopy decodes the whole image in an anonymous
+ * memory file for the readers that need a descriptor anyway.
+ */
+
+#define BOOTIMG_INPUT_FILE              0
+#define BOOTIMG_INPUT_GZIP              1
+#define BOOTIMG_INPUT_LZ4               2
+#define BOOTIMG_INPUT_SPARSE            3
+#define BOOTIMG_INPUT_ZIP               4       /* stored entry */
+#define BOOTIMG_INPUT_DEFLATE           5       /* deflated entry */
+
+/* Most containers in each other */
+#define BOOTIMG_INPUT_MAX_DEPTH         4
+
+/* Entry looked for in a zip when none is given */
+#define BOOTIMG_INPUT_ZIP_DEFAULT       "boot.img"
+
+typedef struct _bootimgInput_st bootimgInput_t, *bootimgInput_p;
+
+bootimgInput_p inputOpen   (const char *, char **);
+ssize_t        inputRead   (bootimgInput_p, void *, size_t, uint64_t);
+uint64_t       inputLength (bootimgInput_p);
+int            inputFd     (bootimgInput_p, uint64_t *);
+int            inputCopy   (bootimgInput_p);
+void           inputClose  (bootimgInput_p);
+
+#endif /* __BOOTIMG_INPUT_H__ */
+
+/* Local Variables:                                                */
+/* mode: C                                                         */
+/* comment-column: 0                                               */
+/* End:                                                            */
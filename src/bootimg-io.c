@@ -0,0 +1,1024 @@
+/* bootimg-tools/bootimg-io.c
+ *
+ * Copyright 2007, The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#ifdef STDC_HEADERS
+# include <stdlib.h>
+# include <stddef.h>
+#else
+# ifdef HAVE_STDLIB_H
+#  include <stdlib.h>
+# endif
+# ifdef HAVE_STDDEF_H
+#  include <stddef.h>
+# endif
+#endif
+#ifdef HAVE_STRING_H
+# include <string.h>
+#endif
+#ifdef HAVE_STRINGS_H
+# include <strings.h>
+#endif
+#ifdef HAVE_UNISTD_H
+# include <unistd.h>
+#endif
+#ifdef HAVE_FCNTL_H
+# include <fcntl.h>
+#endif
+#include <errno.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#ifdef HAVE_LINUX_IO_URING_H
+# include <linux/io_uring.h>
+#endif
+
+#include "bootimg-io.h"
+#include "bootimg-stats.h"
+#include "bootimg-log.h"
+
+#if defined(HAVE_LINUX_IO_URING_H) && defined(__NR_io_uring_setup)
+# define BOOTIMG_IO_HAVE_URING          1
+#endif
+
+/* A single request never transfers more than this, the rest is requeued */
+#define BOOTIMG_IO_MAX_XFER             (1024*1024*1024)
+
+/* O_DIRECT offsets, lengths & buffers alignment */
+#define BOOTIMG_IO_DIRECT_ALIGN         4096
+
+#define IO_MIN(x,y)                     ((x) < (y) ? (x) : (y))
+
+/* Size of the chunk starting with x bytes left */
+#define IO_CHUNK_LEN(x)                 ((x) < BOOTIMG_IO_CHUNK ? (size_t)(x) : (size_t)BOOTIMG_IO_CHUNK)
+
+#define BOOTIMG_IO_OP_READ              0
+#define BOOTIMG_IO_OP_WRITE             1
+
+/* External decls */
+extern int vflag;
+extern char *progname;
+
+typedef struct _bootimgIoOp_st
+{
+  int                  opcode;
+  int                  fd;
+  char                *buf;
+  size_t               len;
+  size_t               done;
+  off64_t              offset;
+  int                  bufIndex;
+  ssize_t              res;
+  struct iovec         iov;
+  bootimgIoCallback_t  callback;
+  void                *arg;
+  int                  phase;           /* --stats phase it was queued from */
+} bootimgIoOp_t, *bootimgIoOp_p;
+
+struct _bootimgIo_st
+{
+  int                  backend;
+  int                  flags;
+  unsigned             depth;
+  unsigned             pending;
+  bootimgIoOp_p        ops;
+  unsigned            *freelist;
+  unsigned             nfree;
+  /* sync backend: requests done, waiting for their callback */
+  unsigned            *doneq;
+  unsigned             donehead;
+  unsigned             donecount;
+  /* io_uring backend */
+  int                  ringfd;
+  int                  registered;
+  unsigned             tosubmit;
+  void                *sqring;
+  void                *cqring;
+  size_t               sqringsz;
+  size_t               cqringsz;
+  size_t               sqessz;
+#ifdef BOOTIMG_IO_HAVE_URING
+  struct io_uring_sqe *sqes;
+  struct io_uring_cqe *cqes;
+#endif
+  unsigned            *sqtail;
+  unsigned            *sqmask;
+  unsigned            *sqarray;
+  unsigned            *cqhead;
+  unsigned            *cqtail;
+  unsigned            *cqmask;
+};
+
+static __thread bootimgIo_p defaultIo = (bootimgIo_p)NULL;
+static int defaultFlags = 0;
+
+#ifdef BOOTIMG_IO_HAVE_URING
+/*
+ * Create the rings and map them. liburing is not needed for the few
+ * operations used here.
+ */
+static int
+uringSetup(bootimgIo_p io)
+{
+  struct io_uring_params p;
+
+  bzero((void *)&p, sizeof(p));
+  io->ringfd = syscall(__NR_io_uring_setup, io->depth, &p);
+  if (io->ringfd < 0)
+    return -1;
+
+  io->sqringsz = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  io->cqringsz = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+#ifdef IORING_FEAT_SINGLE_MMAP
+  if (p.features & IORING_FEAT_SINGLE_MMAP)
+    {
+      if (io->cqringsz > io->sqringsz)
+        io->sqringsz = io->cqringsz;
+      io->cqringsz = 0;
+    }
+#endif
+
+  do
+    {
+      io->sqring = mmap(NULL, io->sqringsz, PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_POPULATE, io->ringfd, IORING_OFF_SQ_RING);
+      if (io->sqring == MAP_FAILED)
+        break;
+
+      if (io->cqringsz)
+        io->cqring = mmap(NULL, io->cqringsz, PROT_READ | PROT_WRITE,
+                          MAP_SHARED | MAP_POPULATE, io->ringfd, IORING_OFF_CQ_RING);
+      else
+        io->cqring = io->sqring;
+      if (io->cqring == MAP_FAILED)
+        break;
+
+      io->sqessz = p.sq_entries * sizeof(struct io_uring_sqe);
+      io->sqes = mmap(NULL, io->sqessz, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, io->ringfd, IORING_OFF_SQES);
+      if (io->sqes == MAP_FAILED)
+        break;
+
+      io->sqtail  = (unsigned *)((char *)io->sqring + p.sq_off.tail);
+      io->sqmask  = (unsigned *)((char *)io->sqring + p.sq_off.ring_mask);
+      io->sqarray = (unsigned *)((char *)io->sqring + p.sq_off.array);
+      io->cqhead  = (unsigned *)((char *)io->cqring + p.cq_off.head);
+      io->cqtail  = (unsigned *)((char *)io->cqring + p.cq_off.tail);
+      io->cqmask  = (unsigned *)((char *)io->cqring + p.cq_off.ring_mask);
+      io->cqes    = (struct io_uring_cqe *)((char *)io->cqring + p.cq_off.cqes);
+
+      return 0;
+    }
+  while (0);
+
+  if (io->sqes && io->sqes != MAP_FAILED)
+    munmap(io->sqes, io->sqessz);
+  if (io->cqringsz && io->cqring && io->cqring != MAP_FAILED)
+    munmap(io->cqring, io->cqringsz);
+  if (io->sqring && io->sqring != MAP_FAILED)
+    munmap(io->sqring, io->sqringsz);
+  io->sqes = NULL;
+  io->sqring = io->cqring = NULL;
+  close(io->ringfd);
+  io->ringfd = -1;
+
+  return -1;
+}
+
+/*
+ * Fill a submission entry for the remaining part of a request
+ */
+static void
+uringQueue(bootimgIo_p io, unsigned idx)
+{
+  bootimgIoOp_p op = &io->ops[idx];
+  unsigned tail = *io->sqtail;
+  unsigned slot = tail & *io->sqmask;
+  struct io_uring_sqe *sqe = &io->sqes[slot];
+  size_t len = op->len - op->done;
+
+  if (len > BOOTIMG_IO_MAX_XFER)
+    len = BOOTIMG_IO_MAX_XFER;
+
+  bzero((void *)sqe, sizeof(struct io_uring_sqe));
+  sqe->fd = op->fd;
+  sqe->off = op->offset + op->done;
+  sqe->user_data = idx;
+  if (op->bufIndex >= 0 && io->registered)
+    {
+      sqe->opcode = op->opcode == BOOTIMG_IO_OP_READ ? IORING_OP_READ_FIXED : IORING_OP_WRITE_FIXED;
+      sqe->addr = (uint64_t)(uintptr_t)(op->buf + op->done);
+      sqe->len = len;
+      sqe->buf_index = op->bufIndex;
+    }
+  else
+    {
+      op->iov.iov_base = op->buf + op->done;
+      op->iov.iov_len = len;
+      sqe->opcode = op->opcode == BOOTIMG_IO_OP_READ ? IORING_OP_READV : IORING_OP_WRITEV;
+      sqe->addr = (uint64_t)(uintptr_t)&op->iov;
+      sqe->len = 1;
+    }
+
+  io->sqarray[slot] = slot;
+  __atomic_store_n(io->sqtail, tail + 1, __ATOMIC_RELEASE);
+  io->tosubmit++;
+}
+
+/*
+ * Submit what is queued and wait for at least want completions
+ */
+static int
+uringEnter(bootimgIo_p io, unsigned want)
+{
+  int ret = syscall(__NR_io_uring_enter, io->ringfd, io->tosubmit, want,
+                    want ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+
+  statsCount(BOOTIMG_STATS_CURRENT, BOOTIMG_STATS_SYSCALLS, 1);
+  if (ret < 0)
+    {
+      if (errno == EINTR || errno == EAGAIN || errno == EBUSY)
+        return 0;
+      fprintf(stderr, "%s: error: io_uring_enter: %s\n", progname, strerror(errno));
+      return -1;
+    }
+  io->tosubmit -= ret;
+
+  return 0;
+}
+#endif
+
+/*
+ * Drop the pages of a finished request from the page cache. Written
+ * pages are flushed first, dirty ones cannot be dropped.
+ */
+static void
+ioDropCache(bootimgIoOp_p op)
+{
+  /* whole pages, the ones shared with the neighbour requests included */
+  off64_t start = op->offset & ~((off64_t)BOOTIMG_IO_DIRECT_ALIGN -1);
+  off64_t end = (op->offset + op->res + BOOTIMG_IO_DIRECT_ALIGN -1) & ~((off64_t)BOOTIMG_IO_DIRECT_ALIGN -1);
+
+  if (op->res <= 0)
+    return;
+
+  if (op->opcode == BOOTIMG_IO_OP_WRITE)
+    {
+      sync_file_range(op->fd, start, end - start,
+                      SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+      statsCount(op->phase, BOOTIMG_STATS_SYSCALLS, 1);
+    }
+  posix_fadvise(op->fd, start, end - start, POSIX_FADV_DONTNEED);
+  statsCount(op->phase, BOOTIMG_STATS_SYSCALLS, 1);
+}
+
+/*
+ * Release the slot of a finished request then run its callback
+ */
+static void
+ioComplete(bootimgIo_p io, unsigned idx)
+{
+  bootimgIoOp_p op = &io->ops[idx];
+  bootimgIoCallback_t callback = op->callback;
+  void *arg = op->arg;
+  ssize_t res = op->res;
+
+  if (io->flags & BOOTIMG_IO_FLAG_NOCACHE)
+    ioDropCache(op);
+  statsCount(op->phase, op->opcode == BOOTIMG_IO_OP_READ ? BOOTIMG_STATS_READ : BOOTIMG_STATS_WRITE,
+             res > 0 ? res : 0);
+
+  io->freelist[io->nfree++] = idx;
+  io->pending--;
+
+  if (callback)
+    callback(arg, res);
+}
+
+/*
+ * Account for a transfer of res bytes (or an error) on a request.
+ * Returns 1 when the request is done.
+ */
+static int
+ioProgress(bootimgIoOp_p op, ssize_t res)
+{
+  if (res < 0)
+    {
+      op->res = res;
+      return 1;
+    }
+  op->done += res;
+  /* end of file */
+  if (res == 0 || op->done >= op->len)
+    {
+      op->res = op->done;
+      return 1;
+    }
+
+  return 0;
+}
+
+/*
+ * Blocking backend: the whole transfer is done when queued
+ */
+static void
+syncRun(bootimgIo_p io, unsigned idx)
+{
+  bootimgIoOp_p op = &io->ops[idx];
+
+  while (1)
+    {
+      size_t len = op->len - op->done;
+      ssize_t res;
+
+      if (len > BOOTIMG_IO_MAX_XFER)
+        len = BOOTIMG_IO_MAX_XFER;
+      if (op->opcode == BOOTIMG_IO_OP_READ)
+        res = pread(op->fd, op->buf + op->done, len, op->offset + op->done);
+      else
+        res = pwrite(op->fd, op->buf + op->done, len, op->offset + op->done);
+      statsCount(op->phase, BOOTIMG_STATS_SYSCALLS, 1);
+      if (res < 0 && errno == EINTR)
+        continue;
+      if (ioProgress(op, res < 0 ? -errno : res))
+        break;
+    }
+
+  io->doneq[(io->donehead + io->donecount) % io->depth] = idx;
+  io->donecount++;
+}
+
+/*
+ * New engine with up to depth requests in flight
+ */
+bootimgIo_p
+ioNew(unsigned depth, int flags)
+{
+  bootimgIo_p io = (bootimgIo_p)calloc(1, sizeof(bootimgIo_t));
+  const char *env = getenv("BOOTIMG_IO");
+
+  if (!io)
+    return io;
+
+  io->depth = depth ? depth : BOOTIMG_IO_DEFAULT_DEPTH;
+  io->flags = flags;
+  io->ringfd = -1;
+  io->ops = (bootimgIoOp_p)calloc(io->depth, sizeof(bootimgIoOp_t));
+  io->freelist = (unsigned *)calloc(io->depth, sizeof(unsigned));
+  io->doneq = (unsigned *)calloc(io->depth, sizeof(unsigned));
+  if (!io->ops || !io->freelist || !io->doneq)
+    {
+      ioFree(io);
+      return (bootimgIo_p)NULL;
+    }
+  for (unsigned n = 0; n < io->depth; n++)
+    io->freelist[io->nfree++] = io->depth - n - 1;
+
+  if (env && !strcmp(env, "sync"))
+    flags |= BOOTIMG_IO_FLAG_SYNC;
+
+  io->backend = BOOTIMG_IO_BACKEND_SYNC;
+#ifdef BOOTIMG_IO_HAVE_URING
+  if (!(flags & BOOTIMG_IO_FLAG_SYNC))
+    {
+      if (uringSetup(io) == 0)
+        io->backend = BOOTIMG_IO_BACKEND_URING;
+      else
+        BOOTIMG_LOG(BOOTIMG_LOG_IO, BOOTIMG_LOG_VERBOSE,
+                    "io_uring not available (%s), using blocking I/O", strerror(errno));
+    }
+#endif
+
+  return io;
+}
+
+/*
+ * Free an engine. Requests still in flight are waited for first.
+ */
+void
+ioFree(bootimgIo_p io)
+{
+  if (!io)
+    return;
+
+  if (io->ops && io->pending)
+    ioWaitAll(io);
+
+#ifdef BOOTIMG_IO_HAVE_URING
+  if (io->backend == BOOTIMG_IO_BACKEND_URING)
+    {
+      munmap(io->sqes, io->sqessz);
+      if (io->cqringsz)
+        munmap(io->cqring, io->cqringsz);
+      munmap(io->sqring, io->sqringsz);
+      close(io->ringfd);
+    }
+#endif
+  if (io == defaultIo)
+    defaultIo = (bootimgIo_p)NULL;
+
+  free((void *)io->ops);
+  free((void *)io->freelist);
+  free((void *)io->doneq);
+  free((void *)io);
+}
+
+/*
+ * Engine of the calling thread, created on first use. Threads other
+ * than the main one should release it before they exit.
+ */
+bootimgIo_p
+ioDefault(void)
+{
+  if (!defaultIo)
+    defaultIo = ioNew(BOOTIMG_IO_DEFAULT_DEPTH, defaultFlags);
+
+  return defaultIo;
+}
+
+/*
+ * Flags of the engines created by ioDefault from now on
+ */
+void
+ioSetDefaultFlags(int flags)
+{
+  defaultFlags = flags;
+}
+
+/*
+ * Free the engine of the calling thread, if any
+ */
+void
+ioReleaseDefault(void)
+{
+  ioFree(defaultIo);
+}
+
+const char *
+ioBackendName(bootimgIo_p io)
+{
+  return io->backend == BOOTIMG_IO_BACKEND_URING ? "io_uring" : "sync";
+}
+
+/*
+ * Register buffers for fixed buffer requests: their index in iovecs is
+ * then given to ioRead/ioWrite. Only one set at a time.
+ */
+int
+ioRegisterBuffers(bootimgIo_p io, const struct iovec *iovecs, unsigned n)
+{
+  if (io->registered)
+    return -1;
+
+#ifdef BOOTIMG_IO_HAVE_URING
+  if (io->backend == BOOTIMG_IO_BACKEND_URING)
+    {
+      if (syscall(__NR_io_uring_register, io->ringfd, IORING_REGISTER_BUFFERS, iovecs, n) < 0)
+        {
+          BOOTIMG_LOG(BOOTIMG_LOG_IO, BOOTIMG_LOG_DEBUG,
+                      "cannot register I/O buffers: %s", strerror(errno));
+          return -1;
+        }
+      io->registered = 1;
+    }
+#endif
+  (void)iovecs;
+  (void)n;
+
+  return 0;
+}
+
+int
+ioUnregisterBuffers(bootimgIo_p io)
+{
+  if (!io->registered)
+    return 0;
+
+  /* nothing may use them anymore */
+  if (io->pending && ioWaitAll(io) < 0)
+    return -1;
+
+#ifdef BOOTIMG_IO_HAVE_URING
+  if (syscall(__NR_io_uring_register, io->ringfd, IORING_UNREGISTER_BUFFERS, NULL, 0) < 0)
+    return -1;
+#endif
+  io->registered = 0;
+
+  return 0;
+}
+
+/*
+ * Queue a request, waiting for a free slot if needed
+ */
+static int
+ioQueue(bootimgIo_p io, int opcode, int fd, void *buf, size_t len, off64_t offset,
+        int bufIndex, bootimgIoCallback_t callback, void *arg)
+{
+  bootimgIoOp_p op;
+  unsigned idx;
+
+  while (!io->nfree)
+    if (ioWait(io, 1) < 0)
+      return -1;
+
+  idx = io->freelist[--io->nfree];
+  op = &io->ops[idx];
+  bzero((void *)op, sizeof(bootimgIoOp_t));
+  op->opcode = opcode;
+  op->fd = fd;
+  op->buf = (char *)buf;
+  op->len = len;
+  op->offset = offset;
+  op->bufIndex = bufIndex;
+  op->callback = callback;
+  op->arg = arg;
+  op->phase = statsPhase();
+  io->pending++;
+
+  /* readahead would bring in pages beyond the ones dropped afterwards */
+  if ((io->flags & BOOTIMG_IO_FLAG_NOCACHE) && opcode == BOOTIMG_IO_OP_READ)
+    {
+      posix_fadvise(fd, 0, 0, POSIX_FADV_RANDOM);
+      statsCount(op->phase, BOOTIMG_STATS_SYSCALLS, 1);
+    }
+
+#ifdef BOOTIMG_IO_HAVE_URING
+  if (io->backend == BOOTIMG_IO_BACKEND_URING)
+    {
+      if (len)
+        {
+          uringQueue(io, idx);
+          return 0;
+        }
+      /* nothing to transfer, completes at once */
+      io->doneq[(io->donehead + io->donecount) % io->depth] = idx;
+      io->donecount++;
+      return 0;
+    }
+#endif
+  syncRun(io, idx);
+
+  return 0;
+}
+
+/*
+ * Read len bytes at offset. bufIndex is the index of the registered
+ * buffer buf is part of, or -1.
+ */
+int
+ioRead(bootimgIo_p io, int fd, void *buf, size_t len, off64_t offset,
+       int bufIndex, bootimgIoCallback_t callback, void *arg)
+{
+  return ioQueue(io, BOOTIMG_IO_OP_READ, fd, buf, len, offset, bufIndex, callback, arg);
+}
+
+int
+ioWrite(bootimgIo_p io, int fd, const void *buf, size_t len, off64_t offset,
+        int bufIndex, bootimgIoCallback_t callback, void *arg)
+{
+  return ioQueue(io, BOOTIMG_IO_OP_WRITE, fd, (void *)buf, len, offset, bufIndex, callback, arg);
+}
+
+/*
+ * Submit queued requests and run the callbacks of at least min finished
+ * ones (fewer if less are pending). Returns the number of callbacks run
+ * or -1.
+ */
+int
+ioWait(bootimgIo_p io, unsigned min)
+{
+  int reaped = 0;
+
+  while (1)
+    {
+      /* completions not coming from the kernel */
+      while (io->donecount)
+        {
+          unsigned idx = io->doneq[io->donehead];
+
+          io->donehead = (io->donehead + 1) % io->depth;
+          io->donecount--;
+          ioComplete(io, idx);
+          reaped++;
+        }
+
+#ifdef BOOTIMG_IO_HAVE_URING
+      if (io->backend == BOOTIMG_IO_BACKEND_URING)
+        {
+          unsigned head = *io->cqhead;
+
+          while (head != __atomic_load_n(io->cqtail, __ATOMIC_ACQUIRE))
+            {
+              struct io_uring_cqe *cqe = &io->cqes[head & *io->cqmask];
+              unsigned idx = (unsigned)cqe->user_data;
+              ssize_t res = cqe->res;
+
+              /* callbacks may wait too: the entry is released first */
+              __atomic_store_n(io->cqhead, ++head, __ATOMIC_RELEASE);
+
+              if (res == -EINTR || res == -EAGAIN || !ioProgress(&io->ops[idx], res))
+                {
+                  uringQueue(io, idx);
+                  continue;
+                }
+              ioComplete(io, idx);
+              reaped++;
+              head = *io->cqhead;
+            }
+
+          if ((unsigned)reaped >= min || !io->pending)
+            {
+              if (io->tosubmit && uringEnter(io, 0) < 0)
+                return -1;
+              return reaped;
+            }
+          if (io->donecount)
+            continue;
+          if (uringEnter(io, 1) < 0)
+            return -1;
+          continue;
+        }
+#endif
+      return reaped;
+    }
+}
+
+/*
+ * Run until nothing is in flight anymore
+ */
+int
+ioWaitAll(bootimgIo_p io)
+{
+  while (io->pending)
+    if (ioWait(io, 1) < 0)
+      return -1;
+
+  return 0;
+}
+
+unsigned
+ioPending(bootimgIo_p io)
+{
+  return io->pending;
+}
+
+/**==========================================================================
+ ** Helpers
+ **==========================================================================
+ **/
+
+typedef struct _ioRangeBuf_st
+{
+  unsigned char       *data;
+  ssize_t              res;
+  int                  ready;
+  unsigned            *inflight;
+} ioRangeBuf_t, *ioRangeBuf_p;
+
+static void
+ioRangeDone(void *arg, ssize_t res)
+{
+  ioRangeBuf_p b = (ioRangeBuf_p)arg;
+
+  b->res = res;
+  b->ready = 1;
+  (*b->inflight)--;
+}
+
+/*
+ * Read span bytes from base by chunks, passing in order the ones in
+ * [skip, skip + len) to consume. *consumed counts the bytes passed.
+ */
+static int
+ioReadSpan(bootimgIo_p io, int fd, off64_t base, uint64_t skip, uint64_t span, uint64_t len,
+           bootimgIoConsumer_t consume, void *arg, uint64_t *consumed)
+{
+  ioRangeBuf_t bufs[BOOTIMG_IO_READAHEAD];
+  struct iovec iovecs[BOOTIMG_IO_READAHEAD];
+  unsigned char *area = (unsigned char *)NULL;
+  unsigned nbufs, inflight = 0, registered = 0;
+  uint64_t submitted = 0, pos = 0, seq = 0;
+  int ret = -1;
+
+  nbufs = (span + BOOTIMG_IO_CHUNK -1) / BOOTIMG_IO_CHUNK;
+  if (nbufs > BOOTIMG_IO_READAHEAD)
+    nbufs = BOOTIMG_IO_READAHEAD;
+  if (posix_memalign((void **)&area, BOOTIMG_IO_DIRECT_ALIGN, (size_t)nbufs * BOOTIMG_IO_CHUNK))
+    return -1;
+  statsCount(BOOTIMG_STATS_CURRENT, BOOTIMG_STATS_ALLOCS, 1);
+
+  bzero((void *)bufs, sizeof(bufs));
+  for (unsigned n = 0; n < nbufs; n++)
+    {
+      bufs[n].data = area + (size_t)n * BOOTIMG_IO_CHUNK;
+      bufs[n].inflight = &inflight;
+      iovecs[n].iov_base = bufs[n].data;
+      iovecs[n].iov_len = BOOTIMG_IO_CHUNK;
+    }
+  if (!io->registered && io->backend == BOOTIMG_IO_BACKEND_URING &&
+      ioRegisterBuffers(io, iovecs, nbufs) == 0)
+    registered = 1;
+
+  do
+    {
+      /* fill the pipeline */
+      for (unsigned n = 0; n < nbufs && submitted < span; n++)
+        {
+          size_t chunk = IO_CHUNK_LEN(span - submitted);
+
+          bufs[n].ready = 0;
+          inflight++;
+          if (ioRead(io, fd, bufs[n].data, chunk, base + submitted,
+                     registered ? (int)n : -1, ioRangeDone, &bufs[n]) < 0)
+            {
+              inflight--;
+              break;
+            }
+          submitted += chunk;
+        }
+
+      while (pos < span)
+        {
+          unsigned n = seq % nbufs;
+          size_t chunk = IO_CHUNK_LEN(span - pos);
+          /* the end of an aligned span may lie past the end of file */
+          size_t need = IO_MIN(pos + chunk, skip + len) - pos;
+          size_t from = pos < skip ? IO_MIN(skip - pos, need) : 0;
+
+          while (!bufs[n].ready && inflight)
+            if (ioWait(io, 1) < 0)
+              break;
+          if (!bufs[n].ready || bufs[n].res < (ssize_t)need)
+            break;
+          if (need > from && consume(arg, bufs[n].data + from, need - from) < 0)
+            break;
+          *consumed += need - from;
+          pos += chunk;
+          seq++;
+
+          if (submitted < span)
+            {
+              size_t next = IO_CHUNK_LEN(span - submitted);
+
+              bufs[n].ready = 0;
+              inflight++;
+              if (ioRead(io, fd, bufs[n].data, next, base + submitted,
+                         registered ? (int)n : -1, ioRangeDone, &bufs[n]) < 0)
+                {
+                  inflight--;
+                  break;
+                }
+              submitted += next;
+            }
+        }
+      if (pos >= span)
+        ret = 0;
+    }
+  while (0);
+
+  /* buffers are still owned by the reads in flight */
+  while (inflight)
+    if (ioWait(io, 1) < 0)
+      break;
+  if (registered)
+    ioUnregisterBuffers(io);
+  if (!inflight)
+    free((void *)area);
+
+  return ret;
+}
+
+/*
+ * Open fd again for O_DIRECT reads
+ */
+static int
+ioOpenDirect(int fd)
+{
+  char path[64];
+
+  snprintf(path, sizeof(path), "/proc/self/fd/%d", fd);
+  statsCount(BOOTIMG_STATS_CURRENT, BOOTIMG_STATS_SYSCALLS, 1);
+
+  return open(path, O_RDONLY | O_DIRECT);
+}
+
+/*
+ * Read len bytes at offset, passed in order and by chunks to consume
+ * while the next chunks are being read. consume returns < 0 to stop.
+ */
+int
+ioReadRange(bootimgIo_p io, int fd, off64_t offset, uint64_t len,
+            bootimgIoConsumer_t consume, void *arg)
+{
+  uint64_t consumed = 0;
+
+  if (!len)
+    return 0;
+
+  if (io->flags & BOOTIMG_IO_FLAG_NOCACHE)
+    {
+      int dfd = ioOpenDirect(fd);
+
+      if (dfd >= 0)
+        {
+          off64_t base = offset & ~((off64_t)BOOTIMG_IO_DIRECT_ALIGN -1);
+          uint64_t skip = offset - base;
+          uint64_t span = (skip + len + BOOTIMG_IO_DIRECT_ALIGN -1) & ~((uint64_t)BOOTIMG_IO_DIRECT_ALIGN -1);
+          int ret = ioReadSpan(io, dfd, base, skip, span, len, consume, arg, &consumed);
+
+          close(dfd);
+          statsCount(BOOTIMG_STATS_CURRENT, BOOTIMG_STATS_SYSCALLS, 1);
+          /* not supported here: start over through the page cache */
+          if (ret == 0 || consumed)
+            return ret;
+          BOOTIMG_LOG(BOOTIMG_LOG_IO, BOOTIMG_LOG_DEBUG,
+                      "O_DIRECT read failed, using buffered reads");
+        }
+    }
+
+  return ioReadSpan(io, fd, offset, 0, len, len, consume, arg, &consumed);
+}
+
+typedef struct _ioBatch_st
+{
+  unsigned             outstanding;
+  int                  error;
+} ioBatch_t, *ioBatch_p;
+
+typedef struct _ioChunk_st
+{
+  ioBatch_p            batch;
+  size_t               expected;
+} ioChunk_t, *ioChunk_p;
+
+static void
+ioChunkDone(void *arg, ssize_t res)
+{
+  ioChunk_p chunk = (ioChunk_p)arg;
+
+  if (res != (ssize_t)chunk->expected && !chunk->batch->error)
+    chunk->batch->error = res < 0 ? (int)-res : EIO;
+  chunk->batch->outstanding--;
+}
+
+/*
+ * Load n whole files at once: all their chunks are read concurrently.
+ * On success data[i] is a new buffer of size[i] bytes.
+ */
+int
+ioLoadFiles(bootimgIo_p io, unsigned n, const char **filenames, void **data, size_t *size)
+{
+  ioBatch_t batch = { 0, 0 };
+  ioChunk_p chunks = (ioChunk_p)NULL;
+  int *fds = (int *)calloc(n ? n : 1, sizeof(int));
+  size_t nchunks = 0, c = 0;
+  int ret = -1;
+
+  if (!fds)
+    return -1;
+  for (unsigned i = 0; i < n; i++)
+    {
+      fds[i] = -1;
+      data[i] = NULL;
+      size[i] = 0;
+    }
+
+  do
+    {
+      struct stat st;
+      unsigned i;
+
+      for (i = 0; i < n; i++)
+        {
+          statsCount(BOOTIMG_STATS_CURRENT, BOOTIMG_STATS_SYSCALLS, 2);
+          if ((fds[i] = open(filenames[i], O_RDONLY)) < 0 || fstat(fds[i], &st) < 0)
+            break;
+          size[i] = st.st_size;
+          statsCount(BOOTIMG_STATS_CURRENT, BOOTIMG_STATS_ALLOCS, 1);
+          if (!(data[i] = malloc(size[i] ? size[i] : 1)))
+            break;
+          nchunks += (size[i] + BOOTIMG_IO_CHUNK -1) / BOOTIMG_IO_CHUNK;
+        }
+      if (i < n)
+        break;
+
+      if (!(chunks = (ioChunk_p)calloc(nchunks ? nchunks : 1, sizeof(ioChunk_t))))
+        break;
+
+      for (i = 0; i < n && !batch.error; i++)
+        for (size_t off = 0; off < size[i]; off += BOOTIMG_IO_CHUNK, c++)
+          {
+            chunks[c].batch = &batch;
+            chunks[c].expected = IO_CHUNK_LEN(size[i] - off);
+            batch.outstanding++;
+            if (ioRead(io, fds[i], (char *)data[i] + off, chunks[c].expected, off,
+                       -1, ioChunkDone, &chunks[c]) < 0)
+              {
+                batch.outstanding--;
+                batch.error = EIO;
+                break;
+              }
+          }
+
+      while (batch.outstanding)
+        if (ioWait(io, 1) < 0)
+          break;
+      if (batch.outstanding || batch.error)
+        {
+          errno = batch.error;
+          break;
+        }
+
+      ret = 0;
+    }
+  while (0);
+
+  for (unsigned i = 0; i < n; i++)
+    {
+      if (fds[i] >= 0)
+        {
+          close(fds[i]);
+          statsCount(BOOTIMG_STATS_CURRENT, BOOTIMG_STATS_SYSCALLS, 1);
+        }
+      if (ret < 0)
+        {
+          free(data[i]);
+          data[i] = NULL;
+          size[i] = 0;
+        }
+    }
+  /* chunks are still referenced by reads in flight on failure */
+  if (!batch.outstanding)
+    free((void *)chunks);
+  free((void *)fds);
+
+  return ret;
+}
+
+/*
+ * Write n buffers one after another from offset, all at once
+ */
+int
+ioWriteVector(bootimgIo_p io, int fd, const struct iovec *iovecs, unsigned n, off64_t offset)
+{
+  ioBatch_t batch = { 0, 0 };
+  ioChunk_p chunks;
+  size_t nchunks = 0, c = 0;
+
+  for (unsigned i = 0; i < n; i++)
+    nchunks += (iovecs[i].iov_len + BOOTIMG_IO_CHUNK -1) / BOOTIMG_IO_CHUNK;
+  if (!(chunks = (ioChunk_p)calloc(nchunks ? nchunks : 1, sizeof(ioChunk_t))))
+    return -1;
+
+  for (unsigned i = 0; i < n && !batch.error; i++)
+    {
+      for (size_t off = 0; off < iovecs[i].iov_len; off += BOOTIMG_IO_CHUNK, c++)
+        {
+          chunks[c].batch = &batch;
+          chunks[c].expected = IO_CHUNK_LEN(iovecs[i].iov_len - off);
+          batch.outstanding++;
+          if (ioWrite(io, fd, (const char *)iovecs[i].iov_base + off, chunks[c].expected,
+                      offset + off, -1, ioChunkDone, &chunks[c]) < 0)
+            {
+              batch.outstanding--;
+              batch.error = EIO;
+              break;
+            }
+        }
+      offset += iovecs[i].iov_len;
+    }
+
+  while (batch.outstanding)
+    if (ioWait(io, 1) < 0)
+      return -1;
+  free((void *)chunks);
+  if (batch.error)
+    {
+      errno = batch.error;
+      return -1;
+    }
+
+  return 0;
+}
+
+/* Local Variables:                                                */
+/* mode: C                                                         */
+/* comment-column: 0                                               */
+/* End:                                                            */
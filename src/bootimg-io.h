@@ -0,0 +1,93 @@
+/* bootimg-tools/bootimg-io.h
+ *
+ * Copyright 2007, The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef __BOOTIMG_IO_H__
+#define __BOOTIMG_IO_H__
+
+#include "config.h"
+
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+/*
+ * Positioned reads & writes kept in flight on an I/O engine. Requests
+ * are queued with ioRead/ioWrite and complete in any order: the
+ * callback of each one is run from ioWait with the number of bytes
+ * transferred (short only at end of file) or a negative errno.
+ * Callbacks may queue new requests.
+ *
+ * Backends:
+ * - io_uring (Linux, unless configured with --disable-io-uring): one
+ *   io_uring_enter(2) submits all queued requests and reaps completions.
+ *   Buffers registered with ioRegisterBuffers are used with fixed
+ *   buffer operations when the request gives their index.
+ * - sync: pread(2)/pwrite(2) when queued, callbacks run from ioWait.
+ *   Used when io_uring is not available or BOOTIMG_IO=sync is set in
+ *   the environment.
+ *
+ * With BOOTIMG_IO_FLAG_NOCACHE, the pages of each finished request are
+ * dropped from the page cache (written ones being flushed first) and
+ * ioReadRange reads with O_DIRECT where the file system allows it, so
+ * that going through big images does not evict everything else.
+ *
+ * An engine must only be used by one thread; ioDefault returns one per
+ * thread, freed by ioReleaseDefault.
+ */
+
+#define BOOTIMG_IO_DEFAULT_DEPTH        64
+#define BOOTIMG_IO_CHUNK                (256*1024)
+#define BOOTIMG_IO_READAHEAD            8
+
+#define BOOTIMG_IO_FLAG_SYNC            1       /* force the blocking backend */
+#define BOOTIMG_IO_FLAG_NOCACHE         2       /* keep data out of the page cache */
+
+#define BOOTIMG_IO_BACKEND_SYNC         0
+#define BOOTIMG_IO_BACKEND_URING        1
+
+typedef struct _bootimgIo_st bootimgIo_t, *bootimgIo_p;
+
+typedef void (*bootimgIoCallback_t)(void *, ssize_t);
+typedef int  (*bootimgIoConsumer_t)(void *, const void *, size_t);
+
+bootimgIo_p  ioNew              (unsigned, int);
+void         ioFree             (bootimgIo_p);
+bootimgIo_p  ioDefault          (void);
+void         ioReleaseDefault   (void);
+void         ioSetDefaultFlags  (int);
+const char  *ioBackendName      (bootimgIo_p);
+int          ioRegisterBuffers  (bootimgIo_p, const struct iovec *, unsigned);
+int          ioUnregisterBuffers(bootimgIo_p);
+int          ioRead             (bootimgIo_p, int, void *, size_t, off64_t, int,
+                                 bootimgIoCallback_t, void *);
+int          ioWrite            (bootimgIo_p, int, const void *, size_t, off64_t, int,
+                                 bootimgIoCallback_t, void *);
+int          ioWait             (bootimgIo_p, unsigned);
+int          ioWaitAll          (bootimgIo_p);
+unsigned     ioPending          (bootimgIo_p);
+int          ioReadRange        (bootimgIo_p, int, off64_t, uint64_t,
+                                 bootimgIoConsumer_t, void *);
+int          ioLoadFiles        (bootimgIo_p, unsigned, const char **, void **, size_t *);
+int          ioWriteVector      (bootimgIo_p, int, const struct iovec *, unsigned, off64_t);
+
+#endif /* __BOOTIMG_IO_H__ */
+
+/* Local Variables:                                                */
+/* mode: C                                                         */
+/* comment-column: 0                                               */
+/* End:                                                            */
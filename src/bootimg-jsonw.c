@@ -0,0 +1,449 @@
+/* bootimg-tools/bootimg-jsonw.c
+ *
+ * Copyright 2007, The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#ifdef STDC_HEADERS
+# include <stdlib.h>
+# include <stddef.h>
+#else
+# ifdef HAVE_STDLIB_H
+#  include <stdlib.h>
+# endif
+# ifdef HAVE_STDDEF_H
+#  include <stddef.h>
+# endif
+#endif
+#ifdef HAVE_STRING_H
+# include <string.h>
+#endif
+#ifdef HAVE_FCNTL_H
+# include <fcntl.h>
+#endif
+#ifdef HAVE_UNISTD_H
+# include <unistd.h>
+#endif
+#include <stdarg.h>
+#include <math.h>
+#include <errno.h>
+
+#include "bootimg-jsonw.h"
+#include "bootimg-stats.h"
+
+/* Container kinds kept on the nesting stack */
+#define JSON_WRITER_CTNR_OBJECT         0
+#define JSON_WRITER_CTNR_ARRAY          1
+
+struct _bootimgJsonWriter_st
+{
+  int fd;
+  int flags;
+  int error;
+  int depth;
+  struct
+  {
+    int kind;
+    int count;
+  } stack[JSON_WRITER_MAX_DEPTH];
+  size_t len;
+  char buf[JSON_WRITER_BUF_SIZE];
+};
+
+/*
+ * Write the whole buffer to the fd, restarting on short writes
+ */
+int
+jsonWriterFlush(bootimgJsonWriter_p w)
+{
+  size_t done = 0;
+
+  if (!w)
+    return -1;
+
+  while (done < w->len)
+    {
+      ssize_t wrsz = write(w->fd, w->buf + done, w->len - done);
+
+      statsCount(BOOTIMG_STATS_CURRENT, BOOTIMG_STATS_SYSCALLS, 1);
+      if (wrsz < 0)
+        {
+          if (errno == EINTR)
+            continue;
+          w->error = 1;
+          break;
+        }
+      done += wrsz;
+    }
+  statsCount(BOOTIMG_STATS_CURRENT, BOOTIMG_STATS_WRITE, done);
+  w->len = 0;
+
+  return w->error ? -1 : 0;
+}
+
+/*
+ * Append raw bytes to the output buffer
+ */
+static void
+jsonWriterPut(bootimgJsonWriter_p w, const char *data, size_t len)
+{
+  while (len && !w->error)
+    {
+      size_t chunk = sizeof(w->buf) - w->len;
+      if (chunk > len)
+        chunk = len;
+      memcpy(w->buf + w->len, data, chunk);
+      w->len += chunk;
+      data += chunk;
+      len -= chunk;
+      if (w->len == sizeof(w->buf))
+        (void)jsonWriterFlush(w);
+    }
+}
+
+static void
+jsonWriterPutChar(bootimgJsonWriter_p w, char c)
+{
+  if (w->len == sizeof(w->buf))
+    (void)jsonWriterFlush(w);
+  w->buf[w->len++] = c;
+}
+
+static void
+jsonWriterIndent(bootimgJsonWriter_p w, int depth)
+{
+  if (w->flags & JSON_WRITER_FLAG_COMPACT)
+    return;
+  while (depth-- > 0)
+    jsonWriterPutChar(w, '\t');
+}
+
+/*
+ * Write a quoted string with the escapes cJSON uses
+ */
+static void
+jsonWriterPutQuoted(bootimgJsonWriter_p w, const char *str)
+{
+  const unsigned char *ptr = (const unsigned char *)(str ? str : "");
+  const unsigned char *run = ptr;
+
+  jsonWriterPutChar(w, '"');
+  for (; *ptr; ptr++)
+    {
+      char esc[8];
+
+      if (*ptr >= 32 && *ptr != '"' && *ptr != '\\')
+        continue;
+
+      /* flush the run of plain characters then the escape */
+      jsonWriterPut(w, (const char *)run, ptr - run);
+      run = ptr + 1;
+      switch (*ptr)
+        {
+        case '"':  jsonWriterPut(w, "\\\"", 2); break;
+        case '\\': jsonWriterPut(w, "\\\\", 2); break;
+        case '\b': jsonWriterPut(w, "\\b", 2);  break;
+        case '\f': jsonWriterPut(w, "\\f", 2);  break;
+        case '\n': jsonWriterPut(w, "\\n", 2);  break;
+        case '\r': jsonWriterPut(w, "\\r", 2);  break;
+        case '\t': jsonWriterPut(w, "\\t", 2);  break;
+        default:
+          snprintf(esc, sizeof(esc), "\\u%04x", *ptr);
+          jsonWriterPut(w, esc, 6);
+          break;
+        }
+    }
+  jsonWriterPut(w, (const char *)run, ptr - run);
+  jsonWriterPutChar(w, '"');
+}
+
+/*
+ * Emit separator, indentation & key before a new member.
+ * Keys are ignored for array elements and for the root value.
+ */
+static int
+jsonWriterBeginMember(bootimgJsonWriter_p w, const char *key)
+{
+  int compact = w->flags & JSON_WRITER_FLAG_COMPACT;
+
+  if (w->error)
+    return -1;
+
+  if (w->depth == 0)
+    return 0;
+
+  if (w->stack[w->depth-1].kind == JSON_WRITER_CTNR_ARRAY)
+    {
+      if (w->stack[w->depth-1].count++)
+        jsonWriterPut(w, compact ? "," : ", ", compact ? 1 : 2);
+      return 0;
+    }
+
+  if (w->stack[w->depth-1].count++)
+    jsonWriterPutChar(w, ',');
+  if (!compact)
+    jsonWriterPutChar(w, '\n');
+  jsonWriterIndent(w, w->depth);
+  jsonWriterPutQuoted(w, key);
+  jsonWriterPutChar(w, ':');
+  if (!compact)
+    jsonWriterPutChar(w, '\t');
+
+  return 0;
+}
+
+static int
+jsonWriterStartContainer(bootimgJsonWriter_p w, const char *key, int kind)
+{
+  if (!w || jsonWriterBeginMember(w, key))
+    return -1;
+  if (w->depth == JSON_WRITER_MAX_DEPTH)
+    {
+      w->error = 1;
+      return -1;
+    }
+  w->stack[w->depth].kind = kind;
+  w->stack[w->depth].count = 0;
+  w->depth++;
+  jsonWriterPutChar(w, kind == JSON_WRITER_CTNR_OBJECT ? '{' : '[');
+
+  return w->error ? -1 : 0;
+}
+
+static int
+jsonWriterEndContainer(bootimgJsonWriter_p w, int kind)
+{
+  if (!w || w->error)
+    return -1;
+  if (w->depth == 0 || w->stack[w->depth-1].kind != kind)
+    {
+      w->error = 1;
+      return -1;
+    }
+  w->depth--;
+  if (kind == JSON_WRITER_CTNR_OBJECT)
+    {
+      if (!(w->flags & JSON_WRITER_FLAG_COMPACT))
+        jsonWriterPutChar(w, '\n');
+      jsonWriterIndent(w, w->depth);
+      jsonWriterPutChar(w, '}');
+    }
+  else
+    jsonWriterPutChar(w, ']');
+  if (!w->depth && (w->flags & JSON_WRITER_FLAG_LINES))
+    jsonWriterPutChar(w, '\n');
+
+  return w->error ? -1 : 0;
+}
+
+/*
+ * Create a writer on an already opened file descriptor
+ */
+bootimgJsonWriter_p
+jsonWriterNew(int fd, int flags)
+{
+  bootimgJsonWriter_p w = (bootimgJsonWriter_p)malloc(sizeof(bootimgJsonWriter_t));
+
+  statsCount(BOOTIMG_STATS_CURRENT, BOOTIMG_STATS_ALLOCS, 1);
+  if (w)
+    {
+      w->fd = fd;
+      w->flags = flags;
+      w->error = 0;
+      w->depth = 0;
+      w->len = 0;
+    }
+
+  return w;
+}
+
+/*
+ * Create a writer on a new file. The fd is closed with the writer.
+ */
+bootimgJsonWriter_p
+jsonWriterNewFilename(const char *filename, int flags)
+{
+  bootimgJsonWriter_p w = (bootimgJsonWriter_p)NULL;
+  int fd = open(filename, O_CREAT | O_TRUNC | O_WRONLY, 0644);
+
+  statsCount(BOOTIMG_STATS_CURRENT, BOOTIMG_STATS_SYSCALLS, 1);
+  if (fd < 0)
+    return w;
+  if (!(w = jsonWriterNew(fd, flags | JSON_WRITER_FLAG_CLOSEFD)))
+    close(fd);
+
+  return w;
+}
+
+int
+jsonWriterStartObject(bootimgJsonWriter_p w, const char *key)
+{
+  return jsonWriterStartContainer(w, key, JSON_WRITER_CTNR_OBJECT);
+}
+
+int
+jsonWriterEndObject(bootimgJsonWriter_p w)
+{
+  return jsonWriterEndContainer(w, JSON_WRITER_CTNR_OBJECT);
+}
+
+int
+jsonWriterStartArray(bootimgJsonWriter_p w, const char *key)
+{
+  return jsonWriterStartContainer(w, key, JSON_WRITER_CTNR_ARRAY);
+}
+
+int
+jsonWriterEndArray(bootimgJsonWriter_p w)
+{
+  return jsonWriterEndContainer(w, JSON_WRITER_CTNR_ARRAY);
+}
+
+int
+jsonWriterWriteString(bootimgJsonWriter_p w, const char *key, const char *value)
+{
+  if (!w || jsonWriterBeginMember(w, key))
+    return -1;
+  jsonWriterPutQuoted(w, value);
+
+  return w->error ? -1 : 0;
+}
+
+int
+jsonWriterWriteFormatString(bootimgJsonWriter_p w, const char *key, const char *fmt, ...)
+{
+  char tmp[1024], *str = tmp;
+  va_list ap;
+  int len, rc;
+
+  va_start(ap, fmt);
+  len = vsnprintf(tmp, sizeof(tmp), fmt, ap);
+  va_end(ap);
+  if (len < 0)
+    return -1;
+
+  /* long values (e.g. cmdline) do not fit the stack buffer */
+  if ((size_t)len >= sizeof(tmp))
+    {
+      if (!(str = (char *)malloc(len +1)))
+        return -1;
+      va_start(ap, fmt);
+      vsnprintf(str, len +1, fmt, ap);
+      va_end(ap);
+    }
+
+  rc = jsonWriterWriteString(w, key, str);
+  if (str != tmp)
+    free((void *)str);
+
+  return rc;
+}
+
+int
+jsonWriterWriteNumber(bootimgJsonWriter_p w, const char *key, long long value)
+{
+  char tmp[24];
+  int len;
+
+  if (!w || jsonWriterBeginMember(w, key))
+    return -1;
+  len = snprintf(tmp, sizeof(tmp), "%lld", value);
+  jsonWriterPut(w, tmp, len);
+
+  return w->error ? -1 : 0;
+}
+
+/*
+ * Doubles as cJSON prints them: 15 significant digits unless 17 are
+ * needed to read the same value back, null when not finite
+ */
+int
+jsonWriterWriteDouble(bootimgJsonWriter_p w, const char *key, double value)
+{
+  char tmp[32];
+  double check = 0;
+  int len;
+
+  if (!w || jsonWriterBeginMember(w, key))
+    return -1;
+  if (isnan(value) || isinf(value))
+    {
+      jsonWriterPut(w, "null", 4);
+      return w->error ? -1 : 0;
+    }
+  len = snprintf(tmp, sizeof(tmp), "%1.15g", value);
+  if (sscanf(tmp, "%lg", &check) != 1 || check != value)
+    len = snprintf(tmp, sizeof(tmp), "%1.17g", value);
+  jsonWriterPut(w, tmp, len);
+
+  return w->error ? -1 : 0;
+}
+
+int
+jsonWriterWriteBool(bootimgJsonWriter_p w, const char *key, int value)
+{
+  if (!w || jsonWriterBeginMember(w, key))
+    return -1;
+  if (value)
+    jsonWriterPut(w, "true", 4);
+  else
+    jsonWriterPut(w, "false", 5);
+
+  return w->error ? -1 : 0;
+}
+
+int
+jsonWriterWriteNull(bootimgJsonWriter_p w, const char *key)
+{
+  if (!w || jsonWriterBeginMember(w, key))
+    return -1;
+  jsonWriterPut(w, "null", 4);
+
+  return w->error ? -1 : 0;
+}
+
+/*
+ * Flush pending output and release the writer.
+ * Returns -1 if any error occured during the writer life.
+ */
+int
+jsonWriterFree(bootimgJsonWriter_p w)
+{
+  int rc;
+
+  if (!w)
+    return -1;
+
+  /* unbalanced document is an error too */
+  if (w->depth != 0)
+    w->error = 1;
+  rc = jsonWriterFlush(w);
+  if (w->flags & JSON_WRITER_FLAG_CLOSEFD)
+    {
+      statsCount(BOOTIMG_STATS_CURRENT, BOOTIMG_STATS_SYSCALLS, 1);
+      if (close(w->fd) < 0)
+        rc = -1;
+    }
+  free((void *)w);
+
+  return rc;
+}
+
+/* Local Variables:                                                */
+/* mode: C                                                         */
+/* comment-column: 0                                               */
+/* End:                                                            */
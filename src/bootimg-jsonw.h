@@ -0,0 +1,65 @@
+/* bootimg-tools/bootimg-jsonw.h
+ *
+ * Copyright 2007, The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef __BOOTIMG_JSONW_H__
+#define __BOOTIMG_JSONW_H__
+
+/*
+ * Streaming JSON writer
+ *
+ * Emits members straight into a buffered file descriptor, in the same
+ * spirit as the libxml2 xmlTextWriter used for the XML metadata: no
+ * document tree is built and the full text never exists in memory.
+ * Default layout is the one of cJSON_Print() so that metadata files
+ * stay byte identical; the compact flag drops all whitespace. With
+ * the lines flag, root values are written one after the other, each
+ * ended by a newline (JSON lines).
+ */
+
+#define JSON_WRITER_FLAG_NONE           0x00
+#define JSON_WRITER_FLAG_COMPACT        0x01
+#define JSON_WRITER_FLAG_CLOSEFD        0x02
+#define JSON_WRITER_FLAG_LINES          0x04    /* a line per root value */
+
+#define JSON_WRITER_BUF_SIZE            16384
+#define JSON_WRITER_MAX_DEPTH           32
+
+typedef struct _bootimgJsonWriter_st bootimgJsonWriter_t;
+typedef struct _bootimgJsonWriter_st *bootimgJsonWriter_p;
+
+bootimgJsonWriter_p  jsonWriterNew               (int, int);
+bootimgJsonWriter_p  jsonWriterNewFilename       (const char *, int);
+int                  jsonWriterStartObject       (bootimgJsonWriter_p, const char *);
+int                  jsonWriterEndObject         (bootimgJsonWriter_p);
+int                  jsonWriterStartArray        (bootimgJsonWriter_p, const char *);
+int                  jsonWriterEndArray          (bootimgJsonWriter_p);
+int                  jsonWriterWriteString       (bootimgJsonWriter_p, const char *, const char *);
+int                  jsonWriterWriteFormatString (bootimgJsonWriter_p, const char *, const char *, ...)
+  __attribute__((format(printf, 3, 4)));
+int                  jsonWriterWriteNumber       (bootimgJsonWriter_p, const char *, long long);
+int                  jsonWriterWriteDouble       (bootimgJsonWriter_p, const char *, double);
+int                  jsonWriterWriteBool         (bootimgJsonWriter_p, const char *, int);
+int                  jsonWriterWriteNull         (bootimgJsonWriter_p, const char *);
+int                  jsonWriterFlush             (bootimgJsonWriter_p);
+int                  jsonWriterFree              (bootimgJsonWriter_p);
+
+#endif /* __BOOTIMG_JSONW_H__ */
+
+/* Local Variables:                                                */
+/* mode: C                                                         */
+/* comment-column: 0                                               */
+/* End:                                                            */
@@ -0,0 +1,467 @@
+/* bootimg-tools/bootimg-log.c
+ *
+ * Copyright 2007, The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#ifdef STDC_HEADERS
+# include <stdlib.h>
+# include <stddef.h>
+#else
+# ifdef HAVE_STDLIB_H
+#  include <stdlib.h>
+# endif
+# ifdef HAVE_STDDEF_H
+#  include <stddef.h>
+# endif
+#endif
+#ifdef HAVE_STRING_H
+# include <string.h>
+#endif
+#ifdef HAVE_STRINGS_H
+# include <strings.h>
+#endif
+#ifdef HAVE_UNISTD_H
+# include <unistd.h>
+#endif
+#include <stdarg.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/syscall.h>
+
+#include "bootimg-log.h"
+
+/* Records queued for the async writer */
+#define BOOTIMG_LOG_QUEUE_SIZE          (64*1024)
+
+/* External decls */
+extern char *progname;
+
+int logLevels[BOOTIMG_LOG_SUBSYS_COUNT] = { -1, -1, -1, -1, -1, -1 };
+
+static int logFormat = BOOTIMG_LOG_FORMAT_TEXT;
+static unsigned logRate = 0;
+
+static const char *subsysNames[BOOTIMG_LOG_SUBSYS_COUNT] = {
+  "main", "image", "meta", "io", "verity", "ramdisk"
+};
+
+static const char *levelNames[] = {
+  "error", "info", "verbose", "debug", "trace"
+};
+
+/* message & record being built by the thread */
+static __thread char logMessage[BOOTIMG_LOG_LINE_MAX];
+static __thread char logRecord[BOOTIMG_LOG_LINE_MAX];
+
+/* rate=<n>: records let through this second, and dropped */
+typedef struct _logRateState_st
+{
+  time_t second;
+  unsigned count;
+  unsigned dropped;
+} logRateState_t, *logRateState_p;
+
+static logRateState_t rates[BOOTIMG_LOG_SUBSYS_COUNT];
+static pthread_mutex_t rate_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* async sink: a ring of records written by a thread of this process */
+static char queue[BOOTIMG_LOG_QUEUE_SIZE];
+static size_t queueHead = 0;
+static size_t queueLen = 0;
+static int queueWriting = 0;
+static unsigned long queueDropped = 0;
+static pid_t queuePid = 0;
+static pthread_mutex_t queue_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t queue_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t queue_idle = PTHREAD_COND_INITIALIZER;
+
+static void
+logWriteFd(const char *buf, size_t len)
+{
+  while (len)
+    {
+      ssize_t wrsz = write(STDERR_FILENO, buf, len);
+
+      if (wrsz < 0 && errno == EINTR)
+        continue;
+      if (wrsz <= 0)
+        return;
+      buf += wrsz;
+      len -= wrsz;
+    }
+}
+
+/*
+ * Async writer thread: writes the queue by contiguous chunks
+ */
+static void *
+logWriter(void *arg)
+{
+  static char chunk[BOOTIMG_LOG_QUEUE_SIZE];
+
+  (void)arg;
+  while (1)
+    {
+      size_t len;
+
+      pthread_mutex_lock(&queue_lock);
+      while (!queueLen)
+        pthread_cond_wait(&queue_cond, &queue_lock);
+      len = queueLen < BOOTIMG_LOG_QUEUE_SIZE - queueHead ? queueLen : BOOTIMG_LOG_QUEUE_SIZE - queueHead;
+      memcpy((void *)chunk, (const void *)(queue + queueHead), len);
+      queueHead = (queueHead + len) % BOOTIMG_LOG_QUEUE_SIZE;
+      queueLen -= len;
+      queueWriting = 1;
+      pthread_mutex_unlock(&queue_lock);
+
+      logWriteFd(chunk, len);
+
+      pthread_mutex_lock(&queue_lock);
+      queueWriting = 0;
+      if (!queueLen)
+        pthread_cond_broadcast(&queue_idle);
+      pthread_mutex_unlock(&queue_lock);
+    }
+
+  return NULL;
+}
+
+/*
+ * Copy a record in the queue, or drop it if there is no room left
+ */
+static int
+logEnqueue(const char *buf, size_t len)
+{
+  int rc = -1;
+
+  pthread_mutex_lock(&queue_lock);
+  if (len <= BOOTIMG_LOG_QUEUE_SIZE - queueLen)
+    {
+      size_t tail = (queueHead + queueLen) % BOOTIMG_LOG_QUEUE_SIZE;
+      size_t first = len < BOOTIMG_LOG_QUEUE_SIZE - tail ? len : BOOTIMG_LOG_QUEUE_SIZE - tail;
+
+      memcpy((void *)(queue + tail), (const void *)buf, first);
+      memcpy((void *)queue, (const void *)(buf + first), len - first);
+      queueLen += len;
+      pthread_cond_signal(&queue_cond);
+      rc = 0;
+    }
+  else
+    queueDropped++;
+  pthread_mutex_unlock(&queue_lock);
+
+  return rc;
+}
+
+/*
+ * Append str to a record as a JSON string
+ */
+static size_t
+logQuote(char *out, size_t pos, size_t size, const char *str)
+{
+  /* room for the worst escape and the closing quote */
+  const size_t reserve = 8;
+
+  out[pos++] = '"';
+  for (; *str && pos + reserve < size; str++)
+    {
+      unsigned char c = (unsigned char)*str;
+
+      if (c == '"' || c == '\\')
+        {
+          out[pos++] = '\\';
+          out[pos++] = c;
+        }
+      else if (c == '\n')
+        pos += sprintf(out + pos, "\\n");
+      else if (c == '\t')
+        pos += sprintf(out + pos, "\\t");
+      else if (c < 0x20)
+        pos += sprintf(out + pos, "\\u%04x", c);
+      else
+        out[pos++] = c;
+    }
+  out[pos++] = '"';
+
+  return pos;
+}
+
+/*
+ * Build the record of a message in logRecord. Returns its length.
+ */
+static size_t
+logFormatRecord(int subsys, int level, const char *msg)
+{
+  size_t pos;
+
+  if (level > BOOTIMG_LOG_TRACE)
+    level = BOOTIMG_LOG_TRACE;
+  if (logFormat == BOOTIMG_LOG_FORMAT_JSON)
+    {
+      struct timespec ts;
+
+      clock_gettime(CLOCK_REALTIME, &ts);
+      pos = snprintf(logRecord, BOOTIMG_LOG_LINE_MAX,
+                     "{\"time\":%lld.%06ld,\"pid\":%d,\"tid\":%ld,\"level\":\"%s\",\"subsys\":\"%s\",\"msg\":",
+                     (long long)ts.tv_sec, ts.tv_nsec / 1000, (int)getpid(), (long)syscall(SYS_gettid),
+                     levelNames[level], subsysNames[subsys]);
+      pos = logQuote(logRecord, pos, BOOTIMG_LOG_LINE_MAX - 2, msg);
+      logRecord[pos++] = '}';
+    }
+  else
+    {
+      pos = snprintf(logRecord, BOOTIMG_LOG_LINE_MAX -1, "%s: %s", progname, msg);
+      if (pos > BOOTIMG_LOG_LINE_MAX -2)
+        pos = BOOTIMG_LOG_LINE_MAX -2;
+      /* one record, one line */
+      for (size_t n = 0; n < pos; n++)
+        if (logRecord[n] == '\n')
+          logRecord[n] = ' ';
+    }
+  logRecord[pos++] = '\n';
+
+  return pos;
+}
+
+static void
+logOutput(int subsys, int level, const char *msg)
+{
+  size_t len = logFormatRecord(subsys, level, msg);
+
+  if (queuePid && queuePid == getpid())
+    {
+      unsigned long dropped;
+
+      pthread_mutex_lock(&queue_lock);
+      dropped = queueDropped;
+      queueDropped = 0;
+      pthread_mutex_unlock(&queue_lock);
+      if (dropped)
+        {
+          char note[64];
+
+          snprintf(note, sizeof(note), "%lu log records dropped (queue full)", dropped);
+          /* the record is in logRecord: queue the note first */
+          memcpy((void *)logMessage, (const void *)logRecord, len);
+          logEnqueue(logRecord, logFormatRecord(BOOTIMG_LOG_MAIN, BOOTIMG_LOG_ERROR, note));
+          memcpy((void *)logRecord, (const void *)logMessage, len);
+        }
+      logEnqueue(logRecord, len);
+    }
+  else
+    /* a single write: records never mix */
+    logWriteFd(logRecord, len);
+}
+
+/*
+ * rate=<n>: returns 0 if the record is dropped; *dropped is set to the
+ * count of records dropped during the previous second.
+ */
+static int
+logRateCheck(int subsys, unsigned *dropped)
+{
+  logRateState_p rate = &rates[subsys];
+  struct timespec ts;
+  int pass = 1;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  *dropped = 0;
+
+  pthread_mutex_lock(&rate_lock);
+  if (rate->second != ts.tv_sec)
+    {
+      *dropped = rate->dropped;
+      rate->second = ts.tv_sec;
+      rate->count = 0;
+      rate->dropped = 0;
+    }
+  if (rate->count >= logRate)
+    {
+      rate->dropped++;
+      pass = 0;
+    }
+  else
+    rate->count++;
+  pthread_mutex_unlock(&rate_lock);
+
+  return pass;
+}
+
+/*
+ * Format & output a record. Use BOOTIMG_LOG, which checks the level
+ * first.
+ */
+void
+logWrite(int subsys, int level, const char *fmt, ...)
+{
+  va_list ap;
+  int len;
+
+  if (logRate && level > BOOTIMG_LOG_ERROR)
+    {
+      unsigned dropped;
+
+      if (!logRateCheck(subsys, &dropped))
+        return;
+      if (dropped)
+        {
+          snprintf(logMessage, BOOTIMG_LOG_LINE_MAX, "%u %s records suppressed (rate=%u)",
+                   dropped, subsysNames[subsys], logRate);
+          logOutput(subsys, BOOTIMG_LOG_ERROR, logMessage);
+        }
+    }
+
+  va_start(ap, fmt);
+  len = vsnprintf(logMessage, BOOTIMG_LOG_LINE_MAX, fmt, ap);
+  va_end(ap);
+  if (len < 0)
+    return;
+  if (len >= BOOTIMG_LOG_LINE_MAX)
+    {
+      len = BOOTIMG_LOG_LINE_MAX -1;
+      memcpy((void *)(logMessage + len - 3), (const void *)"...", 3);
+    }
+  /* the record ends the line */
+  while (len && logMessage[len -1] == '\n')
+    logMessage[--len] = '\0';
+
+  logOutput(subsys, level, logMessage);
+}
+
+/*
+ * Wait for the queued records to be written
+ */
+void
+logFlush(void)
+{
+  unsigned long dropped;
+
+  if (!queuePid || queuePid != getpid())
+    return;
+
+  pthread_mutex_lock(&queue_lock);
+  while (queueLen || queueWriting)
+    pthread_cond_wait(&queue_idle, &queue_lock);
+  dropped = queueDropped;
+  queueDropped = 0;
+  pthread_mutex_unlock(&queue_lock);
+
+  if (dropped)
+    {
+      snprintf(logMessage, BOOTIMG_LOG_LINE_MAX, "%lu log records dropped (queue full)", dropped);
+      logWriteFd(logRecord, logFormatRecord(BOOTIMG_LOG_MAIN, BOOTIMG_LOG_ERROR, logMessage));
+    }
+}
+
+static int
+logStartWriter(void)
+{
+  pthread_attr_t attr;
+  pthread_t thread;
+  int rc;
+
+  if (queuePid)
+    return 0;
+
+  pthread_attr_init(&attr);
+  pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+  rc = pthread_create(&thread, &attr, logWriter, NULL);
+  pthread_attr_destroy(&attr);
+  if (rc)
+    return -1;
+
+  /* a forked child writes its records itself */
+  queuePid = getpid();
+  atexit(logFlush);
+
+  return 0;
+}
+
+/*
+ * Read the BOOTIMG_LOG settings. Returns -1 if some are invalid, the
+ * others being applied anyway.
+ */
+int
+logInit(void)
+{
+  const char *env = getenv("BOOTIMG_LOG");
+  char *settings, *setting, *saveptr = (char *)NULL;
+  int rc = 0, async = 0;
+
+  if (!env || !*env)
+    return 0;
+  if (!(settings = strdup(env)))
+    return -1;
+
+  for (setting = strtok_r(settings, ",", &saveptr);
+       setting;
+       setting = strtok_r((char *)NULL, ",", &saveptr))
+    {
+      char *eq = index(setting, '=');
+      char *end = (char *)NULL;
+      long val = eq ? strtol(eq +1, &end, 10) : 0;
+      int valid = !eq || (end != eq +1 && !*end && val >= 0);
+      int ns;
+
+      if (eq)
+        *eq = '\0';
+
+      if (!eq && !strcmp(setting, "text"))
+        logFormat = BOOTIMG_LOG_FORMAT_TEXT;
+      else if (!eq && !strcmp(setting, "json"))
+        logFormat = BOOTIMG_LOG_FORMAT_JSON;
+      else if (!eq && !strcmp(setting, "async"))
+        async = 1;
+      else if (eq && valid && !strcmp(setting, "rate"))
+        logRate = val;
+      else if (eq && valid && !strcmp(setting, "all"))
+        for (ns = 0; ns < BOOTIMG_LOG_SUBSYS_COUNT; ns++)
+          logLevels[ns] = val;
+      else
+        {
+          for (ns = 0; eq && valid && ns < BOOTIMG_LOG_SUBSYS_COUNT; ns++)
+            if (!strcmp(setting, subsysNames[ns]))
+              {
+                logLevels[ns] = val;
+                break;
+              }
+          if (!eq || !valid || ns == BOOTIMG_LOG_SUBSYS_COUNT)
+            {
+              if (eq)
+                *eq = '=';
+              fprintf(stderr, "%s: warning: invalid BOOTIMG_LOG setting '%s'!\n", progname, setting);
+              rc = -1;
+            }
+        }
+    }
+  free((void *)settings);
+
+  if (async && logStartWriter() < 0)
+    {
+      fprintf(stderr, "%s: warning: cannot start the log writer, logging synchronously\n", progname);
+      rc = -1;
+    }
+
+  return rc;
+}
+
+/* Local Variables:                                                */
+/* mode: C                                                         */
+/* comment-column: 0                                               */
+/* End:                                                            */
@@ -0,0 +1,86 @@
+/* bootimg-tools/bootimg-log.h
+ *
+ * Copyright 2007, The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef __BOOTIMG_LOG_H__
+#define __BOOTIMG_LOG_H__
+
+/*
+ * Verbose messages. BOOTIMG_LOG checks the level of the subsystem
+ * before anything is evaluated or formatted; a record is then built
+ * in a buffer of the thread and written to stderr as a single line
+ * (text or JSON), with one write(2) so that records of concurrent
+ * threads or processes never mix.
+ *
+ * A subsystem follows the -v verbosity unless its level is set with
+ * the BOOTIMG_LOG environment variable, a comma separated list of:
+ * - <subsystem>=<level> or all=<level>: level of the subsystem(s)
+ * - text or json: record format
+ * - async: records are queued and written by a thread, never blocking
+ *   the caller; records are dropped (and counted) if the queue is full
+ * - rate=<n>: at most n records per second and subsystem, the count of
+ *   dropped ones being reported with the next record
+ * e.g. BOOTIMG_LOG=io=3,verity=0,json,async
+ */
+
+#define BOOTIMG_LOG_ERROR               0       /* always */
+#define BOOTIMG_LOG_INFO                1       /* -v */
+#define BOOTIMG_LOG_VERBOSE             2       /* -v -v */
+#define BOOTIMG_LOG_DEBUG               3
+#define BOOTIMG_LOG_TRACE               4       /* options tracing */
+
+#define BOOTIMG_LOG_MAIN                0       /* options & tools flow */
+#define BOOTIMG_LOG_IMAGE               1       /* header & components */
+#define BOOTIMG_LOG_META                2       /* metadata files */
+#define BOOTIMG_LOG_IO                  3       /* I/O engine */
+#define BOOTIMG_LOG_VERITY              4       /* signatures */
+#define BOOTIMG_LOG_RAMDISK             5       /* ramdisk files */
+#define BOOTIMG_LOG_SUBSYS_COUNT        6
+
+#define BOOTIMG_LOG_FORMAT_TEXT         0
+#define BOOTIMG_LOG_FORMAT_JSON         1
+
+/* Longest record, longer messages are truncated */
+#define BOOTIMG_LOG_LINE_MAX            4096
+
+#define BOOTIMG_LOG(subsys, level, ...)                                 \
+  do                                                                    \
+    {                                                                   \
+      if (logEnabled(subsys, level))                                    \
+        logWrite(subsys, level, __VA_ARGS__);                           \
+    }                                                                   \
+  while (0)
+
+extern int vflag;
+extern int logLevels[BOOTIMG_LOG_SUBSYS_COUNT];
+
+/* levels < 0 follow the verbosity */
+static inline int
+logEnabled(int subsys, int level)
+{
+  return level <= (logLevels[subsys] < 0 ? vflag : logLevels[subsys]);
+}
+
+int   logInit   (void);
+void  logWrite  (int, int, const char *, ...) __attribute__((format(printf, 3, 4)));
+void  logFlush  (void);
+
+#endif /* __BOOTIMG_LOG_H__ */
+
+/* Local Variables:                                                */
+/* mode: C                                                         */
+/* comment-column: 0                                               */
+/* End:                                                            */
@@ -0,0 +1,771 @@
+/* bootimg-tools/bootimg-meta.c
+ *
+ * Copyright 2007, The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#ifdef STDC_HEADERS
+# include <stdlib.h>
+# include <stddef.h>
+#else
+# ifdef HAVE_STDLIB_H
+#  include <stdlib.h>
+# endif
+# ifdef HAVE_STDDEF_H
+#  include <stddef.h>
+# endif
+#endif
+#ifdef HAVE_STRING_H
+# include <string.h>
+#endif
+#ifdef HAVE_STRINGS_H
+# include <strings.h>
+#endif
+#ifdef HAVE_FCNTL_H
+# include <fcntl.h>
+#endif
+#ifdef HAVE_SYS_TYPES_H
+# include <sys/types.h>
+#endif
+#ifdef HAVE_SYS_STAT_H
+# include <sys/stat.h>
+#endif
+#ifdef HAVE_UNISTD_H
+# include <unistd.h>
+#endif
+#include <endian.h>
+#include <errno.h>
+
+#ifdef USE_LIBXML2
+# include <libxml/xmlversion.h>
+# if defined(LIBXML_WRITER_ENABLED) && defined(LIBXML_OUTPUT_ENABLED)
+#  include <libxml/encoding.h>
+#  include <libxml/xmlwriter.h>
+# else
+#  error Cannot build with your libxml2 that does not have xmlWriter and having output disabled
+# endif /* defined(LIBXML_WRITER_ENABLED) && defined(LIBXML_OUTPUT_ENABLED) */
+#endif
+
+#ifdef USE_OPENSSL
+# ifndef OPENSSL_NO_SHA256
+#  include <openssl/sha.h>
+# else
+#  error No SHA256 available in this openssl ! It is mandatory ...
+# endif
+#endif
+
+#include "bootimg.h"
+#include "bootimg-priv.h"
+#include "bootimg-utils.h"
+#include "bootimg-jsonw.h"
+#include "bootimg-meta.h"
+#include "bootimg-stats.h"
+#include "bootimg-log.h"
+
+#define BOARD_OS_VERSION_COMMENT                                        \
+  "This is the version of the board Operating System. It is ususally "  \
+  "the Android version with major, minor, micro format. Values are computed " \
+  "as: major = (os_version >> 14) & 0x7f, minor = (os_version >> 7) & 0x7f, " \
+  "micro = os_version & 0x7f"
+
+#define BOARD_OS_PATCH_LEVEL_COMMENT                                    \
+  "This is the version of the board Operating System patch Level (Month & Year). " \
+  "Values are computed as: year = (os_patch_level >> 4) + 2000, month = " \
+  "os_patch_level & 0xf"
+
+#define DIGEST_BUF_SIZE_K               128
+
+/* External decls */
+extern int vflag;
+extern char *progname;
+
+/*
+ * Component image file name members, in component order
+ */
+static xmlChar **
+componentFilename(bootimgParsingContext_p ctxt, int component)
+{
+  switch (component)
+    {
+    case BOOTIMG_COMPONENT_KERNEL:  return &ctxt->kernelImageFile;
+    case BOOTIMG_COMPONENT_RAMDISK: return &ctxt->ramdiskImageFile;
+    case BOOTIMG_COMPONENT_SECOND:  return &ctxt->secondImageFile;
+    case BOOTIMG_COMPONENT_DTB:     return &ctxt->dtbImageFile;
+    }
+  return (xmlChar **)NULL;
+}
+
+/*
+ * Fill the parsing context from an image header: this is the exact
+ * inverse of setHeaderValuesFromParsingContext in bootimg-create.
+ */
+void
+setParsingContextFromHeader(bootimgParsingContext_p ctxt, boot_img_hdr *hdr, off_t kernelOffset)
+{
+  char cmdline[BOOT_ARGS_SIZE + BOOT_EXTRA_ARGS_SIZE +1];
+  size_t len;
+
+  memcpy((void *)&ctxt->hdr, (const void *)hdr, sizeof(boot_img_hdr));
+
+  ctxt->baseAddr      = hdr->kernel_addr - kernelOffset;
+  ctxt->pageSize      = hdr->page_size;
+  ctxt->kernelOffset  = hdr->kernel_addr - ctxt->baseAddr;
+  ctxt->ramdiskOffset = hdr->ramdisk_addr - ctxt->baseAddr;
+  ctxt->secondOffset  = hdr->second_addr - ctxt->baseAddr;
+  ctxt->tagsOffset    = hdr->tags_addr - ctxt->baseAddr;
+  ctxt->osVersion     = hdr->os_version >> 11;
+  ctxt->osPatchLvl    = hdr->os_version & BOOTIMG_OSPATCHLVL_MASK;
+
+  /* cmdline may fill its field without NUL: then extra args follow */
+  len = strnlen((const char *)hdr->cmdline, BOOT_ARGS_SIZE);
+  memcpy((void *)cmdline, (const void *)hdr->cmdline, len);
+  if (len == BOOT_ARGS_SIZE)
+    {
+      size_t extra_len = strnlen((const char *)hdr->extra_cmdline, BOOT_EXTRA_ARGS_SIZE);
+      memcpy((void *)&cmdline[len], (const void *)hdr->extra_cmdline, extra_len);
+      len += extra_len;
+    }
+  cmdline[len] = '\0';
+  ctxt->cmdLine = (xmlChar *)strdup(cmdline);
+  ctxt->boardName = (xmlChar *)strndup((const char *)hdr->name, BOOT_NAME_SIZE);
+}
+
+/*
+ * Release the strings held by a parsing context
+ */
+void
+releaseContextContent(bootimgParsingContext_p ctxt)
+{
+  /* release ctxt */
+  if (ctxt->boardName)
+    free((void *)ctxt->boardName);
+  ctxt->boardName = NULL;
+  if (ctxt->bootImageFile)
+    free((void *)ctxt->bootImageFile);
+  ctxt->bootImageFile = NULL;
+  if (ctxt->cmdLine)
+    free((void *)ctxt->cmdLine);
+  ctxt->cmdLine = NULL;
+  if (ctxt->dtbImageFile)
+    free((void *)ctxt->dtbImageFile);
+  ctxt->dtbImageFile = NULL;
+  if (ctxt->ramdiskGzip)
+    free((void *)ctxt->ramdiskGzip);
+  ctxt->ramdiskGzip = NULL;
+  if (ctxt->ramdiskTuning)
+    free((void *)ctxt->ramdiskTuning);
+  ctxt->ramdiskTuning = NULL;
+  if (ctxt->kernelImageFile)
+    free((void *)ctxt->kernelImageFile);
+  ctxt->kernelImageFile = NULL;
+  if (ctxt->ramdiskImageFile)
+    free((void *)ctxt->ramdiskImageFile);
+  ctxt->ramdiskImageFile = NULL;
+  if (ctxt->secondImageFile)
+    free((void *)ctxt->secondImageFile);
+  ctxt->secondImageFile = NULL;
+  bzero((void *)ctxt, sizeof(bootimgParsingContext_t));
+}
+
+/*
+ * Compute components sizes, offsets & digests from the component
+ * files (metadata read from xml/json does not carry them)
+ */
+int
+computeComponentsFromFiles(bootimgParsingContext_p ctxt)
+{
+  int rc = 0;
+  boot_img_hdr hdr;
+  unsigned char *buffer = (unsigned char *)malloc(DIGEST_BUF_SIZE_K*1024);
+  uint64_t start;
+
+  if (!buffer)
+    return -1;
+  start = statsBegin(BOOTIMG_STATS_HASH);
+  statsCount(BOOTIMG_STATS_CURRENT, BOOTIMG_STATS_ALLOCS, 1);
+
+  bzero((void *)&hdr, sizeof(boot_img_hdr));
+  hdr.page_size = ctxt->pageSize;
+
+  for (int nc = 0; nc < BOOTIMG_COMPONENT_COUNT; nc++)
+    {
+      const char *filename = (const char *)*componentFilename(ctxt, nc);
+      bootimgComponent_p comp = &ctxt->component[nc];
+      SHA256_CTX sha;
+      ssize_t rdsz;
+      int fd;
+
+      bzero((void *)comp, sizeof(bootimgComponent_t));
+      if (!filename)
+        continue;
+
+      statsCount(BOOTIMG_STATS_CURRENT, BOOTIMG_STATS_SYSCALLS, 1);
+      if ((fd = open(filename, O_RDONLY)) < 0)
+        {
+          fprintf(stderr, "%s: error: cannot open component file '%s'!\n", progname, filename);
+          rc = -1;
+          continue;
+        }
+      SHA256_Init(&sha);
+      while ((rdsz = read(fd, buffer, DIGEST_BUF_SIZE_K*1024)) > 0)
+        {
+          SHA256_Update(&sha, buffer, rdsz);
+          comp->size += rdsz;
+          statsCount(BOOTIMG_STATS_CURRENT, BOOTIMG_STATS_SYSCALLS, 1);
+        }
+      close(fd);
+      /* the last read and close */
+      statsCount(BOOTIMG_STATS_CURRENT, BOOTIMG_STATS_SYSCALLS, 2);
+      statsCount(BOOTIMG_STATS_CURRENT, BOOTIMG_STATS_READ, comp->size);
+      if (rdsz < 0)
+        {
+          fprintf(stderr, "%s: error: cannot read component file '%s'!\n", progname, filename);
+          rc = -1;
+          continue;
+        }
+      SHA256_Final(comp->digest, &sha);
+      comp->digestFlag = 1;
+
+      switch (nc)
+        {
+        case BOOTIMG_COMPONENT_KERNEL:  hdr.kernel_size = comp->size;  break;
+        case BOOTIMG_COMPONENT_RAMDISK: hdr.ramdisk_size = comp->size; break;
+        case BOOTIMG_COMPONENT_SECOND:  hdr.second_size = comp->size;  break;
+        case BOOTIMG_COMPONENT_DTB:     hdr.dt_size = comp->size;      break;
+        }
+    }
+
+  /* offsets once all sizes are known */
+  for (int nc = 0; nc < BOOTIMG_COMPONENT_COUNT; nc++)
+    if (ctxt->component[nc].size)
+      ctxt->component[nc].offset = computeComponentOffset(&hdr, nc);
+
+  statsEnd(BOOTIMG_STATS_HASH, start);
+  free((void *)buffer);
+  return rc;
+}
+
+#ifdef USE_LIBXML2
+/*
+ * Write the XML metadata file
+ */
+int
+writeXmlMetadata(bootimgParsingContext_p ctxt, const char *filename)
+{
+  int rc = -1;
+  xmlTextWriterPtr xmlWriter;
+  xmlDocPtr xmlDoc;
+  uint32_t major = (ctxt->osVersion >> 14)&0x7f;
+  uint32_t minor = (ctxt->osVersion >> 7)&0x7f;
+  uint32_t micro = ctxt->osVersion&0x7f;
+  uint32_t year = (ctxt->osPatchLvl >> 4) + 2000;
+  uint32_t month = ctxt->osPatchLvl&0xf;
+
+  xmlWriter = xmlNewTextWriterDoc(&xmlDoc, 0);
+  if (xmlWriter == NULL)
+    {
+      fprintf(stderr, "%s: error: cannot create the xml writer !\n", progname);
+      return rc;
+    }
+
+  do
+    {
+      if (xmlTextWriterSetIndent(xmlWriter, 4) < 0)
+        fprintf(stderr, "%s: error: cannot set indentation level !\n", progname);
+      if (xmlTextWriterStartDocument(xmlWriter, NULL, BOOTIMG_ENCODING, NULL) < 0)
+        {
+          fprintf(stderr, "%s: error: cannot start the xml document !\n", progname);
+          break;
+        }
+      if (xmlTextWriterStartElement(xmlWriter, BOOTIMG_XMLELT_BOOTIMAGE_NAME) < 0)
+        {
+          fprintf(stderr, "%s: error: cannot start the bootImage root element !\n", progname);
+          break;
+        }
+      if (ctxt->bootImageFile)
+        xmlTextWriterWriteAttribute(xmlWriter, BOOTIMG_XMLELT_BOOTIMAGEFILE_NAME, ctxt->bootImageFile);
+
+      /* cmdLine */
+      if (xmlTextWriterWriteFormatElement(xmlWriter,
+                                          BOOTIMG_XMLELT_CMDLINE_NAME,
+                                          "%s", ctxt->cmdLine ? (char *)ctxt->cmdLine : "") < 0)
+        fprintf(stderr, "%s: error: cannot create xml element for cmdLine\n", progname);
+
+      /* boardName */
+      if (xmlTextWriterWriteFormatElement(xmlWriter,
+                                          BOOTIMG_XMLELT_BOARDNAME_NAME,
+                                          "%s", ctxt->boardName ? (char *)ctxt->boardName : "") < 0)
+        fprintf(stderr, "%s: error: cannot create xml element for boardName\n", progname);
+
+      /* baseAddr */
+      if (xmlTextWriterWriteFormatElement(xmlWriter,
+                                          BOOTIMG_XMLELT_BASEADDR_NAME,
+                                          "0x%08lx", ctxt->baseAddr) < 0)
+        fprintf(stderr, "%s: error: cannot create xml element for baseAddr\n", progname);
+
+      /* pageSize */
+      if (xmlTextWriterWriteFormatElement(xmlWriter,
+                                          BOOTIMG_XMLELT_PAGESIZE_NAME,
+                                          "%lu", ctxt->pageSize) < 0)
+        fprintf(stderr, "%s: error: cannot create xml element for pageSize\n", progname);
+
+      /* kernelOffset */
+      if (xmlTextWriterWriteFormatElement(xmlWriter,
+                                          BOOTIMG_XMLELT_KERNELOFFSET_NAME,
+                                          "0x%08lx", ctxt->kernelOffset) < 0)
+        fprintf(stderr, "%s: error: cannot create xml element for kernelOffset\n", progname);
+
+      /* ramdiskOffset */
+      if (xmlTextWriterWriteFormatElement(xmlWriter,
+                                          BOOTIMG_XMLELT_RAMDISKOFFSET_NAME,
+                                          "0x%08lx", ctxt->ramdiskOffset) < 0)
+        fprintf(stderr, "%s: error: cannot create xml element for ramdiskOffset\n", progname);
+
+      /* secondOffset: kept without second loader, the header has it */
+      if (xmlTextWriterWriteFormatElement(xmlWriter,
+                                          BOOTIMG_XMLELT_SECONDOFFSET_NAME,
+                                          "0x%08lx", ctxt->secondOffset) < 0)
+        fprintf(stderr, "%s: error: cannot create xml element for secondOffset\n", progname);
+
+      /* tagsOffset */
+      if (xmlTextWriterWriteFormatElement(xmlWriter,
+                                          BOOTIMG_XMLELT_TAGSOFFSET_NAME,
+                                          "0x%08lx", ctxt->tagsOffset) < 0)
+        fprintf(stderr, "%s: error: cannot create xml element for tagsOffset\n", progname);
+
+      /* Add boardOsVersion element */
+      if (xmlTextWriterStartElement(xmlWriter, BOOTIMG_XMLELT_BOARDOSVERSION_NAME) < 0 ||
+          xmlTextWriterWriteFormatElement(xmlWriter, BOOTIMG_XMLELT_VALUE_NAME, "0x%x", ctxt->osVersion) < 0 ||
+          xmlTextWriterWriteFormatElement(xmlWriter, BOOTIMG_XMLELT_MAJOR_NAME, "%d", major) < 0 ||
+          xmlTextWriterWriteFormatElement(xmlWriter, BOOTIMG_XMLELT_MINOR_NAME, "%d", minor) < 0 ||
+          xmlTextWriterWriteFormatElement(xmlWriter, BOOTIMG_XMLELT_MICRO_NAME, "%d", micro) < 0 ||
+          xmlTextWriterWriteFormatElement(xmlWriter, BOOTIMG_XMLELT_VALUESTR_NAME, "%d.%d.%d", major, minor, micro) < 0 ||
+          xmlTextWriterWriteFormatElement(xmlWriter, BOOTIMG_XMLELT_COMMENT_NAME, "%s", BOARD_OS_VERSION_COMMENT) < 0 ||
+          xmlTextWriterEndElement(xmlWriter) < 0)
+        {
+          fprintf(stderr, "%s: error: cannot create xml element for boardOsVersion\n", progname);
+          break;
+        }
+
+      /* Add boardOsPatchLvl element */
+      if (xmlTextWriterStartElement(xmlWriter, BOOTIMG_XMLELT_BOARDOSPATCHLVL_NAME) < 0 ||
+          xmlTextWriterWriteFormatElement(xmlWriter, BOOTIMG_XMLELT_VALUE_NAME, "0x%x", ctxt->osPatchLvl) < 0 ||
+          xmlTextWriterWriteFormatElement(xmlWriter, BOOTIMG_XMLELT_YEAR_NAME, "%d", year) < 0 ||
+          xmlTextWriterWriteFormatElement(xmlWriter, BOOTIMG_XMLELT_MONTH_NAME, "%d", month) < 0 ||
+          xmlTextWriterWriteFormatElement(xmlWriter, BOOTIMG_XMLELT_VALUESTR_NAME, "%d-%02d", year, month) < 0 ||
+          xmlTextWriterWriteFormatElement(xmlWriter, BOOTIMG_XMLELT_COMMENT_NAME, "%s", BOARD_OS_PATCH_LEVEL_COMMENT) < 0 ||
+          xmlTextWriterEndElement(xmlWriter) < 0)
+        {
+          fprintf(stderr, "%s: error: cannot create xml element for boardOsPatchLvl\n", progname);
+          break;
+        }
+
+      /* Component image files */
+      if (ctxt->kernelImageFile)
+        xmlTextWriterWriteFormatElement(xmlWriter, BOOTIMG_XMLELT_KERNELIMAGEFILE_NAME, "%s", ctxt->kernelImageFile);
+      if (ctxt->ramdiskImageFile)
+        xmlTextWriterWriteFormatElement(xmlWriter, BOOTIMG_XMLELT_RAMDISKIMAGEFILE_NAME, "%s", ctxt->ramdiskImageFile);
+      if (ctxt->secondImageFile)
+        xmlTextWriterWriteFormatElement(xmlWriter, BOOTIMG_XMLELT_SECONDIMAGEFILE_NAME, "%s", ctxt->secondImageFile);
+      if (ctxt->dtbImageFile)
+        xmlTextWriterWriteFormatElement(xmlWriter, BOOTIMG_XMLELT_DTBIMAGEFILE_NAME, "%s", ctxt->dtbImageFile);
+      if (ctxt->ramdiskGzip)
+        xmlTextWriterWriteFormatElement(xmlWriter, BOOTIMG_XMLELT_RAMDISKGZIP_NAME, "%s", ctxt->ramdiskGzip);
+      if (ctxt->ramdiskTuning)
+        xmlTextWriterWriteFormatElement(xmlWriter, BOOTIMG_XMLELT_RAMDISKTUNING_NAME, "%s", ctxt->ramdiskTuning);
+
+      if (xmlTextWriterEndDocument(xmlWriter) < 0)
+        break;
+      rc = 0;
+    }
+  while (0);
+
+  (void)xmlTextWriterFlush(xmlWriter);
+  xmlFreeTextWriter(xmlWriter);
+  if (rc == 0 && xmlSaveFileEnc(filename, xmlDoc, BOOTIMG_ENCODING) < 0)
+    {
+      fprintf(stderr, "%s: error: cannot write xml file '%s' !\n", progname, filename);
+      rc = -1;
+    }
+  xmlFreeDoc(xmlDoc);
+
+  return rc;
+}
+#endif /* USE_LIBXML2 */
+
+/*
+ * Write the JSON metadata file
+ */
+int
+writeJsonMetadata(bootimgParsingContext_p ctxt, const char *filename, int flags)
+{
+  uint32_t major = (ctxt->osVersion >> 14)&0x7f;
+  uint32_t minor = (ctxt->osVersion >> 7)&0x7f;
+  uint32_t micro = ctxt->osVersion&0x7f;
+  uint32_t year = (ctxt->osPatchLvl >> 4) + 2000;
+  uint32_t month = ctxt->osPatchLvl&0xf;
+  bootimgJsonWriter_p jsonWriter;
+
+  jsonWriter = jsonWriterNewFilename(filename,
+                                     (flags & BOOTIMG_META_FLAG_COMPACT) ?
+                                     JSON_WRITER_FLAG_COMPACT : JSON_WRITER_FLAG_NONE);
+  if (!jsonWriter)
+    {
+      fprintf(stderr, "%s: error: cannot open json file '%s' for writing !\n", progname, filename);
+      return -1;
+    }
+
+  jsonWriterStartObject(jsonWriter, NULL);
+  if (ctxt->bootImageFile)
+    jsonWriterWriteString(jsonWriter, (const char *)BOOTIMG_XMLELT_BOOTIMAGEFILE_NAME, (const char *)ctxt->bootImageFile);
+  jsonWriterWriteString(jsonWriter, (const char *)BOOTIMG_XMLELT_CMDLINE_NAME, (const char *)ctxt->cmdLine);
+  jsonWriterWriteString(jsonWriter, (const char *)BOOTIMG_XMLELT_BOARDNAME_NAME, (const char *)ctxt->boardName);
+  jsonWriterWriteFormatString(jsonWriter, (const char *)BOOTIMG_XMLELT_BASEADDR_NAME, "0x%08lx", ctxt->baseAddr);
+  jsonWriterWriteFormatString(jsonWriter, (const char *)BOOTIMG_XMLELT_PAGESIZE_NAME, "%lu", ctxt->pageSize);
+  jsonWriterWriteFormatString(jsonWriter, (const char *)BOOTIMG_XMLELT_KERNELOFFSET_NAME, "0x%08lx", ctxt->kernelOffset);
+  jsonWriterWriteFormatString(jsonWriter, (const char *)BOOTIMG_XMLELT_RAMDISKOFFSET_NAME, "0x%08lx", ctxt->ramdiskOffset);
+  jsonWriterWriteFormatString(jsonWriter, (const char *)BOOTIMG_XMLELT_SECONDOFFSET_NAME, "0x%08lx", ctxt->secondOffset);
+  jsonWriterWriteFormatString(jsonWriter, (const char *)BOOTIMG_XMLELT_TAGSOFFSET_NAME, "0x%08lx", ctxt->tagsOffset);
+
+  jsonWriterStartObject(jsonWriter, (const char *)BOOTIMG_XMLELT_BOARDOSVERSION_NAME);
+  jsonWriterWriteNumber(jsonWriter, (const char *)BOOTIMG_XMLELT_VALUE_NAME, ctxt->osVersion);
+  jsonWriterWriteNumber(jsonWriter, (const char *)BOOTIMG_XMLELT_MAJOR_NAME, major);
+  jsonWriterWriteNumber(jsonWriter, (const char *)BOOTIMG_XMLELT_MINOR_NAME, minor);
+  jsonWriterWriteNumber(jsonWriter, (const char *)BOOTIMG_XMLELT_MICRO_NAME, micro);
+  jsonWriterWriteFormatString(jsonWriter, (const char *)BOOTIMG_XMLELT_VALUESTR_NAME, "%d.%d.%d", major, minor, micro);
+  jsonWriterWriteString(jsonWriter, (const char *)BOOTIMG_XMLELT_COMMENT_NAME, BOARD_OS_VERSION_COMMENT);
+  jsonWriterEndObject(jsonWriter);
+
+  jsonWriterStartObject(jsonWriter, (const char *)BOOTIMG_XMLELT_BOARDOSPATCHLVL_NAME);
+  jsonWriterWriteNumber(jsonWriter, (const char *)BOOTIMG_XMLELT_VALUE_NAME, ctxt->osPatchLvl);
+  jsonWriterWriteNumber(jsonWriter, (const char *)BOOTIMG_XMLELT_YEAR_NAME, year);
+  jsonWriterWriteNumber(jsonWriter, (const char *)BOOTIMG_XMLELT_MONTH_NAME, month);
+  jsonWriterWriteFormatString(jsonWriter, (const char *)BOOTIMG_XMLELT_VALUESTR_NAME, "%d-%02d", year, month);
+  jsonWriterWriteString(jsonWriter, (const char *)BOOTIMG_XMLELT_COMMENT_NAME, BOARD_OS_PATCH_LEVEL_COMMENT);
+  jsonWriterEndObject(jsonWriter);
+
+  if (ctxt->kernelImageFile)
+    jsonWriterWriteString(jsonWriter, (const char *)BOOTIMG_XMLELT_KERNELIMAGEFILE_NAME, (const char *)ctxt->kernelImageFile);
+  if (ctxt->ramdiskImageFile)
+    jsonWriterWriteString(jsonWriter, (const char *)BOOTIMG_XMLELT_RAMDISKIMAGEFILE_NAME, (const char *)ctxt->ramdiskImageFile);
+  if (ctxt->secondImageFile)
+    jsonWriterWriteString(jsonWriter, (const char *)BOOTIMG_XMLELT_SECONDIMAGEFILE_NAME, (const char *)ctxt->secondImageFile);
+  if (ctxt->dtbImageFile)
+    jsonWriterWriteString(jsonWriter, (const char *)BOOTIMG_XMLELT_DTBIMAGEFILE_NAME, (const char *)ctxt->dtbImageFile);
+  if (ctxt->ramdiskGzip)
+    jsonWriterWriteString(jsonWriter, (const char *)BOOTIMG_XMLELT_RAMDISKGZIP_NAME, (const char *)ctxt->ramdiskGzip);
+  if (ctxt->ramdiskTuning)
+    jsonWriterWriteString(jsonWriter, (const char *)BOOTIMG_XMLELT_RAMDISKTUNING_NAME, (const char *)ctxt->ramdiskTuning);
+  jsonWriterEndObject(jsonWriter);
+
+  if (jsonWriterFree(jsonWriter) < 0)
+    {
+      fprintf(stderr, "%s: error: cannot write json file '%s' !\n", progname, filename);
+      return -1;
+    }
+
+  return 0;
+}
+
+/*
+ * Append a string to the binary metadata string table
+ */
+static void
+appendBinaryString(struct bootimg_bmeta_str *ref, char *strtab, uint32_t *strtab_len, const xmlChar *str)
+{
+  size_t len = str ? strlen((const char *)str) : 0;
+
+  ref->offset = htole32(*strtab_len);
+  ref->length = htole32(len);
+  if (len)
+    memcpy((void *)&strtab[*strtab_len], (const void *)str, len);
+  strtab[*strtab_len + len] = '\0';
+  *strtab_len += len +1;
+}
+
+/*
+ * Write the binary metadata file in a single write
+ */
+int
+writeBinaryMetadata(bootimgParsingContext_p ctxt, const char *filename)
+{
+  int rc = -1;
+  struct bootimg_bmeta *bmeta;
+  char *strtab;
+  uint32_t strtab_len = 0;
+  size_t strtab_max = 1;
+  int fd;
+
+  /* worst case string table size */
+  strtab_max += ctxt->bootImageFile ? strlen((const char *)ctxt->bootImageFile) +1 : 1;
+  for (int nc = 0; nc < BOOTIMG_COMPONENT_COUNT; nc++)
+    strtab_max += *componentFilename(ctxt, nc) ? strlen((const char *)*componentFilename(ctxt, nc)) +1 : 1;
+  strtab_max += ctxt->ramdiskGzip ? strlen((const char *)ctxt->ramdiskGzip) +1 : 1;
+  strtab_max += ctxt->ramdiskTuning ? strlen((const char *)ctxt->ramdiskTuning) +1 : 1;
+
+  if (!(bmeta = (struct bootimg_bmeta *)calloc(1, sizeof(struct bootimg_bmeta) + strtab_max)))
+    {
+      fprintf(stderr, "%s: error: cannot allocate memory for binary metadata!\n", progname);
+      return rc;
+    }
+  statsCount(BOOTIMG_STATS_CURRENT, BOOTIMG_STATS_ALLOCS, 1);
+  strtab = (char *)(bmeta +1);
+
+  memcpy((void *)bmeta->magic, (const void *)BOOTIMG_BMETA_MAGIC, BOOTIMG_BMETA_MAGIC_SIZE);
+  bmeta->version        = htole32(BOOTIMG_BMETA_VERSION);
+  bmeta->base_addr      = htole64(ctxt->baseAddr);
+  bmeta->kernel_offset  = htole64(ctxt->kernelOffset);
+  bmeta->ramdisk_offset = htole64(ctxt->ramdiskOffset);
+  bmeta->second_offset  = htole64(ctxt->secondOffset);
+  bmeta->tags_offset    = htole64(ctxt->tagsOffset);
+  bmeta->page_size      = htole32(ctxt->pageSize);
+  bmeta->os_version     = htole32(ctxt->osVersion);
+  bmeta->os_patch_lvl   = htole32(ctxt->osPatchLvl);
+  memcpy((void *)&bmeta->hdr, (const void *)&ctxt->hdr, sizeof(boot_img_hdr));
+
+  /* context strings win over the raw header (not filled when parsed from text) */
+  if (ctxt->boardName)
+    {
+      bzero((void *)bmeta->hdr.name, BOOT_NAME_SIZE);
+      memcpy((void *)bmeta->hdr.name, (const void *)ctxt->boardName,
+             BOOTIMG_MIN(strlen((const char *)ctxt->boardName), BOOT_NAME_SIZE));
+    }
+  if (ctxt->cmdLine)
+    {
+      size_t len = strlen((const char *)ctxt->cmdLine);
+
+      bzero((void *)bmeta->hdr.cmdline, BOOT_ARGS_SIZE);
+      bzero((void *)bmeta->hdr.extra_cmdline, BOOT_EXTRA_ARGS_SIZE);
+      memcpy((void *)bmeta->hdr.cmdline, (const void *)ctxt->cmdLine, BOOTIMG_MIN(len, BOOT_ARGS_SIZE));
+      if (len > BOOT_ARGS_SIZE)
+        memcpy((void *)bmeta->hdr.extra_cmdline, (const void *)&ctxt->cmdLine[BOOT_ARGS_SIZE],
+               BOOTIMG_MIN(len - BOOT_ARGS_SIZE, BOOT_EXTRA_ARGS_SIZE));
+    }
+
+  appendBinaryString(&bmeta->boot_image_file, strtab, &strtab_len, ctxt->bootImageFile);
+  for (int nc = 0; nc < BOOTIMG_COMPONENT_COUNT; nc++)
+    {
+      const xmlChar *path = *componentFilename(ctxt, nc);
+      bootimgComponent_p comp = &ctxt->component[nc];
+      struct bootimg_bmeta_comp *bcomp = &bmeta->comp[nc];
+
+      appendBinaryString(&bcomp->path, strtab, &strtab_len, path);
+      if (!path)
+        continue;
+      bcomp->flags = BOOTIMG_BMETA_COMP_PRESENT;
+      bcomp->offset = htole64(comp->offset);
+      bcomp->size = htole32(comp->size);
+      if (comp->digestFlag)
+        {
+          bcomp->flags |= BOOTIMG_BMETA_COMP_DIGEST;
+          memcpy((void *)bcomp->digest, (const void *)comp->digest, BOOTIMG_DIGEST_SIZE);
+        }
+      bcomp->flags = htole32(bcomp->flags);
+    }
+  appendBinaryString(&bmeta->ramdisk_gzip, strtab, &strtab_len, ctxt->ramdiskGzip);
+  appendBinaryString(&bmeta->ramdisk_tuning, strtab, &strtab_len, ctxt->ramdiskTuning);
+
+  bmeta->strtab_offset = htole32(sizeof(struct bootimg_bmeta));
+  bmeta->strtab_size = htole32(strtab_len);
+  bmeta->length = htole32(sizeof(struct bootimg_bmeta) + strtab_len);
+
+  do
+    {
+      size_t len = sizeof(struct bootimg_bmeta) + strtab_len;
+
+      statsCount(BOOTIMG_STATS_CURRENT, BOOTIMG_STATS_SYSCALLS, 1);
+      if ((fd = open(filename, O_CREAT | O_TRUNC | O_WRONLY, 0644)) < 0)
+        {
+          fprintf(stderr, "%s: error: cannot open binary metadata file '%s' for writing !\n", progname, filename);
+          break;
+        }
+      if (write(fd, (const void *)bmeta, len) != (ssize_t)len)
+        fprintf(stderr, "%s: error: cannot write binary metadata file '%s' !\n", progname, filename);
+      else
+        rc = 0;
+      close(fd);
+      statsCount(BOOTIMG_STATS_CURRENT, BOOTIMG_STATS_SYSCALLS, 2);
+      statsCount(BOOTIMG_STATS_CURRENT, BOOTIMG_STATS_WRITE, rc ? 0 : len);
+    }
+  while (0);
+
+  free((void *)bmeta);
+  return rc;
+}
+
+/*
+ * Check a string reference against the string table
+ */
+static const char *
+checkBinaryString(const struct bootimg_bmeta_str *ref, const char *strtab, uint32_t strtab_size)
+{
+  uint32_t offset = le32toh(ref->offset);
+  uint32_t length = le32toh(ref->length);
+
+  if (offset >= strtab_size || length >= strtab_size - offset || strtab[offset + length] != '\0')
+    return (const char *)NULL;
+
+  return &strtab[offset];
+}
+
+/*
+ * Fill a parsing context from binary metadata: only bounds are checked.
+ * The fields of a later version are only read from files of that
+ * version.
+ */
+int
+readBinaryMetadata(const void *data, size_t len, bootimgParsingContext_p ctxt)
+{
+  const struct bootimg_bmeta *bmeta = (const struct bootimg_bmeta *)data;
+  const char *strtab, *str;
+  uint32_t strtab_offset, strtab_size, version;
+  size_t fixed;
+
+  if (len < BOOTIMG_BMETA_V1_SIZE ||
+      memcmp((const void *)bmeta->magic, (const void *)BOOTIMG_BMETA_MAGIC, BOOTIMG_BMETA_MAGIC_SIZE))
+    {
+      fprintf(stderr, "%s: error: not a binary metadata file!\n", progname);
+      return -1;
+    }
+  version = le32toh(bmeta->version);
+  if (version < 1 || version > BOOTIMG_BMETA_VERSION)
+    {
+      fprintf(stderr, "%s: error: unsupported binary metadata version %u!\n",
+              progname, version);
+      return -1;
+    }
+  fixed = version == 1 ? BOOTIMG_BMETA_V1_SIZE : sizeof(struct bootimg_bmeta);
+
+  strtab_offset = le32toh(bmeta->strtab_offset);
+  strtab_size = le32toh(bmeta->strtab_size);
+  if (len < fixed || le32toh(bmeta->length) != len ||
+      strtab_offset < fixed ||
+      strtab_offset > len || strtab_size > len - strtab_offset)
+    {
+      fprintf(stderr, "%s: error: truncated or corrupted binary metadata!\n", progname);
+      return -1;
+    }
+  strtab = (const char *)data + strtab_offset;
+
+  if (!(str = checkBinaryString(&bmeta->boot_image_file, strtab, strtab_size)))
+    {
+      fprintf(stderr, "%s: error: invalid bootImageFile reference in binary metadata!\n", progname);
+      return -1;
+    }
+  ctxt->bootImageFile = (xmlChar *)strdup(str);
+
+  for (int nc = 0; nc < BOOTIMG_COMPONENT_COUNT; nc++)
+    {
+      const struct bootimg_bmeta_comp *bcomp = &bmeta->comp[nc];
+      bootimgComponent_p comp = &ctxt->component[nc];
+      uint32_t flags = le32toh(bcomp->flags);
+
+      if (!(flags & BOOTIMG_BMETA_COMP_PRESENT))
+        continue;
+      if (!(str = checkBinaryString(&bcomp->path, strtab, strtab_size)))
+        {
+          fprintf(stderr, "%s: error: invalid component reference in binary metadata!\n", progname);
+          return -1;
+        }
+      *componentFilename(ctxt, nc) = (xmlChar *)strdup(str);
+      comp->offset = le64toh(bcomp->offset);
+      comp->size = le32toh(bcomp->size);
+      if ((comp->digestFlag = (flags & BOOTIMG_BMETA_COMP_DIGEST) != 0))
+        memcpy((void *)comp->digest, (const void *)bcomp->digest, BOOTIMG_DIGEST_SIZE);
+    }
+
+  if (version >= 2)
+    {
+      const char *gzip = checkBinaryString(&bmeta->ramdisk_gzip, strtab, strtab_size);
+      const char *tuning = checkBinaryString(&bmeta->ramdisk_tuning, strtab, strtab_size);
+
+      if (!gzip || !tuning)
+        {
+          fprintf(stderr, "%s: error: invalid ramdisk reference in binary metadata!\n", progname);
+          return -1;
+        }
+      if (*gzip)
+        ctxt->ramdiskGzip = (xmlChar *)strdup(gzip);
+      if (*tuning)
+        ctxt->ramdiskTuning = (xmlChar *)strdup(tuning);
+    }
+
+  ctxt->baseAddr      = le64toh(bmeta->base_addr);
+  ctxt->kernelOffset  = le64toh(bmeta->kernel_offset);
+  ctxt->ramdiskOffset = le64toh(bmeta->ramdisk_offset);
+  ctxt->secondOffset  = le64toh(bmeta->second_offset);
+  ctxt->tagsOffset    = le64toh(bmeta->tags_offset);
+  ctxt->pageSize      = le32toh(bmeta->page_size);
+  ctxt->osVersion     = le32toh(bmeta->os_version);
+  ctxt->osPatchLvl    = le32toh(bmeta->os_patch_lvl);
+
+  /* name & cmdline come from the raw header */
+  {
+    char cmdline[BOOT_ARGS_SIZE + BOOT_EXTRA_ARGS_SIZE +1];
+    size_t cmdlen = strnlen((const char *)bmeta->hdr.cmdline, BOOT_ARGS_SIZE);
+
+    memcpy((void *)cmdline, (const void *)bmeta->hdr.cmdline, cmdlen);
+    if (cmdlen == BOOT_ARGS_SIZE)
+      {
+        size_t extra_len = strnlen((const char *)bmeta->hdr.extra_cmdline, BOOT_EXTRA_ARGS_SIZE);
+        memcpy((void *)&cmdline[cmdlen], (const void *)bmeta->hdr.extra_cmdline, extra_len);
+        cmdlen += extra_len;
+      }
+    cmdline[cmdlen] = '\0';
+    ctxt->cmdLine = (xmlChar *)strdup(cmdline);
+    ctxt->boardName = (xmlChar *)strndup((const char *)bmeta->hdr.name, BOOT_NAME_SIZE);
+  }
+
+  BOOTIMG_LOG(BOOTIMG_LOG_META, BOOTIMG_LOG_VERBOSE, "binary metadata read (%lu bytes)", len);
+
+  return 0;
+}
+
+/*
+ * Write metadata in the requested format
+ */
+int
+writeMetadata(bootimgParsingContext_p ctxt, int format, const char *filename, int flags)
+{
+  uint64_t start = statsBegin(BOOTIMG_STATS_METADATA);
+  int rc = -1;
+
+  switch (format)
+    {
+#ifdef USE_LIBXML2
+    case BOOTIMG_META_FORMAT_XML:
+      rc = writeXmlMetadata(ctxt, filename);
+      break;
+#endif
+    case BOOTIMG_META_FORMAT_JSON:
+      rc = writeJsonMetadata(ctxt, filename, flags);
+      break;
+    case BOOTIMG_META_FORMAT_BINARY:
+      rc = writeBinaryMetadata(ctxt, filename);
+      break;
+    default:
+      fprintf(stderr, "%s: error: unknown metadata format %d!\n", progname, format);
+    }
+  statsEnd(BOOTIMG_STATS_METADATA, start);
+
+  return rc;
+}
+
+/* Local Variables:                                                */
+/* mode: C                                                         */
+/* comment-column: 0                                               */
+/* End:                                                            */
@@ -0,0 +1,125 @@
+/* bootimg-tools/bootimg-meta.h
+ *
+ * Copyright 2007, The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef __BOOTIMG_META_H__
+#define __BOOTIMG_META_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "bootimg.h"
+#include "bootimg-priv.h"
+
+/**==========================================================================
+ ** Binary metadata format
+ **==========================================================================
+ **
+ *
+ * +------------------------+
+ * | struct bootimg_bmeta   | fixed size, little endian
+ * +------------------------+
+ * | string table           | strtab_size bytes of NUL terminated strings
+ * +------------------------+
+ *
+ * Strings are referenced by (offset, length) in the string table and
+ * are always NUL terminated so that they can be used in place. Reading
+ * only requires bounds checks: no text is tokenized nor converted.
+ * Any change of the fixed part layout must bump BOOTIMG_BMETA_VERSION.
+ * Version 2 adds the ramdisk gzip fingerprint & --optimize choice at
+ * the end of the fixed part; version 1 files, without them, are still
+ * read.
+ */
+
+#define BOOTIMG_BMETA_MAGIC             "BIMGMETA"
+#define BOOTIMG_BMETA_MAGIC_SIZE        8
+#define BOOTIMG_BMETA_VERSION           2
+
+/* Component flags */
+#define BOOTIMG_BMETA_COMP_PRESENT      0x01
+#define BOOTIMG_BMETA_COMP_DIGEST       0x02
+
+struct bootimg_bmeta_str
+{
+  uint32_t offset;                      /* in string table */
+  uint32_t length;                      /* without trailing NUL */
+} __attribute__((packed));
+
+struct bootimg_bmeta_comp
+{
+  uint64_t offset;                      /* offset in boot image */
+  uint32_t size;                        /* size in bytes */
+  uint32_t flags;                       /* BOOTIMG_BMETA_COMP_* */
+  struct bootimg_bmeta_str path;        /* component image file */
+  uint8_t digest[BOOTIMG_DIGEST_SIZE];  /* SHA256 of the component */
+} __attribute__((packed));
+
+struct bootimg_bmeta
+{
+  uint8_t magic[BOOTIMG_BMETA_MAGIC_SIZE];
+  uint32_t version;
+  uint32_t length;                      /* whole file length */
+  uint32_t strtab_offset;
+  uint32_t strtab_size;
+
+  uint64_t base_addr;
+  uint64_t kernel_offset;
+  uint64_t ramdisk_offset;
+  uint64_t second_offset;
+  uint64_t tags_offset;
+  uint32_t page_size;
+  uint32_t os_version;                  /* A << 14 | B << 7 | C */
+  uint32_t os_patch_lvl;                /* (Y - 2000) << 4 | M */
+  uint32_t reserved;
+
+  struct bootimg_bmeta_str boot_image_file;
+  struct bootimg_bmeta_comp comp[BOOTIMG_COMPONENT_COUNT];
+
+  /* raw header (name, cmdline & id) as found in the image */
+  boot_img_hdr hdr;
+
+  /* version 2 */
+  struct bootimg_bmeta_str ramdisk_gzip;   /* empty if none */
+  struct bootimg_bmeta_str ramdisk_tuning; /* empty if none */
+} __attribute__((packed));
+
+/* Fixed part of a version 1 file */
+#define BOOTIMG_BMETA_V1_SIZE           offsetof(struct bootimg_bmeta, ramdisk_gzip)
+
+/* Metadata formats */
+#define BOOTIMG_META_FORMAT_XML         0
+#define BOOTIMG_META_FORMAT_JSON        1
+#define BOOTIMG_META_FORMAT_BINARY      2
+
+/* Flags for metadata writers */
+#define BOOTIMG_META_FLAG_NONE          0x00
+#define BOOTIMG_META_FLAG_COMPACT       0x01
+
+void setParsingContextFromHeader  (bootimgParsingContext_p, boot_img_hdr *, off_t);
+void releaseContextContent        (bootimgParsingContext_p);
+int  computeComponentsFromFiles   (bootimgParsingContext_p);
+int  writeXmlMetadata             (bootimgParsingContext_p, const char *);
+int  writeJsonMetadata            (bootimgParsingContext_p, const char *, int);
+int  writeBinaryMetadata          (bootimgParsingContext_p, const char *);
+int  readBinaryMetadata           (const void *, size_t, bootimgParsingContext_p);
+int  writeMetadata                (bootimgParsingContext_p, int, const char *, int);
+
+#endif /* __BOOTIMG_META_H__ */
+
+/* Local Variables:                                                */
+/* mode: C                                                         */
+/* comment-column: 0                                               */
+/* End:                                                            */
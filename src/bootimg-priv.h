@@ -52,6 +52,17 @@
 #define BOOTIMG_RAMDISK_FILENAME 4
 #define BOOTIMG_SECOND_LOADER_FILENAME 5
 #define BOOTIMG_DTB_FILENAME 6
+#define BOOTIMG_BMETA_FILENAME 7
+
+/* Boot image components, in image order */
+#define BOOTIMG_COMPONENT_KERNEL        0
+#define BOOTIMG_COMPONENT_RAMDISK       1
+#define BOOTIMG_COMPONENT_SECOND        2
+#define BOOTIMG_COMPONENT_DTB           3
+#define BOOTIMG_COMPONENT_COUNT         4
+
+/* SHA256 digest size for components */
+#define BOOTIMG_DIGEST_SIZE             32
 
 /* XML local name for #text nodes */
 #define BOOTIMG_XMLTYPE_TEXT_NAME            	BAD_CAST"#text"
@@ -81,6 +92,8 @@
 #define BOOTIMG_XMLELT_RAMDISKIMAGEFILE_NAME 	BAD_CAST"ramdiskImageFile"
 #define BOOTIMG_XMLELT_SECONDIMAGEFILE_NAME  	BAD_CAST"secondImageFile"
 #define BOOTIMG_XMLELT_DTBIMAGEFILE_NAME     	BAD_CAST"dtbImageFile"
+#define BOOTIMG_XMLELT_RAMDISKGZIP_NAME      	BAD_CAST"ramdiskGzip"
+#define BOOTIMG_XMLELT_RAMDISKTUNING_NAME    	BAD_CAST"ramdiskTuning"
 
 #define ELEMENT_FLAG_UNDEFINED 			0
 #define ELEMENT_FLAG_OPENED 			1
@@ -94,6 +107,13 @@
 
 #define MAX_COMMAND_LENGTH 1024
 
+/* Boot magic is searched in this many first bytes of a file */
+#define BOOT_MAGIC_SEEK_LIMIT 4096
+
+/* Page sizes accepted in a boot image header */
+#define BOOTIMG_MIN_PAGESIZE 2048
+#define BOOTIMG_MAX_PAGESIZE 65536
+
 #define FLAG4MEMBER(x, t)                       \
   int x##Flag;                                  \
   t x;
@@ -119,10 +139,7 @@
 #define ELEMENT_OPENED(x)               ctxt->x##Flag == ELEMENT_FLAG_OPENED
 
 #define IS_ELEMENT(x)                                                   \
-  !memcmp((void *)localName,                                            \
-          (const void *)BOOTIMG_XMLELT_##x##_NAME,                      \
-          (size_t)sizeof(BOOTIMG_XMLELT_##x##_NAME)-1) &&               \
-  strlen(localName) == strlen(BOOTIMG_XMLELT_##x##_NAME)
+  !xmlStrcmp(localName, BOOTIMG_XMLELT_##x##_NAME)
 
 #define ProcessXmlText4String(x, l)                                     \
   xmlChar *x##Str = xmlTextReaderReadString(xmlReader);                 \
@@ -147,14 +164,14 @@
             progname,                                                   \
             (int)strlen(x##Str),                                        \
             (int)l);                                                    \
-  if (!(ctxt->x = (xmlChar *)malloc(BOOTIMG_MIN(l, strlen(x##Str)))))   \
+  if (!(ctxt->x = (xmlChar *)malloc(BOOTIMG_MIN(l, strlen(x##Str)) +1))) \
     fprintf(stderr,                                                     \
             "%s: error: cannot allocate memory for storing "#x"!\n",    \
             progname);                                                  \
   else                                                                  \
     {                                                                   \
       memcpy((void *)ctxt->x, x##Str, BOOTIMG_MIN(l, strlen(x##Str)));  \
-      ctxt->x[strlen(x##Str)] = 0;                                      \
+      ctxt->x[BOOTIMG_MIN(l, strlen(x##Str))] = 0;                      \
       if (vflag)                                                        \
         fprintf(stdout,                                                 \
                 "%s: "#x" = '%s'\n",                                    \
@@ -228,6 +245,17 @@
     }                                                                   \
   ctxt->x = (t)strtol(jsonItem->valuestring, NULL, 0);
     
+typedef struct _bootimgComponent_st bootimgComponent_t;
+typedef struct _bootimgComponent_st *bootimgComponent_p;
+
+struct _bootimgComponent_st
+{
+  uint64_t offset;                      /* offset in boot image */
+  uint32_t size;                        /* size in bytes */
+  int digestFlag;                       /* digest is valid */
+  uint8_t digest[BOOTIMG_DIGEST_SIZE];  /* SHA256 */
+};
+
 typedef struct _bootimgParsingContext_st bootimgParsingContext_t;
 typedef struct _bootimgParsingContext_st *bootimgParsingContext_p;
 
@@ -268,6 +296,13 @@ struct _bootimgParsingContext_st
   FLAG4MEMBER(ramdiskImageFile, xmlChar *);
   FLAG4MEMBER(secondImageFile, xmlChar *);
   FLAG4MEMBER(dtbImageFile, xmlChar *);
+  /* gzip fingerprint of the ramdisk, for -F round trips */
+  FLAG4MEMBER(ramdiskGzip, xmlChar *);
+  /* compression chosen by bootimg-create --optimize & its measurements */
+  FLAG4MEMBER(ramdiskTuning, xmlChar *);
+
+  /* Components location & digests (binary metadata) */
+  bootimgComponent_t component[BOOTIMG_COMPONENT_COUNT];
 };
 
 typedef struct _data_context_st data_context_t;
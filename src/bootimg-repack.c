@@ -0,0 +1,1001 @@
+/* bootimg-tools/bootimg-repack.c
+ *
+ * Copyright 2007, The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#ifdef STDC_HEADERS
+# include <stdlib.h>
+# include <stddef.h>
+#else
+# ifdef HAVE_STDLIB_H
+#  include <stdlib.h>
+# endif
+# ifdef HAVE_STDDEF_H
+#  include <stddef.h>
+# endif
+#endif
+#ifdef HAVE_STRING_H
+# include <string.h>
+#endif
+#ifdef HAVE_STRINGS_H
+# include <strings.h>
+#endif
+#ifdef HAVE_FCNTL_H
+# include <fcntl.h>
+#endif
+#ifdef HAVE_SYS_TYPES_H
+# include <sys/types.h>
+#endif
+#ifdef HAVE_SYS_STAT_H
+# include <sys/stat.h>
+#endif
+#ifdef HAVE_UNISTD_H
+# include <unistd.h>
+#endif
+#include <getopt.h>
+#ifdef HAVE_ALLOCA_H
+# include <alloca.h>
+#endif
+#ifdef HAVE_ASSERT_H
+# include <assert.h>
+#endif
+#include <errno.h>
+#include <sys/mman.h>
+
+#include "bootimg.h"
+#include "bootimg-priv.h"
+#include "bootimg-utils.h"
+#include "bootimg-cpio.h"
+#include "bootimg-gzip.h"
+#include "bootimg-log.h"
+
+#define REPACK_COPY_BUF_SIZE    (128*1024)
+#define REPACK_GZIP_LEVEL       9       /* as create's gzip -c9 */
+
+/*
+ * Options flags & values
+ * - v: verbose. vflag € N+*
+ * - k: kernel image replacement. kflag € [0, 1]
+ * - r: ramdisk image replacement. rflag € [0, 1]
+ * - s: second bootloader image replacement. sflag € [0, 1]
+ * - d: dtb image replacement. dflag € [0, 1]
+ * - c: new command line. cflag € [0, 1]
+ * - n: new board name. nflag € [0, 1]
+ * - o: output file instead of in place. oflag € [0, 1]
+ * - K: verity private key. Kflag € [0, 1]
+ * - C: verity certificate. Cflag € [0, 1]
+ * - a: ramdisk entries to add or replace. aflag € N
+ * - x: ramdisk entries to remove. xflag € N
+ */
+int vflag = 0;
+int kflag = 0;
+int rflag = 0;
+int sflag = 0;
+int dflag = 0;
+int cflag = 0;
+int nflag = 0;
+int oflag = 0;
+int Kflag = 0;
+int Cflag = 0;
+int aflag = 0;
+int xflag = 0;
+
+/* kval, rval, sval, dval: replacement image files */
+char *kval = (char *)NULL;
+char *rval = (char *)NULL;
+char *sval = (char *)NULL;
+char *dval = (char *)NULL;
+/* cval: command line */
+char *cval = (char *)NULL;
+/* nval: board name */
+char *nval = (char *)NULL;
+/* oval: output file */
+char *oval = (char *)NULL;
+/* Kval: verity private key (PEM) */
+char *Kval = (char *)NULL;
+/* Cval: verity certificate (PEM) */
+char *Cval = (char *)NULL;
+/* aval: <path>=<file> ramdisk entries, aflag of them */
+char **aval = (char **)NULL;
+/* xval: ramdisk entry paths, xflag of them */
+char **xval = (char **)NULL;
+
+/*
+ * progname & blankname are program name and space string with progname size
+ * for displaying messsages and help
+ */
+char *progname = (char *)NULL;
+char *blankname = (char *)NULL;
+
+static const char *progusage =
+  "usage: %s [options] imgfile\n"
+  "       %s --help\n";
+static const char *proghelp =
+  "\n"
+  "       basic user options:\n"
+  "       %s -h --help                     display this message.\n"
+  "       %s -v --verbose[=<lvl>]          be verbose at runtime. <lvl> is\n"
+  "       %s                               added to current verbosity level.\n"
+  "\n"
+  "       options for replacing components:\n"
+  "       %s -k --kernel=<file>            replace the kernel image.\n"
+  "       %s -r --ramdisk=<file>           replace the ramdisk image.\n"
+  "       %s -s --second=<file>            replace the second bootloader image.\n"
+  "       %s -d --dtb=<file>               replace the device tree blob image.\n"
+  "       %s -c --cmdline=<cmdline>        replace the kernel command line.\n"
+  "       %s -n --name=<name>              replace the board name.\n"
+  "\n"
+  "       options for editing the ramdisk (may be repeated):\n"
+  "       %s -a --ramdisk-add=<path>=<file> add or replace the ramdisk entry\n"
+  "       %s                               <path> with the content of <file>.\n"
+  "       %s                               Missing parent directories are\n"
+  "       %s                               added.\n"
+  "       %s -x --ramdisk-remove=<path>    remove the ramdisk entry <path>\n"
+  "       %s                               and, for a directory, its content.\n"
+  "       %s                               The cpio archive is edited in\n"
+  "       %s                               memory and gzip'ed again at the\n"
+  "       %s                               level it was found at.\n"
+  "\n"
+  "       options for controling the output:\n"
+  "       %s -o --output=<file>            write the new image in <file>\n"
+  "       %s                               instead of updating imgfile.\n"
+  "       %s -K --verity-key=<pem>         sign the new image with this\n"
+  "       %s                               private key. Without it, a\n"
+  "       %s                               signature block is dropped.\n"
+  "       %s -C --verity-cert=<pem>        certificate for the signature\n"
+  "       %s                               block. Defaults to the one of\n"
+  "       %s                               the previous block.\n"
+  "\n"
+  "       %s Components keeping their page aligned size are rewritten\n"
+  "       %s in place. Otherwise the image is rewritten in a temporary\n"
+  "       %s file, untouched components being copied with\n"
+  "       %s copy_file_range(2), then renamed over imgfile.\n";
+
+/*
+ * Long options
+ */
+struct option long_options[] = {
+  {"verbose",     optional_argument, 0,  'v' },
+  {"kernel",      required_argument, 0,  'k' },
+  {"ramdisk",     required_argument, 0,  'r' },
+  {"second",      required_argument, 0,  's' },
+  {"dtb",         required_argument, 0,  'd' },
+  {"cmdline",     required_argument, 0,  'c' },
+  {"name",        required_argument, 0,  'n' },
+  {"output",      required_argument, 0,  'o' },
+  {"verity-key",  required_argument, 0,  'K' },
+  {"verity-cert", required_argument, 0,  'C' },
+  {"ramdisk-add", required_argument, 0,  'a' },
+  {"ramdisk-remove", required_argument, 0, 'x' },
+  {"help",        no_argument,       0,  'h' },
+  {0,             0,                 0,   0  }
+};
+#define BOOTIMG_OPTSTRING "v::k:r:s:d:c:n:o:K:C:a:x:h"
+const char *unknown_option = "????";
+
+/*
+ * Getopt external defs
+ */
+extern char *optarg;
+extern int optind;
+
+static const char *component_names[BOOTIMG_COMPONENT_COUNT] = {
+  "kernel", "ramdisk", "second", "dtb"
+};
+
+static unsigned char padding[REPACK_COPY_BUF_SIZE] = { 0, };
+
+/*
+ * Forward decls
+ */
+void  printusage         (int);
+int   repackImage        (const char *);
+int   editRamdisk        (const uint8_t *, size_t, uint8_t **, size_t *);
+
+/*
+ * main
+ */
+int
+main(int argc, char **argv)
+{
+  int c;
+
+  progname = (rindex(argv[0], '/') ? rindex(argv[0], '/')+1 : argv[0]);
+  blankname = (char *)alloca(strlen(progname) +1);
+  memset((void *)blankname, (int)' ', (size_t)strlen(progname));
+  blankname[strlen(progname)] = 0;
+  logInit();
+
+  /*
+   * Process options
+   */
+  while (1)
+    {
+      int option_index = 0;
+      int *flag = (int *)NULL;
+      char **val = (char **)NULL;
+
+      c = getopt_long(argc, argv, BOOTIMG_OPTSTRING,
+                      long_options, &option_index);
+      if (c == -1)
+        break;
+
+      switch (c)
+        {
+        case 'v':
+          if (optarg)
+            vflag += strtol(optarg, NULL, 10);
+          else
+            vflag++;
+          if (vflag > 3)
+            fprintf(stderr, "%s: option %s/%c set to %d\n",
+                    progname, getLongOptionName(long_options, c), c, vflag);
+          break;
+
+        case 'k': flag = &kflag; val = &kval; break;
+        case 'r': flag = &rflag; val = &rval; break;
+        case 's': flag = &sflag; val = &sval; break;
+        case 'd': flag = &dflag; val = &dval; break;
+        case 'c': flag = &cflag; val = &cval; break;
+        case 'n': flag = &nflag; val = &nval; break;
+        case 'o': flag = &oflag; val = &oval; break;
+        case 'K': flag = &Kflag; val = &Kval; break;
+        case 'C': flag = &Cflag; val = &Cval; break;
+
+        case 'a':
+        case 'x':
+          {
+            int *count = (c == 'a' ? &aflag : &xflag);
+            char ***list = (c == 'a' ? &aval : &xval);
+
+            *list = (char **)realloc(*list, (*count +1) * sizeof(char *));
+            assert(*list);
+            (*list)[(*count)++] = optarg;
+            if (vflag > 3)
+              fprintf(stderr, "%s: option %s/%c (=%d) added value '%s'\n",
+                      progname, getLongOptionName(long_options, c), c, *count, optarg);
+          }
+          break;
+
+        case 'h':
+          printusage(1);
+          exit(1);
+
+        case '?':
+          printusage(0);
+          break;
+
+        default:
+          fprintf(stderr, "%s: getopt returned character code 0%o ??\n", progname, c);
+          printusage(0);
+        }
+
+      if (flag)
+        {
+          *flag = 1;
+          *val = optarg;
+          if (vflag > 3)
+            fprintf(stderr, "%s: option %s/%c (=%d) set with value '%s'\n",
+                    progname, getLongOptionName(long_options, c), c, *flag, *val);
+        }
+    }
+
+  if (argc - optind != 1)
+    {
+      fprintf(stderr, "%s: error: one image file is expected !\n", progname);
+      printusage(0);
+      exit(1);
+    }
+  if (!kflag && !rflag && !sflag && !dflag && !cflag && !nflag && !Kflag && !oflag &&
+      !aflag && !xflag)
+    {
+      fprintf(stderr, "%s: error: nothing to repack !\n", progname);
+      exit(1);
+    }
+
+  return(repackImage(argv[optind]) < 0 ? 1 : 0);
+}
+
+/*
+ * Print usage message
+ */
+void
+printusage(int withhelp)
+{
+  char line[256];
+  char *tok = (char *)NULL;
+  char twolines = 2;
+  char *str;
+
+  if (withhelp)
+    {
+      str = (char *)malloc(strlen(progusage) +strlen(proghelp) +1);
+      assert(str);
+      memcpy(str, progusage, strlen(progusage));
+      memcpy(str +strlen(progusage), proghelp, strlen(proghelp) +1);
+    }
+  else
+    {
+      str = (char *)malloc(strlen(progusage) +1);
+      assert(str);
+      memcpy(str, progusage, strlen(progusage) +1);
+    }
+
+  while ((tok = strtok((char *)str, "\n")) != (char *)NULL)
+    {
+      if (twolines)
+        {
+          sprintf(line, tok, progname);
+          twolines--;
+        }
+      else
+        sprintf(line, tok, blankname);
+
+      str = (char *)NULL;
+      fprintf(stdout, "%s\n", line);
+    }
+
+  free((void *)str);
+}
+
+/*
+ * pwrite(2) all or fail
+ */
+static int
+writeAt(int fd, const void *buf, size_t len, off64_t offset)
+{
+  while (len)
+    {
+      ssize_t wrsz = pwrite(fd, buf, len, offset);
+      if (wrsz < 0)
+        {
+          if (errno == EINTR)
+            continue;
+          return -1;
+        }
+      buf = (const uint8_t *)buf + wrsz;
+      offset += wrsz;
+      len -= wrsz;
+    }
+
+  return 0;
+}
+
+/*
+ * Write len zeros at offset
+ */
+static int
+writePaddingAt(int fd, size_t len, off64_t offset)
+{
+  while (len)
+    {
+      size_t sz = BOOTIMG_MIN(len, sizeof(padding));
+      if (writeAt(fd, padding, sz, offset) < 0)
+        return -1;
+      offset += sz;
+      len -= sz;
+    }
+
+  return 0;
+}
+
+/*
+ * Copy a file range, in kernel when possible. Past the end of the
+ * input, zeros are written.
+ */
+static int
+copyRange(int infd, off64_t inoff, int outfd, off64_t outoff, size_t len)
+{
+  unsigned char *buffer;
+
+#ifdef HAVE_COPY_FILE_RANGE
+  while (len)
+    {
+      ssize_t cpsz = copy_file_range(infd, &inoff, outfd, &outoff, len, 0);
+      if (cpsz < 0)
+        {
+          if (errno == EINTR)
+            continue;
+          /* not supported here: fall back to read/write */
+          if (errno == EXDEV || errno == ENOSYS || errno == EINVAL || errno == EOPNOTSUPP)
+            break;
+          return -1;
+        }
+      if (cpsz == 0)
+        return writePaddingAt(outfd, len, outoff);
+      len -= cpsz;
+    }
+  if (!len)
+    return 0;
+#endif
+
+  if (!(buffer = (unsigned char *)malloc(REPACK_COPY_BUF_SIZE)))
+    return -1;
+  while (len)
+    {
+      ssize_t rdsz = pread(infd, buffer, BOOTIMG_MIN(len, REPACK_COPY_BUF_SIZE), inoff);
+      if (rdsz < 0)
+        {
+          if (errno == EINTR)
+            continue;
+          break;
+        }
+      if (rdsz == 0)
+        {
+          if (writePaddingAt(outfd, len, outoff) < 0)
+            break;
+          len = 0;
+          break;
+        }
+      if (writeAt(outfd, buffer, rdsz, outoff) < 0)
+        break;
+      inoff += rdsz;
+      outoff += rdsz;
+      len -= rdsz;
+    }
+  free((void *)buffer);
+
+  return len ? -1 : 0;
+}
+
+/*
+ * Ramdisk entry path without leading '/' or "./" nor trailing '/'
+ */
+static const char *
+normalizePath(char *path)
+{
+  size_t len;
+
+  while (*path == '/' || (path[0] == '.' && path[1] == '/'))
+    path += (*path == '/' ? 1 : 2);
+  len = strlen(path);
+  while (len && path[len -1] == '/')
+    path[--len] = 0;
+
+  return path;
+}
+
+/*
+ * Entry name without the "./" prefix cpio -H newc gives from find .
+ */
+static const char *
+entryPath(const char *name)
+{
+  return (name[0] == '.' && name[1] == '/' ? name + 2 : name);
+}
+
+/*
+ * Index of the entry with path, or -1. Entries keep the archive order
+ * so that directories come before their content: linear search.
+ */
+static ssize_t
+findRamdiskEntry(bootimgCpioArchive_p archive, const char *path, size_t len)
+{
+  for (size_t ne = 0; ne < archive->count; ne++)
+    {
+      const char *name = entryPath(archive->entries[ne].name);
+
+      if (!strncmp(name, path, len) && name[len] == 0)
+        return (ssize_t)ne;
+    }
+
+  return -1;
+}
+
+/*
+ * Keep track of buffers referenced by entries until the archive is
+ * written
+ */
+static int
+keepBuffer(void ***buffers, size_t *count, void *buffer)
+{
+  void **newbuffers;
+
+  if (!buffer || !(newbuffers = (void **)realloc(*buffers, (*count +1) * sizeof(void *))))
+    {
+      free(buffer);
+      return -1;
+    }
+  *buffers = newbuffers;
+  (*buffers)[(*count)++] = buffer;
+
+  return 0;
+}
+
+/*
+ * Apply the -x & -a edits to a ramdisk, in memory. Untouched entries
+ * are written back as they were; the archive is compressed again with
+ * the header, level and tail of the original gzip member when these
+ * could be found.
+ */
+int
+editRamdisk(const uint8_t *ramdisk, size_t len, uint8_t **out, size_t *outlen)
+{
+  static const uint8_t gzip_header[] = { GZIP_MAGIC_0, GZIP_MAGIC_1, 8, 0, 0, 0, 0, 0, 2, 3 };
+  bootimgCpioArchive_t archive;
+  bootimgGzipMember_t member;
+  uint8_t *cpio = (uint8_t *)NULL;
+  size_t cpio_len = 0, nbuffers = 0;
+  void **buffers = (void **)NULL;
+  const char *prefix = "";
+  uint32_t maxino = 0;
+  long jobs = sysconf(_SC_NPROCESSORS_ONLN);
+  int ret = -1, probed = 0;
+
+  if (cpioLoad(ramdisk, len, &archive) < 0)
+    {
+      fprintf(stderr, "%s: error: cannot read the ramdisk cpio archive!\n", progname);
+      return -1;
+    }
+
+  do
+    {
+      int failed = 0;
+
+      for (size_t ne = 0; ne < archive.count; ne++)
+        {
+          if (archive.entries[ne].ino > maxino)
+            maxino = archive.entries[ne].ino;
+          if (!strncmp(archive.entries[ne].name, "./", 2))
+            prefix = "./";
+        }
+
+      /*
+       * Removals: the entry and whatever is below it
+       */
+      for (int nx = 0; nx < xflag; nx++)
+        {
+          char *xpath = strdup(xval[nx]);
+          const char *path;
+          size_t pathlen, removed = 0;
+
+          if (keepBuffer(&buffers, &nbuffers, xpath) < 0)
+            {
+              failed = 1;
+              break;
+            }
+          path = normalizePath(xpath);
+          pathlen = strlen(path);
+          for (size_t ne = 0; pathlen && ne < archive.count; )
+            {
+              const char *name = entryPath(archive.entries[ne].name);
+
+              if (!strncmp(name, path, pathlen) && (name[pathlen] == 0 || name[pathlen] == '/'))
+                {
+                  if (vflag)
+                    fprintf(stdout, "%s: ramdisk entry '%s' removed\n", progname, archive.entries[ne].name);
+                  cpioRemoveEntry(&archive, ne);
+                  removed++;
+                }
+              else
+                ne++;
+            }
+          if (!removed)
+            {
+              fprintf(stderr, "%s: error: no ramdisk entry '%s' to remove!\n", progname, xval[nx]);
+              failed = 1;
+              break;
+            }
+        }
+      if (failed)
+        break;
+
+      /*
+       * Additions & replacements
+       */
+      for (int na = 0; na < aflag; na++)
+        {
+          char *apath = strdup(aval[na]);
+          char *file;
+          const char *path;
+          struct stat st;
+          bootimgCpioEntry_t entry;
+          void *content;
+          size_t content_len;
+          ssize_t index;
+
+          failed = 1;
+          if (keepBuffer(&buffers, &nbuffers, apath) < 0)
+            break;
+          if (!(file = strchr(apath, '=')))
+            {
+              fprintf(stderr, "%s: error: ramdisk entry '%s' is not <path>=<file>!\n", progname, aval[na]);
+              break;
+            }
+          *file++ = 0;
+          path = normalizePath(apath);
+          if (!*path)
+            {
+              fprintf(stderr, "%s: error: empty ramdisk entry path in '%s'!\n", progname, aval[na]);
+              break;
+            }
+          if (stat(file, &st) < 0 || !S_ISREG(st.st_mode) ||
+              (content = loadImage(file, &content_len)) == NULL)
+            {
+              perror(file);
+              fprintf(stderr, "%s: error: cannot load ramdisk file '%s'!\n", progname, file);
+              break;
+            }
+          if (keepBuffer(&buffers, &nbuffers, content) < 0)
+            break;
+
+          if ((index = findRamdiskEntry(&archive, path, strlen(path))) >= 0)
+            {
+              bootimgCpioEntry_p old = &archive.entries[index];
+
+              if (!S_ISREG(old->mode))
+                {
+                  fprintf(stderr, "%s: error: ramdisk entry '%s' is not a regular file!\n",
+                          progname, old->name);
+                  break;
+                }
+              /* same mode & owner, new content */
+              old->data = (const uint8_t *)content;
+              old->filesize = content_len;
+              if (vflag)
+                fprintf(stdout, "%s: ramdisk entry '%s' replaced by '%s' (%lu bytes)\n",
+                        progname, old->name, file, content_len);
+              failed = 0;
+              continue;
+            }
+
+          /* missing parent directories first, then the file */
+          for (const char *slash = strchr(path, '/'); ; slash = strchr(slash +1, '/'))
+            {
+              size_t namelen = slash ? (size_t)(slash - path) : strlen(path);
+              char *name;
+
+              if (slash && findRamdiskEntry(&archive, path, namelen) >= 0)
+                continue;
+
+              name = (char *)malloc(strlen(prefix) + namelen +1);
+              if (keepBuffer(&buffers, &nbuffers, name) < 0)
+                break;
+              sprintf(name, "%s%.*s", prefix, (int)namelen, path);
+
+              bzero((void *)&entry, sizeof(bootimgCpioEntry_t));
+              entry.name = name;
+              entry.ino = ++maxino;
+              if (slash)
+                {
+                  entry.mode = S_IFDIR | 0755;
+                  entry.nlink = 2;
+                }
+              else
+                {
+                  entry.mode = S_IFREG | (st.st_mode & 07777);
+                  entry.nlink = 1;
+                  entry.filesize = content_len;
+                  entry.data = (const uint8_t *)content;
+                }
+              if (cpioAppendEntry(&archive, &entry) < 0)
+                break;
+              if (vflag)
+                fprintf(stdout, "%s: ramdisk entry '%s' added%s\n",
+                        progname, name, slash ? "" : " from file");
+              if (!slash)
+                {
+                  failed = 0;
+                  break;
+                }
+            }
+          if (failed)
+            break;
+        }
+      if (failed)
+        break;
+
+      if (cpioWrite(&archive, &cpio, &cpio_len) < 0)
+        {
+          fprintf(stderr, "%s: error: cannot write the ramdisk cpio archive!\n", progname);
+          break;
+        }
+
+      if (!archive.compressed)
+        {
+          *out = cpio;
+          *outlen = cpio_len;
+          cpio = (uint8_t *)NULL;
+          ret = 0;
+          break;
+        }
+
+      /* gzip as the original member was, when it is a single one */
+      probed = (gzipProbe(ramdisk, len, &member, jobs > 0 ? (unsigned)jobs : 1) == 0);
+      if (gzipRebuild(cpio, cpio_len,
+                      probed && member.level != GZIP_LEVEL_UNKNOWN ? member.level : REPACK_GZIP_LEVEL,
+                      probed ? ramdisk : gzip_header,
+                      probed ? member.hdr_len : sizeof(gzip_header),
+                      probed ? ramdisk + len - member.tail_len : NULL,
+                      probed ? member.tail_len : 0,
+                      out, outlen) < 0)
+        {
+          fprintf(stderr, "%s: error: cannot compress the ramdisk!\n", progname);
+          break;
+        }
+      if (vflag)
+        fprintf(stdout, "%s: ramdisk rebuilt: %lu entries, %lu bytes (was %lu)\n",
+                progname, archive.count, *outlen, len);
+
+      ret = 0;
+    }
+  while (0);
+
+  if (probed)
+    gzipRelease(&member);
+  free((void *)cpio);
+  for (size_t nb = 0; nb < nbuffers; nb++)
+    free(buffers[nb]);
+  free((void *)buffers);
+  cpioRelease(&archive);
+
+  return ret;
+}
+
+/*
+ * Replace components and header fields of an image
+ */
+int
+repackImage(const char *imgfile)
+{
+  boot_img_hdr hdr, newhdr;
+  struct stat statbuf;
+  off_t offset;
+  const char *error = (const char *)NULL;
+  uint8_t *map = (uint8_t *)MAP_FAILED;
+  char *replacements[BOOTIMG_COMPONENT_COUNT] = { kval, rval, sval, dval };
+  void *data[BOOTIMG_COMPONENT_COUNT] = { NULL, };
+  size_t size[BOOTIMG_COMPONENT_COUNT] = { 0, };
+  size_t oldsize[BOOTIMG_COMPONENT_COUNT] = { 0, };
+  char *tmpfile = (char *)NULL;
+  int owned[BOOTIMG_COMPONENT_COUNT] = { 0, };
+  int fd = -1, outfd = -1, ret = -1, inplace = 1, replaced = 0;
+  off64_t oldsig, newsig;
+
+  do
+    {
+      if ((fd = open(imgfile, oflag ? O_RDONLY : O_RDWR)) < 0)
+        {
+          perror(imgfile);
+          fprintf(stderr, "%s: error: cannot open image file '%s'!\n", progname, imgfile);
+          break;
+        }
+      if (fstat(fd, &statbuf) < 0 || statbuf.st_size == 0)
+        {
+          fprintf(stderr, "%s: error: cannot stat image file '%s'!\n", progname, imgfile);
+          break;
+        }
+      if (!findBootMagicFd(fd, &hdr, &offset, &error))
+        {
+          fprintf(stderr, "%s: error: %s in file '%s'\n", progname, error, imgfile);
+          break;
+        }
+      oldsig = offset + computeSignatureBlockOffset(&hdr);
+      if ((map = (uint8_t *)mmap(NULL, statbuf.st_size, PROT_READ, MAP_SHARED, fd, 0)) == MAP_FAILED)
+        {
+          perror(imgfile);
+          break;
+        }
+
+      /*
+       * New header
+       */
+      memcpy((void *)&newhdr, (const void *)&hdr, sizeof(boot_img_hdr));
+      oldsize[BOOTIMG_COMPONENT_KERNEL] = hdr.kernel_size;
+      oldsize[BOOTIMG_COMPONENT_RAMDISK] = hdr.ramdisk_size;
+      oldsize[BOOTIMG_COMPONENT_SECOND] = hdr.second_size;
+      oldsize[BOOTIMG_COMPONENT_DTB] = hdr.dt_size;
+      for (int nc = 0; nc < BOOTIMG_COMPONENT_COUNT; nc++)
+        {
+          size[nc] = oldsize[nc];
+          if (!replacements[nc])
+            {
+              data[nc] = (void *)(map + offset + computeComponentOffset(&hdr, nc));
+              continue;
+            }
+          if (!(data[nc] = loadImage(replacements[nc], &size[nc])))
+            {
+              perror(replacements[nc]);
+              fprintf(stderr, "%s: error: cannot load %s image '%s'!\n",
+                      progname, component_names[nc], replacements[nc]);
+              break;
+            }
+          owned[nc] = 1;
+          replaced++;
+          if (vflag)
+            fprintf(stdout, "%s: %s replaced by '%s' (%lu bytes)\n",
+                    progname, component_names[nc], replacements[nc], size[nc]);
+        }
+      if (replaced < !!kflag + !!rflag + !!sflag + !!dflag)
+        break;
+
+      if (aflag || xflag)
+        {
+          uint8_t *ramdisk;
+          size_t ramdisk_len;
+
+          if (editRamdisk((const uint8_t *)data[BOOTIMG_COMPONENT_RAMDISK], size[BOOTIMG_COMPONENT_RAMDISK],
+                          &ramdisk, &ramdisk_len) < 0)
+            break;
+          if (owned[BOOTIMG_COMPONENT_RAMDISK])
+            free(data[BOOTIMG_COMPONENT_RAMDISK]);
+          else
+            replaced++;
+          data[BOOTIMG_COMPONENT_RAMDISK] = (void *)ramdisk;
+          size[BOOTIMG_COMPONENT_RAMDISK] = ramdisk_len;
+          owned[BOOTIMG_COMPONENT_RAMDISK] = 1;
+        }
+      newhdr.kernel_size = size[BOOTIMG_COMPONENT_KERNEL];
+      newhdr.ramdisk_size = size[BOOTIMG_COMPONENT_RAMDISK];
+      newhdr.second_size = size[BOOTIMG_COMPONENT_SECOND];
+      newhdr.dt_size = size[BOOTIMG_COMPONENT_DTB];
+
+      if (cflag)
+        setCmdline(&newhdr, cval);
+      if (nflag)
+        {
+          bzero((void *)newhdr.name, BOOT_NAME_SIZE);
+          strncpy((char *)newhdr.name, nval, BOOT_NAME_SIZE);
+        }
+
+      /* the id only depends on components: header only changes keep it */
+      if (replaced)
+        {
+          bzero((void *)newhdr.id, sizeof(newhdr.id));
+          computeImageId(&newhdr,
+                         data[BOOTIMG_COMPONENT_KERNEL],
+                         data[BOOTIMG_COMPONENT_RAMDISK],
+                         newhdr.second_size ? data[BOOTIMG_COMPONENT_SECOND] : NULL,
+                         newhdr.dt_size ? data[BOOTIMG_COMPONENT_DTB] : NULL,
+                         (unsigned char *)&newhdr.id);
+        }
+
+      /*
+       * Same page aligned sizes: components stay where they are
+       */
+      newsig = offset + computeSignatureBlockOffset(&newhdr);
+      if (oflag || newsig != oldsig)
+        inplace = 0;
+      for (int nc = 0; inplace && nc < BOOTIMG_COMPONENT_COUNT; nc++)
+        if (alignOnPage(size[nc], hdr.page_size) != alignOnPage(oldsize[nc], hdr.page_size))
+          inplace = 0;
+
+      if (inplace)
+        outfd = fd;
+      else
+        {
+          const char *outfile = oval;
+
+          if (!oflag)
+            {
+              tmpfile = (char *)malloc(strlen(imgfile) + sizeof(".XXXXXX"));
+              assert(tmpfile);
+              sprintf(tmpfile, "%s.XXXXXX", imgfile);
+              if ((outfd = mkstemp(tmpfile)) >= 0)
+                fchmod(outfd, statbuf.st_mode & 07777);
+              outfile = tmpfile;
+            }
+          else
+            outfd = open(oval, O_RDWR|O_CREAT|O_TRUNC, 0644);
+          if (outfd < 0)
+            {
+              perror(outfile);
+              fprintf(stderr, "%s: error: cannot open image file '%s' for writing!\n", progname, outfile);
+              break;
+            }
+
+          /* prefix & header page */
+          if (copyRange(fd, 0, outfd, 0, offset + hdr.page_size) < 0)
+            {
+              fprintf(stderr, "%s: error: cannot copy image header!\n", progname);
+              break;
+            }
+        }
+      if (vflag)
+        fprintf(stdout, "%s: image %s\n", progname, inplace ? "updated in place" : "rewritten");
+
+      if (writeAt(outfd, &newhdr, sizeof(boot_img_hdr), offset) < 0)
+        {
+          perror("writing header");
+          break;
+        }
+
+      for (int nc = 0; nc < BOOTIMG_COMPONENT_COUNT; nc++)
+        {
+          off64_t dst = offset + computeComponentOffset(&newhdr, nc);
+          size_t slot = alignOnPage(size[nc], newhdr.page_size);
+
+          if (owned[nc])
+            {
+              if (writeAt(outfd, data[nc], size[nc], dst) < 0 ||
+                  writePaddingAt(outfd, slot - size[nc], dst + size[nc]) < 0)
+                break;
+            }
+          else if (!inplace &&
+                   copyRange(fd, offset + computeComponentOffset(&hdr, nc), outfd, dst, slot) < 0)
+            break;
+          if (nc == BOOTIMG_COMPONENT_COUNT -1)
+            ret = 0;
+        }
+      if (ret < 0)
+        {
+          fprintf(stderr, "%s: error: cannot write components!\n", progname);
+          break;
+        }
+      ret = -1;
+
+      /*
+       * Signature block: refreshed with a key, dropped otherwise
+       */
+      if (Kflag)
+        {
+          if (veritySign(outfd, newsig,
+                         statbuf.st_size > oldsig ? map + oldsig : NULL,
+                         statbuf.st_size > oldsig ? statbuf.st_size - oldsig : 0,
+                         Kval, Cval) < 0)
+            break;
+        }
+      else
+        {
+          if (statbuf.st_size > oldsig)
+            fprintf(stderr, "%s: warning: signature block dropped, use -K to sign the image\n", progname);
+          if (ftruncate(outfd, newsig) < 0)
+            {
+              perror("truncating image");
+              break;
+            }
+        }
+
+      if (tmpfile)
+        {
+          if (fsync(outfd) < 0 || rename(tmpfile, imgfile) < 0)
+            {
+              perror(imgfile);
+              fprintf(stderr, "%s: error: cannot replace image file '%s'!\n", progname, imgfile);
+              break;
+            }
+          free((void *)tmpfile);
+          tmpfile = (char *)NULL;
+        }
+
+      ret = 0;
+    }
+  while (0);
+
+  if (tmpfile)
+    {
+      unlink(tmpfile);
+      free((void *)tmpfile);
+    }
+  for (int nc = 0; nc < BOOTIMG_COMPONENT_COUNT; nc++)
+    if (owned[nc])
+      free(data[nc]);
+  if (map != MAP_FAILED)
+    munmap((void *)map, statbuf.st_size);
+  if (outfd >= 0 && outfd != fd)
+    close(outfd);
+  if (fd >= 0)
+    close(fd);
+
+  return ret;
+}
+
+/* Local Variables:                                                */
+/* mode: C                                                         */
+/* comment-column: 0                                               */
+/* End:                                                            */
@@ -0,0 +1,311 @@
+/* bootimg-tools/bootimg-stats.c
+ *
+ * Copyright 2007, The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#ifdef STDC_HEADERS
+# include <stdlib.h>
+# include <stddef.h>
+#else
+# ifdef HAVE_STDLIB_H
+#  include <stdlib.h>
+# endif
+# ifdef HAVE_STDDEF_H
+#  include <stddef.h>
+# endif
+#endif
+#ifdef HAVE_STRING_H
+# include <string.h>
+#endif
+#ifdef HAVE_STRINGS_H
+# include <strings.h>
+#endif
+#ifdef HAVE_UNISTD_H
+# include <unistd.h>
+#endif
+#include <time.h>
+
+#include "bootimg-stats.h"
+#include "bootimg-jsonw.h"
+
+/* Nesting depth of phases followed per thread */
+#define BOOTIMG_STATS_MAX_DEPTH         16
+
+/* External decls */
+extern int vflag;
+extern char *progname;
+
+int statsEnabled = 0;
+
+static int statsFormat = BOOTIMG_STATS_FORMAT_TEXT;
+static bootimgStats_t image;
+static bootimgStats_t batch;
+static uint64_t imageStart = 0;
+static uint64_t batchStart = 0;
+
+static __thread int phaseStack[BOOTIMG_STATS_MAX_DEPTH];
+static __thread int phaseDepth = 0;
+
+static const char *phaseNames[BOOTIMG_STATS_PHASE_COUNT] = {
+  "magic-scan", "header-decode", "kernel", "ramdisk", "second", "dtb",
+  "ramdisk-unpack", "ramdisk-pack", "hash", "verify", "metadata",
+  "image-write", "input-decode", "other"
+};
+
+static const char *counterNames[BOOTIMG_STATS_COUNTER_COUNT] = {
+  "read", "written", "syscalls", "allocs"
+};
+
+static uint64_t
+statsNow(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/*
+ * --stats argument: text (default) or json. Returns -1 if unknown.
+ */
+int
+statsParseFormat(const char *format)
+{
+  if (!format || !strcmp(format, "text"))
+    return BOOTIMG_STATS_FORMAT_TEXT;
+  if (!strcmp(format, "json"))
+    return BOOTIMG_STATS_FORMAT_JSON;
+
+  return -1;
+}
+
+void
+statsEnable(int format)
+{
+  statsEnabled = 1;
+  statsFormat = format;
+  batchStart = imageStart = statsNow();
+}
+
+/*
+ * Open a phase, returns the start time for statsEnd
+ */
+uint64_t
+statsBegin(int phase)
+{
+  if (!statsEnabled)
+    return 0;
+
+  if (phaseDepth < BOOTIMG_STATS_MAX_DEPTH)
+    phaseStack[phaseDepth] = phase;
+  phaseDepth++;
+
+  return statsNow();
+}
+
+/*
+ * Close the innermost phase. A phase nested in itself is timed once.
+ */
+void
+statsEnd(int phase, uint64_t start)
+{
+  int outer = 0;
+
+  if (!statsEnabled || !phaseDepth)
+    return;
+
+  phaseDepth--;
+  for (int n = 0; n < phaseDepth && n < BOOTIMG_STATS_MAX_DEPTH; n++)
+    if (phaseStack[n] == phase)
+      outer = 1;
+
+  __atomic_fetch_add(&image.phase[phase].calls, 1, __ATOMIC_RELAXED);
+  if (!outer)
+    __atomic_fetch_add(&image.phase[phase].ns, statsNow() - start, __ATOMIC_RELAXED);
+}
+
+/*
+ * Innermost phase of the thread
+ */
+int
+statsPhase(void)
+{
+  if (!phaseDepth)
+    return BOOTIMG_STATS_OTHER;
+  if (phaseDepth > BOOTIMG_STATS_MAX_DEPTH)
+    return phaseStack[BOOTIMG_STATS_MAX_DEPTH -1];
+
+  return phaseStack[phaseDepth -1];
+}
+
+void
+statsCount(int phase, int counter, uint64_t value)
+{
+  if (!statsEnabled)
+    return;
+
+  if (phase == BOOTIMG_STATS_CURRENT)
+    phase = statsPhase();
+  __atomic_fetch_add(&image.phase[phase].counter[counter], value, __ATOMIC_RELAXED);
+}
+
+/*
+ * Counters of the next image start from here
+ */
+void
+statsImageBegin(void)
+{
+  if (statsEnabled)
+    imageStart = statsNow();
+}
+
+static void
+statsAdd(bootimgStats_p to, bootimgStats_p from)
+{
+  for (int np = 0; np < BOOTIMG_STATS_PHASE_COUNT; np++)
+    {
+      to->phase[np].calls += from->phase[np].calls;
+      to->phase[np].ns += from->phase[np].ns;
+      for (int nc = 0; nc < BOOTIMG_STATS_COUNTER_COUNT; nc++)
+        to->phase[np].counter[nc] += from->phase[np].counter[nc];
+    }
+}
+
+static int
+statsPhaseUsed(bootimgStatsPhase_p phase)
+{
+  int used = (phase->calls != 0);
+
+  for (int nc = 0; nc < BOOTIMG_STATS_COUNTER_COUNT; nc++)
+    used |= (phase->counter[nc] != 0);
+
+  return used;
+}
+
+static void
+statsWriteJson(const char *name, bootimgStats_p stats)
+{
+  bootimgJsonWriter_p w;
+
+  fflush(stderr);
+  if (!(w = jsonWriterNew(STDERR_FILENO, JSON_WRITER_FLAG_COMPACT)))
+    return;
+
+  jsonWriterStartObject(w, NULL);
+  if (name)
+    jsonWriterWriteString(w, "image", name);
+  else
+    jsonWriterWriteNumber(w, "images", stats->images);
+  jsonWriterWriteNumber(w, "wall_ns", stats->ns);
+  jsonWriterStartObject(w, "phases");
+  for (int np = 0; np < BOOTIMG_STATS_PHASE_COUNT; np++)
+    {
+      bootimgStatsPhase_p phase = &stats->phase[np];
+
+      if (!statsPhaseUsed(phase))
+        continue;
+
+      jsonWriterStartObject(w, phaseNames[np]);
+      jsonWriterWriteNumber(w, "calls", phase->calls);
+      jsonWriterWriteNumber(w, "ns", phase->ns);
+      for (int nc = 0; nc < BOOTIMG_STATS_COUNTER_COUNT; nc++)
+        jsonWriterWriteNumber(w, counterNames[nc], phase->counter[nc]);
+      jsonWriterEndObject(w);
+    }
+  jsonWriterEndObject(w);
+  jsonWriterEndObject(w);
+
+  if (jsonWriterFree(w) < 0 || write(STDERR_FILENO, "\n", 1) != 1)
+    fprintf(stderr, "%s: warning: cannot write stats!\n", progname);
+}
+
+static void
+statsWriteText(const char *name, bootimgStats_p stats)
+{
+  if (name)
+    fprintf(stderr, "%s: stats for '%s' (%.3f ms):\n", progname, name, stats->ns / 1e6);
+  else
+    fprintf(stderr, "%s: stats for %u image(s) (%.3f ms):\n", progname, stats->images, stats->ns / 1e6);
+  fprintf(stderr, "  %-16s %8s %12s %12s %12s %9s %7s\n",
+          "phase", "calls", "time (ms)", "read", "written", "syscalls", "allocs");
+
+  for (int np = 0; np < BOOTIMG_STATS_PHASE_COUNT; np++)
+    {
+      bootimgStatsPhase_p phase = &stats->phase[np];
+
+      if (!statsPhaseUsed(phase))
+        continue;
+
+      fprintf(stderr, "  %-16s %8llu %12.3f %12llu %12llu %9llu %7llu\n",
+              phaseNames[np], (unsigned long long)phase->calls, phase->ns / 1e6,
+              (unsigned long long)phase->counter[BOOTIMG_STATS_READ],
+              (unsigned long long)phase->counter[BOOTIMG_STATS_WRITE],
+              (unsigned long long)phase->counter[BOOTIMG_STATS_SYSCALLS],
+              (unsigned long long)phase->counter[BOOTIMG_STATS_ALLOCS]);
+    }
+}
+
+/*
+ * Report the counters of an image on stderr and add them to the batch
+ */
+void
+statsImageDone(const char *name)
+{
+  if (!statsEnabled)
+    return;
+
+  image.images = 1;
+  image.ns = statsNow() - imageStart;
+  /* the report itself is not counted */
+  statsEnabled = 0;
+  if (statsFormat == BOOTIMG_STATS_FORMAT_JSON)
+    statsWriteJson(name, &image);
+  else
+    statsWriteText(name, &image);
+  statsEnabled = 1;
+
+  batch.images++;
+  statsAdd(&batch, &image);
+
+  bzero((void *)&image, sizeof(bootimgStats_t));
+  imageStart = statsNow();
+}
+
+/*
+ * Report the batch; what was counted since the last image (files
+ * still being written, ...) is added to it.
+ */
+void
+statsBatchDone(void)
+{
+  if (!statsEnabled)
+    return;
+
+  statsAdd(&batch, &image);
+  batch.ns = statsNow() - batchStart;
+  statsEnabled = 0;
+  if (statsFormat == BOOTIMG_STATS_FORMAT_JSON)
+    statsWriteJson((const char *)NULL, &batch);
+  else
+    statsWriteText((const char *)NULL, &batch);
+}
+
+/* Local Variables:                                                */
+/* mode: C                                                         */
+/* comment-column: 0                                               */
+/* End:                                                            */
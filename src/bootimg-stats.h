@@ -0,0 +1,99 @@
+/* bootimg-tools/bootimg-stats.h
+ *
+ * Copyright 2007, The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef __BOOTIMG_STATS_H__
+#define __BOOTIMG_STATS_H__
+
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+ * Per phase instrumentation for --stats. Nothing is recorded until
+ * statsEnable is called: each hook is then a single test.
+ *
+ * A phase is timed (monotonic clock) from statsBegin to statsEnd and
+ * phases may nest, an outer phase time including the inner ones. The
+ * counters (bytes read & written, I/O syscalls, buffer allocations)
+ * go to the innermost phase opened by the thread, or to "other" when
+ * none is. Requests of the I/O engine count for the phase they were
+ * queued from. Threads may count at once, reports are made when they
+ * are done.
+ *
+ * Counters of the current image are reported and added to the ones
+ * of the batch by statsImageDone; statsBatchDone reports the batch.
+ */
+
+#define BOOTIMG_STATS_MAGIC_SCAN        0
+#define BOOTIMG_STATS_HEADER_DECODE     1
+#define BOOTIMG_STATS_KERNEL            2       /* components copies, in */
+#define BOOTIMG_STATS_RAMDISK           3       /* BOOTIMG_COMPONENT_* order */
+#define BOOTIMG_STATS_SECOND            4
+#define BOOTIMG_STATS_DTB               5
+#define BOOTIMG_STATS_RAMDISK_UNPACK    6
+#define BOOTIMG_STATS_RAMDISK_PACK      7
+#define BOOTIMG_STATS_HASH              8
+#define BOOTIMG_STATS_VERIFY            9
+#define BOOTIMG_STATS_METADATA          10
+#define BOOTIMG_STATS_IMAGE_WRITE       11
+#define BOOTIMG_STATS_INPUT             12      /* container decoding */
+#define BOOTIMG_STATS_OTHER             13
+#define BOOTIMG_STATS_PHASE_COUNT       14
+
+/* innermost phase of the thread */
+#define BOOTIMG_STATS_CURRENT           -1
+
+#define BOOTIMG_STATS_READ              0
+#define BOOTIMG_STATS_WRITE             1
+#define BOOTIMG_STATS_SYSCALLS          2
+#define BOOTIMG_STATS_ALLOCS            3
+#define BOOTIMG_STATS_COUNTER_COUNT     4
+
+#define BOOTIMG_STATS_FORMAT_TEXT       0
+#define BOOTIMG_STATS_FORMAT_JSON       1
+
+typedef struct _bootimgStatsPhase_st
+{
+  uint64_t calls;
+  uint64_t ns;
+  uint64_t counter[BOOTIMG_STATS_COUNTER_COUNT];
+} bootimgStatsPhase_t, *bootimgStatsPhase_p;
+
+typedef struct _bootimgStats_st
+{
+  unsigned images;
+  uint64_t ns;                          /* wall time */
+  bootimgStatsPhase_t phase[BOOTIMG_STATS_PHASE_COUNT];
+} bootimgStats_t, *bootimgStats_p;
+
+extern int statsEnabled;
+
+int       statsParseFormat  (const char *);
+void      statsEnable       (int);
+uint64_t  statsBegin        (int);
+void      statsEnd          (int, uint64_t);
+int       statsPhase        (void);
+void      statsCount        (int, int, uint64_t);
+void      statsImageBegin   (void);
+void      statsImageDone    (const char *);
+void      statsBatchDone    (void);
+
+#endif /* __BOOTIMG_STATS_H__ */
+
+/* Local Variables:                                                */
+/* mode: C                                                         */
+/* comment-column: 0                                               */
+/* End:                                                            */
@@ -0,0 +1,368 @@
+/* bootimg-tools/bootimg-tar.c
+ *
+ * Copyright 2007, The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#ifdef STDC_HEADERS
+# include <stdlib.h>
+# include <stddef.h>
+#else
+# ifdef HAVE_STDLIB_H
+#  include <stdlib.h>
+# endif
+# ifdef HAVE_STDDEF_H
+#  include <stddef.h>
+# endif
+#endif
+#ifdef HAVE_STRING_H
+# include <string.h>
+#endif
+#ifdef HAVE_STRINGS_H
+# include <strings.h>
+#endif
+#ifdef HAVE_UNISTD_H
+# include <unistd.h>
+#endif
+#include <errno.h>
+
+#include "bootimg-tar.h"
+#include "bootimg-stats.h"
+#include "bootimg-log.h"
+
+#define TAR_PADDING(x)          ((TAR_BLOCK_SIZE - ((x) % TAR_BLOCK_SIZE)) % TAR_BLOCK_SIZE)
+#define TAR_COPY_CHUNK          (64*1024)
+
+/* External decls */
+extern int vflag;
+extern char *progname;
+
+static const char zeros[TAR_BLOCK_SIZE] = { 0, };
+
+/*
+ * read(2) until len bytes or end of file
+ */
+ssize_t
+tarReadFull(int fd, void *buf, size_t len)
+{
+  size_t done = 0;
+
+  while (done < len)
+    {
+      ssize_t rdsz = read(fd, (char *)buf + done, len - done);
+
+      statsCount(BOOTIMG_STATS_CURRENT, BOOTIMG_STATS_SYSCALLS, 1);
+      if (rdsz < 0 && errno == EINTR)
+        continue;
+      if (rdsz < 0)
+        return -1;
+      if (rdsz == 0)
+        break;
+      done += rdsz;
+    }
+  statsCount(BOOTIMG_STATS_CURRENT, BOOTIMG_STATS_READ, done);
+
+  return done;
+}
+
+/*
+ * write(2) the whole buffer
+ */
+ssize_t
+tarWriteFull(int fd, const void *buf, size_t len)
+{
+  size_t done = 0;
+
+  while (done < len)
+    {
+      ssize_t wrsz = write(fd, (const char *)buf + done, len - done);
+
+      statsCount(BOOTIMG_STATS_CURRENT, BOOTIMG_STATS_SYSCALLS, 1);
+      if (wrsz < 0 && errno == EINTR)
+        continue;
+      if (wrsz <= 0)
+        return -1;
+      done += wrsz;
+    }
+  statsCount(BOOTIMG_STATS_CURRENT, BOOTIMG_STATS_WRITE, done);
+
+  return done;
+}
+
+/*
+ * Header checksum: sum of all bytes, the checksum field counting as spaces
+ */
+static unsigned
+tarChecksum(const bootimgTarHeader_t *hdr)
+{
+  const unsigned char *p = (const unsigned char *)hdr;
+  unsigned sum = 0;
+
+  for (size_t n = 0; n < sizeof(bootimgTarHeader_t); n++)
+    if (n >= offsetof(bootimgTarHeader_t, chksum) &&
+        n < offsetof(bootimgTarHeader_t, chksum) + sizeof(hdr->chksum))
+      sum += ' ';
+    else
+      sum += p[n];
+
+  return sum;
+}
+
+/*
+ * Parse an octal numeric field (or a GNU base-256 one)
+ */
+static int
+tarNumber(const char *field, size_t len, uint64_t *value)
+{
+  uint64_t v = 0;
+  size_t n = 0;
+
+  if ((unsigned char)field[0] & 0x80)
+    {
+      v = (unsigned char)field[0] & 0x7f;
+      for (n = 1; n < len; n++)
+        v = (v << 8) | (unsigned char)field[n];
+      *value = v;
+      return 0;
+    }
+
+  while (n < len && field[n] == ' ')
+    n++;
+  for (; n < len && field[n] >= '0' && field[n] <= '7'; n++)
+    v = (v << 3) | (field[n] - '0');
+  if (n < len && field[n] != ' ' && field[n] != '\0')
+    return -1;
+  *value = v;
+
+  return 0;
+}
+
+/*
+ * Write the header of a regular file entry. Names longer than the name
+ * field are split on a '/' into the ustar prefix.
+ */
+int
+tarWriteHeader(int fd, const char *name, uint64_t size, mode_t mode, time_t mtime)
+{
+  bootimgTarHeader_t hdr;
+  size_t len = strlen(name);
+  const char *base = name;
+
+  bzero((void *)&hdr, sizeof(bootimgTarHeader_t));
+
+  if (len > TAR_NAME_SIZE)
+    {
+      const char *slash = name + len - TAR_NAME_SIZE - 1;
+
+      while (*slash && *slash != '/')
+        slash++;
+      if (!*slash || slash - name > TAR_PREFIX_SIZE)
+        {
+          fprintf(stderr, "%s: error: tar entry name '%s' is too long!\n", progname, name);
+          return -1;
+        }
+      memcpy(hdr.prefix, name, slash - name);
+      base = slash + 1;
+    }
+  memcpy(hdr.name, base, strlen(base));
+
+  snprintf(hdr.mode, sizeof(hdr.mode), "%07o", (unsigned)(mode & 07777));
+  snprintf(hdr.uid, sizeof(hdr.uid), "%07o", 0);
+  snprintf(hdr.gid, sizeof(hdr.gid), "%07o", 0);
+  snprintf(hdr.size, sizeof(hdr.size), "%011llo", (unsigned long long)size);
+  snprintf(hdr.mtime, sizeof(hdr.mtime), "%011llo", (unsigned long long)mtime);
+  hdr.typeflag = TAR_TYPE_REGULAR;
+  memcpy(hdr.magic, "ustar", 6);
+  memcpy(hdr.version, "00", 2);
+  snprintf(hdr.chksum, sizeof(hdr.chksum), "%06o", tarChecksum(&hdr));
+  hdr.chksum[7] = ' ';
+
+  if (tarWriteFull(fd, &hdr, sizeof(bootimgTarHeader_t)) < 0)
+    return -1;
+
+  return 0;
+}
+
+/*
+ * Pad the data of an entry of size bytes to the block size
+ */
+int
+tarWritePadding(int fd, uint64_t size)
+{
+  if (TAR_PADDING(size) && tarWriteFull(fd, zeros, TAR_PADDING(size)) < 0)
+    return -1;
+
+  return 0;
+}
+
+/*
+ * Write a whole regular file entry from memory
+ */
+int
+tarWriteEntry(int fd, const char *name, const void *data, uint64_t size, mode_t mode, time_t mtime)
+{
+  if (tarWriteHeader(fd, name, size, mode, mtime) < 0 ||
+      tarWriteFull(fd, data, size) < 0 ||
+      tarWritePadding(fd, size) < 0)
+    return -1;
+
+  return 0;
+}
+
+/*
+ * End of archive: two zero blocks
+ */
+int
+tarWriteEnd(int fd)
+{
+  if (tarWriteFull(fd, zeros, TAR_BLOCK_SIZE) < 0 ||
+      tarWriteFull(fd, zeros, TAR_BLOCK_SIZE) < 0)
+    return -1;
+
+  return 0;
+}
+
+/*
+ * Read headers until the next regular file entry. Its name (at most
+ * namelen -1 chars) and size are returned; the data must then be
+ * consumed with tarReadData or tarSkipData.
+ * Returns 1 for an entry, 0 at end of archive & -1 on error.
+ */
+int
+tarReadHeader(int fd, char *name, size_t namelen, uint64_t *size)
+{
+  bootimgTarHeader_t hdr;
+  char longname[TAR_MAX_NAME +1];
+  int haveLongname = 0;
+  ssize_t rdsz;
+
+  while (1)
+    {
+      uint64_t sum = 0;
+
+      rdsz = tarReadFull(fd, &hdr, sizeof(bootimgTarHeader_t));
+      /* a missing end of archive is tolerated */
+      if (rdsz == 0)
+        return 0;
+      if (rdsz != sizeof(bootimgTarHeader_t))
+        {
+          fprintf(stderr, "%s: error: truncated tar header!\n", progname);
+          return -1;
+        }
+
+      if (!memcmp(&hdr, zeros, TAR_BLOCK_SIZE))
+        return 0;
+
+      if (tarNumber(hdr.chksum, sizeof(hdr.chksum), &sum) < 0 || sum != tarChecksum(&hdr))
+        {
+          fprintf(stderr, "%s: error: bad tar header checksum!\n", progname);
+          return -1;
+        }
+      if (tarNumber(hdr.size, sizeof(hdr.size), size) < 0)
+        {
+          fprintf(stderr, "%s: error: bad tar entry size!\n", progname);
+          return -1;
+        }
+
+      if (hdr.typeflag == TAR_TYPE_GNU_LONGNAME)
+        {
+          if (*size > TAR_MAX_NAME)
+            {
+              fprintf(stderr, "%s: error: tar long name too long!\n", progname);
+              return -1;
+            }
+          bzero((void *)longname, sizeof(longname));
+          if (tarReadData(fd, longname, *size) < 0)
+            return -1;
+          haveLongname = 1;
+          continue;
+        }
+
+      if (hdr.typeflag != TAR_TYPE_REGULAR && hdr.typeflag != TAR_TYPE_AREGULAR)
+        {
+          BOOTIMG_LOG(BOOTIMG_LOG_IMAGE, BOOTIMG_LOG_DEBUG,
+                      "skipping tar entry '%.*s' of type '%c'",
+                      TAR_NAME_SIZE, hdr.name, hdr.typeflag);
+          if (tarSkipData(fd, *size) < 0)
+            return -1;
+          haveLongname = 0;
+          continue;
+        }
+
+      if (haveLongname)
+        snprintf(name, namelen, "%s", longname);
+      else if (!memcmp(hdr.magic, "ustar", 5) && hdr.prefix[0])
+        snprintf(name, namelen, "%.*s/%.*s",
+                 TAR_PREFIX_SIZE, hdr.prefix, TAR_NAME_SIZE, hdr.name);
+      else
+        snprintf(name, namelen, "%.*s", TAR_NAME_SIZE, hdr.name);
+
+      return 1;
+    }
+}
+
+/*
+ * Consume exactly len bytes
+ */
+static int
+tarSkip(int fd, uint64_t len)
+{
+  char buf[TAR_COPY_CHUNK];
+
+  while (len)
+    {
+      size_t chunk = len < sizeof(buf) ? len : sizeof(buf);
+
+      if (tarReadFull(fd, buf, chunk) != (ssize_t)chunk)
+        {
+          fprintf(stderr, "%s: error: truncated tar entry!\n", progname);
+          return -1;
+        }
+      len -= chunk;
+    }
+
+  return 0;
+}
+
+/*
+ * Read the data of the current entry and the padding after it
+ */
+int
+tarReadData(int fd, void *buf, uint64_t size)
+{
+  if (tarReadFull(fd, buf, size) != (ssize_t)size)
+    {
+      fprintf(stderr, "%s: error: truncated tar entry!\n", progname);
+      return -1;
+    }
+
+  return tarSkip(fd, TAR_PADDING(size));
+}
+
+/*
+ * Skip the data of the current entry and the padding after it
+ */
+int
+tarSkipData(int fd, uint64_t size)
+{
+  return tarSkip(fd, size + TAR_PADDING(size));
+}
+
+/* Local Variables:                                                */
+/* mode: C                                                         */
+/* comment-column: 0                                               */
+/* End:                                                            */
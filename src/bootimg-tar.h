@@ -0,0 +1,77 @@
+/* bootimg-tools/bootimg-tar.h
+ *
+ * Copyright 2007, The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef __BOOTIMG_TAR_H__
+#define __BOOTIMG_TAR_H__
+
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+/*
+ * Sequential access to POSIX ustar archives on plain file descriptors
+ * (pipes included): nothing is ever seeked. Only regular files are
+ * returned by the reader; directories, links, pax extended headers and
+ * other special entries are skipped. GNU long names are honored.
+ */
+
+#define TAR_BLOCK_SIZE                  512
+#define TAR_NAME_SIZE                   100
+#define TAR_PREFIX_SIZE                 155
+#define TAR_MAX_NAME                    1024
+
+#define TAR_TYPE_REGULAR                '0'
+#define TAR_TYPE_AREGULAR               '\0'
+#define TAR_TYPE_GNU_LONGNAME           'L'
+
+typedef struct _bootimgTarHeader_st
+{
+  char name[TAR_NAME_SIZE];
+  char mode[8];
+  char uid[8];
+  char gid[8];
+  char size[12];
+  char mtime[12];
+  char chksum[8];
+  char typeflag;
+  char linkname[100];
+  char magic[6];                        /* "ustar\0" */
+  char version[2];                      /* "00" */
+  char uname[32];
+  char gname[32];
+  char devmajor[8];
+  char devminor[8];
+  char prefix[TAR_PREFIX_SIZE];
+  char pad[12];
+} bootimgTarHeader_t, *bootimgTarHeader_p;
+
+ssize_t  tarReadFull        (int, void *, size_t);
+ssize_t  tarWriteFull       (int, const void *, size_t);
+int      tarWriteHeader     (int, const char *, uint64_t, mode_t, time_t);
+int      tarWritePadding    (int, uint64_t);
+int      tarWriteEntry      (int, const char *, const void *, uint64_t, mode_t, time_t);
+int      tarWriteEnd        (int);
+int      tarReadHeader      (int, char *, size_t, uint64_t *);
+int      tarReadData        (int, void *, uint64_t);
+int      tarSkipData        (int, uint64_t);
+
+#endif /* __BOOTIMG_TAR_H__ */
+
+/* Local Variables:                                                */
+/* mode: C                                                         */
+/* comment-column: 0                                               */
+/* End:                                                            */
@@ -44,6 +44,9 @@
 #ifdef HAVE_UNISTD_H
 # include <unistd.h>
 #endif
+#ifdef HAVE_FCNTL_H
+# include <fcntl.h>
+#endif
 #ifdef HAVE_STRING_H
 #include <string.h>
 #endif
@@ -58,13 +61,19 @@
 # include <assert.h>
 #endif
 #include <libgen.h>
+#include <errno.h>
+#include <time.h>
 
 #include "bootimg.h"
+#include "bootimg-io.h"
+#include "bootimg-stats.h"
+#include "bootimg-utils.h"
 
 // trigger implem for asn1 funcs
 #define __DO_IMPLEM_ASN1_AUTH_ATTRS__
 #define __DO_IMPLEM_ASN1_BOOT_SIGNATURE__
 #include "bootimg-priv.h"
+#include "bootimg-log.h"
 #undef __DO_IMPLEM_ASN1_AUTH_ATTRS__
 #undef __DO_IMPLEM_ASN1_BOOT_SIGNATURE__
 
@@ -76,13 +85,19 @@
 #  include <openssl/evp.h>
 #  include <openssl/rsa.h>
 #  include <openssl/x509.h>
+#  include <openssl/pem.h>
 # else
 #  error No SHA256 available in this openssl ! It is mandatory ... 
 # endif
 #endif
 
 #define VERITY_FORMAT_VERSION  	1
-#define SHA_BUF_SIZE_K		128
+#define VERITY_DEFAULT_TARGET	"/boot"
+
+#define BOOTIMG_SHA_CTX	SHA_CTX
+#define BOOTIMG_SHA_Init SHA1_Init
+#define BOOTIMG_SHA_Update SHA1_Update
+#define BOOTIMG_SHA_Final SHA1_Final
 
 /* External decls */
 extern int vflag;
@@ -136,50 +151,47 @@ getImageFilename(const char *basenm, const char *outdir, int kind)
               basenameIsAbsolute ? "%s.img" : "%s/%s.img",
               basenameIsAbsolute ? bname : outdir,
               bname);
-      if (vflag > 2)
-        fprintf(stdout, "%s: Boot Image filename = '%s'\n", progname, pathname);
+      BOOTIMG_LOG(BOOTIMG_LOG_MAIN, BOOTIMG_LOG_DEBUG, "Boot Image filename = '%s'", pathname);
       break;
     case BOOTIMG_XML_FILENAME:
       sprintf(pathname, "%s.xml", bname);
-      if (vflag > 2)
-        fprintf(stdout, "%s: XML Metadata filename = '%s'\n", progname, pathname);
+      BOOTIMG_LOG(BOOTIMG_LOG_META, BOOTIMG_LOG_DEBUG, "XML Metadata filename = '%s'", pathname);
       break;
     case BOOTIMG_JSON_FILENAME:
       sprintf(pathname, "%s.json", bname);
-      if (vflag > 2)
-        fprintf(stdout, "%s: JSON Metadata filename = '%s'\n", progname, pathname);
+      BOOTIMG_LOG(BOOTIMG_LOG_META, BOOTIMG_LOG_DEBUG, "JSON Metadata filename = '%s'", pathname);
+      break;
+    case BOOTIMG_BMETA_FILENAME:
+      sprintf(pathname, "%s.bmeta", bname);
+      BOOTIMG_LOG(BOOTIMG_LOG_META, BOOTIMG_LOG_DEBUG, "Binary Metadata filename = '%s'", pathname);
       break;
     case BOOTIMG_KERNEL_FILENAME:
       sprintf(pathname,
               basenameIsAbsolute ? "%s.img" : "%s/%s.zImage",
               basenameIsAbsolute ? bname : outdir,
               bname);
-      if (vflag > 2)
-        fprintf(stdout, "%s: KERNEL filename = '%s'\n", progname, pathname);
+      BOOTIMG_LOG(BOOTIMG_LOG_MAIN, BOOTIMG_LOG_DEBUG, "KERNEL filename = '%s'", pathname);
       break;
     case BOOTIMG_RAMDISK_FILENAME:
       sprintf(pathname,
               basenameIsAbsolute ? "%s.cpio.gz" : "%s/%s.cpio.gz",
               basenameIsAbsolute ? bname : outdir,
               bname);
-      if (vflag > 2)
-        fprintf(stdout, "%s: RAMDISK filename = '%s'\n", progname, pathname);
+      BOOTIMG_LOG(BOOTIMG_LOG_MAIN, BOOTIMG_LOG_DEBUG, "RAMDISK filename = '%s'", pathname);
       break;
     case BOOTIMG_SECOND_LOADER_FILENAME:
       sprintf(pathname,
               basenameIsAbsolute ? "%s-2ndldr.img" : "%s/%s-2ndldr.img",
               basenameIsAbsolute ? bname : outdir,
               bname);
-      if (vflag > 2)
-        fprintf(stdout, "%s: 2nd BOOTLOADER filename = '%s'\n", progname, pathname);
+      BOOTIMG_LOG(BOOTIMG_LOG_MAIN, BOOTIMG_LOG_DEBUG, "2nd BOOTLOADER filename = '%s'", pathname);
       break;
     case BOOTIMG_DTB_FILENAME:
       sprintf(pathname,
               basenameIsAbsolute ? "%s.dtb" : "%s/%s.dtb",
               basenameIsAbsolute ? bname : outdir,
               bname);
-      if (vflag > 2)
-        fprintf(stdout, "%s: DTB filename = '%s'\n", progname, pathname);
+      BOOTIMG_LOG(BOOTIMG_LOG_MAIN, BOOTIMG_LOG_DEBUG, "DTB filename = '%s'", pathname);
       break;
     default:
       sprintf(pathname, "%s-unknown.dat", bname);
@@ -187,8 +199,7 @@ getImageFilename(const char *basenm, const char *outdir, int kind)
       break;
     }
   
-  if (vflag == 2)
-    fprintf(stdout, "%s: using file with name '%s'\n", progname, pathname);
+  BOOTIMG_LOG(BOOTIMG_LOG_MAIN, BOOTIMG_LOG_VERBOSE, "using file with name '%s'", pathname);
 
   return strdup(pathname);
 }
@@ -218,14 +229,9 @@ const char *getDirname(const char *pathname, uint8_t flags)
 
   bzero((void *)buffer, PATH_MAX+1);
   memcpy((void *)buffer, pathname, BOOTIMG_MIN(PATH_MAX, strlen(pathname)));
-  dir_name_ptr = dirname((char *)pathname);
+  dir_name_ptr = dirname(buffer);
   if (dir_name_ptr[0] != '/' && (flags & FLAG_GET_DIRNAME_ABSOLUTE) != 0)
-    {
-      char rootpath[PATH_MAX+1];
-      char *cwd = realpath(".", rootpath);
-      sprintf(buffer, "%s/%s", cwd, dir_name_ptr);
-      return realpath(dir_name_ptr, NULL);
-    }
+    return realpath(dir_name_ptr, NULL);
   else  
     return strdup(dir_name_ptr);
 }
@@ -242,7 +248,7 @@ const char *getBasename(const char *pathname, const char *ext)
   bzero((void *)buffer, PATH_MAX+1);
   pathname_len = strlen(pathname);
   ext_len = strlen(ext)+1; /* +1 4 dot */
-  memcpy((void *)buffer, pathname, BOOTIMG_MAX(PATH_MAX, strlen(pathname)));
+  memcpy((void *)buffer, pathname, BOOTIMG_MIN(PATH_MAX, strlen(pathname)));
   ext_ptr = strstr(buffer, ext) -1;
   if (ext_ptr == buffer + (pathname_len - ext_len))
     *ext_ptr = '\0';
@@ -259,6 +265,351 @@ alignOnPage(uint64_t size, uint64_t page_size)
   return ((size + page_size -1) & ~(page_size - 1));
 }
 
+/*
+ * Load a whole file in a new buffer
+ */
+void *
+loadImage(const char *filename, size_t *sz_p)
+{
+  bootimgIo_p io = ioDefault();
+  void *data = (void *)NULL;
+
+  if (io == (bootimgIo_p)NULL ||
+      ioLoadFiles(io, 1, &filename, &data, sz_p) < 0)
+    return (void *)NULL;
+
+  return data;
+}
+
+/*
+ * Check a header found at offset in a file of len bytes (0 if the
+ * length is unknown, e.g. a pipe) before any of its sizes is trusted:
+ * the page size must be a power of two in [BOOTIMG_MIN_PAGESIZE,
+ * BOOTIMG_MAX_PAGESIZE] and each component, laid out page aligned
+ * after the header, must end within the file. Constant time and no
+ * allocation. Returns NULL if the header is sane, else what is wrong.
+ */
+const char *
+checkBootImgHeader(boot_img_hdr *hdr, uint64_t offset, uint64_t len)
+{
+  static const char *truncated[BOOTIMG_COMPONENT_COUNT] = {
+    "kernel is truncated", "ramdisk is truncated",
+    "second bootloader is truncated", "device tree blob is truncated"
+  };
+  uint32_t sizes[BOOTIMG_COMPONENT_COUNT] = {
+    hdr->kernel_size, hdr->ramdisk_size, hdr->second_size, hdr->dt_size
+  };
+  uint64_t end = offset + hdr->page_size;
+
+  if (hdr->page_size < BOOTIMG_MIN_PAGESIZE || hdr->page_size > BOOTIMG_MAX_PAGESIZE ||
+      (hdr->page_size & (hdr->page_size -1)))
+    return "bad page size";
+  if (!len)
+    return (const char *)NULL;
+
+  /* sizes are 32 bits: no overflow of the 64 bits sums below */
+  if (offset > len || len - offset < sizeof(boot_img_hdr))
+    return "header is truncated";
+  for (int nc = 0; nc < BOOTIMG_COMPONENT_COUNT; nc++)
+    {
+      if (sizes[nc] && end + sizes[nc] > len)
+        return truncated[nc];
+      end += alignOnPage(sizes[nc], hdr->page_size);
+    }
+
+  return (const char *)NULL;
+}
+
+static ssize_t
+findBootMagicRead(void *arg, void *buf, size_t len, uint64_t off)
+{
+  ssize_t rdsz = pread(*(int *)arg, buf, len, off);
+
+  statsCount(BOOTIMG_STATS_CURRENT, BOOTIMG_STATS_SYSCALLS, 1);
+  statsCount(BOOTIMG_STATS_CURRENT, BOOTIMG_STATS_READ, rdsz > 0 ? rdsz : 0);
+  return rdsz;
+}
+
+/*
+ * Find the boot magic in the first page(s) of a file and check the
+ * header found there. The probe window, header included, is read at
+ * once and a regular file too short to hold a header is rejected
+ * without being read. Returns hdr or NULL if no sane header was found,
+ * the reason being then set in *error (if not NULL) for the caller to
+ * report along with the file name.
+ */
+boot_img_hdr *
+findBootMagicFd(int fd, boot_img_hdr *hdr, off_t *off, const char **error)
+{
+  struct stat statbuf;
+  uint64_t len = 0;
+
+  statsCount(BOOTIMG_STATS_CURRENT, BOOTIMG_STATS_SYSCALLS, 1);
+  if (fstat(fd, &statbuf) == 0 && S_ISREG(statbuf.st_mode))
+    {
+      /* too short to hold a header */
+      if ((len = statbuf.st_size) < sizeof(boot_img_hdr))
+        {
+          BOOTIMG_LOG(BOOTIMG_LOG_IMAGE, BOOTIMG_LOG_VERBOSE, "error: Android boot magic not found.");
+          if (error)
+            *error = "Magic not found";
+          return (boot_img_hdr *)NULL;
+        }
+    }
+
+  return findBootMagicAt(findBootMagicRead, (void *)&fd, len, hdr, off, error);
+}
+
+/*
+ * Same as findBootMagicFd for an image of len bytes (0 if unknown) read
+ * with the pread like function given
+ */
+boot_img_hdr *
+findBootMagicAt(bootimgPread_t readAt, void *arg, uint64_t len, boot_img_hdr *hdr, off_t *off,
+                const char **error)
+{
+  char buf[BOOT_MAGIC_SEEK_LIMIT + sizeof(boot_img_hdr)];
+  ssize_t rdsz;
+  char *magic = (char *)NULL;
+  const char *bad;
+  uint64_t start;
+
+  BOOTIMG_LOG(BOOTIMG_LOG_IMAGE, BOOTIMG_LOG_TRACE, "Reading header...");
+
+  start = statsBegin(BOOTIMG_STATS_MAGIC_SCAN);
+  rdsz = readAt(arg, buf, sizeof(buf), 0);
+  if (rdsz >= BOOT_MAGIC_SIZE)
+    magic = memmem(buf, BOOTIMG_MIN(rdsz, BOOT_MAGIC_SEEK_LIMIT + BOOT_MAGIC_SIZE),
+                   BOOT_MAGIC, BOOT_MAGIC_SIZE);
+  statsEnd(BOOTIMG_STATS_MAGIC_SCAN, start);
+  if (!magic)
+    {
+      BOOTIMG_LOG(BOOTIMG_LOG_IMAGE, BOOTIMG_LOG_VERBOSE, "error: Android boot magic not found.");
+      if (error)
+        *error = "Magic not found";
+      return (boot_img_hdr *)NULL;
+    }
+  *off = magic - buf;
+
+  if (*off > 0)
+    BOOTIMG_LOG(BOOTIMG_LOG_IMAGE, BOOTIMG_LOG_INFO, "Android magic found at offset: %ld", *off);
+
+  start = statsBegin(BOOTIMG_STATS_HEADER_DECODE);
+  if (*off + sizeof(boot_img_hdr) <= (size_t)rdsz)
+    {
+      memcpy((void *)hdr, (const void *)magic, sizeof(boot_img_hdr));
+      rdsz = sizeof(boot_img_hdr);
+    }
+  else
+    rdsz = readAt(arg, hdr, sizeof(boot_img_hdr), *off);
+  bad = (rdsz == sizeof(boot_img_hdr) ? checkBootImgHeader(hdr, *off, len) : "header is truncated");
+  statsEnd(BOOTIMG_STATS_HEADER_DECODE, start);
+  if (bad)
+    {
+      if (rdsz != sizeof(boot_img_hdr))
+        BOOTIMG_LOG(BOOTIMG_LOG_IMAGE, BOOTIMG_LOG_VERBOSE,
+                    "error: expected %lu bytes read, but got %ld", sizeof(boot_img_hdr), rdsz);
+      BOOTIMG_LOG(BOOTIMG_LOG_IMAGE, BOOTIMG_LOG_VERBOSE, "error: invalid boot image header: %s.", bad);
+      if (error)
+        *error = bad;
+      return (boot_img_hdr *)NULL;
+    }
+
+  if (logEnabled(BOOTIMG_LOG_IMAGE, BOOTIMG_LOG_VERBOSE))
+    {
+      size_t base = hdr->kernel_addr - 0x00008000;
+      logWrite(BOOTIMG_LOG_IMAGE, BOOTIMG_LOG_VERBOSE, "KERNEL_CMDLINE %.*s", BOOT_ARGS_SIZE, hdr->cmdline);
+      logWrite(BOOTIMG_LOG_IMAGE, BOOTIMG_LOG_VERBOSE, "KERNEL_BASE %08lx", base);
+      logWrite(BOOTIMG_LOG_IMAGE, BOOTIMG_LOG_VERBOSE, "NAME %.*s", BOOT_NAME_SIZE, hdr->name);
+      logWrite(BOOTIMG_LOG_IMAGE, BOOTIMG_LOG_VERBOSE, "PAGE_SIZE %d", hdr->page_size);
+      logWrite(BOOTIMG_LOG_IMAGE, BOOTIMG_LOG_VERBOSE, "KERNEL_OFFSET %08lx", hdr->kernel_addr - base);
+      logWrite(BOOTIMG_LOG_IMAGE, BOOTIMG_LOG_VERBOSE, "RAMDISK_OFFSET %08lx", hdr->ramdisk_addr - base);
+      if (hdr->second_size != 0)
+        logWrite(BOOTIMG_LOG_IMAGE, BOOTIMG_LOG_VERBOSE, "SECOND_OFFSET %08lx", hdr->second_addr - base);
+      logWrite(BOOTIMG_LOG_IMAGE, BOOTIMG_LOG_VERBOSE, "TAGS_OFFSET %08lx", hdr->tags_addr - base);
+    }
+
+  return hdr;
+}
+
+/*
+ * Same as findBootMagicFd but leaves the stream just after the header
+ */
+boot_img_hdr *
+findBootMagic(FILE *fp, boot_img_hdr *hdr, off_t *off)
+{
+  if (!findBootMagicFd(fileno(fp), hdr, off, (const char **)NULL))
+    return (boot_img_hdr *)NULL;
+  if (fseek(fp, *off + sizeof(boot_img_hdr), SEEK_SET) == -1)
+    return (boot_img_hdr *)NULL;
+
+  return hdr;
+}
+
+/*
+ * Set the command line fields as create does
+ */
+void
+setCmdline(boot_img_hdr *hdr, const char *cmdline)
+{
+  size_t len = strlen(cmdline);
+
+  bzero((void *)hdr->cmdline, BOOT_ARGS_SIZE);
+  bzero((void *)hdr->extra_cmdline, BOOT_EXTRA_ARGS_SIZE);
+
+  if (len > BOOT_ARGS_SIZE + BOOT_EXTRA_ARGS_SIZE)
+    {
+      fprintf(stderr, "%s: WARNING: command line arguments was truncated to %d characters!\n",
+              progname, BOOT_ARGS_SIZE + BOOT_EXTRA_ARGS_SIZE);
+      len = BOOT_ARGS_SIZE + BOOT_EXTRA_ARGS_SIZE;
+    }
+  memcpy((void *)hdr->cmdline, (const void *)cmdline, BOOTIMG_MIN(len, BOOT_ARGS_SIZE));
+  if (len > BOOT_ARGS_SIZE)
+    memcpy((void *)hdr->extra_cmdline, (const void *)&cmdline[BOOT_ARGS_SIZE], len - BOOT_ARGS_SIZE);
+}
+
+/*
+ * Lower case hex string of data (hex holds 2*len+1 chars)
+ */
+void
+hexString(const uint8_t *data, size_t len, char *hex)
+{
+  for (size_t n = 0; n < len; n++)
+    sprintf(&hex[2*n], "%02x", data[n]);
+}
+
+/*
+ * Time of the SOURCE_DATE_EPOCH environment variable (as defined by
+ * reproducible-builds.org) if set and valid, dflt otherwise
+ */
+time_t
+getSourceDateEpoch(time_t dflt)
+{
+  const char *env = getenv("SOURCE_DATE_EPOCH");
+  char *end;
+  long long epoch;
+
+  if (!env || !*env)
+    return dflt;
+
+  errno = 0;
+  epoch = strtoll(env, &end, 10);
+  if (errno || *end || epoch < 0 || epoch > UINT32_MAX)
+    {
+      fprintf(stderr, "%s: warning: invalid SOURCE_DATE_EPOCH '%s' ignored!\n", progname, env);
+      return dflt;
+    }
+
+  return (time_t)epoch;
+}
+
+/*
+ * Parse a size with an optional K, M or G (power of 2) suffix
+ */
+int
+parseSize(const char *str, const char *what, uint64_t max, uint64_t *size)
+{
+  char *end = (char *)NULL;
+  unsigned long long value;
+
+  errno = 0;
+  value = strtoull(str, &end, 0);
+  if (!errno && end != str)
+    switch (*end)
+      {
+      case 'g': case 'G': value <<= 10; /* fall through */
+      case 'm': case 'M': value <<= 10; /* fall through */
+      case 'k': case 'K': value <<= 10; end++; break;
+      default: break;
+      }
+  if (errno || end == str || *end || value > max)
+    {
+      fprintf(stderr, "%s: error: invalid %s '%s' (max %llu) !\n",
+              progname, what, str, (unsigned long long)max);
+      return -1;
+    }
+  *size = value;
+
+  return 0;
+}
+
+/*
+ * Consumers of ioReadRange feeding digests
+ */
+static int
+sha256Consume(void *ctx, const void *data, size_t len)
+{
+  SHA256_Update((SHA256_CTX *)ctx, data, len);
+  return 0;
+}
+
+static int
+evpDigestConsume(void *ctx, const void *data, size_t len)
+{
+  return EVP_DigestUpdate((EVP_MD_CTX *)ctx, data, len) ? 0 : -1;
+}
+
+/*
+ * SHA256 of a range of a file
+ */
+int
+computeRangeDigest(int fd, off64_t offset, uint64_t len, unsigned char *digest)
+{
+  bootimgIo_p io = ioDefault();
+  SHA256_CTX sha;
+  uint64_t start;
+  int ret;
+
+  if (!io)
+    return -1;
+
+  start = statsBegin(BOOTIMG_STATS_HASH);
+  SHA256_Init(&sha);
+  ret = ioReadRange(io, fd, offset, len, sha256Consume, &sha);
+  SHA256_Final(digest, &sha);
+  statsEnd(BOOTIMG_STATS_HASH, start);
+
+  return ret;
+}
+
+/*
+ * Compute the id header field from images and images' sizes, as
+ * mkbootimg does. Second and dtb data may be NULL.
+ */
+void
+computeImageId(struct boot_img_hdr *hdr,
+               const void *kernel_data, const void *ramdisk_data,
+               const void *second_data, const void *dtb_data,
+               unsigned char *id)
+{
+  BOOTIMG_SHA_CTX sha;
+  uint64_t start = statsBegin(BOOTIMG_STATS_HASH);
+
+  (void)BOOTIMG_SHA_Init(&sha);
+
+  /* start computation with kernel image */
+  (void)BOOTIMG_SHA_Update(&sha, kernel_data, hdr->kernel_size);
+  /* update with the kernel_size field */
+  (void)BOOTIMG_SHA_Update(&sha, (const void *)&hdr->kernel_size, sizeof(hdr->kernel_size));
+  /* add the ramdisk image */
+  (void)BOOTIMG_SHA_Update(&sha, ramdisk_data, hdr->ramdisk_size);
+  /* and its size field */
+  (void)BOOTIMG_SHA_Update(&sha, (const void *)&hdr->ramdisk_size, sizeof(hdr->ramdisk_size));
+  /* second loader image is available */
+  if (second_data)
+    (void)BOOTIMG_SHA_Update(&sha, second_data, hdr->second_size);
+  /* and its size field */
+  (void)BOOTIMG_SHA_Update(&sha, (const void *)&hdr->second_size, sizeof(hdr->second_size));
+  /* then the device tree blob image */
+  if (dtb_data)
+    (void)BOOTIMG_SHA_Update(&sha, dtb_data, hdr->dt_size);
+  /* and its size field */
+  (void)BOOTIMG_SHA_Update(&sha, (const void *)&hdr->dt_size, sizeof(hdr->dt_size));
+  /* get the digest in the id field of the header */
+  (void)BOOTIMG_SHA_Final(id, &sha);
+  statsEnd(BOOTIMG_STATS_HASH, start);
+}
+
 /* 
  * Compute signature block offset in image file
  */
@@ -273,6 +624,23 @@ computeSignatureBlockOffset(struct boot_img_hdr *hdr)
   return (off64_t)alignOnPage(imgSz, hdr->page_size);		/* Next page */
 }
 
+/*
+ * Compute a component offset in image file
+ */
+off64_t
+computeComponentOffset(struct boot_img_hdr *hdr, int component)
+{
+  uint64_t offset = hdr->page_size;			/* Header */
+
+  if (component > BOOTIMG_COMPONENT_KERNEL)
+    offset += alignOnPage(hdr->kernel_size, hdr->page_size);
+  if (component > BOOTIMG_COMPONENT_RAMDISK)
+    offset += alignOnPage(hdr->ramdisk_size, hdr->page_size);
+  if (component > BOOTIMG_COMPONENT_SECOND)
+    offset += alignOnPage(hdr->second_size, hdr->page_size);
+  return (off64_t)offset;
+}
+
 /*
  * Read signature block from image file
  */
@@ -382,23 +750,22 @@ computeImageDigest(int imgfd, uint64_t imglen,
   int ret = -1;
   EVP_MD_CTX *ctx = NULL;
   struct stat statbuf;
-  unsigned char *buffer;
+  bootimgIo_p io = ioDefault();
   unsigned char *attrs, *tmp;
-  uint64_t imgsz, totsz = 0L, bufsz, rdsz = 0L;
+  uint64_t imgsz, rdsz = 0L;
+  uint64_t start = statsBegin(BOOTIMG_STATS_HASH);
 
   do
     {
-      if (!aa || !digest) break;
+      if (!aa || !digest || !io) break;
+      statsCount(BOOTIMG_STATS_CURRENT, BOOTIMG_STATS_SYSCALLS, 1);
       if (fstat(imgfd, &statbuf) == -1)
 	{
 	  perror("getting stat on image file");
 	  break;
 	}
-      imgsz = statbuf.st_size;
-      bufsz = BOOTIMG_MIN(statbuf.st_size, SHA_BUF_SIZE_K*1024);
-      buffer = malloc(bufsz);
-      assert(buffer);
-      if (lseek64(imgfd, 0, SEEK_SET)) break;
+      /* signed part only, not the signature block that follows */
+      imgsz = BOOTIMG_MIN(imglen, (uint64_t)statbuf.st_size);
       if (!(ctx = EVP_MD_CTX_create()))
 	{
 	  ERR_print_errors_fp(stderr);
@@ -407,21 +774,12 @@ computeImageDigest(int imgfd, uint64_t imglen,
       /* Init digest */
       EVP_DigestInit(ctx, EVP_sha256());
 
-      /* Loop on image for digest comptation */
-      do
+      /* Digest the image while the next chunks are read */
+      if (ioReadRange(io, imgfd, 0, imgsz, evpDigestConsume, ctx) < 0)
 	{
-	  rdsz = BOOTIMG_MIN(bufsz, imgsz - totsz);
-	  if ((rdsz = read(imgfd, buffer, rdsz)) == -1)
-	    {
-	      perror("reading image for digest computing");
-	      break;
-	    }
-	  EVP_DigestUpdate(ctx, buffer, rdsz);
-	  totsz += rdsz;
+	  perror("reading image for digest computing");
+	  break;
 	}
-      while (totsz < imgsz);
-      /* Could not read until end */
-      if (totsz < imgsz) break;
 
       /* Get Auth Attrs size ... */
       if ((rdsz = i2d_AuthAttrs((AuthAttrs *)aa, NULL)) < 0)
@@ -435,6 +793,7 @@ computeImageDigest(int imgfd, uint64_t imglen,
 	  ERR_print_errors_fp(stderr);
 	  break;
 	}
+      statsCount(BOOTIMG_STATS_CURRENT, BOOTIMG_STATS_ALLOCS, 1);
       /* ..., then get */
       tmp = attrs;
       if ((rdsz = i2d_AuthAttrs((AuthAttrs *)aa, &tmp)) < 0)
@@ -465,17 +824,18 @@ computeImageDigest(int imgfd, uint64_t imglen,
       EVP_DigestUpdate(ctx, attrs, rdsz);
       EVP_DigestFinal(ctx, digest, NULL);
 
-      if (vflag)
+      if (logEnabled(BOOTIMG_LOG_VERITY, BOOTIMG_LOG_INFO))
 	{
-	  fprintf(stdout, "%s: Image Verity digest (SHA256)\n\t", progname);
-	  for (int nx = 0; nx < SHA256_DIGEST_LENGTH; nx++)
-	    fprintf(stdout, "%02x", digest[nx]);
-	  fprintf(stdout, "\n");
+	  char hex[SHA256_DIGEST_LENGTH *2 +1];
+
+	  hexString(digest, SHA256_DIGEST_LENGTH, hex);
+	  logWrite(BOOTIMG_LOG_VERITY, BOOTIMG_LOG_INFO, "Image Verity digest (SHA256) %s", hex);
 	}
 
       ret = 0;
     }
   while (0);
+  statsEnd(BOOTIMG_STATS_HASH, start);
 
   return ret;
 }
@@ -561,6 +921,8 @@ verityVerify(FILE* imgfp, struct boot_img_hdr *hdr)
   int imgfd = -1;
   off64_t offset = 0L;
   uint64_t imglen = 0L;
+  long pos = ftell(imgfp);
+  uint64_t start = statsBegin(BOOTIMG_STATS_VERIFY);
   
   do
     {
@@ -568,14 +930,144 @@ verityVerify(FILE* imgfp, struct boot_img_hdr *hdr)
       if ((imglen = ftell(imgfp)) == -1) break;
       rewind(imgfp);
       if ((offset = computeSignatureBlockOffset(hdr)) == -1) break;
+      if (imglen <= (uint64_t)offset) break;
       if (readSignatureBlock(fileno(imgfp), offset, &bs)) break;
-      if (checkSignatureBlockConsistency(imglen, bs)) break;
-      if (checkSignatureBlockValidity(fileno(imgfp), imglen, bs)) break;
+      if (checkSignatureBlockConsistency(offset, bs)) break;
+      if (checkSignatureBlockValidity(fileno(imgfp), offset, bs)) break;
 
       ret = 0;
     }
   while (0);
 
+  /* the signature checks moved the file offset under the stream */
+  if (pos != -1)
+    fseek(imgfp, pos, SEEK_SET);
+  statsEnd(BOOTIMG_STATS_VERIFY, start);
+
+  return ret;
+}
+
+/*
+ * Sign the first imglen bytes of the image and write the signature
+ * block right after them, dropping anything that followed. The
+ * certificate & target of a previous block (DER in oldblock) are kept
+ * unless a certificate file is given.
+ */
+int
+veritySign(int imgfd, uint64_t imglen,
+           const unsigned char *oldblock, size_t oldblock_len,
+           const char *keyfile, const char *certfile)
+{
+  int ret = -1;
+  BootSignature *bs = NULL;
+  EVP_PKEY *key = NULL;
+  RSA *rsa = NULL;
+  FILE *fp = NULL;
+  unsigned char digest[SHA256_DIGEST_LENGTH];
+  unsigned char *sig = NULL, *der = NULL, *tmp;
+  unsigned int siglen = 0;
+  int derlen;
+
+  do
+    {
+      if (oldblock && oldblock_len)
+        {
+          tmp = (unsigned char *)oldblock;
+          if (!(bs = d2i_BootSignature(NULL, (const unsigned char **)&tmp, oldblock_len)))
+            {
+              fprintf(stderr, "%s: warning: previous signature block cannot be parsed\n", progname);
+              ERR_clear_error();
+            }
+        }
+
+      if (!bs)
+        {
+          if (!certfile)
+            {
+              fprintf(stderr, "%s: error: a certificate is needed to sign an unsigned image !\n", progname);
+              break;
+            }
+          if (!(bs = BootSignature_new()))
+            {
+              ERR_print_errors_fp(stderr);
+              break;
+            }
+          ASN1_INTEGER_set(bs->formatVersion, VERITY_FORMAT_VERSION);
+          X509_ALGOR_set0(bs->algorithmIdentifier, OBJ_nid2obj(NID_sha256WithRSAEncryption), V_ASN1_NULL, NULL);
+          bs->authenticatedAttributes->target->type = V_ASN1_PRINTABLESTRING;
+          ASN1_STRING_set(bs->authenticatedAttributes->target, VERITY_DEFAULT_TARGET, -1);
+        }
+
+      if (certfile)
+        {
+          X509 *cert;
+
+          if (!(fp = fopen(certfile, "r")) || !(cert = PEM_read_X509(fp, NULL, NULL, NULL)))
+            {
+              fprintf(stderr, "%s: error: cannot read certificate '%s' !\n", progname, certfile);
+              break;
+            }
+          fclose(fp);
+          fp = NULL;
+          X509_free(bs->certificate);
+          bs->certificate = cert;
+        }
+
+      if (!(fp = fopen(keyfile, "r")) || !(key = PEM_read_PrivateKey(fp, NULL, NULL, NULL)))
+        {
+          fprintf(stderr, "%s: error: cannot read private key '%s' !\n", progname, keyfile);
+          break;
+        }
+      fclose(fp);
+      fp = NULL;
+      if (!(rsa = EVP_PKEY_get1_RSA(key)))
+        {
+          ERR_print_errors_fp(stderr);
+          break;
+        }
+
+      /* digest covers the image up to the block and the attributes */
+      ASN1_INTEGER_set_uint64(bs->authenticatedAttributes->length, imglen);
+      if (ftruncate(imgfd, imglen) < 0)
+        {
+          perror("truncating image before signing");
+          break;
+        }
+      if (computeImageDigest(imgfd, imglen, bs->authenticatedAttributes, digest) == -1)
+        break;
+
+      sig = (unsigned char *)OPENSSL_malloc(RSA_size(rsa));
+      if (!sig || !RSA_sign(NID_sha256, digest, SHA256_DIGEST_LENGTH, sig, &siglen, rsa))
+        {
+          ERR_print_errors_fp(stderr);
+          break;
+        }
+      ASN1_OCTET_STRING_set(bs->signature, sig, siglen);
+
+      if ((derlen = i2d_BootSignature(bs, &der)) < 0)
+        {
+          ERR_print_errors_fp(stderr);
+          break;
+        }
+      if (pwrite(imgfd, der, derlen, imglen) != derlen)
+        {
+          perror("writing signature block");
+          break;
+        }
+
+      BOOTIMG_LOG(BOOTIMG_LOG_VERITY, BOOTIMG_LOG_INFO,
+                  "Image signed (%d bytes signature block)", derlen);
+      ret = 0;
+    }
+  while (0);
+
+  if (fp) fclose(fp);
+  if (der) OPENSSL_free(der);
+  if (sig) OPENSSL_free(sig);
+  if (rsa) RSA_free(rsa);
+  if (key) EVP_PKEY_free(key);
+  if (bs) BootSignature_free(bs);
+
   return ret;
 }
 
@@ -20,19 +20,42 @@
 
 #include "config.h"
 
+#include <time.h>
+#include <sys/types.h>
+#include <getopt.h>
+
 #ifdef USE_LIBXML2
 # include <libxml/xmlstring.h>
 #endif
 
 #include "bootimg.h"
 
+/* pread like function of an image reader */
+typedef ssize_t (*bootimgPread_t)(void *, void *, size_t, uint64_t);
+
 struct boot_img_hdr *initBootImgHeader(struct boot_img_hdr *);
 const char          *getLongOptionName(struct option *, char);
 const char          *getImageFilename(const char *, const char *, int);
 const char          *getDirname(const char *, uint8_t);
 const char          *getBasename(const char *, const char *);
 size_t               alignOnPage(size_t, size_t);
+void                *loadImage(const char *, size_t *);
+off64_t              computeComponentOffset(struct boot_img_hdr *, int);
+off64_t              computeSignatureBlockOffset(struct boot_img_hdr *);
+const char          *checkBootImgHeader(struct boot_img_hdr *, uint64_t, uint64_t);
+struct boot_img_hdr *findBootMagicFd(int, struct boot_img_hdr *, off_t *, const char **);
+struct boot_img_hdr *findBootMagicAt(bootimgPread_t, void *, uint64_t, struct boot_img_hdr *, off_t *,
+                                     const char **);
+struct boot_img_hdr *findBootMagic(FILE *, struct boot_img_hdr *, off_t *);
+void                 setCmdline(struct boot_img_hdr *, const char *);
+void                 hexString(const uint8_t *, size_t, char *);
+time_t               getSourceDateEpoch(time_t);
+int                  parseSize(const char *, const char *, uint64_t, uint64_t *);
+int                  computeRangeDigest(int, off64_t, uint64_t, unsigned char *);
+void                 computeImageId(struct boot_img_hdr *, const void *, const void *,
+                                    const void *, const void *, unsigned char *);
 int                  verityVerify(FILE *, struct boot_img_hdr *);
+int                  veritySign(int, uint64_t, const unsigned char *, size_t, const char *, const char *);
 
 #endif /* __BOOTIMG_UTILS_H__ */
 